@@ -152,11 +152,8 @@ CFTypeID CFDateGetTypeID(void) {
     __CFTSRRate = (double)freq.QuadPart;
     __CF1_TSRRate = 1.0 / __CFTSRRate;
 #elif DEPLOYMENT_TARGET_LINUX
-    struct timespec res;
-    if (clock_getres(CLOCK_MONOTONIC, &res) != 0) {
-        HALT;
-    }
-    __CFTSRRate = res.tv_sec + (1000000000 * res.tv_nsec);
+    // mach_absolute_time() counts nanoseconds of CLOCK_MONOTONIC
+    __CFTSRRate = 1.0E9;
     __CF1_TSRRate = 1.0 / __CFTSRRate;
 #else
 #error Unable to initialize date
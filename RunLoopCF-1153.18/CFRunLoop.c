@@ -68,7 +68,27 @@ DISPATCH_EXPORT void _dispatch_main_queue_callback_4CF(void);
 #define _dispatch_get_main_queue_port_4CF _dispatch_get_main_queue_handle_4CF
 #define _dispatch_main_queue_callback_4CF(x) _dispatch_main_queue_callback_4CF()
 
-#define AbsoluteTime LARGE_INTEGER 
+#define AbsoluteTime LARGE_INTEGER
+
+#elif DEPLOYMENT_TARGET_LINUX
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+DISPATCH_EXPORT int _dispatch_get_main_queue_handle_4CF(void);
+DISPATCH_EXPORT void _dispatch_main_queue_callback_4CF(void);
+
+#define MACH_PORT_NULL (-1)
+#define mach_port_name_t int
+#define mach_port_t int
+#define _dispatch_get_main_queue_port_4CF _dispatch_get_main_queue_handle_4CF
+#define _dispatch_main_queue_callback_4CF(x) _dispatch_main_queue_callback_4CF()
+
+typedef uint64_t AbsoluteTime;
+typedef	int kern_return_t;
+#define KERN_SUCCESS 0
 
 #endif
 
@@ -407,9 +427,60 @@ static kern_return_t __CFPortSetRemove(__CFPort port, __CFPortSet portSet) {
     return KERN_SUCCESS;
 }
 
+#elif DEPLOYMENT_TARGET_LINUX
+
+// A port is an eventfd and a port set is an epoll instance, so the run loop
+// sleeps in a single epoll_wait. Version 1 sources put any pollable file
+// descriptor in the port set; ports are level-triggered like Mach ports.
+typedef int __CFPort;
+#define CFPORT_NULL MACH_PORT_NULL
+typedef int __CFPortSet;
+
+CF_INLINE __CFPort __CFPortAllocate(void) {
+    return eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+CF_INLINE void __CFPortFree(__CFPort port) {
+    close(port);
+}
+
+// Consume every pending signal of a port so that it stops waking the port set
+CF_INLINE void __CFPortDrain(__CFPort port) {
+    uint64_t count;
+    (void)read(port, &count, sizeof(count));
+}
+
+static __CFPortSet __CFPortSetAllocate(void) {
+    __CFPortSet portSet = epoll_create1(EPOLL_CLOEXEC);
+    if (portSet < 0) CRASH("*** Unable to create run loop port set. (%d) ***", errno);
+    return portSet;
+}
+
+CF_INLINE void __CFPortSetFree(__CFPortSet portSet) {
+    close(portSet);
+}
+
+CF_INLINE kern_return_t __CFPortSetInsert(__CFPort port, __CFPortSet portSet) {
+    if (CFPORT_NULL == port) {
+        return -1;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = port;
+    return (0 == epoll_ctl(portSet, EPOLL_CTL_ADD, port, &event)) ? KERN_SUCCESS : errno;
+}
+
+CF_INLINE kern_return_t __CFPortSetRemove(__CFPort port, __CFPortSet portSet) {
+    if (CFPORT_NULL == port) {
+        return -1;
+    }
+    return (0 == epoll_ctl(portSet, EPOLL_CTL_DEL, port, NULL)) ? KERN_SUCCESS : errno;
+}
+
 #endif
 
-#if !defined(__MACTYPES__) && !defined(_OS_OSTYPES_H)
+#if !defined(__MACTYPES__) && !defined(_OS_OSTYPES_H) && !DEPLOYMENT_TARGET_LINUX
 #if defined(__BIG_ENDIAN__)
 typedef	struct UnsignedWide {
     UInt32		hi;
@@ -426,6 +497,40 @@ typedef UnsignedWide		AbsoluteTime;
 
 /// MK_TIMER 创建和操作
 #if USE_MK_TIMER_TOO
+#if DEPLOYMENT_TARGET_LINUX
+// The mode's timer port is a one-shot timerfd on CLOCK_MONOTONIC, the clock
+// behind mach_absolute_time(), so deadlines are armed as absolute TSR values.
+static mach_port_name_t mk_timer_create(void) {
+    return timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+}
+
+static kern_return_t mk_timer_destroy(mach_port_name_t name) {
+    return (0 == close(name)) ? KERN_SUCCESS : errno;
+}
+
+static kern_return_t mk_timer_arm(mach_port_name_t name, AbsoluteTime expire_time) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    // A zero it_value disarms the timer; a deadline already in the past fires at once
+    if (0 == expire_time) expire_time = 1;
+    spec.it_value.tv_sec = expire_time / 1000000000ULL;
+    spec.it_value.tv_nsec = expire_time % 1000000000ULL;
+    return (0 == timerfd_settime(name, TFD_TIMER_ABSTIME, &spec, NULL)) ? KERN_SUCCESS : errno;
+}
+
+static kern_return_t mk_timer_cancel(mach_port_name_t name, AbsoluteTime *result_time) {
+    struct itimerspec spec, old;
+    memset(&spec, 0, sizeof(spec));
+    if (0 != timerfd_settime(name, TFD_TIMER_ABSTIME, &spec, &old)) return errno;
+    if (result_time) *result_time = (uint64_t)old.it_value.tv_sec * 1000000000ULL + old.it_value.tv_nsec;
+    __CFPortDrain(name);
+    return KERN_SUCCESS;
+}
+
+CF_INLINE AbsoluteTime __CFUInt64ToAbsoluteTime(uint64_t x) {
+    return x;
+}
+#else
 extern mach_port_name_t mk_timer_create(void);
 extern kern_return_t mk_timer_destroy(mach_port_name_t name);
 extern kern_return_t mk_timer_arm(mach_port_name_t name, AbsoluteTime expire_time);
@@ -438,6 +543,8 @@ CF_INLINE AbsoluteTime __CFUInt64ToAbsoluteTime(uint64_t x) {
     return a;
 }
 #endif
+#endif
+#if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI
 #pragma mark - 唤醒RunLoop mack_prot核心代码
 static uint32_t __CFSendTrivialMachMessage(mach_port_t port, uint32_t msg_id, CFOptionFlags options, uint32_t timeout) {
     kern_return_t result;
@@ -452,6 +559,7 @@ static uint32_t __CFSendTrivialMachMessage(mach_port_t port, uint32_t msg_id, CF
     if (result == MACH_SEND_TIMED_OUT) mach_msg_destroy(&header);
     return result;
 }
+#endif
 
 
 
@@ -469,6 +577,42 @@ static CFTypeID __kCFRunLoopTimerTypeID = _kCFRuntimeNotATypeID;
 /// RunLoop Mode 结构体
 typedef struct __CFRunLoopMode *CFRunLoopModeRef;
 
+/* Each mode keeps its timers in a binary min-heap ordered by fire TSR,
+ * then by the order in which they were positioned, so timers with equal
+ * fire TSRs still fire first-scheduled first. An entry carries a copy
+ * of its timer's fire TSR, which is only changed together with a
+ * reposition in every mode of the timer. */
+typedef struct {
+    uint64_t _fireTSR;          /* TSR units */
+    uint64_t _order;
+    CFRunLoopTimerRef _timer;   /* retained */
+} __CFRunLoopTimerHeapEntry;
+
+typedef struct {
+    __CFRunLoopTimerHeapEntry *_entries;
+    CFIndex _count;
+    CFIndex _capacity;
+    uint64_t _nextOrder;
+} __CFRunLoopTimerHeap;
+
+/// Item
+struct _block_item {
+    struct _block_item *_next;
+    CFTypeRef _mode;	// CFString or CFSet
+    void (^_block)(void);
+    uint64_t _sequence;	// order of CFRunLoopPerformBlock calls, set when collected
+};
+
+static void __CFRunLoopFreeBlockItems(struct _block_item *item) {
+    while (item) {
+        struct _block_item *curr = item;
+        item = item->_next;
+        CFRelease(curr->_mode);
+        Block_release(curr->_block);
+        free(curr);
+    }
+}
+
 #pragma mark - __CFRunLoopMode 结构体
 struct __CFRunLoopMode {
     CFRuntimeBase _base;
@@ -485,11 +629,14 @@ struct __CFRunLoopMode {
     // observers
     CFMutableArrayRef _observers;
     // timers
-    CFMutableArrayRef _timers;
+    __CFRunLoopTimerHeap _timers;
     //
     CFMutableDictionaryRef _portToV1SourceMap;
     __CFPortSet _portSet;
     CFIndex _observerMask;
+    /// 只属于这个 Mode 的 block, 从 RunLoop 的 _blocksInbox 收集过来
+    struct _block_item *_blocks_head;
+    struct _block_item *_blocks_tail;
     
 /// GCD_TIMERS_SOURCE
 #if USE_DISPATCH_SOURCE_FOR_TIMERS
@@ -528,6 +675,9 @@ static CFHashCode __CFRunLoopModeHash(CFTypeRef cf) {
     return CFHash(rlm->_name);
 }
 
+static CFArrayRef __CFRunLoopModeCopyTimers(CFRunLoopModeRef rlm);
+static void __CFRunLoopModeRemoveAllTimers(CFRunLoopModeRef rlm);
+
 static CFStringRef __CFRunLoopModeCopyDescription(CFTypeRef cf) {
     CFRunLoopModeRef rlm = (CFRunLoopModeRef)cf;
     CFMutableStringRef result;
@@ -544,7 +694,9 @@ static CFStringRef __CFRunLoopModeCopyDescription(CFTypeRef cf) {
 #if DEPLOYMENT_TARGET_WINDOWS
     CFStringAppendFormat(result, NULL, CFSTR("MSGQ mask = %p, "), rlm->_msgQMask);
 #endif
-    CFStringAppendFormat(result, NULL, CFSTR("\n\tsources0 = %@,\n\tsources1 = %@,\n\tobservers = %@,\n\ttimers = %@,\n\tcurrently %0.09g (%lld) / soft deadline in: %0.09g sec (@ %lld) / hard deadline in: %0.09g sec (@ %lld)\n},\n"), rlm->_sources0, rlm->_sources1, rlm->_observers, rlm->_timers, CFAbsoluteTimeGetCurrent(), mach_absolute_time(), __CFTSRToTimeInterval(rlm->_timerSoftDeadline - mach_absolute_time()), rlm->_timerSoftDeadline, __CFTSRToTimeInterval(rlm->_timerHardDeadline - mach_absolute_time()), rlm->_timerHardDeadline);
+    CFArrayRef timers = __CFRunLoopModeCopyTimers(rlm);
+    CFStringAppendFormat(result, NULL, CFSTR("\n\tsources0 = %@,\n\tsources1 = %@,\n\tobservers = %@,\n\ttimers = %@,\n\tcurrently %0.09g (%lld) / soft deadline in: %0.09g sec (@ %lld) / hard deadline in: %0.09g sec (@ %lld)\n},\n"), rlm->_sources0, rlm->_sources1, rlm->_observers, timers, CFAbsoluteTimeGetCurrent(), mach_absolute_time(), __CFTSRToTimeInterval(rlm->_timerSoftDeadline - mach_absolute_time()), rlm->_timerSoftDeadline, __CFTSRToTimeInterval(rlm->_timerHardDeadline - mach_absolute_time()), rlm->_timerHardDeadline);
+    if (timers) CFRelease(timers);
     return result;
 }
 
@@ -555,8 +707,9 @@ static void __CFRunLoopModeDeallocate(CFTypeRef cf) {
     if (NULL != rlm->_sources0) CFRelease(rlm->_sources0);
     if (NULL != rlm->_sources1) CFRelease(rlm->_sources1);
     if (NULL != rlm->_observers) CFRelease(rlm->_observers);
-    if (NULL != rlm->_timers) CFRelease(rlm->_timers);
+    __CFRunLoopModeRemoveAllTimers(rlm);
     if (NULL != rlm->_portToV1SourceMap) CFRelease(rlm->_portToV1SourceMap);
+    __CFRunLoopFreeBlockItems(rlm->_blocks_head);
     CFRelease(rlm->_name);
     __CFPortSetFree(rlm->_portSet);
 #if USE_DISPATCH_SOURCE_FOR_TIMERS
@@ -575,13 +728,6 @@ static void __CFRunLoopModeDeallocate(CFTypeRef cf) {
     memset((char *)cf + sizeof(CFRuntimeBase), 0x7C, sizeof(struct __CFRunLoopMode) - sizeof(CFRuntimeBase));
 }
 
-/// Item
-struct _block_item {
-    struct _block_item *_next;
-    CFTypeRef _mode;	// CFString or CFSet
-    void (^_block)(void);
-};
-
 typedef struct _per_run_data {
     uint32_t a;
     uint32_t b;
@@ -590,6 +736,13 @@ typedef struct _per_run_data {
 } _per_run_data;
 /// Run Loop 结构体
 #pragma mark - Run Loop 结构体
+/// source0 就绪队列的节点, 持有 source
+struct __CFRunLoopReadySource {
+    struct __CFRunLoopReadySource *_next;
+    CFRunLoopSourceRef _source;
+    CFIndex _sequence;
+};
+
 struct __CFRunLoop {
     CFRuntimeBase _base;
     /// 锁
@@ -611,10 +764,18 @@ struct __CFRunLoop {
     CFRunLoopModeRef _currentMode;
     /// 所有的Modes
     CFMutableSetRef _modes;
-    /// 头指针
+    /// CFRunLoopPerformBlock 无锁压栈, 持有 RunLoop 锁时由 __CFRunLoopCollectBlocks 分到各个 Mode
+    struct _block_item * volatile _blocksInbox;
+    uint64_t _blocksSequence;
+    /// 头指针, 指定了 kCFRunLoopCommonModes 或多个 Mode 的 block
     struct _block_item *_blocks_head;
     /// 尾指针
     struct _block_item *_blocks_tail;
+    /// 被 signal 的 source0, CFRunLoopSourceSignal 无锁压栈, __CFRunLoopDoSources0 一次取走
+    struct __CFRunLoopReadySource * volatile _readySources0;
+    /// 就绪队列中检查过的和真正触发的 source0 次数
+    uint64_t _sources0Scanned;
+    uint64_t _sources0Fired;
     /// 运行时间
     CFAbsoluteTime _runTime;
     /// 休眠时间
@@ -702,6 +863,8 @@ static CFStringRef __CFRunLoopCopyDescription(CFTypeRef cf) {
 
     CFStringAppendFormat(result, NULL, CFSTR("<CFRunLoop %p [%p]>{wakeup port = 0x%x, stopped = %s, ignoreWakeUps = %s, \ncurrent mode = %@,\n"), cf, CFGetAllocator(cf), rl->_wakeUpPort, __CFRunLoopIsStopped(rl) ? "true" : "false", __CFRunLoopIsIgnoringWakeUps(rl) ? "true" : "false", rl->_currentMode ? rl->_currentMode->_name : CFSTR("(none)"));
 
+    CFStringAppendFormat(result, NULL, CFSTR("sources0 scanned = %llu, sources0 fired = %llu,\n"), rl->_sources0Scanned, rl->_sources0Fired);
+
     CFStringAppendFormat(result, NULL, CFSTR("common modes = %@,\ncommon mode items = %@,\nmodes = %@}\n"), rl->_commonModes, rl->_commonModeItems, rl->_modes);
     return result;
 }
@@ -748,8 +911,13 @@ static CFRunLoopModeRef __CFRunLoopFindMode(CFRunLoopRef rl, CFStringRef modeNam
     rlm->_sources0 = NULL;
     rlm->_sources1 = NULL;
     rlm->_observers = NULL;
-    rlm->_timers = NULL;
+    rlm->_timers._entries = NULL;
+    rlm->_timers._count = 0;
+    rlm->_timers._capacity = 0;
+    rlm->_timers._nextOrder = 0;
     rlm->_observerMask = 0;
+    rlm->_blocks_head = NULL;
+    rlm->_blocks_tail = NULL;
     rlm->_portSet = __CFPortSetAllocate();
     rlm->_timerSoftDeadline = UINT64_MAX;
     rlm->_timerHardDeadline = UINT64_MAX;
@@ -790,6 +958,57 @@ static CFRunLoopModeRef __CFRunLoopFindMode(CFRunLoopRef rl, CFStringRef modeNam
     return rlm;
 }
 
+static void __CFRunLoopEnsureMode(const void *value, void *context) {
+    CFRunLoopRef rl = (CFRunLoopRef)context;
+    CFRunLoopModeRef rlm = __CFRunLoopFindMode(rl, (CFStringRef)value, true);
+    if (rlm) __CFRunLoopModeUnlock(rlm);
+}
+
+CF_INLINE void __CFRunLoopAppendBlockItem(struct _block_item **head, struct _block_item **tail, struct _block_item *item) {
+    item->_next = NULL;
+    if (!*tail) {
+        *head = item;
+    } else {
+        (*tail)->_next = item;
+    }
+    *tail = item;
+}
+
+#pragma mark - 收集 CFRunLoopPerformBlock 放进来的 block
+/* rl is locked; modes may be locked */
+static void __CFRunLoopCollectBlocks(CFRunLoopRef rl) {
+    struct _block_item *inbox;
+    do {
+        inbox = rl->_blocksInbox;
+    } while (NULL != inbox && !OSAtomicCompareAndSwapPtrBarrier(inbox, NULL, (void * volatile *)&rl->_blocksInbox));
+    /// 栈是后进先出, 反转成调用顺序
+    struct _block_item *item = NULL;
+    while (inbox) {
+        struct _block_item *next = inbox->_next;
+        inbox->_next = item;
+        item = inbox;
+        inbox = next;
+    }
+    while (item) {
+        struct _block_item *curr = item;
+        item = item->_next;
+        curr->_sequence = rl->_blocksSequence++;
+        /// 只指定一个 Mode 的 block 直接放进那个 Mode, 别的 Mode 不会再扫描到它
+        if (CFStringGetTypeID() == CFGetTypeID(curr->_mode)) {
+            CFRunLoopModeRef rlm = __CFRunLoopFindMode(rl, (CFStringRef)curr->_mode, true);
+            if (rlm) {
+                Boolean own = !CFEqual(curr->_mode, kCFRunLoopCommonModes);
+                if (own) __CFRunLoopAppendBlockItem(&rlm->_blocks_head, &rlm->_blocks_tail, curr);
+                __CFRunLoopModeUnlock(rlm);
+                if (own) continue;
+            }
+        } else {
+            CFSetApplyFunction((CFSetRef)curr->_mode, (__CFRunLoopEnsureMode), rl);
+        }
+        __CFRunLoopAppendBlockItem(&rl->_blocks_head, &rl->_blocks_tail, curr);
+    }
+}
+
 #pragma mark - 判断RunLoopMode是否是空的
 static Boolean __CFRunLoopModeIsEmpty(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFRunLoopModeRef previousMode) {
     CHECK_FOR_FORK();
@@ -802,7 +1021,9 @@ static Boolean __CFRunLoopModeIsEmpty(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFR
     /// 有source 0 或 source1 或 times return false
     if (NULL != rlm->_sources0 && 0 < CFSetGetCount(rlm->_sources0)) return false;
     if (NULL != rlm->_sources1 && 0 < CFSetGetCount(rlm->_sources1)) return false;
-    if (NULL != rlm->_timers && 0 < CFArrayGetCount(rlm->_timers)) return false;
+    if (0 < rlm->_timers._count) return false;
+    __CFRunLoopCollectBlocks(rl);
+    if (rlm->_blocks_head) return false;
     struct _block_item *item = rl->_blocks_head;
     while (item) {
         struct _block_item *curr = item;
@@ -868,6 +1089,47 @@ CF_INLINE void __CFRunLoopSourceUnlock(CFRunLoopSourceRef rls) {
     //    CFLog(6, CFSTR("__CFRunLoopSourceLock unlocking %p"), rls);
     pthread_mutex_unlock(&(rls->_lock));
 }
+/// 把一串节点 (first ... last) 压进 rl 的 source0 就绪队列, 不需要 rl 的锁
+static void __CFRunLoopPushReadySources0(CFRunLoopRef rl, struct __CFRunLoopReadySource *first, struct __CFRunLoopReadySource *last) {
+    struct __CFRunLoopReadySource *head;
+    do {
+        head = rl->_readySources0;
+        last->_next = head;
+    } while (!OSAtomicCompareAndSwapPtrBarrier(head, first, (void * volatile *)&rl->_readySources0));
+}
+
+/* rls is locked and was just signaled, or added to rl while signaled */
+static void __CFRunLoopPushReadySource0(CFRunLoopRef rl, CFRunLoopSourceRef rls) {
+    struct __CFRunLoopReadySource *item = (struct __CFRunLoopReadySource *)CFAllocatorAllocate(kCFAllocatorSystemDefault, sizeof(struct __CFRunLoopReadySource), 0);
+    item->_source = (CFRunLoopSourceRef)CFRetain(rls);
+    item->_sequence = 0;
+    __CFRunLoopPushReadySources0(rl, item, item);
+}
+
+/// 取走整个就绪队列, 按 signal 的先后顺序返回
+static struct __CFRunLoopReadySource *__CFRunLoopTakeReadySources0(CFRunLoopRef rl) {
+    struct __CFRunLoopReadySource *head;
+    do {
+        head = rl->_readySources0;
+    } while (NULL != head && !OSAtomicCompareAndSwapPtrBarrier(head, NULL, (void * volatile *)&rl->_readySources0));
+    struct __CFRunLoopReadySource *fifo = NULL;
+    while (head) {
+        struct __CFRunLoopReadySource *next = head->_next;
+        head->_next = fifo;
+        fifo = head;
+        head = next;
+    }
+    return fifo;
+}
+
+/// source1 的端口; Linux 上 getPort 返回的是转成指针的 fd
+CF_INLINE __CFPort __CFRunLoopSourceGetPort(CFRunLoopSourceRef rls) {
+#if DEPLOYMENT_TARGET_LINUX
+    return (__CFPort)(intptr_t)rls->_context.version1.getPort(rls->_context.version1.info);	/* CALLOUT */
+#else
+    return rls->_context.version1.getPort(rls->_context.version1.info);	/* CALLOUT */
+#endif
+}
 
 #pragma mark - Observers
 /// 观察者
@@ -943,6 +1205,13 @@ static void __CFRunLoopObserverCancel(CFRunLoopObserverRef rlo, CFRunLoopRef rl,
 }
 
 #pragma mark - Timers
+/* A timer's index in the timer heap of each mode it is in. Timers are
+ * rarely in more than the two usual common modes. */
+typedef struct {
+    CFRunLoopModeRef _mode;
+    CFIndex _index;
+} __CFRunLoopTimerHeapSlot;
+
 /// timer 结构体
 struct __CFRunLoopTimer {
     CFRuntimeBase _base;
@@ -960,6 +1229,11 @@ struct __CFRunLoopTimer {
     /// 宽容时间
     CFTimeInterval _tolerance;          /* mutable */
     uint64_t _fireTSR;			/* TSR units */
+    /// 在每个Mode的timer堆中的位置
+    __CFRunLoopTimerHeapSlot *_heapSlots;	/* run loop locked */
+    CFIndex _heapSlotCount;
+    CFIndex _heapSlotCapacity;
+    __CFRunLoopTimerHeapSlot _heapSlotsInline[2];
     CFIndex _order;			/* immutable */
     /// Timer回调
     CFRunLoopTimerCallBack _callout;	/* immutable */
@@ -1011,6 +1285,152 @@ CF_INLINE void __CFRunLoopTimerFireTSRUnlock(void) {
     __CFUnlock(&__CFRLTFireTSRLock);
 }
 
+#pragma mark - Timer heap
+/* The timer heap of a mode and the heap slots of its timers change only
+ * with the run loop and the mode locked. */
+
+static __CFRunLoopTimerHeapSlot *__CFRunLoopTimerGetHeapSlot(CFRunLoopTimerRef rlt, CFRunLoopModeRef rlm) {
+    for (CFIndex idx = 0; idx < rlt->_heapSlotCount; idx++) {
+        if (rlt->_heapSlots[idx]._mode == rlm) return &rlt->_heapSlots[idx];
+    }
+    return NULL;
+}
+
+static void __CFRunLoopTimerAddHeapSlot(CFRunLoopTimerRef rlt, CFRunLoopModeRef rlm) {
+    if (rlt->_heapSlotCount == rlt->_heapSlotCapacity) {
+        CFIndex capacity = 2 * rlt->_heapSlotCapacity;
+        __CFRunLoopTimerHeapSlot *slots = (__CFRunLoopTimerHeapSlot *)CFAllocatorAllocate(kCFAllocatorSystemDefault, capacity * sizeof(__CFRunLoopTimerHeapSlot), 0);
+        memmove(slots, rlt->_heapSlots, rlt->_heapSlotCount * sizeof(__CFRunLoopTimerHeapSlot));
+        if (rlt->_heapSlots != rlt->_heapSlotsInline) CFAllocatorDeallocate(kCFAllocatorSystemDefault, rlt->_heapSlots);
+        rlt->_heapSlots = slots;
+        rlt->_heapSlotCapacity = capacity;
+    }
+    rlt->_heapSlots[rlt->_heapSlotCount]._mode = rlm;
+    rlt->_heapSlots[rlt->_heapSlotCount]._index = kCFNotFound;
+    rlt->_heapSlotCount++;
+}
+
+static void __CFRunLoopTimerRemoveHeapSlot(CFRunLoopTimerRef rlt, __CFRunLoopTimerHeapSlot *slot) {
+    rlt->_heapSlotCount--;
+    *slot = rlt->_heapSlots[rlt->_heapSlotCount];
+}
+
+CF_INLINE Boolean __CFRunLoopTimerHeapEntryLess(const __CFRunLoopTimerHeapEntry *entry1, const __CFRunLoopTimerHeapEntry *entry2) {
+    return entry1->_fireTSR < entry2->_fireTSR || (entry1->_fireTSR == entry2->_fireTSR && entry1->_order < entry2->_order);
+}
+
+CF_INLINE void __CFRunLoopTimerHeapPut(CFRunLoopModeRef rlm, CFIndex idx, __CFRunLoopTimerHeapEntry entry) {
+    rlm->_timers._entries[idx] = entry;
+    __CFRunLoopTimerGetHeapSlot(entry._timer, rlm)->_index = idx;
+}
+
+static void __CFRunLoopTimerHeapSiftUp(CFRunLoopModeRef rlm, CFIndex idx) {
+    __CFRunLoopTimerHeapEntry *entries = rlm->_timers._entries;
+    __CFRunLoopTimerHeapEntry entry = entries[idx];
+    while (0 < idx) {
+        CFIndex parent = (idx - 1) / 2;
+        if (!__CFRunLoopTimerHeapEntryLess(&entry, &entries[parent])) break;
+        __CFRunLoopTimerHeapPut(rlm, idx, entries[parent]);
+        idx = parent;
+    }
+    __CFRunLoopTimerHeapPut(rlm, idx, entry);
+}
+
+static void __CFRunLoopTimerHeapSiftDown(CFRunLoopModeRef rlm, CFIndex idx) {
+    __CFRunLoopTimerHeapEntry *entries = rlm->_timers._entries;
+    CFIndex cnt = rlm->_timers._count;
+    __CFRunLoopTimerHeapEntry entry = entries[idx];
+    for (;;) {
+        CFIndex child = 2 * idx + 1;
+        if (cnt <= child) break;
+        if (child + 1 < cnt && __CFRunLoopTimerHeapEntryLess(&entries[child + 1], &entries[child])) child++;
+        if (!__CFRunLoopTimerHeapEntryLess(&entries[child], &entry)) break;
+        __CFRunLoopTimerHeapPut(rlm, idx, entries[child]);
+        idx = child;
+    }
+    __CFRunLoopTimerHeapPut(rlm, idx, entry);
+}
+
+// Restores the heap order around an entry whose key changed or that was moved.
+static void __CFRunLoopTimerHeapFix(CFRunLoopModeRef rlm, CFIndex idx) {
+    __CFRunLoopTimerHeapEntry *entries = rlm->_timers._entries;
+    if (0 < idx && __CFRunLoopTimerHeapEntryLess(&entries[idx], &entries[(idx - 1) / 2])) {
+        __CFRunLoopTimerHeapSiftUp(rlm, idx);
+    } else {
+        __CFRunLoopTimerHeapSiftDown(rlm, idx);
+    }
+}
+
+static void __CFRunLoopTimerHeapInsert(CFRunLoopModeRef rlm, CFRunLoopTimerRef rlt) {
+    __CFRunLoopTimerHeap *heap = &rlm->_timers;
+    if (heap->_count == heap->_capacity) {
+        CFIndex capacity = heap->_capacity ? 2 * heap->_capacity : 16;
+        heap->_entries = (__CFRunLoopTimerHeapEntry *)CFAllocatorReallocate(kCFAllocatorSystemDefault, heap->_entries, capacity * sizeof(__CFRunLoopTimerHeapEntry), 0);
+        if (NULL == heap->_entries) CRASH("*** Unable to grow run loop timer heap. (%d) ***", -1);
+        heap->_capacity = capacity;
+    }
+    __CFRunLoopTimerAddHeapSlot(rlt, rlm);
+    __CFRunLoopTimerHeapEntry *entry = &heap->_entries[heap->_count++];
+    entry->_fireTSR = rlt->_fireTSR;
+    entry->_order = heap->_nextOrder++;
+    entry->_timer = (CFRunLoopTimerRef)CFRetain(rlt);
+    __CFRunLoopTimerHeapSiftUp(rlm, heap->_count - 1);
+}
+
+// A repositioned timer goes after the timers with the same fire TSR,
+// as if it had been removed and added again.
+static Boolean __CFRunLoopTimerHeapReposition(CFRunLoopModeRef rlm, CFRunLoopTimerRef rlt) {
+    __CFRunLoopTimerHeapSlot *slot = __CFRunLoopTimerGetHeapSlot(rlt, rlm);
+    if (!slot) return false;
+    __CFRunLoopTimerHeapEntry *entry = &rlm->_timers._entries[slot->_index];
+    entry->_fireTSR = rlt->_fireTSR;
+    entry->_order = rlm->_timers._nextOrder++;
+    __CFRunLoopTimerHeapFix(rlm, slot->_index);
+    return true;
+}
+
+static Boolean __CFRunLoopTimerHeapRemove(CFRunLoopModeRef rlm, CFRunLoopTimerRef rlt) {
+    __CFRunLoopTimerHeap *heap = &rlm->_timers;
+    __CFRunLoopTimerHeapSlot *slot = __CFRunLoopTimerGetHeapSlot(rlt, rlm);
+    if (!slot) return false;
+    CFIndex idx = slot->_index;
+    __CFRunLoopTimerRemoveHeapSlot(rlt, slot);
+    heap->_count--;
+    if (idx < heap->_count) {
+        __CFRunLoopTimerHeapPut(rlm, idx, heap->_entries[heap->_count]);
+        __CFRunLoopTimerHeapFix(rlm, idx);
+    }
+    CFRelease(rlt);
+    return true;
+}
+
+static CFArrayRef __CFRunLoopModeCopyTimers(CFRunLoopModeRef rlm) {
+    __CFRunLoopTimerHeap *heap = &rlm->_timers;
+    if (NULL == heap->_entries) return NULL;
+    CFMutableArrayRef timers = CFArrayCreateMutable(kCFAllocatorSystemDefault, heap->_count, &kCFTypeArrayCallBacks);
+    for (CFIndex idx = 0; idx < heap->_count; idx++) {
+        CFArrayAppendValue(timers, heap->_entries[idx]._timer);
+    }
+    return timers;
+}
+
+static void __CFRunLoopModeRemoveAllTimers(CFRunLoopModeRef rlm) {
+    __CFRunLoopTimerHeap *heap = &rlm->_timers;
+    __CFRunLoopTimerHeapEntry *entries = heap->_entries;
+    CFIndex cnt = heap->_count;
+    heap->_entries = NULL;
+    heap->_count = 0;
+    heap->_capacity = 0;
+    for (CFIndex idx = 0; idx < cnt; idx++) {
+        CFRunLoopTimerRef rlt = entries[idx]._timer;
+        __CFRunLoopTimerRemoveHeapSlot(rlt, __CFRunLoopTimerGetHeapSlot(rlt, rlm));
+    }
+    for (CFIndex idx = 0; idx < cnt; idx++) {
+        CFRelease(entries[idx]._timer);
+    }
+    if (entries) CFAllocatorDeallocate(kCFAllocatorSystemDefault, entries);
+}
+
 #pragma mark -
 
 /* CFRunLoop */
@@ -1078,7 +1498,7 @@ static void __CFRunLoopDeallocateSources(const void *value, void *context) {
                 rls->_context.version0.cancel(rls->_context.version0.info, rl, rlm->_name);	/* CALLOUT */
             }
         } else if (1 == rls->_context.version0.version) {
-            __CFPort port = rls->_context.version1.getPort(rls->_context.version1.info);	/* CALLOUT */
+            __CFPort port = __CFRunLoopSourceGetPort(rls);	/* CALLOUT */
             if (CFPORT_NULL != port) {
                 __CFPortSetRemove(port, rlm->_portSet);
             }
@@ -1110,32 +1530,27 @@ static void __CFRunLoopDeallocateObservers(const void *value, void *context) {
 /// Timers 的析构函数 清掉里面的内部资源
 static void __CFRunLoopDeallocateTimers(const void *value, void *context) {
     CFRunLoopModeRef rlm = (CFRunLoopModeRef)value;
-    if (NULL == rlm->_timers) return;
-    void (^deallocateTimers)(CFMutableArrayRef timers) = ^(CFMutableArrayRef timers) {
-        CFIndex idx, cnt;
-        const void **list, *buffer[256];
-        cnt = CFArrayGetCount(timers);
-        list = (const void **)((cnt <= 256) ? buffer : CFAllocatorAllocate(kCFAllocatorSystemDefault, cnt * sizeof(void *), 0));
-        CFArrayGetValues(timers, CFRangeMake(0, CFArrayGetCount(timers)), list);
-        for (idx = 0; idx < cnt; idx++) {
-            CFRetain(list[idx]);
-        }
-        CFArrayRemoveAllValues(timers);
-        for (idx = 0; idx < cnt; idx++) {
-            CFRunLoopTimerRef rlt = (CFRunLoopTimerRef)list[idx];
-            __CFRunLoopTimerLock(rlt);
-            // if the run loop is deallocating, and since a timer can only be in one
-            // run loop, we're going to be removing the timer from all modes, so be
-            // a little heavy-handed and direct
-            CFSetRemoveAllValues(rlt->_rlModes);
-            rlt->_runLoop = NULL;
-            __CFRunLoopTimerUnlock(rlt);
-            CFRelease(list[idx]);
-        }
-        if (list != buffer) CFAllocatorDeallocate(kCFAllocatorSystemDefault, list);
-    };
-    
-    if (rlm->_timers && CFArrayGetCount(rlm->_timers)) deallocateTimers(rlm->_timers);
+    CFIndex idx, cnt;
+    const void **list, *buffer[256];
+    cnt = rlm->_timers._count;
+    if (0 == cnt) return;
+    list = (const void **)((cnt <= 256) ? buffer : CFAllocatorAllocate(kCFAllocatorSystemDefault, cnt * sizeof(void *), 0));
+    for (idx = 0; idx < cnt; idx++) {
+        list[idx] = CFRetain(rlm->_timers._entries[idx]._timer);
+    }
+    __CFRunLoopModeRemoveAllTimers(rlm);
+    for (idx = 0; idx < cnt; idx++) {
+        CFRunLoopTimerRef rlt = (CFRunLoopTimerRef)list[idx];
+        __CFRunLoopTimerLock(rlt);
+        // if the run loop is deallocating, and since a timer can only be in one
+        // run loop, we're going to be removing the timer from all modes, so be
+        // a little heavy-handed and direct
+        CFSetRemoveAllValues(rlt->_rlModes);
+        rlt->_runLoop = NULL;
+        __CFRunLoopTimerUnlock(rlt);
+        CFRelease(list[idx]);
+    }
+    if (list != buffer) CFAllocatorDeallocate(kCFAllocatorSystemDefault, list);
 }
 
 CF_EXPORT CFRunLoopRef _CFRunLoopGet0b(pthread_t t);
@@ -1164,14 +1579,16 @@ static void __CFRunLoopDeallocate(CFTypeRef cf) {
     }
     /// 加递归锁
     __CFRunLoopLock(rl);
-    /// 递归释放Item 由blocks_head 头指针 指向下一个Node节点指针 然后释放 curr item
-    struct _block_item *item = rl->_blocks_head;
-    while (item) {
-        struct _block_item *curr = item;
-        item = item->_next;
-        CFRelease(curr->_mode);
-        Block_release(curr->_block);
-        free(curr);
+    /// 递归释放Item 由blocks_head 头指针 指向下一个Node节点指针 然后释放 curr item, Mode 里的 block 随 Mode 释放
+    __CFRunLoopFreeBlockItems(rl->_blocks_head);
+    __CFRunLoopFreeBlockItems((struct _block_item *)rl->_blocksInbox);
+    /// 释放就绪队列里还没处理的 source0
+    struct __CFRunLoopReadySource *ready = __CFRunLoopTakeReadySources0(rl);
+    while (ready) {
+        struct __CFRunLoopReadySource *curr = ready;
+        ready = ready->_next;
+        CFRelease(curr->_source);
+        CFAllocatorDeallocate(kCFAllocatorSystemDefault, curr);
     }
     /// 释放 _commonModeItems
     if (NULL != rl->_commonModeItems) {
@@ -1258,8 +1675,13 @@ static CFRunLoopRef __CFRunLoopCreate(pthread_t t) {
     loop->_commonModeItems = NULL;
     loop->_currentMode = NULL;
     loop->_modes = CFSetCreateMutable(kCFAllocatorSystemDefault, 0, &kCFTypeSetCallBacks);
+    loop->_blocksInbox = NULL;
+    loop->_blocksSequence = 0;
     loop->_blocks_head = NULL;
     loop->_blocks_tail = NULL;
+    loop->_readySources0 = NULL;
+    loop->_sources0Scanned = 0;
+    loop->_sources0Fired = 0;
     loop->_counterpart = NULL;
     /// 给RunLoop pthread 赋值线程
     loop->_pthread = t;
@@ -1478,6 +1900,7 @@ CFArrayRef CFRunLoopCopyAllModes(CFRunLoopRef rl) {
     CHECK_FOR_FORK();
     CFMutableArrayRef array;
     __CFRunLoopLock(rl);
+    __CFRunLoopCollectBlocks(rl);
     array = CFArrayCreateMutable(kCFAllocatorSystemDefault, CFSetGetCount(rl->_modes), &kCFTypeArrayCallBacks);
     CFSetApplyFunction(rl->_modes, (__CFRunLoopGetModeName), array);
     __CFRunLoopUnlock(rl);
@@ -1585,9 +2008,14 @@ static void __CFRUNLOOP_IS_CALLING_OUT_TO_A_BLOCK__(void (^block)(void)) {
 }
 #pragma mark -  做 blocks 回调处理
 static Boolean __CFRunLoopDoBlocks(CFRunLoopRef rl, CFRunLoopModeRef rlm) { // Call with rl and rlm locked
-    if (!rl->_blocks_head) return false;
     if (!rlm || !rlm->_name) return false;
+    __CFRunLoopCollectBlocks(rl);
+    if (!rl->_blocks_head && !rlm->_blocks_head) return false;
     Boolean did = false;
+    /// 这个 Mode 自己的 block 整批取走, 它们都要执行
+    struct _block_item *own = rlm->_blocks_head;
+    rlm->_blocks_head = NULL;
+    rlm->_blocks_tail = NULL;
     /// 头和尾指针
     struct _block_item *head = rl->_blocks_head;
     struct _block_item *tail = rl->_blocks_tail;
@@ -1599,31 +2027,39 @@ static Boolean __CFRunLoopDoBlocks(CFRunLoopRef rl, CFRunLoopModeRef rlm) { // C
     __CFRunLoopModeUnlock(rlm);
     __CFRunLoopUnlock(rl);
     
+    /// 两个列表按 CFRunLoopPerformBlock 的调用顺序合并执行
     struct _block_item *prev = NULL;
     struct _block_item *item = head;
-    while (item) {
-        struct _block_item *curr = item;
-        item = item->_next;
+    while (item || own) {
+        struct _block_item *curr;
         Boolean doit = false;
-        /// 当前mode与制定mode相等或者当前mode为commonMode（此处为一个字符串）且commonMode（此处为一个集合，若有不懂，请看runLoop结构）这个集合中包含指定mode。
-        if (CFStringGetTypeID() == CFGetTypeID(curr->_mode)) {
-            doit = CFEqual(curr->_mode, curMode) || (CFEqual(curr->_mode, kCFRunLoopCommonModes) && CFSetContainsValue(commonModes, curMode));
+        if (own && (!item || own->_sequence < item->_sequence)) {
+            curr = own;
+            own = own->_next;
+            doit = true;
         } else {
-            doit = CFSetContainsValue((CFSetRef)curr->_mode, curMode) || (CFSetContainsValue((CFSetRef)curr->_mode, kCFRunLoopCommonModes) && CFSetContainsValue(commonModes, curMode));
+            curr = item;
+            item = item->_next;
+            /// 当前mode与制定mode相等或者当前mode为commonMode（此处为一个字符串）且commonMode（此处为一个集合，若有不懂，请看runLoop结构）这个集合中包含指定mode。
+            if (CFStringGetTypeID() == CFGetTypeID(curr->_mode)) {
+                doit = CFEqual(curr->_mode, curMode) || (CFEqual(curr->_mode, kCFRunLoopCommonModes) && CFSetContainsValue(commonModes, curMode));
+            } else {
+                doit = CFSetContainsValue((CFSetRef)curr->_mode, curMode) || (CFSetContainsValue((CFSetRef)curr->_mode, kCFRunLoopCommonModes) && CFSetContainsValue(commonModes, curMode));
+            }
+            if (!doit) prev = curr;
+            if (doit) {
+                if (prev) prev->_next = item;
+                if (curr == head) head = item;
+                if (curr == tail) tail = prev;
+            }
         }
-        if (!doit) prev = curr;
         if (doit) {
-            if (prev) prev->_next = item;
-            if (curr == head) head = item;
-            if (curr == tail) tail = prev;
             void (^block)(void) = curr->_block;
             CFRelease(curr->_mode);
             free(curr);
-            if (doit) {
-                /// 执行Block回调
-                __CFRUNLOOP_IS_CALLING_OUT_TO_A_BLOCK__(block);
-                did = true;
-            }
+            /// 执行Block回调
+            __CFRUNLOOP_IS_CALLING_OUT_TO_A_BLOCK__(block);
+            did = true;
             Block_release(block); // do this before relocking to prevent deadlocks where some yahoo wants to run the run loop reentrantly from their dealloc
         }
     }
@@ -1692,33 +2128,16 @@ static void __CFRunLoopDoObservers(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFRunL
     /// 释放 collectedObservers
     if (collectedObservers != buffer) free(collectedObservers);
 }
-/// 比较两个Sourece的优先级
-static CFComparisonResult __CFRunLoopSourceComparator(const void *val1, const void *val2, void *context) {
-    CFRunLoopSourceRef o1 = (CFRunLoopSourceRef)val1;
-    CFRunLoopSourceRef o2 = (CFRunLoopSourceRef)val2;
-    if (o1->_order < o2->_order) return kCFCompareLessThan;
-    if (o2->_order < o1->_order) return kCFCompareGreaterThan;
+/// 比较两个就绪 Source 的优先级, order 相同时先 signal 的先处理
+static CFComparisonResult __CFRunLoopReadySourceComparator(const void *val1, const void *val2, void *context) {
+    const struct __CFRunLoopReadySource *o1 = *(const struct __CFRunLoopReadySource **)val1;
+    const struct __CFRunLoopReadySource *o2 = *(const struct __CFRunLoopReadySource **)val2;
+    if (o1->_source->_order < o2->_source->_order) return kCFCompareLessThan;
+    if (o2->_source->_order < o1->_source->_order) return kCFCompareGreaterThan;
+    if (o1->_sequence < o2->_sequence) return kCFCompareLessThan;
+    if (o2->_sequence < o1->_sequence) return kCFCompareGreaterThan;
     return kCFCompareEqualTo;
 }
-/// 收集Source0
-static void __CFRunLoopCollectSources0(const void *value, void *context) {
-    CFRunLoopSourceRef rls = (CFRunLoopSourceRef)value;
-    CFTypeRef *sources = (CFTypeRef *)context;
-    /// 这里有个条件是 必须是 被打了Signaled标记的才会收集
-    if (0 == rls->_context.version0.version && __CFIsValid(rls) && __CFRunLoopSourceIsSignaled(rls)) {
-        if (NULL == *sources) {
-            *sources = CFRetain(rls);
-        } else if (CFGetTypeID(*sources) == CFRunLoopSourceGetTypeID()) {
-            CFTypeRef oldrls = *sources;
-            *sources = CFArrayCreateMutable(kCFAllocatorSystemDefault, 0, &kCFTypeArrayCallBacks);
-            CFArrayAppendValue((CFMutableArrayRef)*sources, oldrls);
-            CFArrayAppendValue((CFMutableArrayRef)*sources, rls);
-            CFRelease(oldrls);
-        } else {
-            CFArrayAppendValue((CFMutableArrayRef)*sources, rls);
-        }
-    }
-}
 #pragma mark - Source0 处理原事件的函数
 static void __CFRUNLOOP_IS_CALLING_OUT_TO_A_SOURCE0_PERFORM_FUNCTION__() __attribute__((noinline));
 static void __CFRUNLOOP_IS_CALLING_OUT_TO_A_SOURCE0_PERFORM_FUNCTION__(void (*perform)(void *), void *info) {
@@ -1752,62 +2171,98 @@ static void __CFRUNLOOP_IS_CALLING_OUT_TO_A_SOURCE1_PERFORM_FUNCTION__(
 static Boolean __CFRunLoopDoSources0(CFRunLoopRef rl, CFRunLoopModeRef rlm, Boolean stopAfterHandle) __attribute__((noinline));
 static Boolean __CFRunLoopDoSources0(CFRunLoopRef rl, CFRunLoopModeRef rlm, Boolean stopAfterHandle) {	/* DOES CALLOUT */
     CHECK_FOR_FORK();
-    CFTypeRef sources = NULL;
     Boolean sourceHandled = false;
     
     /* Fire the version 0 sources */
-    if (NULL != rlm->_sources0 && 0 < CFSetGetCount(rlm->_sources0)) {
-        CFSetApplyFunction(rlm->_sources0, (__CFRunLoopCollectSources0), &sources);
+    /// 只看被 signal 过的 source, 不再遍历整个 _sources0
+    struct __CFRunLoopReadySource *ready = __CFRunLoopTakeReadySources0(rl);
+    if (NULL == ready) return false;
+    
+    struct __CFRunLoopReadySource *buffer[32];
+    struct __CFRunLoopReadySource **list = buffer;
+    CFIndex capacity = sizeof(buffer) / sizeof(buffer[0]);
+    CFIndex cnt = 0, scanned = 0, fired = 0;
+    /// 不在这个 Mode 里的 source 放回队列, 等它所在的 Mode 运行
+    struct __CFRunLoopReadySource *pendingFirst = NULL, *pendingLast = NULL;
+    while (ready) {
+        struct __CFRunLoopReadySource *item = ready;
+        ready = ready->_next;
+        CFRunLoopSourceRef rls = item->_source;
+        item->_sequence = scanned++;
+        Boolean keep = false;
+        if (__CFIsValid(rls) && __CFRunLoopSourceIsSignaled(rls)) {
+            if (NULL != rlm->_sources0 && CFSetContainsValue(rlm->_sources0, rls)) {
+                if (cnt == capacity) {
+                    capacity *= 2;
+                    if (list == buffer) {
+                        list = (struct __CFRunLoopReadySource **)CFAllocatorAllocate(kCFAllocatorSystemDefault, capacity * sizeof(struct __CFRunLoopReadySource *), 0);
+                        memmove(list, buffer, cnt * sizeof(struct __CFRunLoopReadySource *));
+                    } else {
+                        list = (struct __CFRunLoopReadySource **)CFAllocatorReallocate(kCFAllocatorSystemDefault, list, capacity * sizeof(struct __CFRunLoopReadySource *), 0);
+                    }
+                }
+                list[cnt++] = item;
+                continue;
+            }
+            __CFRunLoopSourceLock(rls);
+            keep = (NULL != rls->_runLoops && CFBagContainsValue(rls->_runLoops, rl));
+            __CFRunLoopSourceUnlock(rls);
+        }
+        if (keep) {
+            item->_next = pendingFirst;
+            pendingFirst = item;
+            if (NULL == pendingLast) pendingLast = item;
+        } else {
+            CFRelease(rls);
+            CFAllocatorDeallocate(kCFAllocatorSystemDefault, item);
+        }
     }
-    if (NULL != sources) {
+    
+    if (0 < cnt) {
+        if (1 < cnt) CFQSortArray(list, cnt, sizeof(struct __CFRunLoopReadySource *), __CFRunLoopReadySourceComparator, NULL);
         __CFRunLoopModeUnlock(rlm);
         __CFRunLoopUnlock(rl);
-        // sources is either a single (retained) CFRunLoopSourceRef or an array of (retained) CFRunLoopSourceRef
-        if (CFGetTypeID(sources) == CFRunLoopSourceGetTypeID()) {
-            CFRunLoopSourceRef rls = (CFRunLoopSourceRef)sources;
+        CFIndex idx;
+        for (idx = 0; idx < cnt; idx++) {
+            if (stopAfterHandle && sourceHandled) {
+                break;
+            }
+            CFRunLoopSourceRef rls = list[idx]->_source;
             __CFRunLoopSourceLock(rls);
             if (__CFRunLoopSourceIsSignaled(rls)) {
                 __CFRunLoopSourceUnsetSignaled(rls);
                 if (__CFIsValid(rls)) {
                     __CFRunLoopSourceUnlock(rls);
+                    /// 处理原事件源
                     __CFRUNLOOP_IS_CALLING_OUT_TO_A_SOURCE0_PERFORM_FUNCTION__(rls->_context.version0.perform, rls->_context.version0.info);
                     CHECK_FOR_FORK();
                     sourceHandled = true;
+                    fired++;
                 } else {
                     __CFRunLoopSourceUnlock(rls);
                 }
             } else {
                 __CFRunLoopSourceUnlock(rls);
             }
-        } else {
-            CFIndex cnt = CFArrayGetCount((CFArrayRef)sources);
-            CFArraySortValues((CFMutableArrayRef)sources, CFRangeMake(0, cnt), (__CFRunLoopSourceComparator), NULL);
-            for (CFIndex idx = 0; idx < cnt; idx++) {
-                CFRunLoopSourceRef rls = (CFRunLoopSourceRef)CFArrayGetValueAtIndex((CFArrayRef)sources, idx);
-                __CFRunLoopSourceLock(rls);
-                if (__CFRunLoopSourceIsSignaled(rls)) {
-                    __CFRunLoopSourceUnsetSignaled(rls);
-                    if (__CFIsValid(rls)) {
-                        __CFRunLoopSourceUnlock(rls);
-                       /// 处理原事件源
-                        __CFRUNLOOP_IS_CALLING_OUT_TO_A_SOURCE0_PERFORM_FUNCTION__(rls->_context.version0.perform, rls->_context.version0.info);
-                        CHECK_FOR_FORK();
-                        sourceHandled = true;
-                    } else {
-                        __CFRunLoopSourceUnlock(rls);
-                    }
-                } else {
-                    __CFRunLoopSourceUnlock(rls);
-                }
-                if (stopAfterHandle && sourceHandled) {
-                    break;
-                }
-            }
+            CFRelease(rls);
+            CFAllocatorDeallocate(kCFAllocatorSystemDefault, list[idx]);
+        }
+        /// stopAfterHandle 时剩下的 source 还是 signaled 状态, 放回队列下一轮处理
+        for (; idx < cnt; idx++) {
+            struct __CFRunLoopReadySource *item = list[idx];
+            item->_next = pendingFirst;
+            pendingFirst = item;
+            if (NULL == pendingLast) pendingLast = item;
         }
-        CFRelease(sources);
         __CFRunLoopLock(rl);
         __CFRunLoopModeLock(rlm);
     }
+    if (list != buffer) CFAllocatorDeallocate(kCFAllocatorSystemDefault, list);
+    if (NULL != pendingFirst) __CFRunLoopPushReadySources0(rl, pendingFirst, pendingLast);
+    
+    rl->_sources0Scanned += scanned;
+    rl->_sources0Fired += fired;
+    if (_LogCFRunLoop) { CFLog(kCFLogLevelDebug, CFSTR("%p (%s) __CFRunLoopDoSources0 scanned %ld, fired %ld sources"), CFRunLoopGetCurrent(), *_CFGetProgname(), (long)scanned, (long)fired); }
     return sourceHandled;
 }
 
@@ -1848,79 +2303,48 @@ static Boolean __CFRunLoopDoSource1(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFRun
     __CFRunLoopModeLock(rlm);
     return sourceHandled;
 }
-// 根据timer的_fireTSR时间字段，利用二分查找的算法，将timer插入到已按照时间排列好的timerArray（rlm_timers）中，
-// 这个rlm_timers的array是按照fireTSR的升序排列的
-static CFIndex __CFRunLoopInsertionIndexInTimerArray(CFArrayRef array, CFRunLoopTimerRef rlt) __attribute__((noinline));
-static CFIndex __CFRunLoopInsertionIndexInTimerArray(CFArrayRef array, CFRunLoopTimerRef rlt) {
-    CFIndex cnt = CFArrayGetCount(array);
-    if (cnt <= 0) {
-        return 0;
-    }
-    if (256 < cnt) {
-        CFRunLoopTimerRef item = (CFRunLoopTimerRef)CFArrayGetValueAtIndex(array, cnt - 1);
-        if (item->_fireTSR <= rlt->_fireTSR) {
-            return cnt;
+#pragma mark - 处理Mode的下个到来的Timer
+// 根据mode中的最前面的那个timer的触发时间，将其通过dispatch_source_set_runloop_timer或者mk_timer的方式注册。
+// Looks at the timers in the subtree of the heap at idx. We calculate two TSR values; the next soft and next hard deadline.
+// The next soft deadline is the first time we can fire any timer. This is the earliest fire date of the timers that aren't firing.
+// The next hard deadline is the last time at which we can fire the timer before we've moved out of the allowable tolerance of the timers.
+static void __CFRunLoopTimerHeapGetDeadlines(__CFRunLoopTimerHeap *heap, CFIndex idx, uint64_t *nextSoftDeadline, uint64_t *nextHardDeadline) {
+    if (heap->_count <= idx) return;
+    __CFRunLoopTimerHeapEntry *entry = &heap->_entries[idx];
+    
+    // We can skip this subtree if the soft deadline of its first timer exceeds the current hard deadline. Otherwise, later timers with lower tolerance could still have earlier hard deadlines.
+    // 通过这几行代码对deadline进行修正，保证前边的长tolerance的timer不会影响后面的timer的触发
+    if (entry->_fireTSR > *nextHardDeadline) return;
+    
+    // discount timers currently firing
+    CFRunLoopTimerRef t = entry->_timer;
+    if (!__CFRunLoopTimerIsFiring(t)) {
+        int32_t err = CHECKINT_NO_ERROR;
+        // SoftDeadline是理应触发的时间
+        uint64_t oneTimerSoftDeadline = entry->_fireTSR;
+        // HardDeadline是理应触发的时间加上tolerance
+        uint64_t oneTimerHardDeadline = check_uint64_add(entry->_fireTSR, __CFTimeIntervalToTSR(t->_tolerance), &err);
+        if (err != CHECKINT_NO_ERROR) oneTimerHardDeadline = UINT64_MAX;
+        
+        if (oneTimerSoftDeadline < *nextSoftDeadline) {
+            *nextSoftDeadline = oneTimerSoftDeadline;
         }
-        item = (CFRunLoopTimerRef)CFArrayGetValueAtIndex(array, 0);
-        if (rlt->_fireTSR < item->_fireTSR) {
-            return 0;
+        
+        if (oneTimerHardDeadline < *nextHardDeadline) {
+            *nextHardDeadline = oneTimerHardDeadline;
         }
     }
     
-    CFIndex add = (1 << flsl(cnt)) * 2;
-    CFIndex idx = 0;
-    Boolean lastTestLEQ;
-    do {
-        add = add / 2;
-        lastTestLEQ = false;
-        CFIndex testIdx = idx + add;
-        if (testIdx < cnt) {
-            CFRunLoopTimerRef item = (CFRunLoopTimerRef)CFArrayGetValueAtIndex(array, testIdx);
-            if (item->_fireTSR <= rlt->_fireTSR) {
-                idx = testIdx;
-                lastTestLEQ = true;
-            }
-        }
-    } while (0 < add);
-    
-    return lastTestLEQ ? idx + 1 : idx;
+    __CFRunLoopTimerHeapGetDeadlines(heap, 2 * idx + 1, nextSoftDeadline, nextHardDeadline);
+    __CFRunLoopTimerHeapGetDeadlines(heap, 2 * idx + 2, nextSoftDeadline, nextHardDeadline);
 }
-#pragma mark - 处理Mode的下个到来的Timer
-// 根据mode中的最前面的那个timer的触发时间，将其通过dispatch_source_set_runloop_timer或者mk_timer的方式注册。
+
 static void __CFArmNextTimerInMode(CFRunLoopModeRef rlm, CFRunLoopRef rl) {    
     uint64_t nextHardDeadline = UINT64_MAX;
     uint64_t nextSoftDeadline = UINT64_MAX;
     
-    if (rlm->_timers) {
-        // Look at the list of timers. We will calculate two TSR values; the next soft and next hard deadline.
-        // The next soft deadline is the first time we can fire any timer. This is the fire date of the first timer in our sorted list of timers.
-        // The next hard deadline is the last time at which we can fire the timer before we've moved out of the allowable tolerance of the timers in our list.
-        for (CFIndex idx = 0, cnt = CFArrayGetCount(rlm->_timers); idx < cnt; idx++) {
-            CFRunLoopTimerRef t = (CFRunLoopTimerRef)CFArrayGetValueAtIndex(rlm->_timers , idx);
-            // discount timers currently firing
-            if (__CFRunLoopTimerIsFiring(t)) continue;
-            
-            int32_t err = CHECKINT_NO_ERROR;
-            // SoftDeadline是理应触发的时间
-            uint64_t oneTimerSoftDeadline = t->_fireTSR;
-            // HardDeadline是理应触发的时间加上tolerance
-            uint64_t oneTimerHardDeadline = check_uint64_add(t->_fireTSR, __CFTimeIntervalToTSR(t->_tolerance), &err);
-            if (err != CHECKINT_NO_ERROR) oneTimerHardDeadline = UINT64_MAX;
-            
-            // We can stop searching if the soft deadline for this timer exceeds the current hard deadline. Otherwise, later timers with lower tolerance could still have earlier hard deadlines.
-            // 通过这几行代码对deadline进行修正，保证前边的长tolerance的timer不会影响后面的timer的触发
-            if (oneTimerSoftDeadline > nextHardDeadline) {
-                break;
-            }
-            
-            if (oneTimerSoftDeadline < nextSoftDeadline) {
-                nextSoftDeadline = oneTimerSoftDeadline;
-            }
-            
-            if (oneTimerHardDeadline < nextHardDeadline) {
-                nextHardDeadline = oneTimerHardDeadline;
-            }
-        }
+    if (rlm->_timers._entries) {
+        __CFRunLoopTimerHeapGetDeadlines(&rlm->_timers, 0, &nextSoftDeadline, &nextHardDeadline);
         
         if (nextSoftDeadline < UINT64_MAX && (nextHardDeadline != rlm->_timerHardDeadline || nextSoftDeadline != rlm->_timerSoftDeadline)) {
             if (CFRUNLOOP_NEXT_TIMER_ARMED_ENABLED()) {
@@ -1992,32 +2416,19 @@ static void __CFArmNextTimerInMode(CFRunLoopModeRef rlm, CFRunLoopRef rl) {
 }
 
 // call with rlm and its run loop locked, and the TSRLock locked; rlt not locked; returns with same state
-/// 重新排列这个mode中的所有timer触发时刻
+/// 在这个mode的timer堆中加入timer或调整它的位置
 static void __CFRepositionTimerInMode(CFRunLoopModeRef rlm, CFRunLoopTimerRef rlt, Boolean isInArray) __attribute__((noinline));
 static void __CFRepositionTimerInMode(CFRunLoopModeRef rlm, CFRunLoopTimerRef rlt, Boolean isInArray) {
     if (!rlt) return;
     
-    CFMutableArrayRef timerArray = rlm->_timers;
-    if (!timerArray) return;
-    Boolean found = false;
-    
-    // If we know in advance that the timer is not in the array (just being added now) then we can skip this search
+    // If we know in advance that the timer is not in the heap (just being added now) then we can skip this search
     if (isInArray) {
-        CFIndex idx = CFArrayGetFirstIndexOfValue(timerArray, CFRangeMake(0, CFArrayGetCount(timerArray)), rlt);
-        if (kCFNotFound != idx) {
-            CFRetain(rlt);
-            CFArrayRemoveValueAtIndex(timerArray, idx);
-            found = true;
-        }
-    }
-    if (!found && isInArray) return;
-    /// 根据timer的_fireTSR时间字段，利用二分查找的算法，将timer插入到已按照时间排列好的timerArray（rlm_timers）中，
-    /// 这个rlm_timers的array是按照fireTSR的升序排列的
-    CFIndex newIdx = __CFRunLoopInsertionIndexInTimerArray(timerArray, rlt);
-    CFArrayInsertValueAtIndex(timerArray, newIdx, rlt);
+        if (!__CFRunLoopTimerHeapReposition(rlm, rlt)) return;
+    } else {
+        __CFRunLoopTimerHeapInsert(rlm, rlt);
+    }
     // 根据mode中的最前面的那个timer的触发时间，将其通过dispatch_source_set_runloop_timer或者mk_timer的方式注册。
     __CFArmNextTimerInMode(rlm, rlt->_runLoop);
-    if (isInArray) CFRelease(rlt);
 }
 
 #pragma mark - 处理Timer __CFRunLoopDoTimer
@@ -2163,30 +2574,65 @@ static Boolean __CFRunLoopDoTimer(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFRunLo
 }
 
 
+static CFComparisonResult __CFRunLoopTimerHeapIndexCompare(const void *val1, const void *val2, void *context) {
+    const __CFRunLoopTimerHeapEntry *entries = (const __CFRunLoopTimerHeapEntry *)context;
+    const __CFRunLoopTimerHeapEntry *entry1 = &entries[*(const CFIndex *)val1];
+    const __CFRunLoopTimerHeapEntry *entry2 = &entries[*(const CFIndex *)val2];
+    if (__CFRunLoopTimerHeapEntryLess(entry1, entry2)) return kCFCompareLessThan;
+    if (__CFRunLoopTimerHeapEntryLess(entry2, entry1)) return kCFCompareGreaterThan;
+    return kCFCompareEqualTo;
+}
+
 // rl and rlm are locked on entry and exit
 static Boolean __CFRunLoopDoTimers(CFRunLoopRef rl, CFRunLoopModeRef rlm, uint64_t limitTSR) {	/* DOES CALLOUT */
-    /// 遍历runLoopMode维护的Timers数组，取其中有效的timer并加入新临时数组
+    /// 遍历runLoopMode维护的Timer堆，取其中到期的timer。到期的timer在堆顶形成一棵子树，只需访问这棵子树
     Boolean timerHandled = false;
-    CFMutableArrayRef timers = NULL;
-    for (CFIndex idx = 0, cnt = rlm->_timers ? CFArrayGetCount(rlm->_timers) : 0; idx < cnt; idx++) {
-        /// timer
-        CFRunLoopTimerRef rlt = (CFRunLoopTimerRef)CFArrayGetValueAtIndex(rlm->_timers, idx);
-        
-        if (__CFIsValid(rlt) && !__CFRunLoopTimerIsFiring(rlt)) {
-            if (rlt->_fireTSR <= limitTSR) {
-                if (!timers) timers = CFArrayCreateMutable(kCFAllocatorSystemDefault, 0, &kCFTypeArrayCallBacks);
-                CFArrayAppendValue(timers, rlt);
+    __CFRunLoopTimerHeap *heap = &rlm->_timers;
+    CFIndex idx, cnt = 0, capacity = 64;
+    CFIndex buffer[64];
+    CFIndex *due = buffer;
+    if (0 < heap->_count && heap->_entries[0]._fireTSR <= limitTSR) {
+        due[cnt++] = 0;
+    }
+    for (idx = 0; idx < cnt; idx++) {
+        for (CFIndex child = 2 * due[idx] + 1; child <= 2 * due[idx] + 2 && child < heap->_count; child++) {
+            if (heap->_entries[child]._fireTSR <= limitTSR) {
+                if (cnt == capacity) {
+                    capacity = 2 * capacity;
+                    CFIndex *bigger = (CFIndex *)CFAllocatorAllocate(kCFAllocatorSystemDefault, capacity * sizeof(CFIndex), 0);
+                    memmove(bigger, due, cnt * sizeof(CFIndex));
+                    if (due != buffer) CFAllocatorDeallocate(kCFAllocatorSystemDefault, due);
+                    due = bigger;
+                }
+                due[cnt++] = child;
             }
         }
     }
-    /// 遍历临时数组，每个有效Timer调用__CFRunLoopDoTimer
-    for (CFIndex idx = 0, cnt = timers ? CFArrayGetCount(timers) : 0; idx < cnt; idx++) {
-        CFRunLoopTimerRef rlt = (CFRunLoopTimerRef)CFArrayGetValueAtIndex(timers, idx);
+    /// 按触发时间排序，保持原来按顺序触发的行为
+    CFQSortArray(due, cnt, sizeof(CFIndex), __CFRunLoopTimerHeapIndexCompare, heap->_entries);
+    
+    /// 取其中有效的timer并retain，callout期间堆会变化
+    CFIndex timerCount = 0;
+    CFRunLoopTimerRef timerBuffer[64];
+    CFRunLoopTimerRef *timers = (cnt <= 64) ? timerBuffer : (CFRunLoopTimerRef *)CFAllocatorAllocate(kCFAllocatorSystemDefault, cnt * sizeof(CFRunLoopTimerRef), 0);
+    for (idx = 0; idx < cnt; idx++) {
+        CFRunLoopTimerRef rlt = heap->_entries[due[idx]]._timer;
+        if (__CFIsValid(rlt) && !__CFRunLoopTimerIsFiring(rlt)) {
+            timers[timerCount++] = (CFRunLoopTimerRef)CFRetain(rlt);
+        }
+    }
+    if (due != buffer) CFAllocatorDeallocate(kCFAllocatorSystemDefault, due);
+    
+    /// 遍历到期的timer，每个有效Timer调用__CFRunLoopDoTimer
+    for (idx = 0; idx < timerCount; idx++) {
         /// do timer
-        Boolean did = __CFRunLoopDoTimer(rl, rlm, rlt);
+        Boolean did = __CFRunLoopDoTimer(rl, rlm, timers[idx]);
         timerHandled = timerHandled || did;
     }
-    if (timers) CFRelease(timers);
+    for (idx = 0; idx < timerCount; idx++) {
+        CFRelease(timers[idx]);
+    }
+    if (timers != timerBuffer) CFAllocatorDeallocate(kCFAllocatorSystemDefault, timers);
     return timerHandled;
 }
 
@@ -2196,6 +2642,7 @@ CF_EXPORT Boolean _CFRunLoopFinished(CFRunLoopRef rl, CFStringRef modeName) {
     CFRunLoopModeRef rlm;
     Boolean result = false;
     __CFRunLoopLock(rl);
+    __CFRunLoopCollectBlocks(rl);
     rlm = __CFRunLoopFindMode(rl, modeName, false);
     if (NULL == rlm || __CFRunLoopModeIsEmpty(rl, rlm, NULL)) {
         result = true;
@@ -2315,6 +2762,36 @@ static Boolean __CFRunLoopWaitForMultipleObjects(__CFPortSet portSet, HANDLE *on
     return result;
 }
 
+#elif DEPLOYMENT_TARGET_LINUX
+
+#define TIMEOUT_INFINITY (-1)
+
+// pass in either a portSet or onePort; timeout is in milliseconds
+static Boolean __CFRunLoopServiceFileDescriptors(__CFPortSet portSet, __CFPort onePort, int timeout, __CFPort *livePort) {
+    int result;
+    if (TIMEOUT_INFINITY == timeout) { CFRUNLOOP_SLEEP(); } else { CFRUNLOOP_POLL(); }
+    if (CFPORT_NULL != portSet) {
+        // One event per wakeup, like one message per mach_msg; epoll hands
+        // level-triggered ports out round-robin, so a busy port can't starve the rest.
+        struct epoll_event event;
+        do {
+            result = epoll_wait(portSet, &event, 1, timeout);
+        } while (result < 0 && EINTR == errno);
+        if (1 == result) *livePort = event.data.fd;
+    } else {
+        struct pollfd pfd = { onePort, POLLIN, 0 };
+        do {
+            result = poll(&pfd, 1, timeout);
+        } while (result < 0 && EINTR == errno);
+        if (1 == result) *livePort = onePort;
+    }
+    CFRUNLOOP_WAKEUP(result);
+    if (1 == result) return true;
+    if (result < 0) CRASH("*** Unable to wait for run loop ports. (%d) ***", errno);
+    *livePort = CFPORT_NULL;
+    return false;
+}
+
 #endif
 /// 超时上下文
 struct __timeout_context {
@@ -2417,6 +2894,9 @@ static int32_t __CFRunLoopRun(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFTimeInter
 #if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI
         mach_msg_header_t *msg = NULL;
         mach_port_t livePort = MACH_PORT_NULL;
+#elif DEPLOYMENT_TARGET_LINUX
+        __CFPort livePort = CFPORT_NULL;
+#endif
 
         /// Mode 中的 port 集合
         __CFPortSet waitSet = rlm->_portSet;
@@ -2438,11 +2918,17 @@ static int32_t __CFRunLoopRun(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFTimeInter
         Boolean poll = sourceHandledThisLoop || (0ULL == timeout_context->termTSR);
         /// 检测端口，如果端口有事件则跳转至handle_msg（首次执行不会进入判断，因为didDispatchPortLastTime为true）
         if (MACH_PORT_NULL != dispatchPort && !didDispatchPortLastTime) {
+#if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI
             msg = (mach_msg_header_t *)msg_buffer;
             if (__CFRunLoopServiceMachPort(dispatchPort, &msg, sizeof(msg_buffer), &livePort, 0, &voucherState, NULL)) {
                 /// 跳转去source1收到的系统消息
                 goto handle_msg;
             }
+#elif DEPLOYMENT_TARGET_LINUX
+            if (__CFRunLoopServiceFileDescriptors(CFPORT_NULL, dispatchPort, 0, &livePort)) {
+                goto handle_msg;
+            }
+#endif
         }
         
         didDispatchPortLastTime = false;
@@ -2509,6 +2995,10 @@ static int32_t __CFRunLoopRun(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFTimeInter
         /// 被其他什么调用者手动唤醒
         __CFRunLoopServiceMachPort(waitSet, &msg, sizeof(msg_buffer), &livePort, poll ? 0 : TIMEOUT_INFINITY, &voucherState, &voucherCopy);
 #endif
+#elif DEPLOYMENT_TARGET_LINUX
+        /// epoll_wait 等待 waitSet 中的任一 fd 可读: wakeUpPort、timerfd、dispatchPort 或 source1 的 fd
+        __CFRunLoopServiceFileDescriptors(waitSet, CFPORT_NULL, poll ? 0 : TIMEOUT_INFINITY, &livePort);
+#endif
         
         __CFRunLoopLock(rl);
         __CFRunLoopModeLock(rlm);
@@ -2540,6 +3030,10 @@ static int32_t __CFRunLoopRun(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFTimeInter
             // handle nothing
         } else if (livePort == rl->_wakeUpPort) {
             CFRUNLOOP_WAKEUP_FOR_WAKEUP();
+#if DEPLOYMENT_TARGET_LINUX
+            // Always drain the wake up port, or risk spinning forever
+            __CFPortDrain(rl->_wakeUpPort);
+#endif
         }
         /// 如果一个 Timer 到时间了，触发这个Timer的回调。
 //#if USE_DISPATCH_SOURCE_FOR_TIMERS
@@ -2555,7 +3049,9 @@ static int32_t __CFRunLoopRun(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFTimeInter
 #if USE_MK_TIMER_TOO
         else if (rlm->_timerPort != MACH_PORT_NULL && livePort == rlm->_timerPort) {
             CFRUNLOOP_WAKEUP_FOR_TIMER();
-     
+#if DEPLOYMENT_TARGET_LINUX
+            __CFPortDrain(rlm->_timerPort);
+#endif
             if (!__CFRunLoopDoTimers(rl, rlm, mach_absolute_time())) {
                 // Re-arm the next timer
                 __CFArmNextTimerInMode(rlm, rl);
@@ -2565,10 +3061,17 @@ static int32_t __CFRunLoopRun(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFTimeInter
         /// 如果有dispatch到main_queue的block，执行block。
         else if (livePort == dispatchPort) {
             CFRUNLOOP_WAKEUP_FOR_DISPATCH();
+#if DEPLOYMENT_TARGET_LINUX
+            __CFPortDrain(dispatchPort);
+#endif
             __CFRunLoopModeUnlock(rlm);
             __CFRunLoopUnlock(rl);
             _CFSetTSD(__CFTSDKeyIsInGCDMainQ, (void *)6, NULL);
+#if DEPLOYMENT_TARGET_LINUX
+            __CFRUNLOOP_IS_SERVICING_THE_MAIN_DISPATCH_QUEUE__(NULL);
+#else
             __CFRUNLOOP_IS_SERVICING_THE_MAIN_DISPATCH_QUEUE__(msg);
+#endif
             _CFSetTSD(__CFTSDKeyIsInGCDMainQ, (void *)0, NULL);
             __CFRunLoopLock(rl);
             __CFRunLoopModeLock(rlm);
@@ -2578,8 +3081,10 @@ static int32_t __CFRunLoopRun(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFTimeInter
             /// 如果一个 Source1 (基于port) 发出事件了，处理这个事件
             CFRUNLOOP_WAKEUP_FOR_SOURCE();
             
+#if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI
             // If we received a voucher from this mach_msg, then put a copy of the new voucher into TSD. CFMachPortBoost will look in the TSD for the voucher. By using the value in the TSD we tie the CFMachPortBoost to this received mach_msg explicitly without a chance for anything in between the two pieces of code to set the voucher again.
             voucher_t previousVoucher = _CFSetTSD(__CFTSDKeyMachMessageHasVoucher, (void *)voucherCopy, os_release);
+#endif
             /// 这里调用 __CFRunLoopModeFindSourceForMachPort 找到 source, key 为 mach_port 指为 source
             // Despite the name, this works for windows handles as well
             CFRunLoopSourceRef rls = __CFRunLoopModeFindSourceForMachPort(rl, rlm, livePort);
@@ -2592,10 +3097,16 @@ static int32_t __CFRunLoopRun(CFRunLoopRef rl, CFRunLoopModeRef rlm, CFTimeInter
                     (void)mach_msg(reply, MACH_SEND_MSG, reply->msgh_size, 0, MACH_PORT_NULL, 0, MACH_PORT_NULL);
                     CFAllocatorDeallocate(kCFAllocatorSystemDefault, reply);
                 }
+#elif DEPLOYMENT_TARGET_LINUX
+                /// source1 的 perform 负责读走 fd 上的数据, 否则下一次 epoll_wait 会立即返回
+                sourceHandledThisLoop = __CFRunLoopDoSource1(rl, rlm, rls) || sourceHandledThisLoop;
+#endif
             }
             
+#if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI
             // Restore the previous voucher
             _CFSetTSD(__CFTSDKeyMachMessageHasVoucher, previousVoucher, os_release);
+#endif
             
         } 
 #if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI
@@ -2656,6 +3167,8 @@ SInt32 CFRunLoopRunSpecific(CFRunLoopRef rl, CFStringRef modeName, CFTimeInterva
     if (__CFRunLoopIsDeallocating(rl)) return kCFRunLoopRunFinished;
     /// 加锁
     __CFRunLoopLock(rl);
+    /// 先收集 CFRunLoopPerformBlock 放进来的 block, 它们可能需要创建这个 Mode
+    __CFRunLoopCollectBlocks(rl);
     /// 根据Mode名称找到RunLoopMode
     CFRunLoopModeRef currentMode = __CFRunLoopFindMode(rl, modeName, false);
     if (NULL == currentMode || __CFRunLoopModeIsEmpty(rl, currentMode, rl->_currentMode)) {
@@ -2704,7 +3217,7 @@ CFAbsoluteTime CFRunLoopGetNextTimerFireDate(CFRunLoopRef rl, CFStringRef modeNa
     __CFRunLoopLock(rl);
     CFRunLoopModeRef rlm = __CFRunLoopFindMode(rl, modeName, false);
     CFAbsoluteTime at = 0.0;
-    CFRunLoopTimerRef nextTimer = (rlm && rlm->_timers && 0 < CFArrayGetCount(rlm->_timers)) ? (CFRunLoopTimerRef)CFArrayGetValueAtIndex(rlm->_timers, 0) : NULL;
+    CFRunLoopTimerRef nextTimer = (rlm && 0 < rlm->_timers._count) ? rlm->_timers._entries[0]._timer : NULL;
     if (nextTimer) {
         at = CFRunLoopTimerGetNextFireDate(nextTimer);
     }
@@ -2736,6 +3249,10 @@ void CFRunLoopWakeUp(CFRunLoopRef rl) {
     if (ret != MACH_MSG_SUCCESS && ret != MACH_SEND_TIMED_OUT) CRASH("*** Unable to send message to wake up port. (%d) ***", ret);
 #elif DEPLOYMENT_TARGET_WINDOWS
     SetEvent(rl->_wakeUpPort);
+#elif DEPLOYMENT_TARGET_LINUX
+    /* EAGAIN only means the eventfd counter is saturated, so a wakeup is
+     * already pending. */
+    if (eventfd_write(rl->_wakeUpPort, 1) < 0 && EAGAIN != errno) CRASH("*** Unable to signal wake up port. (%d) ***", errno);
 #endif
     __CFRunLoopUnlock(rl);
 }
@@ -2774,39 +3291,20 @@ CF_EXPORT Boolean _CFRunLoopModeContainsMode(CFRunLoopRef rl, CFStringRef modeNa
 /// RunLoop Perform Block
 void CFRunLoopPerformBlock(CFRunLoopRef rl, CFTypeRef mode, void (^block)(void)) {
     CHECK_FOR_FORK();
-    /// 找到当前执行perfonBlock中的RunLoop中的Mode
+    /// 复制 mode; 不存在的 Mode 在 __CFRunLoopCollectBlocks 里创建, 这里不需要 RunLoop 的锁
     if (CFStringGetTypeID() == CFGetTypeID(mode)) {
         mode = CFStringCreateCopy(kCFAllocatorSystemDefault, (CFStringRef)mode);
-        __CFRunLoopLock(rl);
-        // ensure mode exists
-        CFRunLoopModeRef currentMode = __CFRunLoopFindMode(rl, (CFStringRef)mode, true);
-        if (currentMode) __CFRunLoopModeUnlock(currentMode);
-        __CFRunLoopUnlock(rl);
     } else if (CFArrayGetTypeID() == CFGetTypeID(mode)) {
         CFIndex cnt = CFArrayGetCount((CFArrayRef)mode);
         const void **values = (const void **)malloc(sizeof(const void *) * cnt);
         CFArrayGetValues((CFArrayRef)mode, CFRangeMake(0, cnt), values);
         mode = CFSetCreate(kCFAllocatorSystemDefault, values, cnt, &kCFTypeSetCallBacks);
-        __CFRunLoopLock(rl);
-        // ensure modes exist
-        for (CFIndex idx = 0; idx < cnt; idx++) {
-            CFRunLoopModeRef currentMode = __CFRunLoopFindMode(rl, (CFStringRef)values[idx], true);
-            if (currentMode) __CFRunLoopModeUnlock(currentMode);
-        }
-        __CFRunLoopUnlock(rl);
         free(values);
     } else if (CFSetGetTypeID() == CFGetTypeID(mode)) {
         CFIndex cnt = CFSetGetCount((CFSetRef)mode);
         const void **values = (const void **)malloc(sizeof(const void *) * cnt);
         CFSetGetValues((CFSetRef)mode, values);
         mode = CFSetCreate(kCFAllocatorSystemDefault, values, cnt, &kCFTypeSetCallBacks);
-        __CFRunLoopLock(rl);
-        // ensure modes exist
-        for (CFIndex idx = 0; idx < cnt; idx++) {
-            CFRunLoopModeRef currentMode = __CFRunLoopFindMode(rl, (CFStringRef)values[idx], true);
-            if (currentMode) __CFRunLoopModeUnlock(currentMode);
-        }
-        __CFRunLoopUnlock(rl);
         free(values);
     } else {
         mode = NULL;
@@ -2819,20 +3317,16 @@ void CFRunLoopPerformBlock(CFRunLoopRef rl, CFTypeRef mode, void (^block)(void))
         if (block) Block_release(block);
         return;
     }
-    /// 加锁
-    __CFRunLoopLock(rl);
-    /// 把block、mode 放进 RunLoop里面
+    /// 把block、mode 无锁压进 RunLoop 的 _blocksInbox
     struct _block_item *new_item = (struct _block_item *)malloc(sizeof(struct _block_item));
-    new_item->_next = NULL;
     new_item->_mode = mode;
     new_item->_block = block;
-    if (!rl->_blocks_tail) {
-        rl->_blocks_head = new_item;
-    } else {
-        rl->_blocks_tail->_next = new_item;
-    }
-    rl->_blocks_tail = new_item;
-    __CFRunLoopUnlock(rl);
+    new_item->_sequence = 0;
+    struct _block_item *head;
+    do {
+        head = rl->_blocksInbox;
+        new_item->_next = head;
+    } while (!OSAtomicCompareAndSwapPtrBarrier(head, new_item, (void * volatile *)&rl->_blocksInbox));
 }
 /// 判断RunLoop 是否包含 Source
 Boolean CFRunLoopContainsSource(CFRunLoopRef rl, CFRunLoopSourceRef rls, CFStringRef modeName) {
@@ -2897,7 +3391,7 @@ void CFRunLoopAddSource(CFRunLoopRef rl, CFRunLoopSourceRef rls, CFStringRef mod
                 /// source 1 存入 set
                 CFSetAddValue(rlm->_sources1, rls);
                 /// 从 _context.version1.info 取得 port
-                __CFPort src_port = rls->_context.version1.getPort(rls->_context.version1.info);
+                __CFPort src_port = __CFRunLoopSourceGetPort(rls);
                 if (CFPORT_NULL != src_port) {
                     /// 以 mach_port 为 key 值为 source1 存入到 Mode 的 _portToV1SourceMap Map中
                     CFDictionarySetValue(rlm->_portToV1SourceMap, (const void *)(uintptr_t)src_port, rls);
@@ -2909,7 +3403,12 @@ void CFRunLoopAddSource(CFRunLoopRef rl, CFRunLoopSourceRef rls, CFStringRef mod
             if (NULL == rls->_runLoops) {
                 rls->_runLoops = CFBagCreateMutable(kCFAllocatorSystemDefault, 0, &kCFTypeBagCallBacks); // sources retain run loops!
             }
+            Boolean firstInRunLoop = (0 == CFBagGetCountOfValue(rls->_runLoops, rl));
             CFBagAddValue(rls->_runLoops, rl);
+            /// 添加之前就已经被 signal 的 source0 也要放进这个 RunLoop 的就绪队列; 已经在别的 mode 里时节点已经放过了, 只放一次
+            if (firstInRunLoop && 0 == rls->_context.version0.version && __CFIsValid(rls) && __CFRunLoopSourceIsSignaled(rls)) {
+                __CFRunLoopPushReadySource0(rl, rls);
+            }
             __CFRunLoopSourceUnlock(rls);
             if (0 == rls->_context.version0.version) {
                 if (NULL != rls->_context.version0.schedule) {
@@ -2952,7 +3451,7 @@ void CFRunLoopRemoveSource(CFRunLoopRef rl, CFRunLoopSourceRef rls, CFStringRef
         if (NULL != rlm && ((NULL != rlm->_sources0 && CFSetContainsValue(rlm->_sources0, rls)) || (NULL != rlm->_sources1 && CFSetContainsValue(rlm->_sources1, rls)))) {
             CFRetain(rls);
             if (1 == rls->_context.version0.version) {
-                __CFPort src_port = rls->_context.version1.getPort(rls->_context.version1.info);
+                __CFPort src_port = __CFRunLoopSourceGetPort(rls);
                 if (CFPORT_NULL != src_port) {
                     CFDictionaryRemoveValue(rlm->_portToV1SourceMap, (const void *)(uintptr_t)src_port);
                     __CFPortSetRemove(src_port, rlm->_portSet);
@@ -3149,10 +3648,7 @@ Boolean CFRunLoopContainsTimer(CFRunLoopRef rl, CFRunLoopTimerRef rlt, CFStringR
     } else {
         CFRunLoopModeRef rlm = __CFRunLoopFindMode(rl, modeName, false);
         if (NULL != rlm) {
-            if (NULL != rlm->_timers) {
-                CFIndex idx = CFArrayGetFirstIndexOfValue(rlm->_timers, CFRangeMake(0, CFArrayGetCount(rlm->_timers)), rlt);
-                hasValue = (kCFNotFound != idx);
-            }
+            hasValue = (NULL != __CFRunLoopTimerGetHeapSlot(rlt, rlm));
             __CFRunLoopModeUnlock(rlm);
         }
     }
@@ -3186,13 +3682,6 @@ void CFRunLoopAddTimer(CFRunLoopRef rl, CFRunLoopTimerRef rlt, CFStringRef modeN
     } else { // 不在 kCFRunLoopCommonModes
         /// 找到RunLoopMode
         CFRunLoopModeRef rlm = __CFRunLoopFindMode(rl, modeName, true);
-        if (NULL != rlm) {
-            if (NULL == rlm->_timers) {
-                CFArrayCallBacks cb = kCFTypeArrayCallBacks;
-                cb.equal = NULL;
-                rlm->_timers = CFArrayCreateMutable(kCFAllocatorSystemDefault, 0, &cb);
-            }
-        }
         if (NULL != rlm && !CFSetContainsValue(rlt->_rlModes, rlm->_name)) {
             __CFRunLoopTimerLock(rlt);
             if (NULL == rlt->_runLoop) {
@@ -3207,7 +3696,7 @@ void CFRunLoopAddTimer(CFRunLoopRef rl, CFRunLoopTimerRef rlt, CFStringRef modeN
             CFSetAddValue(rlt->_rlModes, rlm->_name);
             __CFRunLoopTimerUnlock(rlt);
             __CFRunLoopTimerFireTSRLock();
-            // 重新排列这个mode中的所有timer触发时刻，吧timer加入到array中
+            // 把timer加入到这个mode的timer堆中
             __CFRepositionTimerInMode(rlm, rlt, false);
             __CFRunLoopTimerFireTSRUnlock();
             if (!_CFExecutableLinkedOnOrAfter(CFSystemVersionLion)) {
@@ -3240,22 +3729,14 @@ void CFRunLoopRemoveTimer(CFRunLoopRef rl, CFRunLoopTimerRef rlt, CFStringRef mo
         }
     } else {
         CFRunLoopModeRef rlm = __CFRunLoopFindMode(rl, modeName, false);
-        CFIndex idx = kCFNotFound;
-        CFMutableArrayRef timerList = NULL;
-        if (NULL != rlm) {
-            timerList = rlm->_timers;
-            if (NULL != timerList) {
-                idx = CFArrayGetFirstIndexOfValue(timerList, CFRangeMake(0, CFArrayGetCount(timerList)), rlt);
-            }
-        }
-        if (kCFNotFound != idx) {
+        if (NULL != rlm && NULL != __CFRunLoopTimerGetHeapSlot(rlt, rlm)) {
             __CFRunLoopTimerLock(rlt);
             CFSetRemoveValue(rlt->_rlModes, rlm->_name);
             if (0 == CFSetGetCount(rlt->_rlModes)) {
                 rlt->_runLoop = NULL;
             }
             __CFRunLoopTimerUnlock(rlt);
-            CFArrayRemoveValueAtIndex(timerList, idx);
+            __CFRunLoopTimerHeapRemove(rlm, rlt);
             __CFArmNextTimerInMode(rlm, rl);
         }
         if (NULL != rlm) {
@@ -3464,12 +3945,28 @@ void CFRunLoopSourceGetContext(CFRunLoopSourceRef rls, CFRunLoopSourceContext *c
     }
     memmove(context, &rls->_context, size);
 }
+struct __CFRunLoopSourceSignalContext {
+    CFRunLoopSourceRef rls;
+    CFRunLoopRef previous;
+};
+/// 放进 source 所在的每个 RunLoop 的就绪队列; bag 里同一个 RunLoop 的多个计数是连续的, 只放一次
+static void __CFRunLoopSourcePushReady(const void *value, void *context) {
+    struct __CFRunLoopSourceSignalContext *ctx = (struct __CFRunLoopSourceSignalContext *)context;
+    CFRunLoopRef rl = (CFRunLoopRef)value;
+    if (rl == ctx->previous) return;
+    ctx->previous = rl;
+    __CFRunLoopPushReadySource0(rl, ctx->rls);
+}
 /// 为RunLoop中的Mode中的Source 设置信号标志
 void CFRunLoopSourceSignal(CFRunLoopSourceRef rls) {
     CHECK_FOR_FORK();
     __CFRunLoopSourceLock(rls);
-    if (__CFIsValid(rls)) {
+    if (__CFIsValid(rls) && !__CFRunLoopSourceIsSignaled(rls)) {
         __CFRunLoopSourceSetSignaled(rls);
+        if (0 == rls->_context.version0.version && NULL != rls->_runLoops) {
+            struct __CFRunLoopSourceSignalContext ctx = {rls, NULL};
+            CFBagApplyFunction(rls->_runLoops, __CFRunLoopSourcePushReady, &ctx);
+        }
     }
     __CFRunLoopSourceUnlock(rls);
 }
@@ -3719,6 +4216,7 @@ static void __CFRunLoopTimerDeallocate(CFTypeRef cf) {	/* DOES CALLOUT */
     CFRunLoopTimerInvalidate(rlt);	/* DOES CALLOUT */
     CFRelease(rlt->_rlModes);
     rlt->_rlModes = NULL;
+    if (rlt->_heapSlots != rlt->_heapSlotsInline) CFAllocatorDeallocate(kCFAllocatorSystemDefault, rlt->_heapSlots);
     pthread_mutex_destroy(&rlt->_lock);
 }
 
@@ -3761,6 +4259,9 @@ CFRunLoopTimerRef CFRunLoopTimerCreate(CFAllocatorRef allocator, CFAbsoluteTime
     // 初始化
     memory->_runLoop = NULL;
     memory->_rlModes = CFSetCreateMutable(kCFAllocatorSystemDefault, 0, &kCFTypeSetCallBacks);
+    memory->_heapSlots = memory->_heapSlotsInline;
+    memory->_heapSlotCount = 0;
+    memory->_heapSlotCapacity = sizeof(memory->_heapSlotsInline) / sizeof(memory->_heapSlotsInline[0]);
     memory->_order = order;
     if (interval < 0.0) interval = 0.0;
     memory->_interval = interval;
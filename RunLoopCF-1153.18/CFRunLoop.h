@@ -155,6 +155,7 @@ typedef struct {
     /// 回调指针
     void *	(*perform)(void *msg, CFIndex size, CFAllocatorRef allocator, void *info);
 #else
+    /// Linux 上返回 (void *)(intptr_t)fd, fd 可读时调用 perform; perform 需要读走数据
     void *	(*getPort)(void *info);
     void	(*perform)(void *info);
 #endif
@@ -960,6 +960,16 @@ Boolean __CFSocketGetBytesAvailable(CFSocketRef s, CFIndex* ctBytesAvailable) {
 #include <sys/un.h>
 #include <libc.h>
 #include <dlfcn.h>
+#elif DEPLOYMENT_TARGET_LINUX
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #endif
 #include <CoreFoundation/CFArray.h>
 #include <CoreFoundation/CFData.h>
@@ -1002,16 +1012,29 @@ CF_PRIVATE int _NS_gettimeofday(struct timeval *tv, struct timezone *tz);
 
 
 // On Mach we use a v0 RunLoopSource to make client callbacks.  That source is signalled by a
-// separate SocketManager thread who uses select() to watch the sockets' fds.
+// separate SocketManager thread who uses select() to watch the sockets' fds.  On Linux the
+// SocketManager waits in epoll instead, so neither FD_SETSIZE nor the number of sockets
+// bounds it.
 
 //#define LOG_CFSOCKET
 
-#if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI
+#if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI || DEPLOYMENT_TARGET_LINUX
 #define INVALID_SOCKET (CFSocketNativeHandle)(-1)
 #define closesocket(a) close((a))
 #define ioctlsocket(a,b,c) ioctl((a),(b),(c))
 #endif
 
+#if DEPLOYMENT_TARGET_LINUX
+// The fd sets below are CFData bitmaps grown to the highest fd, not FD_SETSIZE-sized fd_sets;
+// glibc's FD_SET and friends abort on fds past 1024, so index the bitmap directly.
+#undef FD_SET
+#undef FD_CLR
+#undef FD_ISSET
+#define FD_SET(n, p)	(((fd_mask *)(p))[(n) / NFDBITS] |= (fd_mask)(1UL << ((n) % NFDBITS)))
+#define FD_CLR(n, p)	(((fd_mask *)(p))[(n) / NFDBITS] &= ~(fd_mask)(1UL << ((n) % NFDBITS)))
+#define FD_ISSET(n, p)	((((fd_mask *)(p))[(n) / NFDBITS] & (fd_mask)(1UL << ((n) % NFDBITS))) != 0)
+#endif
+
 CF_INLINE int __CFSocketLastError(void) {
 #if DEPLOYMENT_TARGET_WINDOWS
     return WSAGetLastError();
@@ -1069,6 +1092,10 @@ static Boolean __CFReadSocketsTimeoutInvalid = true;  /* rebuild the timeout val
 
 static CFSocketNativeHandle __CFWakeupSocketPair[2] = {INVALID_SOCKET, INVALID_SOCKET};
 static void *__CFSocketManagerThread = NULL;
+#if DEPLOYMENT_TARGET_LINUX
+static int __CFSocketEpollFd = -1;
+static CFMutableDictionaryRef __CFActiveSocketsByFd = NULL; /* fd -> CFSocket for everything in __CFRead/WriteSockets, under __CFActiveSocketsLock */
+#endif
 
 static void __CFSocketDoCallback(CFSocketRef s, CFDataRef data, CFDataRef address, CFSocketNativeHandle sock);
 
@@ -1232,7 +1259,7 @@ CF_INLINE Boolean __CFSocketFdClr(CFSocketNativeHandle sock, CFMutableDataRef fd
 }
 
 static SInt32 __CFSocketCreateWakeupSocketPair(void) {
-#if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI
+#if DEPLOYMENT_TARGET_MACOSX || DEPLOYMENT_TARGET_EMBEDDED || DEPLOYMENT_TARGET_EMBEDDED_MINI || DEPLOYMENT_TARGET_LINUX
     SInt32 error;
 
     error = socketpair(PF_LOCAL, SOCK_DGRAM, 0, __CFWakeupSocketPair);
@@ -1274,12 +1301,49 @@ static SInt32 __CFSocketCreateWakeupSocketPair(void) {
 }
 
 
+#if DEPLOYMENT_TARGET_LINUX
+// Each socket in __CFRead/WriteSockets is registered with epoll once, edge-triggered for both
+// directions; the fd sets still say which directions the manager acts on.  Turning a direction
+// back on re-arms the fd with EPOLL_CTL_MOD, which makes epoll re-check readiness, so an edge
+// that came while the direction was off is not lost.  Call these with __CFActiveSocketsLock held.
+static void __CFSocketEpollRegister(CFSocketRef s) {
+    if (INVALID_SOCKET == s->_socket || s == CFDictionaryGetValue(__CFActiveSocketsByFd, (void *)(uintptr_t)s->_socket)) return;
+    CFDictionarySetValue(__CFActiveSocketsByFd, (void *)(uintptr_t)s->_socket, s);
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = s->_socket;
+    if (0 > epoll_ctl(__CFSocketEpollFd, EPOLL_CTL_ADD, s->_socket, &event) && EEXIST == errno) {
+        epoll_ctl(__CFSocketEpollFd, EPOLL_CTL_MOD, s->_socket, &event);
+    }
+}
+
+static void __CFSocketEpollUnregister(CFSocketRef s) {
+    if (INVALID_SOCKET == s->_socket || s != CFDictionaryGetValue(__CFActiveSocketsByFd, (void *)(uintptr_t)s->_socket)) return;
+    CFDictionaryRemoveValue(__CFActiveSocketsByFd, (void *)(uintptr_t)s->_socket);
+    epoll_ctl(__CFSocketEpollFd, EPOLL_CTL_DEL, s->_socket, NULL);
+}
+
+static void __CFSocketEpollRearm(CFSocketRef s) {
+    if (s != CFDictionaryGetValue(__CFActiveSocketsByFd, (void *)(uintptr_t)s->_socket)) return;
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = s->_socket;
+    epoll_ctl(__CFSocketEpollFd, EPOLL_CTL_MOD, s->_socket, &event);
+}
+#endif
+
 // Version 0 RunLoopSources set a mask in an FD set to control what socket activity we hear about.
 // Changes to the master fs_sets occur via these 4 functions.
 CF_INLINE Boolean __CFSocketSetFDForRead(CFSocketRef s) {
     __CFReadSocketsTimeoutInvalid = true;
     Boolean b = __CFSocketFdSet(s->_socket, __CFReadSocketsFds);
+#if DEPLOYMENT_TARGET_LINUX
+    if (b) __CFSocketEpollRearm(s);
+    // epoll sees the change by itself; the manager only needs waking to shorten its timeout
+    if (b && (timerisset(&s->_readBufferTimeout) || s->_leftoverBytes) && INVALID_SOCKET != __CFWakeupSocketPair[0]) {
+#else
     if (b && INVALID_SOCKET != __CFWakeupSocketPair[0]) {
+#endif
         uint8_t c = 'r';
         send(__CFWakeupSocketPair[0], (const char *)&c, sizeof(c), 0);
     }
@@ -1289,30 +1353,39 @@ CF_INLINE Boolean __CFSocketSetFDForRead(CFSocketRef s) {
 CF_INLINE Boolean __CFSocketClearFDForRead(CFSocketRef s) {
     __CFReadSocketsTimeoutInvalid = true;
     Boolean b = __CFSocketFdClr(s->_socket, __CFReadSocketsFds);
+    // on Linux the manager drops events for directions that are off, and a stale timeout only wakes it early
+#if !DEPLOYMENT_TARGET_LINUX
     if (b && INVALID_SOCKET != __CFWakeupSocketPair[0]) {
         uint8_t c = 's';
         send(__CFWakeupSocketPair[0], (const char *)&c, sizeof(c), 0);
     }
+#endif
     return b;
 }
 
 CF_INLINE Boolean __CFSocketSetFDForWrite(CFSocketRef s) {
 // CFLog(5, CFSTR("__CFSocketSetFDForWrite(%p)"), s);
     Boolean b = __CFSocketFdSet(s->_socket, __CFWriteSocketsFds);
+#if DEPLOYMENT_TARGET_LINUX
+    if (b) __CFSocketEpollRearm(s);
+#else
     if (b && INVALID_SOCKET != __CFWakeupSocketPair[0]) {
         uint8_t c = 'w';
         send(__CFWakeupSocketPair[0], (const char *)&c, sizeof(c), 0);
     }
+#endif
     return b;
 }
 
 CF_INLINE Boolean __CFSocketClearFDForWrite(CFSocketRef s) {
 // CFLog(5, CFSTR("__CFSocketClearFDForWrite(%p)"), s);
     Boolean b = __CFSocketFdClr(s->_socket, __CFWriteSocketsFds);
+#if !DEPLOYMENT_TARGET_LINUX
     if (b && INVALID_SOCKET != __CFWakeupSocketPair[0]) {
         uint8_t c = 'x';
         send(__CFWakeupSocketPair[0], (const char *)&c, sizeof(c), 0);
     }
+#endif
     return b;
 }
 
@@ -1364,6 +1437,13 @@ static void __CFSocketInitializeSockets(void) {
     zeroLengthData = CFDataCreateMutable(kCFAllocatorSystemDefault, 0);
 #if DEPLOYMENT_TARGET_WINDOWS
     __CFSocketInitializeWinSock_Guts();
+#elif DEPLOYMENT_TARGET_LINUX
+    __CFActiveSocketsByFd = CFDictionaryCreateMutable(kCFAllocatorSystemDefault, 0, NULL, NULL);
+    __CFSocketEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (0 > __CFSocketEpollFd) {
+        CFLog(kCFLogLevelError, CFSTR("*** Could not create epoll instance for CFSocket (%d) ***"), errno);
+        HALT;
+    }
 #endif
     if (0 > __CFSocketCreateWakeupSocketPair()) {
         CFLog(kCFLogLevelWarning, CFSTR("*** Could not create wakeup socket pair for CFSocket!!!"));
@@ -1372,7 +1452,14 @@ static void __CFSocketInitializeSockets(void) {
         /* wakeup sockets must be non-blocking */
         ioctlsocket(__CFWakeupSocketPair[0], FIONBIO, (u_long *)&yes);
         ioctlsocket(__CFWakeupSocketPair[1], FIONBIO, (u_long *)&yes);
+#if DEPLOYMENT_TARGET_LINUX
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.fd = __CFWakeupSocketPair[1];
+        epoll_ctl(__CFSocketEpollFd, EPOLL_CTL_ADD, __CFWakeupSocketPair[1], &event);
+#else
         __CFSocketFdSet(__CFWakeupSocketPair[1], __CFReadSocketsFds);
+#endif
     }
 }
 
@@ -1993,6 +2080,134 @@ static void __CFSocketWriteSocketList(CFArrayRef sockets, CFDataRef fdSet, Boole
 }
 #endif
 
+#if DEPLOYMENT_TARGET_LINUX
+
+static int __CFSocketTimeoutToMilliseconds(const struct timeval *tv) {
+    if (NULL == tv) return -1;
+    int64_t ms = (int64_t)tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+    return (INT_MAX < ms) ? INT_MAX : (int)ms;
+}
+
+static void *__CFSocketManager(void * arg)
+{
+    // glibc takes the thread and limits names to 15 characters.
+    pthread_setname_np(pthread_self(), "CFSocket");
+    if (objc_collectingEnabled()) objc_registerThreadWithCollector();
+    SInt32 nevents, maxevents = 256;
+    struct epoll_event *events = (struct epoll_event *)CFAllocatorAllocate(kCFAllocatorSystemDefault, maxevents * sizeof(struct epoll_event), 0);
+    SInt32 idx, cnt;
+    uint8_t buffer[256];
+    CFMutableArrayRef selectedWriteSockets = CFArrayCreateMutable(kCFAllocatorSystemDefault, 0, &kCFTypeArrayCallBacks);
+    CFMutableArrayRef selectedReadSockets = CFArrayCreateMutable(kCFAllocatorSystemDefault, 0, &kCFTypeArrayCallBacks);
+    CFIndex selectedWriteSocketsIndex = 0, selectedReadSocketsIndex = 0;
+
+    struct timeval tv;
+    struct timeval* pTimeout = NULL;
+
+    for (;;) {
+        __CFLock(&__CFActiveSocketsLock);
+        __CFSocketManagerIteration++;
+        if (__CFReadSocketsTimeoutInvalid) {
+            struct timeval* minTimeout = NULL;
+            __CFReadSocketsTimeoutInvalid = false;
+            CFArrayApplyFunction(__CFReadSockets, CFRangeMake(0, CFArrayGetCount(__CFReadSockets)), _calcMinTimeout_locked, (void*) &minTimeout);
+            if (minTimeout == NULL) {
+                pTimeout = NULL;
+            } else {
+                tv = *minTimeout;
+                pTimeout = &tv;
+            }
+        }
+        __CFUnlock(&__CFActiveSocketsLock);
+
+        nevents = epoll_wait(__CFSocketEpollFd, events, maxevents, __CFSocketTimeoutToMilliseconds(pTimeout));
+
+#if defined(LOG_CFSOCKET)
+        fprintf(stdout, "socket manager woke from epoll_wait, ret=%ld\n", (long)nevents);
+#endif
+        // a descriptor closed behind our back just leaves the epoll set, so the only error is EINTR
+        if (0 > nevents) continue;
+
+        __CFLock(&__CFActiveSocketsLock);
+        // Only the fds that fired are looked at; an event for a direction whose bit is off
+        // (disabled, or already handed to the run loop) is dropped, and re-enabling it re-arms the fd.
+        for (idx = 0; idx < nevents; idx++) {
+            CFSocketNativeHandle sock = events[idx].data.fd;
+            uint32_t revents = events[idx].events;
+            CFSocketRef s = NULL;
+            if (sock == __CFWakeupSocketPair[1]) {
+                recv(__CFWakeupSocketPair[1], (char *)buffer, sizeof(buffer), 0);
+#if defined(LOG_CFSOCKET)
+                fprintf(stdout, "socket manager received %c on wakeup socket\n", buffer[0]);
+#endif
+                continue;
+            }
+            if (!CFDictionaryGetValueIfPresent(__CFActiveSocketsByFd, (void *)(uintptr_t)sock, (const void **)&s)) continue;
+            /* socket is removed from fds here, restored by CFSocketReschedule */
+            if ((revents & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && __CFSocketFdClr(sock, __CFWriteSocketsFds)) {
+                CFArraySetValueAtIndex(selectedWriteSockets, selectedWriteSocketsIndex, s);
+                selectedWriteSocketsIndex++;
+            }
+            /* socket is removed from fds here, will be restored in read handling or in perform function */
+            if ((revents & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && __CFSocketFdClr(sock, __CFReadSocketsFds)) {
+                s->_hitTheTimeout = false;
+                CFArraySetValueAtIndex(selectedReadSockets, selectedReadSocketsIndex, s);
+                selectedReadSocketsIndex++;
+            }
+        }
+        // Buffered reads with a timeout are the one case still found by walking __CFReadSockets,
+        // and only while some socket has asked for one.
+        if (pTimeout) {
+            struct timeval timeNow = { 0 };
+            gettimeofday(&timeNow, NULL);
+            cnt = CFArrayGetCount(__CFReadSockets);
+            for (idx = 0; idx < cnt; idx++) {
+                CFSocketRef s = (CFSocketRef)CFArrayGetValueAtIndex(__CFReadSockets, idx);
+                Boolean expired = (0 == nevents) ? (timerisset(&s->_readBufferTimeout) || NULL != s->_leftoverBytes) : (timerisset(&s->_readBufferTimeoutNotificationTime) && timercmp(&timeNow, &s->_readBufferTimeoutNotificationTime, >));
+                if (INVALID_SOCKET != s->_socket && expired && __CFSocketFdClr(s->_socket, __CFReadSocketsFds)) {
+#if defined(LOG_CFSOCKET)
+                    fprintf(stdout, "Expiring socket %d (delta %ld, %d)\n", s->_socket, s->_readBufferTimeout.tv_sec, s->_readBufferTimeout.tv_usec);
+#endif
+                    s->_hitTheTimeout = true;
+                    CFArraySetValueAtIndex(selectedReadSockets, selectedReadSocketsIndex, s);
+                    selectedReadSocketsIndex++;
+                }
+            }
+        }
+        __CFUnlock(&__CFActiveSocketsLock);
+
+        if (nevents == maxevents) {
+            maxevents *= 2;
+            events = (struct epoll_event *)CFAllocatorReallocate(kCFAllocatorSystemDefault, events, maxevents * sizeof(struct epoll_event), 0);
+        }
+
+        for (idx = 0; idx < selectedWriteSocketsIndex; idx++) {
+            CFSocketRef s = (CFSocketRef)CFArrayGetValueAtIndex(selectedWriteSockets, idx);
+            if (kCFNull == (CFNullRef)s) continue;
+#if defined(LOG_CFSOCKET)
+            fprintf(stdout, "socket manager signaling socket %d for write\n", s->_socket);
+#endif
+            __CFSocketHandleWrite(s, FALSE);
+            CFArraySetValueAtIndex(selectedWriteSockets, idx, kCFNull);
+        }
+        selectedWriteSocketsIndex = 0;
+
+        for (idx = 0; idx < selectedReadSocketsIndex; idx++) {
+            CFSocketRef s = (CFSocketRef)CFArrayGetValueAtIndex(selectedReadSockets, idx);
+            if (kCFNull == (CFNullRef)s) continue;
+#if defined(LOG_CFSOCKET)
+            fprintf(stdout, "socket manager signaling socket %d for read\n", s->_socket);
+#endif
+            __CFSocketHandleRead(s, s->_hitTheTimeout);
+            CFArraySetValueAtIndex(selectedReadSockets, idx, kCFNull);
+        }
+        selectedReadSocketsIndex = 0;
+    }
+    return NULL;
+}
+
+#else
+
 static void
 clearInvalidFileDescriptors(CFMutableDataRef d)
 {
@@ -2290,6 +2505,8 @@ static void *__CFSocketManager(void * arg)
     return NULL;
 }
 
+#endif
+
 static CFStringRef __CFSocketCopyDescription(CFTypeRef cf) {
     CFSocketRef s = (CFSocketRef)cf;
     CFMutableStringRef result;
@@ -2548,6 +2765,9 @@ void CFSocketInvalidate(CFSocketRef s) {
             CFArrayRemoveValueAtIndex(__CFReadSockets, idx);
             __CFSocketClearFDForRead(s);
         }
+#if DEPLOYMENT_TARGET_LINUX
+        __CFSocketEpollUnregister(s);
+#endif
         previousSocketManagerIteration = __CFSocketManagerIteration;
         __CFUnlock(&__CFActiveSocketsLock);
         CFDictionaryRemoveValue(__CFAllSockets, (void *)(uintptr_t)(s->_socket));
@@ -2751,6 +2971,9 @@ void __CFSocketEnableCallBacks(CFSocketRef s, CFOptionFlags callBackTypes, Boole
                     SInt32 idx = CFArrayGetFirstIndexOfValue(__CFWriteSockets, CFRangeMake(0, CFArrayGetCount(__CFWriteSockets)), s);
                     if (kCFNotFound == idx) CFArrayAppendValue(__CFWriteSockets, s);
 //                     if (kCFNotFound == idx) CFLog(5, CFSTR("__CFSocketEnableCallBacks: put %p in __CFWriteSockets list due to force and non-presence"), s);
+#if DEPLOYMENT_TARGET_LINUX
+                    __CFSocketEpollRegister(s);
+#endif
                 }
                 if (__CFSocketSetFDForWrite(s)) wakeup = true;
             }
@@ -2758,6 +2981,9 @@ void __CFSocketEnableCallBacks(CFSocketRef s, CFOptionFlags callBackTypes, Boole
                 if (force) {
                     SInt32 idx = CFArrayGetFirstIndexOfValue(__CFReadSockets, CFRangeMake(0, CFArrayGetCount(__CFReadSockets)), s);
                     if (kCFNotFound == idx) CFArrayAppendValue(__CFReadSockets, s);
+#if DEPLOYMENT_TARGET_LINUX
+                    __CFSocketEpollRegister(s);
+#endif
                 }
                 if (__CFSocketSetFDForRead(s)) wakeup = true;
             }
@@ -2819,6 +3045,9 @@ static void __CFSocketCancel(void *info, CFRunLoopRef rl, CFStringRef mode) {
             CFArrayRemoveValueAtIndex(__CFReadSockets, idx);
             __CFSocketClearFDForRead(s);
         }
+#if DEPLOYMENT_TARGET_LINUX
+        __CFSocketEpollUnregister(s);
+#endif
         __CFUnlock(&__CFActiveSocketsLock);
     }
     if (NULL != s->_runLoops) {
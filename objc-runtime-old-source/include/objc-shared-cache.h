@@ -695,6 +695,55 @@ struct alignas(alignof(void*)) objc_opt_t {
 STATIC_ASSERT(sizeof(objc_opt_t) % sizeof(void*) == 0);
 
 
+// Precomputed tables for images outside the dyld shared cache.
+// Written by objcopt and mapped by the runtime from OBJC_PREOPT_SIDECAR.
+// The selopt and clsopt formats are the shared cache's, except that
+// clsopt's clsOffset is from the image's mach_header to the class
+// and hiOffset is an index into images[].
+
+enum : uint32_t {
+    SIDECAR_MAGIC = 0x6f626a73,  // 'objs'
+    SIDECAR_VERSION = 1,
+};
+
+struct objc_sidecar_image_t {
+    uint8_t uuid[16];
+    int32_t name_offset;  // offset from the objc_sidecar_t to the image name
+    uint32_t unused;
+};
+
+struct alignas(alignof(uint64_t)) objc_sidecar_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t imageCount;
+    int32_t images_offset;
+    int32_t selopt_offset;
+    int32_t clsopt_offset;
+    // ...images, strings, selopt, clsopt, terminated by a 0 byte
+
+    const objc_sidecar_image_t* images() const {
+        return (const objc_sidecar_image_t *)((const uint8_t *)this + images_offset);
+    }
+
+    const char* imageName(uint32_t i) const {
+        return (const char *)this + images()[i].name_offset;
+    }
+
+    const objc_selopt_t* selopt() const {
+        if (selopt_offset == 0) return NULL;
+        return (const objc_selopt_t *)((const uint8_t *)this + selopt_offset);
+    }
+
+    const objc_clsopt_t* clsopt() const {
+        if (clsopt_offset == 0) return NULL;
+        return (const objc_clsopt_t *)((const uint8_t *)this + clsopt_offset);
+    }
+};
+
+STATIC_ASSERT(sizeof(objc_sidecar_image_t) == 24);
+STATIC_ASSERT(sizeof(objc_sidecar_t) == 24);
+
+
 // List of offsets in libobjc that the shared cache optimization needs to use.
 template <typename T>
 struct objc_opt_pointerlist_tt {
@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+  objcopt.cpp
+  Writes a preoptimization sidecar: perfect hash tables of the selector
+  names and class names in a set of images outside the dyld shared cache.
+  The runtime maps the file named by OBJC_PREOPT_SIDECAR at launch.
+
+  usage: objcopt [-v] [-arch <arch>] -o <sidecar> <image>...
+
+  Images must be 64-bit. Their data pointers must hold unslid addresses,
+  so images linked with chained fixups are rejected. Fat files need -arch.
+  Class offsets are only used for loaded images with the same UUID,
+  so a stale sidecar costs lookups but never finds the wrong class.
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/errno.h>
+#include <libkern/OSByteOrder.h>
+#include <mach-o/fat.h>
+#include <mach-o/arch.h>
+#include <mach-o/loader.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#define SELOPT_WRITE
+#include "include/objc-shared-cache.h"
+
+// Some SDKs don't define these.
+#ifndef LC_DYLD_CHAINED_FIXUPS
+#define LC_DYLD_CHAINED_FIXUPS (0x34 | LC_REQ_DYLD)
+#endif
+
+using objc_opt::string_map;
+using objc_opt::class_map;
+using objc_opt::objc_selopt_t;
+using objc_opt::objc_clsopt_t;
+using objc_opt::objc_sidecar_t;
+using objc_opt::objc_sidecar_image_t;
+
+static bool verbose = false;
+
+// Class data pointers have flags in their low bits.
+#define CLASS_DATA_MASK 0x00007ffffffffff8ULL
+
+struct image {
+    const char *path;
+    std::string name;  // install name, or path if none
+    uint8_t uuid[16];
+    const uint8_t *start;  // mach_header
+    size_t size;
+    uint64_t headerAddress;  // vmaddr of the mach_header
+    std::vector<const segment_command_64 *> segments;
+    std::vector<const section_64 *> sections;
+};
+
+struct class_entry {
+    std::string name;
+    int64_t offset;  // from the image's mach_header
+    uint32_t imageIndex;
+};
+
+
+// Segment and section names are 16 bytes and may be un-terminated.
+static bool segnameEquals(const char *lhs, const char *rhs)
+{
+    return 0 == strncmp(lhs, rhs, 16);
+}
+
+static bool segnameStartsWith(const char *segname, const char *prefix)
+{
+    return 0 == strncmp(segname, prefix, strlen(prefix));
+}
+
+static bool sectnameEquals(const char *lhs, const char *rhs)
+{
+    return segnameEquals(lhs, rhs);
+}
+
+
+// Returns the file contents at [vmaddr, vmaddr+len), or NULL.
+static const uint8_t *at(const image& img, uint64_t vmaddr, uint64_t len)
+{
+    for (auto seg : img.segments) {
+        if (vmaddr < seg->vmaddr  ||  vmaddr - seg->vmaddr >= seg->filesize) {
+            continue;
+        }
+        uint64_t offset = vmaddr - seg->vmaddr;
+        if (len > seg->filesize - offset) return NULL;
+        if (seg->fileoff + offset + len > img.size) return NULL;
+        return img.start + seg->fileoff + offset;
+    }
+    return NULL;
+}
+
+// Returns the C string at vmaddr, or NULL if it isn't terminated
+// inside its segment.
+static const char *stringAt(const image& img, uint64_t vmaddr)
+{
+    for (auto seg : img.segments) {
+        if (vmaddr < seg->vmaddr  ||  vmaddr - seg->vmaddr >= seg->filesize) {
+            continue;
+        }
+        uint64_t offset = vmaddr - seg->vmaddr;
+        uint64_t len = seg->filesize - offset;
+        if (seg->fileoff + offset + len > img.size) return NULL;
+        const char *s = (const char *)img.start + seg->fileoff + offset;
+        if (!memchr(s, 0, len)) return NULL;
+        return s;
+    }
+    return NULL;
+}
+
+static bool readPointer(const image& img, uint64_t vmaddr, uint64_t& value)
+{
+    const uint8_t *p = at(img, vmaddr, sizeof(value));
+    if (!p) return false;
+    memcpy(&value, p, sizeof(value));
+    return true;
+}
+
+
+static bool parse_macho(image& img)
+{
+    if (img.size < sizeof(mach_header_64)) {
+        printf("%s: file is too small\n", img.path);
+        return false;
+    }
+    auto mh = (const mach_header_64 *)img.start;
+    if (mh->magic != MH_MAGIC_64) {
+        printf("%s: not a 64-bit mach-o file for this host (magic %x)\n",
+               img.path, mh->magic);
+        return false;
+    }
+    if (sizeof(*mh) + mh->sizeofcmds > img.size) {
+        printf("%s: file is badly formed\n", img.path);
+        return false;
+    }
+
+    bool haveUUID = false;
+    bool haveHeader = false;
+    img.name = img.path;
+    const uint8_t *cmds = (const uint8_t *)(mh + 1);
+    const uint8_t *end = cmds + mh->sizeofcmds;
+    for (uint32_t c = 0; c < mh->ncmds; c++) {
+        auto cmd = (const load_command *)cmds;
+        if (cmds + sizeof(*cmd) > end  ||  cmd->cmdsize < sizeof(*cmd)  ||
+            cmd->cmdsize > (size_t)(end - cmds))
+        {
+            printf("%s: file is badly formed\n", img.path);
+            return false;
+        }
+        cmds += cmd->cmdsize;
+
+        if (cmd->cmd == LC_SEGMENT_64) {
+            auto seg = (const segment_command_64 *)cmd;
+            if (sizeof(*seg) + seg->nsects * sizeof(section_64) > seg->cmdsize) {
+                printf("%s: file is badly formed\n", img.path);
+                return false;
+            }
+            img.segments.push_back(seg);
+            if (seg->fileoff == 0  &&  seg->filesize != 0) {
+                img.headerAddress = seg->vmaddr;
+                haveHeader = true;
+            }
+            auto sect = (const section_64 *)(seg + 1);
+            for (uint32_t i = 0; i < seg->nsects; i++) {
+                img.sections.push_back(&sect[i]);
+            }
+        }
+        else if (cmd->cmd == LC_UUID) {
+            memcpy(img.uuid, ((const uuid_command *)cmd)->uuid, 16);
+            haveUUID = true;
+        }
+        else if (cmd->cmd == LC_ID_DYLIB) {
+            auto dylib = (const dylib_command *)cmd;
+            if (dylib->dylib.name.offset < cmd->cmdsize  &&
+                memchr((const char *)cmd + dylib->dylib.name.offset, 0,
+                       cmd->cmdsize - dylib->dylib.name.offset))
+            {
+                img.name = (const char *)cmd + dylib->dylib.name.offset;
+            }
+        }
+        else if (cmd->cmd == LC_DYLD_CHAINED_FIXUPS) {
+            printf("%s: images with chained fixups are not supported "
+                   "(link with -no_fixup_chains)\n", img.path);
+            return false;
+        }
+    }
+
+    if (!haveUUID) {
+        printf("%s: image has no LC_UUID\n", img.path);
+        return false;
+    }
+    if (!haveHeader) {
+        printf("%s: image has no segment for its mach header\n", img.path);
+        return false;
+    }
+    return true;
+}
+
+
+static bool parse_fat(image& img, const char *archName)
+{
+    uint32_t magic;
+    if (img.size < sizeof(magic)) {
+        printf("%s: file is too small\n", img.path);
+        return false;
+    }
+
+    magic = *(const uint32_t *)img.start;
+    if (magic != FAT_MAGIC  &&  magic != FAT_CIGAM) {
+        /* Not a fat file */
+        return parse_macho(img);
+    }
+
+    if (!archName) {
+        printf("%s: fat file needs -arch\n", img.path);
+        return false;
+    }
+    const NXArchInfo *arch = NXGetArchInfoFromName(archName);
+    if (!arch) {
+        printf("unknown architecture %s\n", archName);
+        return false;
+    }
+
+    if (img.size < sizeof(fat_header)) {
+        printf("%s: file is too small\n", img.path);
+        return false;
+    }
+    auto fh = (const fat_header *)img.start;
+    uint32_t fat_nfat_arch = OSSwapBigToHostInt32(fh->nfat_arch);
+    if ((img.size - sizeof(fat_header)) / sizeof(fat_arch) < fat_nfat_arch) {
+        printf("%s: file is too small\n", img.path);
+        return false;
+    }
+
+    auto archs = (const fat_arch *)(fh + 1);
+    for (uint32_t i = 0; i < fat_nfat_arch; i++) {
+        if ((cpu_type_t)OSSwapBigToHostInt32(archs[i].cputype) != arch->cputype) {
+            continue;
+        }
+        uint32_t arch_offset = OSSwapBigToHostInt32(archs[i].offset);
+        uint32_t arch_size = OSSwapBigToHostInt32(archs[i].size);
+        if (arch_offset > img.size  ||  arch_size > img.size - arch_offset) {
+            printf("%s: file is badly formed\n", img.path);
+            return false;
+        }
+        img.start += arch_offset;
+        img.size = arch_size;
+        return parse_macho(img);
+    }
+
+    printf("%s: no %s slice\n", img.path, archName);
+    return false;
+}
+
+
+// Every C string in __TEXT,__objc_methname and every string
+// referenced by __objc_selrefs.
+static bool collectSelectors(const image& img, std::set<std::string>& names)
+{
+    for (auto sect : img.sections) {
+        if (segnameEquals(sect->segname, "__TEXT")  &&
+            sectnameEquals(sect->sectname, "__objc_methname"))
+        {
+            const char *s = (const char *)at(img, sect->addr, sect->size);
+            if (!s) {
+                printf("%s: __objc_methname is out of bounds\n", img.path);
+                return false;
+            }
+            const char *end = s + sect->size;
+            while (s < end) {
+                size_t len = strnlen(s, end - s);
+                if (len == (size_t)(end - s)) break;  // unterminated tail
+                if (len) names.insert(s);
+                s += len + 1;
+            }
+        }
+        else if (segnameStartsWith(sect->segname, "__DATA")  &&
+                 sectnameEquals(sect->sectname, "__objc_selrefs"))
+        {
+            for (uint64_t i = 0; i < sect->size / 8; i++) {
+                uint64_t ref;
+                const char *name;
+                if (!readPointer(img, sect->addr + i*8, ref)  ||
+                    !(name = stringAt(img, ref)))
+                {
+                    printf("%s: selector reference %llu is bad\n",
+                           img.path, (unsigned long long)i);
+                    return false;
+                }
+                names.insert(name);
+            }
+        }
+    }
+    return true;
+}
+
+
+// The name and offset of every class in __objc_classlist.
+static bool collectClasses(const image& img, uint32_t imageIndex,
+                           std::vector<class_entry>& classes)
+{
+    for (auto sect : img.sections) {
+        if (!segnameStartsWith(sect->segname, "__DATA")  ||
+            !sectnameEquals(sect->sectname, "__objc_classlist"))
+        {
+            continue;
+        }
+
+        for (uint64_t i = 0; i < sect->size / 8; i++) {
+            // objc_class: isa, superclass, cache (2 words), bits
+            // class_ro_t: flags, instanceStart, instanceSize, reserved,
+            //             ivarLayout, name
+            uint64_t cls, bits, name;
+            const char *str = NULL;
+            if (readPointer(img, sect->addr + i*8, cls)  &&
+                readPointer(img, cls + 4*8, bits)  &&
+                readPointer(img, (bits & CLASS_DATA_MASK) + 4*4 + 8, name))
+            {
+                str = stringAt(img, name);
+            }
+            if (!str) {
+                printf("%s: class %llu is bad\n",
+                       img.path, (unsigned long long)i);
+                return false;
+            }
+
+            int64_t offset = (int64_t)(cls - img.headerAddress);
+            if (offset <= 0  ||  offset > INT32_MAX  ||  (offset & 7)) {
+                printf("%s: class %s is too far from the mach header\n",
+                       img.path, str);
+                return false;
+            }
+            classes.push_back(class_entry{str, offset, imageIndex});
+        }
+    }
+    return true;
+}
+
+
+// Upper bound of a selopt or clsopt table's size. make_perfect()'s
+// capacity and tab size are less than 4 times the number of names.
+static size_t tableBound(size_t names, size_t classes)
+{
+    return sizeof(objc_opt::objc_stringhash_t) + 4 * (names + 1) *
+        (1 + sizeof(objc_opt::objc_stringhash_check_t) +
+         sizeof(objc_opt::objc_stringhash_offset_t) +
+         sizeof(objc_opt::objc_classheader_t)) +
+        sizeof(uint32_t) + classes * sizeof(objc_opt::objc_classheader_t);
+}
+
+static size_t align8(size_t x)
+{
+    return (x + 7) & ~(size_t)7;
+}
+
+
+static bool writeSidecar(const char *path, std::vector<image>& images)
+{
+    std::set<std::string> selectors;
+    std::vector<class_entry> classes;
+    for (uint32_t i = 0; i < images.size(); i++) {
+        if (!collectSelectors(images[i], selectors)) return false;
+        if (!collectClasses(images[i], i, classes)) return false;
+        for (uint32_t j = 0; j < i; j++) {
+            if (0 == memcmp(images[i].uuid, images[j].uuid, 16)) {
+                printf("%s: same UUID as %s\n",
+                       images[i].path, images[j].path);
+                return false;
+            }
+        }
+    }
+
+    // Layout: header, images, strings, selopt, clsopt, terminating 0.
+    std::map<std::string, size_t> strings;
+    size_t pos = sizeof(objc_sidecar_t);
+    size_t imagesOffset = pos;
+    pos += images.size() * sizeof(objc_sidecar_image_t);
+    auto addString = [&](const std::string& s) {
+        if (strings.count(s)) return;
+        strings[s] = pos;
+        pos += s.size() + 1;
+    };
+    for (auto& img : images) addString(img.name);
+    for (auto& s : selectors) addString(s);
+    std::set<std::string> classNames;
+    for (auto& c : classes) {
+        addString(c.name);
+        classNames.insert(c.name);
+    }
+
+    size_t seloptOffset = align8(pos);
+    size_t bound = seloptOffset +
+        tableBound(selectors.size(), 0) + 8 +
+        tableBound(classNames.size(), classes.size()) + 8;
+    if (bound > INT32_MAX) {
+        printf("too many names for a sidecar\n");
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(bound);
+    uint8_t *base = buffer.data();
+    auto sc = (objc_sidecar_t *)base;
+    sc->magic = objc_opt::SIDECAR_MAGIC;
+    sc->version = objc_opt::SIDECAR_VERSION;
+    sc->imageCount = (uint32_t)images.size();
+    sc->images_offset = (int32_t)imagesOffset;
+    for (auto& s : strings) {
+        memcpy(base + s.second, s.first.c_str(), s.first.size() + 1);
+    }
+    auto imageList = (objc_sidecar_image_t *)(base + imagesOffset);
+    for (uint32_t i = 0; i < images.size(); i++) {
+        memcpy(imageList[i].uuid, images[i].uuid, 16);
+        imageList[i].name_offset = (int32_t)strings[images[i].name];
+        imageList[i].unused = 0;
+    }
+
+    // String addresses are their addresses in the buffer,
+    // so table offsets come out relative to the table.
+    // A table needs at least two names: make_perfect() hashes a lone 
+    // name with a shift of 64. Images with fewer gain nothing anyway.
+    pos = seloptOffset;
+    const char *err;
+    if (selectors.size() > 1) {
+        string_map selmap;
+        for (auto& s : selectors) {
+            const char *str = (const char *)base + strings[s];
+            selmap[str] = (uint64_t)(uintptr_t)str;
+        }
+        auto selopt = (objc_selopt_t *)(base + pos);
+        err = selopt->write((uint64_t)(uintptr_t)selopt,
+                            buffer.size() - pos, selmap);
+        if (err) {
+            printf("selector table: %s\n", err);
+            return false;
+        }
+        sc->selopt_offset = (int32_t)pos;
+        pos = align8(pos + selopt->size());
+    }
+
+    if (classNames.size() > 1) {
+        string_map namemap;
+        class_map classmap;
+        auto clsopt = (objc_clsopt_t *)(base + pos);
+        uint64_t tableAddress = (uint64_t)(uintptr_t)clsopt;
+        for (auto& c : classes) {
+            const char *str = (const char *)base + strings[c.name];
+            namemap[str] = (uint64_t)(uintptr_t)str;
+            // clsOffset is from the mach header; hiOffset is the image index.
+            classmap.insert(std::make_pair(str, std::make_pair(
+                tableAddress + c.offset, tableAddress + c.imageIndex)));
+        }
+        err = clsopt->write(tableAddress, buffer.size() - pos,
+                            namemap, classmap, verbose);
+        if (err) {
+            printf("class table: %s\n", err);
+            return false;
+        }
+        sc->clsopt_offset = (int32_t)pos;
+        pos = align8(pos + clsopt->size());
+    }
+
+    // The runtime requires the last byte to be 0.
+    buffer.resize(pos + 8);
+    memset(buffer.data() + pos, 0, 8);
+
+    if (verbose) {
+        printf("%zu images, %zu selectors, %zu classes, %zu bytes\n",
+               images.size(), selectors.size(), classes.size(),
+               buffer.size());
+    }
+
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    ssize_t written = write(fd, buffer.data(), buffer.size());
+    if (written != (ssize_t)buffer.size()) {
+        printf("write %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+
+static bool mapFile(image& img)
+{
+    int fd = open(img.path, O_RDONLY);
+    if (fd < 0) {
+        printf("open %s: %s\n", img.path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        printf("fstat %s: %s\n", img.path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    void *buffer = mmap(NULL, (size_t)st.st_size, PROT_READ,
+                        MAP_FILE|MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED) {
+        printf("mmap %s: %s\n", img.path, strerror(errno));
+        return false;
+    }
+
+    img.start = (const uint8_t *)buffer;
+    img.size = (size_t)st.st_size;
+    return true;
+}
+
+
+static int usage()
+{
+    printf("usage: objcopt [-v] [-arch <arch>] -o <sidecar> <image>...\n");
+    return 1;
+}
+
+int main(int argc, const char *argv[]) {
+    const char *output = NULL;
+    const char *archName = NULL;
+    std::vector<image> images;
+
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "-v")) {
+            verbose = true;
+        } else if (0 == strcmp(argv[i], "-o")  &&  i+1 < argc) {
+            output = argv[++i];
+        } else if (0 == strcmp(argv[i], "-arch")  &&  i+1 < argc) {
+            archName = argv[++i];
+        } else if (argv[i][0] == '-') {
+            return usage();
+        } else {
+            image img = {};
+            img.path = argv[i];
+            images.push_back(img);
+        }
+    }
+    if (!output  ||  images.empty()) return usage();
+
+    for (auto& img : images) {
+        if (!mapFile(img)) return 1;
+        if (!parse_fat(img, archName)) return 1;
+    }
+
+    if (!writeSidecar(output, images)) return 1;
+    return 0;
+}
@@ -27,6 +27,40 @@ if [[ $XIT == 0 ]]; then
   perl test.pl ARCHS=i386 GUARDMALLOC=YES OBJC_ROOT="$RootsDirectory/objc4.roots/"
   XIT=`expr $XIT \| $?`
   perl test.pl clean
+  cd ..
+fi
+# Build and test again with the concurrent side table refcount engine, 
+# which is off by default.
+if [[ $XIT == 0 ]]; then
+  ConcurrentRootsDirectory="${RootsDirectory%/}/concurrent-refcount/"
+  mkdir -p "$ConcurrentRootsDirectory"
+  Buildit="/Network/Servers/xs1/release/bin/buildit -rootsDirectory ${ConcurrentRootsDirectory} -arch i386 -arch x86_64 -project objc4 ."
+  sudo OTHER_CFLAGS="-DSUPPORT_CONCURRENT_REFCOUNT=1" $Buildit
+  XIT=$?
+  if [[ $XIT == 0 ]]; then
+    cd "$TestsDir"
+    perl test.pl ARCHS=x86_64 OBJC_ROOT="$ConcurrentRootsDirectory/objc4.roots/"
+    XIT=`expr $XIT \| $?`
+    OBJC_DEFER_SIDETABLE_RELEASE=YES perl test.pl ARCHS=x86_64 OBJC_ROOT="$ConcurrentRootsDirectory/objc4.roots/"
+    XIT=`expr $XIT \| $?`
+    perl test.pl clean
+    cd ..
+  fi
+fi
+# Build with DEBUG=1 so lockdebug checks the locks that parallel image 
+# reading lends to its worker threads.
+if [[ $XIT == 0 ]]; then
+  LockdebugRootsDirectory="${RootsDirectory%/}/lockdebug/"
+  mkdir -p "$LockdebugRootsDirectory"
+  Buildit="/Network/Servers/xs1/release/bin/buildit -rootsDirectory ${LockdebugRootsDirectory} -arch x86_64 -project objc4 ."
+  sudo OTHER_CFLAGS="-DDEBUG=1" $Buildit
+  XIT=$?
+  if [[ $XIT == 0 ]]; then
+    cd "$TestsDir"
+    perl test.pl ARCHS=x86_64 OBJC_ROOT="$LockdebugRootsDirectory/objc4.roots/" parallel-images parallel-images-lockdebug
+    XIT=`expr $XIT \| $?`
+    perl test.pl clean
+  fi
 fi
 cd "$StartingDir"
 exit $XIT
\ No newline at end of file
@@ -143,8 +143,10 @@ enum HaveNew { DontHaveNew = false, DoHaveNew = true };
 struct SideTable {
     /// 保证原子操作的自旋锁
     spinlock_t slock;
+#if !SUPPORT_CONCURRENT_REFCOUNT
     /// 引用计数的 hash 表  retain / release 均是操作此表
     RefcountMap refcnts;
+#endif
     // weak 引用全局 hash 表
     weak_table_t weak_table;
 
@@ -156,10 +158,22 @@ struct SideTable {
         _objc_fatal("Do not delete SideTable.");
     }
 
-    void lock() { slock.lock(); }
+    void lock() { StripedMap<SideTable>::lockStripe(*this, slock); }
     void unlock() { slock.unlock(); }
     void forceReset() { slock.forceReset(); }
 
+    // Nil out referent's weak pointers. The lock must be held. It is 
+    // released and retaken between batches of WEAK_CLEAR_BATCH referrers, 
+    // so other threads may change this table while this runs: anything 
+    // found in it before the call must be looked up again after.
+    void weakClearDroppingLock(id referent) {
+        weak_clear_cursor_t cursor = {};
+        while (weak_clear_no_lock(&weak_table, referent, &cursor)) {
+            unlock();
+            lock();
+        }
+    }
+
     // Address-ordered lock discipline for a pair of side tables.
 
     template<HaveOld, HaveNew>
@@ -173,7 +187,13 @@ template<>
 void SideTable::lockTwo<DoHaveOld, DoHaveNew>
     (SideTable *lock1, SideTable *lock2)
 {
-    spinlock_t::lockTwo(&lock1->slock, &lock2->slock);
+    if (lock1 < lock2) {
+        lock1->lock();
+        lock2->lock();
+    } else {
+        lock2->lock();
+        if (lock2 != lock1) lock1->lock();
+    }
 }
 
 template<>
@@ -212,19 +232,14 @@ void SideTable::unlockTwo<DontHaveOld, DoHaveNew>
 }
 
 
-// We cannot use a C++ static initializer to initialize SideTables because
-// libc calls us before our C++ initializers run. We also don't want a global 
-// pointer to this struct because of the extra indirection.
-// Do it the hard way.
-alignas(StripedMap<SideTable>) static uint8_t 
-    SideTableBuf[sizeof(StripedMap<SideTable>)];
+// libc calls us before our C++ initializers run. StripedMap has a 
+// constexpr constructor, so SideTableMap needs no static initializer 
+// and its stripes are allocated on first use.
+static StripedMap<SideTable> SideTableMap;
 
-static void SideTableInit() {
-    new (SideTableBuf) StripedMap<SideTable>();
-}
 /// 是一个全局的Hash表，里面的内容装的都是SideTable结构体而已
 static StripedMap<SideTable>& SideTables() {
-    return *reinterpret_cast<StripedMap<SideTable>*>(SideTableBuf);
+    return SideTableMap;
 }
 
 // anonymous namespace
@@ -270,6 +285,14 @@ void SideTableLocksSucceedLocks(StripedMap<spinlock_t>& oldlocks) {
     }
 }
 
+void SideTablePrintStatistics() {
+    SideTables().printStatistics("SideTables");
+}
+
+void SideTableNameProfiledLocks() {
+    SideTables().nameProfiledLocks("SideTables");
+}
+
 //
 // The -fobjc-arc flag causes the compiler to issue calls to objc_{retain/release/autorelease/retain_block}
 //
@@ -691,6 +714,43 @@ objc_moveWeak(id *dst, id *src)
 BREAKPOINT_FUNCTION(void objc_autoreleaseNoPool(id obj));
 BREAKPOINT_FUNCTION(void objc_autoreleasePoolInvalid(const void *token));
 
+
+/***********************************************************************
+* Autorelease pool page recycling
+* Pages freed when pools are popped go on a short per-thread free list 
+* and are reused by the next page the thread needs, instead of going 
+* back to malloc. Pages beyond that limit, and the cached pages of an 
+* exiting thread, go on a bounded process-wide overflow list that any 
+* thread may take from. With OBJC_POOL_PAGE_ARENAS, pages are carved 
+* from 2 MB arenas (superpages where the VM allows) and are never 
+* returned to the system. OBJC_DEBUG_POOL_ALLOCATION turns all of 
+* this off so heap debuggers see every page.
+**********************************************************************/
+
+spinlock_t PoolPageLock;
+
+#define POOL_PAGE_CACHE_MAX 4
+#define POOL_PAGE_OVERFLOW_MAX 64
+#define POOL_PAGE_ARENA_SIZE (2*1024*1024)
+
+struct PoolFreePage {
+    PoolFreePage *next;
+};
+
+// One per thread that has used a pool page, in AUTORELEASE_POOL_CACHE_KEY.
+struct PoolPageCache {
+    PoolFreePage *pages;
+    uint32_t count;       // pages on this thread's free list
+    uint32_t inUse;       // pages holding this thread's pools
+    uint32_t inUseHiwat;  // most pages held at once
+    uint64_t allocated;   // pages taken from malloc or an arena
+    uint64_t recycled;    // pages reused from a free list
+};
+
+// Protected by PoolPageLock.
+static PoolFreePage *PoolPageOverflow;
+static uint32_t PoolPageOverflowCount;
+
 namespace {
 
 struct magic_t {
@@ -761,6 +821,7 @@ class AutoreleasePoolPage
 
 #   define POOL_BOUNDARY nil
     static pthread_key_t const key = AUTORELEASE_POOL_KEY;
+    static pthread_key_t const cacheKey = AUTORELEASE_POOL_CACHE_KEY;
     static uint8_t const SCRIBBLE = 0xA3;  // 0xA3A3A3A3 after releasing
     static size_t const SIZE = 
 #if PROTECT_AUTORELEASEPOOL
@@ -786,10 +847,153 @@ class AutoreleasePoolPage
     // SIZE-sizeof(*this) bytes of contents follow
 
     static void * operator new(size_t size) {
-        return malloc_zone_memalign(malloc_default_zone(), SIZE, SIZE);
+        return allocPage();
     }
     static void operator delete(void * p) {
-        return free(p);
+        return freePage(p);
+    }
+
+    static PoolPageCache *pageCache(bool create)
+    {
+        PoolPageCache *cache = (PoolPageCache *)tls_get_direct(cacheKey);
+        if (!cache  &&  create) {
+            cache = (PoolPageCache *)calloc(1, sizeof(*cache));
+            tls_set_direct(cacheKey, cache);
+        }
+        return cache;
+    }
+
+    static void *allocPage()
+    {
+        PoolPageCache *cache = pageCache(true);
+        void *result = nil;
+
+        if (!DebugPoolAllocation) {
+            if (PoolFreePage *page = cache->pages) {
+                cache->pages = page->next;
+                cache->count--;
+                result = page;
+            } else {
+                result = takeOverflowPage();
+            }
+        }
+
+        if (result) {
+            cache->recycled++;
+        } else {
+            result = newPage();
+            cache->allocated++;
+        }
+        if (++cache->inUse > cache->inUseHiwat) {
+            cache->inUseHiwat = cache->inUse;
+        }
+        return result;
+    }
+
+    static void freePage(void *p)
+    {
+        // The cache may already be gone if the thread is exiting.
+        PoolPageCache *cache = pageCache(false);
+        if (cache  &&  cache->inUse > 0) cache->inUse--;
+
+        if (DebugPoolAllocation) {
+            free(p);
+            return;
+        }
+
+        PoolFreePage *page = (PoolFreePage *)p;
+        if (cache  &&  cache->count < POOL_PAGE_CACHE_MAX) {
+            page->next = cache->pages;
+            cache->pages = page;
+            cache->count++;
+        }
+        else if (!giveOverflowPages(page, page, 1)) {
+            free(p);
+        }
+    }
+
+    static void *newPage()
+    {
+        if (PoolPageArenas  &&  !DebugPoolAllocation) {
+            if (void *page = newArenaPage()) return page;
+            // Out of VM. Pages from malloc are never freed either 
+            // in arena mode, so falling back is harmless.
+        }
+        return malloc_zone_memalign(malloc_default_zone(), SIZE, SIZE);
+    }
+
+    // Allocate an arena, keep its first page, and put the rest 
+    // on the overflow list. Returns nil if the VM allocation fails.
+    static void *newArenaPage()
+    {
+        vm_address_t arena = 0;
+        kern_return_t kr = KERN_FAILURE;
+#if defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+        kr = vm_allocate(mach_task_self(), &arena, POOL_PAGE_ARENA_SIZE,
+                         VM_FLAGS_ANYWHERE | VM_FLAGS_SUPERPAGE_SIZE_2MB | 
+                         VM_MAKE_TAG(VM_MEMORY_FOUNDATION));
+#endif
+        if (kr != KERN_SUCCESS) {
+            kr = vm_allocate(mach_task_self(), &arena, POOL_PAGE_ARENA_SIZE,
+                             VM_FLAGS_ANYWHERE | 
+                             VM_MAKE_TAG(VM_MEMORY_FOUNDATION));
+        }
+        if (kr != KERN_SUCCESS) return nil;
+
+        // Pages are aligned to SIZE, which may exceed the VM page size.
+        uintptr_t start = (arena + SIZE-1) & ~(uintptr_t)(SIZE-1);
+        uint32_t count = (uint32_t)((arena + POOL_PAGE_ARENA_SIZE - start) / SIZE);
+        if (count > 1) {
+            PoolFreePage *head = nil;
+            for (uint32_t i = count - 1; i > 0; i--) {
+                PoolFreePage *page = (PoolFreePage *)(start + i*SIZE);
+                page->next = head;
+                head = page;
+            }
+            PoolFreePage *tail = (PoolFreePage *)(start + (count-1)*SIZE);
+            giveOverflowPages(head, tail, count - 1);
+        }
+        return (void *)start;
+    }
+
+    // Put a chain of free pages on the overflow list. Returns false 
+    // if there is no room. There is always room for arena pages.
+    static bool giveOverflowPages(PoolFreePage *head, PoolFreePage *tail, 
+                                  uint32_t count)
+    {
+        PoolPageLock.lock();
+        bool fits = (PoolPageArenas  ||  
+                     PoolPageOverflowCount + count <= POOL_PAGE_OVERFLOW_MAX);
+        if (fits) {
+            tail->next = PoolPageOverflow;
+            PoolPageOverflow = head;
+            PoolPageOverflowCount += count;
+        }
+        PoolPageLock.unlock();
+        return fits;
+    }
+
+    static void *takeOverflowPage()
+    {
+        PoolPageLock.lock();
+        PoolFreePage *page = PoolPageOverflow;
+        if (page) {
+            PoolPageOverflow = page->next;
+            PoolPageOverflowCount--;
+        }
+        PoolPageLock.unlock();
+        return page;
+    }
+
+    // Thread exit: hand the thread's free pages to everyone else.
+    static void pageCacheDealloc(void *p)
+    {
+        PoolPageCache *cache = (PoolPageCache *)p;
+        while (PoolFreePage *page = cache->pages) {
+            cache->pages = page->next;
+            if (!giveOverflowPages(page, page, 1)) free(page);
+        }
+        free(cache);
     }
 
     inline void protect() {
@@ -1245,6 +1449,9 @@ public:
         int r __unused = pthread_key_init_np(AutoreleasePoolPage::key, 
                                              AutoreleasePoolPage::tls_dealloc);
         assert(r == 0);
+        r = pthread_key_init_np(AutoreleasePoolPage::cacheKey, 
+                                AutoreleasePoolPage::pageCacheDealloc);
+        assert(r == 0);
     }
 
     void print() 
@@ -1276,6 +1483,16 @@ public:
         }
         _objc_inform("%llu releases pending.", (unsigned long long)objects);
 
+        objc_autorelease_pool_statistics stats;
+        getStatistics(&stats);
+        _objc_inform("%u pages in use (high water %u), %u cached, "
+                     "%llu allocated, %llu recycled, %u shared.", 
+                     stats.pagesInUse, stats.pagesInUseHiwat, 
+                     stats.pagesCached, 
+                     (unsigned long long)stats.pagesAllocated, 
+                     (unsigned long long)stats.pagesRecycled, 
+                     stats.pagesShared);
+
         if (haveEmptyPoolPlaceholder()) {
             _objc_inform("[%p]  ................  PAGE (placeholder)", 
                          EMPTY_POOL_PLACEHOLDER);
@@ -1291,6 +1508,21 @@ public:
         _objc_inform("##############");
     }
 
+    static void getStatistics(objc_autorelease_pool_statistics *stats)
+    {
+        bzero(stats, sizeof(*stats));
+        if (PoolPageCache *cache = pageCache(false)) {
+            stats->pagesAllocated = cache->allocated;
+            stats->pagesRecycled = cache->recycled;
+            stats->pagesInUse = cache->inUse;
+            stats->pagesInUseHiwat = cache->inUseHiwat;
+            stats->pagesCached = cache->count;
+        }
+        PoolPageLock.lock();
+        stats->pagesShared = PoolPageOverflowCount;
+        PoolPageLock.unlock();
+    }
+
     static void printHiwat()
     {
         // Check and propagate high water mark
@@ -1357,14 +1589,95 @@ objc_object::clearDeallocating_slow()
     SideTable& table = SideTables()[this];
     table.lock();
     if (isa.weakly_referenced) {
-        weak_clear_no_lock(&table.weak_table, (id)this);
+        // Drops the lock between batches. Nothing is cached across it: 
+        // has_sidetable_rc is read from isa afterwards, not before.
+        table.weakClearDroppingLock((id)this);
     }
     if (isa.has_sidetable_rc) {
+#if SUPPORT_CONCURRENT_REFCOUNT
+        ConcurrentRefcounts().erase(this);
+#else
         table.refcnts.erase(this);
+#endif
+        if (PinOverflowedRetainCounts) pinned_clearRC();
     }
     table.unlock();
 }
 
+
+/***********************************************************************
+* Pinned retain counts for nonpointer isa.
+* See objc-refcount.h.
+**********************************************************************/
+
+// Adds one to the pinned count. pin is true for the retain that 
+// overflowed extra_rc and pinned the object.
+// Returns false if changeIsa() moved the pinned count to the side table.
+bool
+objc_object::pinned_retain(bool pin)
+{
+    uintptr_t oldCount = PinnedRefcounts().update(this,
+        [](uintptr_t oldCount) -> uintptr_t {
+            if (oldCount == PinnedMoved) return oldCount;
+            return oldCount + 1;
+        });
+    if (slowpath(oldCount == PinnedMoved)) return false;
+
+    if (pin) {
+        RetainCountStatistics::count(RetainCountStats.overflows);
+        RetainCountStatistics::count(RetainCountStats.pins);
+    }
+    return true;
+}
+
+
+// Subtracts one from the pinned count.
+// Returns false if the pinned count is empty, or if changeIsa() 
+// moved it to the side table and *moved is set.
+bool
+objc_object::pinned_release(bool *moved)
+{
+    uintptr_t oldCount = PinnedRefcounts().update(this,
+        [](uintptr_t oldCount) -> uintptr_t {
+            if (oldCount == 0  ||  oldCount == PinnedMoved) return oldCount;
+            return oldCount - 1;
+        });
+    *moved = (oldCount == PinnedMoved);
+    return oldCount != 0  &&  !*moved;
+}
+
+
+size_t
+objc_object::pinned_getRC()
+{
+    uintptr_t count = PinnedRefcounts().load(this);
+    return count == PinnedMoved ? 0 : count;
+}
+
+
+// changeIsa() from nonpointer to raw isa, with the side table locked.
+// Returns the pinned count for the side table. Later pinned retains 
+// and releases see PinnedMoved and start over with the raw isa.
+size_t
+objc_object::pinned_moveRC_nolock()
+{
+    assert(!isa.nonpointer);
+    uintptr_t oldCount = PinnedRefcounts().update(this,
+        [](uintptr_t) -> uintptr_t { return PinnedMoved; });
+    assert(oldCount != PinnedMoved);
+    return oldCount;
+}
+
+
+// Deallocation. Forgets the pinned count, or the PinnedMoved left 
+// by changeIsa(), so the next object at this address starts at zero.
+// The dead slot is reclaimed when PinnedRefcounts() next compacts.
+void
+objc_object::pinned_clearRC()
+{
+    PinnedRefcounts().erase(this);
+}
+
 #endif
 
 __attribute__((noinline,used))
@@ -1396,6 +1709,423 @@ objc_object::overrelease_error()
 **********************************************************************/
 
 
+#if SUPPORT_CONCURRENT_REFCOUNT
+
+// Side table retain counts live in ConcurrentRefcounts() instead of
+// SideTable::refcnts. The SideTable lock still guards the weak table
+// and the nonpointer isa <-> side table transfers, but raw isa
+// retain/release never takes it.
+
+#if DEBUG
+// Used to assert that an object is not present in the side table.
+bool
+objc_object::sidetable_present()
+{
+    bool result = false;
+    SideTable& table = SideTables()[this];
+
+    table.lock();
+
+    if (ConcurrentRefcounts().load(this) != 0) result = true;
+
+#if SUPPORT_PINNED_REFCOUNT
+    if (PinOverflowedRetainCounts  &&  PinnedRefcounts().load(this) != 0) {
+        result = true;
+    }
+#endif
+
+    if (weak_is_registered_no_lock(&table.weak_table, (id)this)) result = true;
+
+    table.unlock();
+
+    return result;
+}
+#endif
+
+#if SUPPORT_NONPOINTER_ISA
+
+void
+objc_object::sidetable_lock()
+{
+    SideTable& table = SideTables()[this];
+    table.lock();
+}
+
+void
+objc_object::sidetable_unlock()
+{
+    SideTable& table = SideTables()[this];
+    table.unlock();
+}
+
+
+// Move the entire retain count to the side table,
+// as well as isDeallocating and weaklyReferenced.
+void
+objc_object::sidetable_moveExtraRC_nolock(size_t extra_rc,
+                                          bool isDeallocating,
+                                          bool weaklyReferenced)
+{
+    assert(!isa.nonpointer);        // should already be changed to raw pointer
+
+    uintptr_t oldRefcnt = ConcurrentRefcounts().update(this,
+        [=](uintptr_t oldRefcnt) -> uintptr_t {
+            uintptr_t carry;
+            size_t refcnt =
+                addc(oldRefcnt, extra_rc << SIDE_TABLE_RC_SHIFT, 0, &carry);
+            if (carry) refcnt = SIDE_TABLE_RC_PINNED;
+            if (isDeallocating) refcnt |= SIDE_TABLE_DEALLOCATING;
+            if (weaklyReferenced) refcnt |= SIDE_TABLE_WEAKLY_REFERENCED;
+            return refcnt;
+        });
+
+    // not deallocating - that was in the isa
+    assert((oldRefcnt & SIDE_TABLE_DEALLOCATING) == 0);
+    assert((oldRefcnt & SIDE_TABLE_WEAKLY_REFERENCED) == 0);
+    (void)oldRefcnt;
+}
+
+
+// Move some retain counts to the side table from the isa field.
+// Returns true if the object is now pinned.
+bool
+objc_object::sidetable_addExtraRC_nolock(size_t delta_rc)
+{
+    assert(isa.nonpointer);
+
+    uintptr_t oldRefcnt = ConcurrentRefcounts().update(this,
+        [=](uintptr_t oldRefcnt) -> uintptr_t {
+            if (oldRefcnt & SIDE_TABLE_RC_PINNED) return oldRefcnt;
+            uintptr_t carry;
+            size_t newRefcnt =
+                addc(oldRefcnt, delta_rc << SIDE_TABLE_RC_SHIFT, 0, &carry);
+            if (carry) {
+                return SIDE_TABLE_RC_PINNED | (oldRefcnt & SIDE_TABLE_FLAG_MASK);
+            }
+            return newRefcnt;
+        });
+
+    // isa-side bits should not be set here
+    assert((oldRefcnt & SIDE_TABLE_DEALLOCATING) == 0);
+    assert((oldRefcnt & SIDE_TABLE_WEAKLY_REFERENCED) == 0);
+
+    if (oldRefcnt & SIDE_TABLE_RC_PINNED) return true;
+    uintptr_t carry;
+    (void)addc(oldRefcnt, delta_rc << SIDE_TABLE_RC_SHIFT, 0, &carry);
+    return carry;
+}
+
+
+// Move some retain counts from the side table to the isa field.
+// Returns the actual count subtracted, which may be less than the request.
+size_t
+objc_object::sidetable_subExtraRC_nolock(size_t delta_rc)
+{
+    assert(isa.nonpointer);
+
+    uintptr_t oldRefcnt = ConcurrentRefcounts().update(this,
+        [=](uintptr_t oldRefcnt) -> uintptr_t {
+            // Side table retain count is zero. Can't borrow.
+            if (oldRefcnt == 0) return oldRefcnt;
+            return oldRefcnt - (delta_rc << SIDE_TABLE_RC_SHIFT);
+        });
+    if (oldRefcnt == 0) return 0;
+
+    // isa-side bits should not be set here
+    assert((oldRefcnt & SIDE_TABLE_DEALLOCATING) == 0);
+    assert((oldRefcnt & SIDE_TABLE_WEAKLY_REFERENCED) == 0);
+    // shouldn't underflow
+    assert(oldRefcnt > oldRefcnt - (delta_rc << SIDE_TABLE_RC_SHIFT));
+
+    return delta_rc;
+}
+
+
+size_t
+objc_object::sidetable_getExtraRC_nolock()
+{
+    assert(isa.nonpointer);
+    return ConcurrentRefcounts().load(this) >> SIDE_TABLE_RC_SHIFT;
+}
+
+
+// SUPPORT_NONPOINTER_ISA
+#endif
+
+
+id
+objc_object::sidetable_retain()
+{
+#if SUPPORT_NONPOINTER_ISA
+    assert(!isa.nonpointer);
+#endif
+
+    if (DeferSidetableRelease  &&  RefcountBuffer::cancelRelease(this)) {
+        // This thread still owes a release. Keep the reference instead.
+        return (id)this;
+    }
+
+    ConcurrentRefcounts().update(this, [](uintptr_t refcnt) -> uintptr_t {
+        if (refcnt & SIDE_TABLE_RC_PINNED) return refcnt;
+        return refcnt + SIDE_TABLE_RC_ONE;
+    });
+
+    return (id)this;
+}
+
+
+bool
+objc_object::sidetable_tryRetain()
+{
+#if SUPPORT_NONPOINTER_ISA
+    assert(!isa.nonpointer);
+#endif
+
+    // No lock needed. The refcount word is updated atomically
+    // so the deallocating check and the increment cannot be split.
+    uintptr_t oldRefcnt =
+        ConcurrentRefcounts().update(this, [](uintptr_t refcnt) -> uintptr_t {
+            if (refcnt & (SIDE_TABLE_DEALLOCATING|SIDE_TABLE_RC_PINNED)) {
+                return refcnt;
+            }
+            return refcnt + SIDE_TABLE_RC_ONE;
+        });
+
+    return !(oldRefcnt & SIDE_TABLE_DEALLOCATING);
+}
+
+
+uintptr_t
+objc_object::sidetable_retainCount()
+{
+    // Publish this thread's pending releases so the count is exact
+    // from this thread's point of view. Other threads' pending
+    // releases are still counted.
+    if (DeferSidetableRelease) RefcountBuffer::flush();
+
+    // this is valid for SIDE_TABLE_RC_PINNED too
+    return 1 + (ConcurrentRefcounts().load(this) >> SIDE_TABLE_RC_SHIFT);
+}
+
+
+bool
+objc_object::sidetable_isDeallocating()
+{
+    return ConcurrentRefcounts().load(this) & SIDE_TABLE_DEALLOCATING;
+}
+
+
+bool
+objc_object::sidetable_isWeaklyReferenced()
+{
+    return ConcurrentRefcounts().load(this) & SIDE_TABLE_WEAKLY_REFERENCED;
+}
+
+
+void
+objc_object::sidetable_setWeaklyReferenced_nolock()
+{
+#if SUPPORT_NONPOINTER_ISA
+    assert(!isa.nonpointer);
+#endif
+
+    ConcurrentRefcounts().update(this, [](uintptr_t refcnt) -> uintptr_t {
+        return refcnt | SIDE_TABLE_WEAKLY_REFERENCED;
+    });
+}
+
+
+// rdar://20206767
+// return uintptr_t instead of bool so that the various raw-isa
+// -release paths all return zero in eax
+uintptr_t
+objc_object::sidetable_release(bool performDealloc)
+{
+#if SUPPORT_NONPOINTER_ISA
+    assert(!isa.nonpointer);
+#endif
+
+    // Callers that want the dealloc decision itself
+    // (performDealloc == false) always get the real answer.
+    if (performDealloc  &&  DeferSidetableRelease  &&
+        RefcountBuffer::deferRelease(this))
+    {
+        return false;
+    }
+
+    uintptr_t oldRefcnt =
+        ConcurrentRefcounts().update(this, [](uintptr_t refcnt) -> uintptr_t {
+            if (refcnt < SIDE_TABLE_DEALLOCATING) {
+                // SIDE_TABLE_WEAKLY_REFERENCED may be set. Don't change it.
+                return refcnt | SIDE_TABLE_DEALLOCATING;
+            }
+            if (refcnt & SIDE_TABLE_RC_PINNED) return refcnt;
+            return refcnt - SIDE_TABLE_RC_ONE;
+        });
+
+    bool do_dealloc = oldRefcnt < SIDE_TABLE_DEALLOCATING;
+    if (do_dealloc  &&  performDealloc) {
+        ((void(*)(objc_object *, SEL))objc_msgSend)(this, SEL_dealloc);
+    }
+    return do_dealloc;
+}
+
+
+// Apply count releases in one update. Used by RefcountBuffer.
+uintptr_t
+objc_object::sidetable_releaseBatch(size_t count)
+{
+    assert(count > 0);
+
+    uintptr_t oldRefcnt =
+        ConcurrentRefcounts().update(this, [=](uintptr_t refcnt) -> uintptr_t {
+            if (refcnt & SIDE_TABLE_RC_PINNED) return refcnt;
+            size_t extra = refcnt >> SIDE_TABLE_RC_SHIFT;
+            if (extra >= count) {
+                return refcnt - count * SIDE_TABLE_RC_ONE;
+            }
+            // The last release deallocates. Any beyond that are
+            // overreleases, which are ignored here as they would be
+            // by a raw isa object's -release.
+            return (refcnt & SIDE_TABLE_FLAG_MASK) | SIDE_TABLE_DEALLOCATING;
+        });
+
+    bool do_dealloc =
+        !(oldRefcnt & (SIDE_TABLE_DEALLOCATING|SIDE_TABLE_RC_PINNED))  &&
+        (oldRefcnt >> SIDE_TABLE_RC_SHIFT) < count;
+    if (do_dealloc) {
+        ((void(*)(objc_object *, SEL))objc_msgSend)(this, SEL_dealloc);
+    }
+    return do_dealloc;
+}
+
+
+void
+objc_object::sidetable_clearDeallocating()
+{
+    SideTable& table = SideTables()[this];
+
+    // clear any weak table items
+    // clear extra retain count and deallocating bit
+    // (fixme warn or abort if extra retain count == 0 ?)
+    // The refcount entry keeps the deallocating bit visible to weak 
+    // loads until weak clearing is finished, so erase it last.
+    table.lock();
+    if (ConcurrentRefcounts().load(this) & SIDE_TABLE_WEAKLY_REFERENCED) {
+        // Drops the lock between batches. The refcount table has its own 
+        // synchronization, so the erase below needs nothing from before.
+        table.weakClearDroppingLock((id)this);
+    }
+    ConcurrentRefcounts().erase(this);
+#if SUPPORT_PINNED_REFCOUNT
+    // changeIsa() may have left PinnedMoved.
+    if (PinOverflowedRetainCounts) pinned_clearRC();
+#endif
+    table.unlock();
+}
+
+
+/***********************************************************************
+* Per-thread deferred side table releases. See objc-refcount.h.
+**********************************************************************/
+
+RefcountBuffer *
+RefcountBuffer::get(bool create)
+{
+    _objc_pthread_data *data = _objc_fetch_pthread_data(create);
+    if (!data) return nil;
+
+    RefcountBuffer *buffer = data->refcountBuffer;
+    if (!buffer  &&  create) {
+        buffer = (RefcountBuffer *)calloc(1, sizeof(RefcountBuffer));
+        data->refcountBuffer = buffer;
+    }
+    return buffer;
+}
+
+
+bool
+RefcountBuffer::deferRelease(objc_object *obj)
+{
+    RefcountBuffer *buffer = get(true);
+    // Releases performed while flushing (i.e. inside -dealloc)
+    // go straight to the table so a flush never recurses.
+    if (!buffer  ||  buffer->flushing) return false;
+
+    for (unsigned i = 0; i < buffer->count; i++) {
+        if (buffer->entries[i].obj == obj) {
+            buffer->entries[i].pendingReleases++;
+            return true;
+        }
+    }
+
+    if (buffer->count == Capacity) buffer->flushEntries();
+
+    buffer->entries[buffer->count].obj = obj;
+    buffer->entries[buffer->count].pendingReleases = 1;
+    buffer->count++;
+    return true;
+}
+
+
+bool
+RefcountBuffer::cancelRelease(objc_object *obj)
+{
+    RefcountBuffer *buffer = get(false);
+    if (!buffer) return false;
+
+    for (unsigned i = 0; i < buffer->count; i++) {
+        if (buffer->entries[i].obj == obj) {
+            if (--buffer->entries[i].pendingReleases == 0) {
+                buffer->entries[i] = buffer->entries[--buffer->count];
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void
+RefcountBuffer::flushEntries()
+{
+    if (flushing) return;
+    flushing = true;
+
+    // Detach the entries first. -dealloc may retain or release anything.
+    Entry pending[Capacity];
+    unsigned pendingCount = count;
+    memcpy(pending, entries, pendingCount * sizeof(Entry));
+    count = 0;
+
+    for (unsigned i = 0; i < pendingCount; i++) {
+        pending[i].obj->sidetable_releaseBatch(pending[i].pendingReleases);
+    }
+
+    flushing = false;
+}
+
+
+void
+RefcountBuffer::flush()
+{
+    RefcountBuffer *buffer = get(false);
+    if (buffer  &&  buffer->count) buffer->flushEntries();
+}
+
+
+void
+RefcountBuffer::destroy(RefcountBuffer *buffer)
+{
+    if (!buffer) return;
+    buffer->flushEntries();
+    free(buffer);
+}
+
+// SUPPORT_CONCURRENT_REFCOUNT
+#else
+// not SUPPORT_CONCURRENT_REFCOUNT
+
 #if DEBUG
 // Used to assert that an object is not present in the side table.
 bool
@@ -1409,6 +2139,12 @@ objc_object::sidetable_present()
     RefcountMap::iterator it = table.refcnts.find(this);
     if (it != table.refcnts.end()) result = true;
 
+#if SUPPORT_PINNED_REFCOUNT
+    if (PinOverflowedRetainCounts  &&  PinnedRefcounts().load(this) != 0) {
+        result = true;
+    }
+#endif
+
     if (weak_is_registered_no_lock(&table.weak_table, (id)this)) result = true;
 
     table.unlock();
@@ -1703,13 +2439,23 @@ objc_object::sidetable_clearDeallocating()
     /// C++ 迭代器 移除资源
     if (it != table.refcnts.end()) {
         if (it->second & SIDE_TABLE_WEAKLY_REFERENCED) {
-            weak_clear_no_lock(&table.weak_table, (id)this);
+            table.weakClearDroppingLock((id)this);
+            // The lock may have been dropped, and other objects' 
+            // refcnts entries added meanwhile, invalidating the iterator.
+            it = table.refcnts.find(this);
         }
-        table.refcnts.erase(it);
+        if (it != table.refcnts.end()) table.refcnts.erase(it);
     }
+#if SUPPORT_PINNED_REFCOUNT
+    // changeIsa() may have left PinnedMoved.
+    if (PinOverflowedRetainCounts) pinned_clearRC();
+#endif
     table.unlock();
 }
 
+// not SUPPORT_CONCURRENT_REFCOUNT
+#endif
+
 
 /***********************************************************************
 * Optimized retain/release/autorelease entrypoints
@@ -1981,6 +2727,12 @@ void
 objc_autoreleasePoolPop(void *ctxt)
 {
     AutoreleasePoolPage::pop(ctxt);
+#if __OBJC2__
+    cache_quiescent_state();
+#endif
+#if SUPPORT_CONCURRENT_REFCOUNT
+    if (DeferSidetableRelease) RefcountBuffer::flush();
+#endif
 }
 
 
@@ -2002,6 +2754,12 @@ _objc_autoreleasePoolPrint(void)
     AutoreleasePoolPage::printAll();
 }
 
+void 
+_objc_autoreleasePoolGetStatistics(struct objc_autorelease_pool_statistics *outStats)
+{
+    AutoreleasePoolPage::getStatistics(outStats);
+}
+
 
 // Same as objc_release but suitable for tail-calling 
 // if you need the value back and don't want to push a frame before this point.
@@ -2086,10 +2844,55 @@ id objc_unretainedObject(objc_objectptr_t pointer) { return (id)pointer; }
 objc_objectptr_t objc_unretainedPointer(id object) { return object; }
 
 
+/***********************************************************************
+* _objc_getRetainCountStatistics
+* _objc_printRetainCountStatistics
+* Counts of nonpointer isa retain count transfers, for tuning and 
+* OBJC_PRINT_RETAIN_COUNT_STATISTICS. Counts are updated without 
+* ordering, so a snapshot taken while other threads run may be skewed.
+**********************************************************************/
+BOOL
+_objc_getRetainCountStatistics(struct objc_retain_count_statistics *outStats)
+{
+#if SUPPORT_PINNED_REFCOUNT
+    outStats->overflows = RetainCountStats.overflows.load(std::memory_order_relaxed);
+    outStats->borrows = RetainCountStats.borrows.load(std::memory_order_relaxed);
+    outStats->pins = RetainCountStats.pins.load(std::memory_order_relaxed);
+    return YES;
+#else
+    bzero(outStats, sizeof(*outStats));
+    return NO;
+#endif
+}
+
+#if SUPPORT_PINNED_REFCOUNT
+void
+_objc_printRetainCountStatistics(void)
+{
+    struct objc_retain_count_statistics stats;
+    _objc_getRetainCountStatistics(&stats);
+    _objc_inform("RETAIN COUNTS: %llu inline overflows, %llu side table borrows", 
+                 stats.overflows, stats.borrows);
+    if (PinOverflowedRetainCounts) {
+        size_t occupied, capacity;
+        PinnedRefcounts().getSize(&occupied, &capacity);
+        _objc_inform("RETAIN COUNTS: %llu objects pinned, "
+                     "%zu of %zu pinned count slots used", 
+                     stats.pins, occupied, capacity);
+    }
+}
+#endif
+
+
 void arr_init(void) 
 {
     AutoreleasePoolPage::init();
-    SideTableInit();
+#if SUPPORT_CONCURRENT_REFCOUNT
+    ConcurrentRefcounts().init();
+#endif
+#if SUPPORT_PINNED_REFCOUNT
+    if (PinOverflowedRetainCounts) PinnedRefcounts().init();
+#endif
 }
 
 
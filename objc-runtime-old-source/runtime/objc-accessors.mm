@@ -40,8 +40,13 @@
 @end
 
 StripedMap<spinlock_t> PropertyLocks;
-StripedMap<spinlock_t> StructLocks;
+StripedMap<seqlock_t> StructLocks;
 StripedMap<spinlock_t> CppObjectLocks;
+#if SUPPORT_LOCKFREE_ACCESSORS
+// Atomic getters count themselves here instead of taking PropertyLocks. 
+// Atomic setters wait for them before releasing the old value.
+StripedMap<readcount_t> PropertyReaders;
+#endif
 
 #define MUTABLE_COPY 2
 
@@ -55,10 +60,18 @@ id objc_getProperty(id self, SEL _cmd, ptrdiff_t offset, BOOL atomic) {
     if (!atomic) return *slot;
         
     // Atomic retain release world
+#if SUPPORT_LOCKFREE_ACCESSORS
+    // The setter does not release the old value until we leave.
+    readcount_t& readers = PropertyReaders[slot];
+    unsigned which = readers.enter();
+    id value = objc_retain(__atomic_load_n(slot, __ATOMIC_SEQ_CST));
+    readers.leave(which);
+#else
     spinlock_t& slotlock = PropertyLocks[slot];
-    slotlock.lock();
+    StripedMap<spinlock_t>::lockStripe(slotlock);
     id value = objc_retain(*slot);
     slotlock.unlock();
+#endif
     
     // for performance, we (safely) issue the autorelease OUTSIDE of the spinlock.
     return objc_autoreleaseReturnValue(value);
@@ -91,10 +104,18 @@ static inline void reallySetProperty(id self, SEL _cmd, id newValue, ptrdiff_t o
         *slot = newValue;
     } else { /// 直接加锁 自旋锁
         spinlock_t& slotlock = PropertyLocks[slot];
-        slotlock.lock();
+        StripedMap<spinlock_t>::lockStripe(slotlock);
         oldValue = *slot;
+#if SUPPORT_LOCKFREE_ACCESSORS
+        __atomic_store_n(slot, newValue, __ATOMIC_SEQ_CST);
+#else
         *slot = newValue;        
+#endif
         slotlock.unlock();
+#if SUPPORT_LOCKFREE_ACCESSORS
+        // Unlocked getters may still be retaining oldValue.
+        if (oldValue) PropertyReaders[slot].synchronize();
+#endif
     }
     /// 释放旧值
     objc_release(oldValue);
@@ -132,26 +153,66 @@ void objc_setProperty_nonatomic_copy(id self, SEL _cmd, id newValue, ptrdiff_t o
 // This entry point was designed wrong.  When used as a getter, src needs to be locked so that
 // if simultaneously used for a setter then there would be contention on src.
 // So we need two locks - one of which will be contended.
+#if SUPPORT_LOCKFREE_ACCESSORS
+// Instead, src is copied optimistically into a buffer and the copy is 
+// retried if a write to src's stripe overlapped it. Only dest is locked.
+// Structs too big for the buffer lock both stripes as before.
+enum { StructBufferSize = 128 };
+#endif
+
+static void lockStructStripe(seqlock_t& stripe)
+{
+    StripedMap<seqlock_t>::lockStripe(stripe, stripe.slock);
+}
+
 void objc_copyStruct(void *dest, const void *src, ptrdiff_t size, BOOL atomic, BOOL hasStrong __unused) {
-    spinlock_t *srcLock = nil;
-    spinlock_t *dstLock = nil;
-    if (atomic) {
-        srcLock = &StructLocks[src];
-        dstLock = &StructLocks[dest];
-        spinlock_t::lockTwo(srcLock, dstLock);
+    if (!atomic) {
+        memmove(dest, src, size);
+        return;
     }
 
+    seqlock_t& srcLock = StructLocks[src];
+    seqlock_t& dstLock = StructLocks[dest];
+
+#if SUPPORT_LOCKFREE_ACCESSORS
+    if (size <= StructBufferSize) {
+        uint8_t buffer[StructBufferSize];
+        uintptr_t seq;
+        do {
+            seq = srcLock.beginRead();
+            memcpy(buffer, src, size);
+        } while (!srcLock.endRead(seq));
+
+        lockStructStripe(dstLock);
+        dstLock.beginWrite();
+        memcpy(dest, buffer, size);
+        dstLock.endWrite();
+        dstLock.unlock();
+        return;
+    }
+#endif
+
+    // Address-ordered lock discipline for the pair of stripes.
+    if (&srcLock < &dstLock) {
+        lockStructStripe(srcLock);
+        lockStructStripe(dstLock);
+    } else {
+        lockStructStripe(dstLock);
+        if (&srcLock != &dstLock) lockStructStripe(srcLock);
+    }
+
+    dstLock.beginWrite();
     memmove(dest, src, size);
+    dstLock.endWrite();
 
-    if (atomic) {
-        spinlock_t::unlockTwo(srcLock, dstLock);
-    }
+    dstLock.unlock();
+    if (&srcLock != &dstLock) srcLock.unlock();
 }
 
 void objc_copyCppObjectAtomic(void *dest, const void *src, void (*copyHelper) (void *dest, const void *source)) {
     spinlock_t *srcLock = &CppObjectLocks[src];
     spinlock_t *dstLock = &CppObjectLocks[dest];
-    spinlock_t::lockTwo(srcLock, dstLock);
+    StripedMap<spinlock_t>::lockTwoStripes(srcLock, dstLock);
 
     // let C++ code perform the actual copy.
     copyHelper(dest, src);
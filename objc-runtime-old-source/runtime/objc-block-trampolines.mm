@@ -35,6 +35,7 @@
 #include <Block.h>
 #include <Block_private.h>
 #include <mach/mach.h>
+#include <atomic>
 
 // symbols defined in assembly files
 // Don't use the symbols directly; they're thumb-biased on some ARM archs.
@@ -82,26 +83,20 @@ typedef enum {
 
 struct TrampolineBlockPagePair 
 {
-    TrampolineBlockPagePair *nextPagePair; // linked list of all pages
-    TrampolineBlockPagePair *nextAvailablePage; // linked list of pages with available slots
-    
-    uintptr_t nextAvailable; // index of next available slot, endIndex() if no more available
-    
-    // Payload data: block pointers and free list.
-    // Bytes parallel with trampoline header code are the fields above or unused
-    // uint8_t blocks[ PAGE_MAX_SIZE - sizeof(TrampolineBlockPagePair) ] 
+    // Payload data: block pointers.
+    // Bytes parallel with trampoline header code are unused.
+    // uint8_t blocks[ PAGE_MAX_SIZE ] 
     
     // Code: trampoline header followed by trampolines.
     // uint8_t trampolines[PAGE_MAX_SIZE];
     
     // Per-trampoline block data format:
-    // initial value is 0 while page data is filled sequentially 
-    // when filled, value is reference to Block_copy()d block
-    // when empty, value is index of next available slot OR 0 if never used yet
+    // nil while the slot is free or held in a thread's TrampolineCache
+    // otherwise reference to Block_copy()d block
+    // Free slots are tracked by TrampolinePagePairInfo.
     
-    union Payload {
+    struct Payload {
         id block;
-        uintptr_t nextAvailable;  // free list
     };
     
     static uintptr_t headerSize() {
@@ -150,9 +145,14 @@ struct TrampolineBlockPagePair
         return 0;
     }
 
+    // tramp must be a trampoline handed out by _allocateTrampoline().
+    static Payload *payloadForTrampoline(IMP tramp) {
+        // Data is at the same offset in the page before the code.
+        return (Payload *)(((uintptr_t)tramp & ~1UL) - PAGE_MAX_SIZE);
+    }
+
     static void check() {
         assert(TrampolineBlockPagePair::slotSize() == 8);
-        assert(TrampolineBlockPagePair::headerSize() >= sizeof(TrampolineBlockPagePair));
         assert(TrampolineBlockPagePair::headerSize() % TrampolineBlockPagePair::slotSize() == 0);
         
         // _objc_inform("%p %p %p", a1a2_tramphead(), a1a2_firsttramp(), 
@@ -177,57 +177,99 @@ struct TrampolineBlockPagePair
 
 };
 
-// two sets of trampoline pages; one for stack returns and one for register returns
-static TrampolineBlockPagePair *headPagePairs[ArgumentModeCount];
 
-#pragma mark Utility Functions
+// The data page has no room for allocation state, so each page pair's 
+// free slots are tracked here: one bit per slot, set when the slot is free.
+// Locking: TrampolineLock
+struct TrampolinePagePairInfo {
+    TrampolineBlockPagePair *pagePair;
+    TrampolinePagePairInfo *nextAvailable;  // list of page pairs with free slots
+    uint32_t freeCount;
+    bool isAvailable;                       // on the list
+    uint64_t freeSlots[PAGE_MAX_SIZE / 8 / 64];
+};
 
-static inline void _lock() {
-#if __OBJC2__
-    runtimeLock.write();
-#else
-    classLock.lock();
-#endif
-}
+// Page pairs allocated together. Chunks are never deallocated.
+struct TrampolineChunk {
+    uintptr_t start;
+    uintptr_t end;
+    ArgumentMode aMode;
+    uint32_t pairCount;
+    TrampolinePagePairInfo pairs[0];
+
+    TrampolinePagePairInfo *infoForTrampoline(IMP tramp) {
+        uintptr_t pair = ((uintptr_t)tramp - start) / (PAGE_MAX_SIZE * 2);
+        assert(pair < pairCount);
+        return &pairs[pair];
+    }
+};
 
-static inline void _unlock() {
-#if __OBJC2__
-    runtimeLock.unlockWrite();
-#else
-    classLock.unlock();
-#endif
-}
+// Chunks start at one page pair and double up to this size.
+#define TRAMPOLINE_CHUNK_MAX_PAIRS 16
 
-static inline void _assert_locked() {
-#if __OBJC2__
-    runtimeLock.assertWriting();
-#else
-    classLock.assertLocked();
-#endif
+// Page pairs with free slots for one argument mode.
+// Locking: TrampolineLock
+struct TrampolinePool {
+    TrampolinePagePairInfo *available;
+    uint32_t nextChunkPairs;
+};
+
+// two pools of trampoline pages; one for stack returns and one for register returns
+static TrampolinePool pools[ArgumentModeCount];
+
+// Every chunk, so a trampoline's page pair can be found without a lock.
+// Appended under TrampolineLock. The count is published after the list, 
+// and a replaced list is leaked because readers may still be scanning it.
+static std::atomic<TrampolineChunk **> chunkList;
+static std::atomic<uint32_t> chunkCount;
+static uint32_t chunkCapacity;
+
+mutex_t TrampolineLock;
+
+
+// Slots each thread keeps so most allocations and frees take no lock.
+// Refills and flushes move half the cache at once.
+#define TRAMPOLINE_CACHE_SLOTS 32
+
+struct TrampolineCache {
+    uint32_t count[ArgumentModeCount];
+    IMP slots[ArgumentModeCount][TRAMPOLINE_CACHE_SLOTS];
+};
+
+static TrampolineCache *trampolineCache(bool create)
+{
+    _objc_pthread_data *data = _objc_fetch_pthread_data(create);
+    if (!data) return nil;
+
+    TrampolineCache *cache = data->trampolineCache;
+    if (!cache  &&  create) {
+        cache = (TrampolineCache *)calloc(1, sizeof(*cache));
+        data->trampolineCache = cache;
+    }
+    return cache;
 }
 
+
 #pragma mark Trampoline Management Functions
-static TrampolineBlockPagePair *_allocateTrampolinesAndData(ArgumentMode aMode) 
+
+/***********************************************************************
+* _allocateTrampolineChunk
+* Maps a chunk of page pairs with one vm_allocate and puts 
+* its page pairs on the pool's available list.
+* Locking: TrampolineLock must be held
+**********************************************************************/
+static void _allocateTrampolineChunk(ArgumentMode aMode) 
 {
-    _assert_locked();
+    TrampolineLock.assertLocked();
 
-    vm_address_t dataAddress;
-    
     TrampolineBlockPagePair::check();
 
-    TrampolineBlockPagePair *headPagePair = headPagePairs[aMode];
-    
-    assert(headPagePair == nil  ||  headPagePair->nextAvailablePage == nil);
-    
-    kern_return_t result;
-    result = vm_allocate(mach_task_self(), &dataAddress, PAGE_MAX_SIZE * 2,
-                         VM_FLAGS_ANYWHERE | VM_MAKE_TAG(VM_MEMORY_FOUNDATION));
-    if (result != KERN_SUCCESS) {
-        _objc_fatal("vm_allocate trampolines failed (%d)", result);
+    TrampolinePool& pool = pools[aMode];
+    uint32_t pairCount = pool.nextChunkPairs ? pool.nextChunkPairs : 1;
+    if (pairCount < TRAMPOLINE_CHUNK_MAX_PAIRS) {
+        pool.nextChunkPairs = pairCount * 2;
     }
 
-    vm_address_t codeAddress = dataAddress + PAGE_MAX_SIZE;
-        
     uintptr_t codePage;
     switch(aMode) {
     case ReturnValueInRegisterArgumentMode:
@@ -242,77 +284,238 @@ static TrampolineBlockPagePair *_allocateTrampolinesAndData(ArgumentMode aMode)
         _objc_fatal("unknown return mode %d", (int)aMode);
         break;
     }
-    
-    vm_prot_t currentProtection, maxProtection;
-    result = vm_remap(mach_task_self(), &codeAddress, PAGE_MAX_SIZE, 
-                      0, VM_FLAGS_FIXED | VM_FLAGS_OVERWRITE,
-                      mach_task_self(), codePage, TRUE, 
-                      &currentProtection, &maxProtection, VM_INHERIT_SHARE);
+
+    vm_address_t dataAddress;
+    kern_return_t result;
+    result = vm_allocate(mach_task_self(), &dataAddress, 
+                         PAGE_MAX_SIZE * 2 * pairCount,
+                         VM_FLAGS_ANYWHERE | VM_MAKE_TAG(VM_MEMORY_FOUNDATION));
     if (result != KERN_SUCCESS) {
-        // vm_deallocate(mach_task_self(), dataAddress, PAGE_MAX_SIZE * 2);
-        _objc_fatal("vm_remap trampolines failed (%d)", result);
+        _objc_fatal("vm_allocate trampolines failed (%d)", result);
     }
-    
-    TrampolineBlockPagePair *pagePair = (TrampolineBlockPagePair *) dataAddress;
-    pagePair->nextAvailable = pagePair->startIndex();
-    pagePair->nextPagePair = nil;
-    pagePair->nextAvailablePage = nil;
-    
-    if (headPagePair) {
-        TrampolineBlockPagePair *lastPagePair = headPagePair;
-        while(lastPagePair->nextPagePair) {
-            lastPagePair = lastPagePair->nextPagePair;
+
+    TrampolineChunk *chunk = (TrampolineChunk *)
+        calloc(1, sizeof(TrampolineChunk) + 
+               pairCount * sizeof(TrampolinePagePairInfo));
+    chunk->start = dataAddress;
+    chunk->end = dataAddress + PAGE_MAX_SIZE * 2 * pairCount;
+    chunk->aMode = aMode;
+    chunk->pairCount = pairCount;
+
+    // Fill the chunk's first page pair first.
+    for (uint32_t pair = pairCount; pair-- > 0; ) {
+        vm_address_t pairAddress = dataAddress + PAGE_MAX_SIZE * 2 * pair;
+        vm_address_t codeAddress = pairAddress + PAGE_MAX_SIZE;
+        vm_prot_t currentProtection, maxProtection;
+        result = vm_remap(mach_task_self(), &codeAddress, PAGE_MAX_SIZE, 
+                          0, VM_FLAGS_FIXED | VM_FLAGS_OVERWRITE,
+                          mach_task_self(), codePage, TRUE, 
+                          &currentProtection, &maxProtection, VM_INHERIT_SHARE);
+        if (result != KERN_SUCCESS) {
+            _objc_fatal("vm_remap trampolines failed (%d)", result);
         }
-        lastPagePair->nextPagePair = pagePair;
-        headPagePairs[aMode]->nextAvailablePage = pagePair;
-    } else {
-        headPagePairs[aMode] = pagePair;
+
+        TrampolinePagePairInfo *info = &chunk->pairs[pair];
+        info->pagePair = (TrampolineBlockPagePair *)pairAddress;
+        for (uintptr_t index = TrampolineBlockPagePair::startIndex(); 
+             index < TrampolineBlockPagePair::endIndex(); 
+             index++) 
+        {
+            info->freeSlots[index / 64] |= 1ULL << (index % 64);
+        }
+        info->freeCount = (uint32_t)(TrampolineBlockPagePair::endIndex() - 
+                                     TrampolineBlockPagePair::startIndex());
+        info->isAvailable = true;
+        info->nextAvailable = pool.available;
+        pool.available = info;
     }
-    
-    return pagePair;
+
+    // Publish the chunk for _chunkContainingTrampoline().
+    uint32_t count = chunkCount.load(std::memory_order_relaxed);
+    TrampolineChunk **list = chunkList.load(std::memory_order_relaxed);
+    if (count == chunkCapacity) {
+        chunkCapacity = chunkCapacity ? chunkCapacity * 2 : 16;
+        TrampolineChunk **newList = (TrampolineChunk **)
+            calloc(chunkCapacity, sizeof(TrampolineChunk *));
+        if (count) memcpy(newList, list, count * sizeof(TrampolineChunk *));
+        list = newList;
+        chunkList.store(list, std::memory_order_release);
+    }
+    list[count] = chunk;
+    chunkCount.store(count + 1, std::memory_order_release);
 }
 
-static TrampolineBlockPagePair *
-_getOrAllocatePagePairWithNextAvailable(ArgumentMode aMode) 
+
+/***********************************************************************
+* _chunkContainingTrampoline
+* Returns the chunk containing address tramp, or nil if it 
+* is not one of ours. Newer chunks are searched first.
+* Locking: none
+**********************************************************************/
+static TrampolineChunk *_chunkContainingTrampoline(IMP tramp)
 {
-    _assert_locked();
-    
-    TrampolineBlockPagePair *headPagePair = headPagePairs[aMode];
+    uint32_t count = chunkCount.load(std::memory_order_acquire);
+    TrampolineChunk **list = chunkList.load(std::memory_order_acquire);
+    uintptr_t address = (uintptr_t)tramp;
+    for (uint32_t i = count; i-- > 0; ) {
+        TrampolineChunk *chunk = list[i];
+        if (address >= chunk->start  &&  address < chunk->end) return chunk;
+    }
+    return nil;
+}
 
-    if (!headPagePair)
-        return _allocateTrampolinesAndData(aMode);
-    
-    // make sure head page is filled first
-    if (headPagePair->nextAvailable != headPagePair->endIndex())
-        return headPagePair;
-    
-    if (headPagePair->nextAvailablePage) // check if there is a page w/a hole
-        return headPagePair->nextAvailablePage;
-    
-    return _allocateTrampolinesAndData(aMode); // tack on a new one
+
+/***********************************************************************
+* _payloadForTrampoline
+* Returns the payload of trampoline tramp, or nil if tramp 
+* is not a trampoline. Also returns its chunk.
+* Locking: none
+**********************************************************************/
+static TrampolineBlockPagePair::Payload *
+_payloadForTrampoline(IMP tramp, TrampolineChunk **outChunk)
+{
+    TrampolineChunk *chunk = _chunkContainingTrampoline(tramp);
+    if (!chunk) return nil;
+
+    TrampolineBlockPagePair *pagePair = 
+        chunk->infoForTrampoline(tramp)->pagePair;
+    uintptr_t index = pagePair->indexForTrampoline(tramp);
+    if (!index) return nil;
+
+    if (outChunk) *outChunk = chunk;
+    return pagePair->payload(index);
 }
 
-static TrampolineBlockPagePair *
-_pageAndIndexContainingIMP(IMP anImp, uintptr_t *outIndex, 
-                           TrampolineBlockPagePair **outHeadPagePair) 
+
+/***********************************************************************
+* _takeFreeSlot
+* Removes the first free slot of the first available page pair 
+* from the free slots, allocating a chunk if there is none.
+* Locking: TrampolineLock must be held
+**********************************************************************/
+static IMP _takeFreeSlot(ArgumentMode aMode)
 {
-    _assert_locked();
+    TrampolineLock.assertLocked();
+
+    TrampolinePool& pool = pools[aMode];
+    if (!pool.available) _allocateTrampolineChunk(aMode);
+    TrampolinePagePairInfo *info = pool.available;
+
+    uintptr_t word = 0;
+    while (info->freeSlots[word] == 0) word++;
+    uintptr_t bit = __builtin_ctzll(info->freeSlots[word]);
+    info->freeSlots[word] &= ~(1ULL << bit);
+
+    if (--info->freeCount == 0) {
+        // PagePair is now full. Remove from available page linked list
+        pool.available = info->nextAvailable;
+        info->nextAvailable = nil;
+        info->isAvailable = false;
+    }
 
-    for (int arg = 0; arg < ArgumentModeCount; arg++) {
-        for (TrampolineBlockPagePair *pagePair = headPagePairs[arg]; 
-             pagePair;
-             pagePair = pagePair->nextPagePair)
-        {
-            uintptr_t index = pagePair->indexForTrampoline(anImp);
-            if (index) {
-                if (outIndex) *outIndex = index;
-                if (outHeadPagePair) *outHeadPagePair = headPagePairs[arg];
-                return pagePair;
+    return info->pagePair->trampoline(word * 64 + bit);
+}
+
+
+/***********************************************************************
+* _returnFreeSlot
+* Marks trampoline tramp of chunk free.
+* Locking: TrampolineLock must be held
+**********************************************************************/
+static void _returnFreeSlot(IMP tramp, TrampolineChunk *chunk)
+{
+    TrampolineLock.assertLocked();
+
+    TrampolinePagePairInfo *info = chunk->infoForTrampoline(tramp);
+    uintptr_t index = info->pagePair->indexForTrampoline(tramp);
+    assert(index);
+    assert(!(info->freeSlots[index / 64] & (1ULL << (index % 64))));
+    info->freeSlots[index / 64] |= 1ULL << (index % 64);
+    info->freeCount++;
+
+    // make sure this page is on available linked list
+    if (!info->isAvailable) {
+        TrampolinePool& pool = pools[chunk->aMode];
+        info->nextAvailable = pool.available;
+        info->isAvailable = true;
+        pool.available = info;
+    }
+}
+
+
+/***********************************************************************
+* _allocateTrampoline
+* Returns a free trampoline, from the thread's cache if possible.
+* Locking: may acquire TrampolineLock
+**********************************************************************/
+static IMP _allocateTrampoline(ArgumentMode aMode)
+{
+    TrampolineCache *cache = trampolineCache(true);
+    if (cache  &&  cache->count[aMode] > 0) {
+        return cache->slots[aMode][--cache->count[aMode]];
+    }
+
+    mutex_locker_t lock(TrampolineLock);
+    if (!cache) return _takeFreeSlot(aMode);
+
+    while (cache->count[aMode] < TRAMPOLINE_CACHE_SLOTS / 2) {
+        cache->slots[aMode][cache->count[aMode]++] = _takeFreeSlot(aMode);
+    }
+    return cache->slots[aMode][--cache->count[aMode]];
+}
+
+
+/***********************************************************************
+* _freeTrampoline
+* Frees trampoline tramp of chunk, whose payload is already nil, 
+* to the thread's cache if possible.
+* Locking: may acquire TrampolineLock
+**********************************************************************/
+static void _freeTrampoline(IMP tramp, TrampolineChunk *chunk)
+{
+    // Cache the address _allocateTrampoline() handed out, 
+    // in case the caller dropped the Thumb bit.
+    TrampolineBlockPagePair *pagePair = chunk->infoForTrampoline(tramp)->pagePair;
+    tramp = pagePair->trampoline(pagePair->indexForTrampoline(tramp));
+
+    ArgumentMode aMode = chunk->aMode;
+    TrampolineCache *cache = trampolineCache(false);
+    if (cache  &&  cache->count[aMode] < TRAMPOLINE_CACHE_SLOTS) {
+        cache->slots[aMode][cache->count[aMode]++] = tramp;
+        return;
+    }
+
+    mutex_locker_t lock(TrampolineLock);
+    _returnFreeSlot(tramp, chunk);
+    if (!cache) return;
+
+    while (cache->count[aMode] > TRAMPOLINE_CACHE_SLOTS / 2) {
+        IMP cached = cache->slots[aMode][--cache->count[aMode]];
+        _returnFreeSlot(cached, _chunkContainingTrampoline(cached));
+    }
+}
+
+
+/***********************************************************************
+* _destroyTrampolineCache
+* Returns a thread's cached trampolines to the pools.
+* Locking: acquires TrampolineLock
+**********************************************************************/
+void _destroyTrampolineCache(TrampolineCache *cache)
+{
+    if (!cache) return;
+
+    {
+        mutex_locker_t lock(TrampolineLock);
+        for (int arg = 0; arg < ArgumentModeCount; arg++) {
+            while (cache->count[arg] > 0) {
+                IMP cached = cache->slots[arg][--cache->count[arg]];
+                _returnFreeSlot(cached, _chunkContainingTrampoline(cached));
             }
         }
     }
-    
-    return nil;
+
+    free(cache);
 }
 
 
@@ -336,41 +539,14 @@ _argumentModeForBlock(id block)
 IMP 
 _imp_implementationWithBlockNoCopy(id block)
 {
-    _assert_locked();
-
     ArgumentMode aMode = _argumentModeForBlock(block);
 
-    TrampolineBlockPagePair *pagePair = 
-        _getOrAllocatePagePairWithNextAvailable(aMode);
-    if (!headPagePairs[aMode])
-        headPagePairs[aMode] = pagePair;
-
-    uintptr_t index = pagePair->nextAvailable;
-    assert(index >= pagePair->startIndex()  &&  index < pagePair->endIndex());
-    TrampolineBlockPagePair::Payload *payload = pagePair->payload(index);
-    
-    uintptr_t nextAvailableIndex = payload->nextAvailable;
-    if (nextAvailableIndex == 0) {
-        // First time through (unused slots are zero). Fill sequentially.
-        // If the page is now full this will now be endIndex(), handled below.
-        nextAvailableIndex = index + 1;
-    }
-    pagePair->nextAvailable = nextAvailableIndex;
-    if (nextAvailableIndex == pagePair->endIndex()) {
-        // PagePair is now full (free list or wilderness exhausted)
-        // Remove from available page linked list
-        TrampolineBlockPagePair *iterator = headPagePairs[aMode];
-        while(iterator && (iterator->nextAvailablePage != pagePair)) {
-            iterator = iterator->nextAvailablePage;
-        }
-        if (iterator) {
-            iterator->nextAvailablePage = pagePair->nextAvailablePage;
-            pagePair->nextAvailablePage = nil;
-        }
-    }
-    
-    payload->block = block;
-    return pagePair->trampoline(index);
+    IMP tramp = _allocateTrampoline(aMode);
+    TrampolineBlockPagePair::Payload *payload = 
+        TrampolineBlockPagePair::payloadForTrampoline(tramp);
+    assert(payload->block == nil);
+    __atomic_store_n(&payload->block, block, __ATOMIC_RELEASE);
+    return tramp;
 }
 
 
@@ -378,81 +554,35 @@ _imp_implementationWithBlockNoCopy(id block)
 IMP imp_implementationWithBlock(id block) 
 {
     block = Block_copy(block);
-    _lock();
-    IMP returnIMP = _imp_implementationWithBlockNoCopy(block);
-    _unlock();
-    return returnIMP;
+    return _imp_implementationWithBlockNoCopy(block);
 }
 
 
 id imp_getBlock(IMP anImp) {
-    uintptr_t index;
-    TrampolineBlockPagePair *pagePair;
-    
     if (!anImp) return nil;
     
-    _lock();
-    
-    pagePair = _pageAndIndexContainingIMP(anImp, &index, nil);
-    
-    if (!pagePair) {
-        _unlock();
-        return nil;
-    }
+    TrampolineBlockPagePair::Payload *payload = 
+        _payloadForTrampoline(anImp, nil);
+    if (!payload) return nil;
 
-    TrampolineBlockPagePair::Payload *payload = pagePair->payload(index);
-    
-    if (payload->nextAvailable <= TrampolineBlockPagePair::endIndex()) {
-        // unallocated
-        _unlock();
-        return nil;
-    }
-    
-    _unlock();
-    
-    return payload->block;
+    // nil if unallocated
+    return __atomic_load_n(&payload->block, __ATOMIC_ACQUIRE);
 }
 
 BOOL imp_removeBlock(IMP anImp) {
-    TrampolineBlockPagePair *pagePair;
-    TrampolineBlockPagePair *headPagePair;
-    uintptr_t index;
-    
     if (!anImp) return NO;
     
-    _lock();
-    pagePair = _pageAndIndexContainingIMP(anImp, &index, &headPagePair);
-    
-    if (!pagePair) {
-        _unlock();
-        return NO;
-    }
+    TrampolineChunk *chunk;
+    TrampolineBlockPagePair::Payload *payload = 
+        _payloadForTrampoline(anImp, &chunk);
+    if (!payload) return NO;
 
-    TrampolineBlockPagePair::Payload *payload = pagePair->payload(index);
-    id block = payload->block;
+    // Only one caller gets the block if the trampoline is removed twice.
+    id block = __atomic_exchange_n(&payload->block, nil, __ATOMIC_ACQ_REL);
+    if (!block) return NO;
     // block is released below
-    
-    payload->nextAvailable = pagePair->nextAvailable;
-    pagePair->nextAvailable = index;
-    
-    // make sure this page is on available linked list
-    TrampolineBlockPagePair *pagePairIterator = headPagePair;
-    
-    // see if page is the next available page for any existing pages
-    while (pagePairIterator->nextAvailablePage && 
-           pagePairIterator->nextAvailablePage != pagePair)
-    {
-        pagePairIterator = pagePairIterator->nextAvailablePage;
-    }
-    
-    if (! pagePairIterator->nextAvailablePage) {
-        // if iteration stopped because nextAvail was nil
-        // add to end of list.
-        pagePairIterator->nextAvailablePage = pagePair;
-        pagePair->nextAvailablePage = nil;
-    }
-    
-    _unlock();
+
+    _freeTrampoline(anImp, chunk);
     Block_release(block);
     return YES;
 }
@@ -10,6 +10,8 @@ extern IMP cache_getImp(Class cls, SEL sel);
 
 extern void cache_fill(Class cls, SEL sel, IMP imp, id receiver);
 
+extern void cache_fill_nolock(Class cls, SEL sel, IMP imp, id receiver);
+
 extern void cache_erase_nolock(Class cls);
 
 extern void cache_delete(Class cls);
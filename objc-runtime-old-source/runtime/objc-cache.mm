@@ -27,6 +27,7 @@
 * Cache flushing
 * Cache garbage collection
 * Cache instrumentation
+* Cache statistics
 * Dedicated allocator for large caches
 **********************************************************************/
 
@@ -46,20 +47,23 @@
  * The memory is now only accessible to instances of objc_msgSend that 
  * were running when the memory was disconnected; any further calls to 
  * objc_msgSend will not see the garbage memory because the other data 
- * structures don't point to it anymore. The collecting_in_critical
- * function checks the PC of all threads and returns FALSE when all threads 
- * are found to be outside objc_msgSend. This means any call to objc_msgSend 
- * that could have had access to the garbage has finished or moved past the 
- * cache lookup stage, so it is safe to free the memory.
+ * structures don't point to it anymore. Threads announce quiescent 
+ * states with cache_quiescent_state() at points where they cannot be 
+ * reading a cache, and cache_quiescent_epoch() also counts threads the 
+ * kernel reports as blocked. Once every thread has passed a quiescent 
+ * state since some garbage was disconnected, any call to objc_msgSend 
+ * that could have had access to that garbage has finished or moved past 
+ * the cache lookup stage, so it is safe to free the memory. No thread 
+ * is stopped to find this out. See "Cache garbage reclamation".
  *
  * All functions that modify cache data or structures must acquire the 
  * cacheUpdateLock to prevent interference from concurrent modifications.
  * The function that frees cache garbage must acquire the cacheUpdateLock 
- * and use collecting_in_critical() to flush out cache readers.
+ * and use cache_quiescent_epoch() to flush out cache readers.
  * The cacheUpdateLock is also used to protect the custom allocator used 
  * for large method cache blocks.
  *
- * Cache readers (PC-checked by collecting_in_critical())
+ * Cache readers (tracked by cache_quiescent_epoch())
  * objc_msgSend*
  * cache_getImp
  *
@@ -85,6 +89,18 @@
 
 #include "objc-private.h"
 #include "objc-cache.h"
+#include "llvm-DenseMap.h"
+#include <atomic>
+
+#if __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#endif
+
+#if SUPPORT_SIMD_CACHE_FILL_PROBE
+#include <immintrin.h>
+#endif
 
 
 /* Initial cache bucket count. INIT_CACHE_SIZE must be a power of two. */
@@ -94,7 +110,7 @@ enum {
 };
 
 static void cache_collect_free(struct bucket_t *data, mask_t capacity);
-static int _collecting_in_critical(void);
+static uint64_t cache_quiescent_epoch(uint64_t epoch);
 static void _garbage_make_room(void);
 
 
@@ -122,6 +138,40 @@ static void recordDeadCache(mask_t capacity)
     }
 }
 
+
+/***********************************************************************
+* Cache statistics for OBJC_PRINT_CACHE_STATISTICS
+* Counted for each class and in total. Protected by cacheUpdateLock.
+* The counters of a class are discarded by cache_delete().
+**********************************************************************/
+struct CacheStatistics {
+    size_t fills;
+    size_t fillProbes;
+    size_t expansions;
+    size_t flushes;
+    size_t garbageBytes;
+};
+
+static objc::DenseMap<Class, CacheStatistics> *cache_statistics;
+static CacheStatistics cache_statistics_total;
+
+static CacheStatistics& statisticsForClass(Class cls)
+{
+    cacheUpdateLock.assertLocked();
+    if (!cache_statistics) {
+        cache_statistics = new objc::DenseMap<Class, CacheStatistics>();
+    }
+    return (*cache_statistics)[cls];
+}
+
+#define CACHE_COUNT(cls, counter, n)                                    \
+    do {                                                                \
+        if (slowpath(PrintCacheStatistics)) {                           \
+            statisticsForClass(cls).counter += (n);                     \
+            cache_statistics_total.counter += (n);                      \
+        }                                                               \
+    } while (0)
+
 /***********************************************************************
 * Pointers used by compiled class objects
 * These use asm to avoid conflicts with the compiler's internal declarations
@@ -159,6 +209,10 @@ asm("\n .section __TEXT,__const"
 static inline mask_t cache_next(mask_t i, mask_t mask) {
     return (i+1) & mask;
 }
+// Number of cache_next() steps from begin to i.
+static inline mask_t cache_distance(mask_t begin, mask_t i, mask_t mask) {
+    return (i - begin) & mask;
+}
 
 #elif __arm64__
 // objc_msgSend has lots of registers available.
@@ -167,6 +221,10 @@ static inline mask_t cache_next(mask_t i, mask_t mask) {
 static inline mask_t cache_next(mask_t i, mask_t mask) {
     return i ? i-1 : mask;
 }
+// Number of cache_next() steps from begin to i.
+static inline mask_t cache_distance(mask_t begin, mask_t i, mask_t mask) {
+    return (begin - i) & mask;
+}
 
 #else
 #error unknown architecture
@@ -233,6 +291,58 @@ static inline mask_t cache_hash(cache_key_t key, mask_t mask)
     return (mask_t)(key & mask);
 }
 
+
+#if SUPPORT_SIMD_CACHE_FILL_PROBE
+
+// Probe CACHE_PROBE_WIDTH consecutive buckets at once.
+// Used by cache_t::find(), which runs only to place a fill after a miss.
+// bucket_t is { key, imp }, so the keys are every other 64-bit lane.
+// Returns a mask with bit n set if bucket n's key is k or empty.
+// Only used on architectures where cache_next() increments.
+static_assert(sizeof(bucket_t) == 2 * sizeof(cache_key_t)  &&  
+              sizeof(cache_key_t) == 8, "unexpected bucket_t layout");
+
+#if __AVX2__
+
+#define CACHE_PROBE_WIDTH 4
+
+static inline unsigned cache_probe(const bucket_t *b, cache_key_t k)
+{
+    __m256i lo = _mm256_loadu_si256((const __m256i *)&b[0]);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)&b[2]);
+    // Lanes: key0, key2, key1, key3
+    __m256i keys = _mm256_unpacklo_epi64(lo, hi);
+    __m256i match = 
+        _mm256_or_si256(_mm256_cmpeq_epi64(keys, _mm256_set1_epi64x(k)), 
+                        _mm256_cmpeq_epi64(keys, _mm256_setzero_si256()));
+    unsigned bits = _mm256_movemask_pd(_mm256_castsi256_pd(match));
+    // Swap bits 1 and 2 back into bucket order.
+    return (bits & 9) | ((bits & 2) << 1) | ((bits & 4) >> 1);
+}
+
+#else
+
+#define CACHE_PROBE_WIDTH 2
+
+static inline unsigned cache_probe(const bucket_t *b, cache_key_t k)
+{
+    __m128i b0 = _mm_loadu_si128((const __m128i *)&b[0]);
+    __m128i b1 = _mm_loadu_si128((const __m128i *)&b[1]);
+    __m128i keys = _mm_unpacklo_epi64(b0, b1);
+    // SSE2 has no 64-bit compare. Compare 32-bit halves 
+    // and require both halves of a key to match.
+    __m128i key = _mm_cmpeq_epi32(keys, _mm_set1_epi64x(k));
+    __m128i zero = _mm_cmpeq_epi32(keys, _mm_setzero_si128());
+    key = _mm_and_si128(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(2,3,0,1)));
+    zero = _mm_and_si128(zero, _mm_shuffle_epi32(zero, _MM_SHUFFLE(2,3,0,1)));
+    __m128i match = _mm_or_si128(key, zero);
+    return _mm_movemask_pd(_mm_castsi128_pd(match));
+}
+
+#endif
+
+#endif
+
 cache_t *getCache(Class cls) 
 {
     assert(cls);
@@ -245,6 +355,11 @@ cache_key_t getKey(SEL sel)
     return (cache_key_t)sel;
 }
 
+static Class getClass(cache_t *cache)
+{
+    return (Class)((uintptr_t)cache - offsetof(objc_class, cache));
+}
+
 #if __arm64__
 
 void bucket_t::set(cache_key_t newKey, IMP newImp)
@@ -461,6 +576,8 @@ void cache_t::reallocate(mask_t oldCapacity, mask_t newCapacity)
     setBucketsAndMask(newBuckets, newCapacity - 1);
     
     if (freeOld) {
+        CACHE_COUNT(getClass(this), garbageBytes, 
+                    bytesForCapacity(oldCapacity));
         cache_collect_free(oldBuckets, oldCapacity);
         cache_collect(false);
     }
@@ -502,15 +619,31 @@ bucket_t * cache_t::find(cache_key_t k, id receiver)
     mask_t m = mask();
     mask_t begin = cache_hash(k, m);
     mask_t i = begin;
+
+#if SUPPORT_SIMD_CACHE_FILL_PROBE
+    // Probe whole blocks up to the end of the buckets, then wrap 
+    // around and finish one bucket at a time. Blocks never read 
+    // past the last bucket, so they never see the end marker.
+    bool wrapped = false;
+    while ((uint32_t)i + CACHE_PROBE_WIDTH - 1 <= m) {
+        unsigned match = cache_probe(&b[i], k);
+        if (match) return &b[i + __builtin_ctz(match)];
+        i += CACHE_PROBE_WIDTH;
+    }
+    if (i > m) {
+        i = 0;
+        wrapped = true;
+    }
+    // Blocks that started at bucket 0 already probed everything.
+    if (!wrapped  ||  i != begin)
+#endif
     do {
         if (b[i].key() == 0  ||  b[i].key() == k) {
             return &b[i];
         }
     } while ((i = cache_next(i, m)) != begin);
 
-    // hack
-    Class cls = (Class)((uintptr_t)this - offsetof(objc_class, cache));
-    cache_t::bad_cache(receiver, (SEL)k, cls);
+    cache_t::bad_cache(receiver, (SEL)k, getClass(this));
 }
 
 
@@ -527,11 +660,12 @@ void cache_t::expand()
         newCapacity = oldCapacity;
     }
 
+    CACHE_COUNT(getClass(this), expansions, 1);
     reallocate(oldCapacity, newCapacity);
 }
 
 
-static void cache_fill_nolock(Class cls, SEL sel, IMP imp, id receiver)
+void cache_fill_nolock(Class cls, SEL sel, IMP imp, id receiver)
 {
     cacheUpdateLock.assertLocked();
 
@@ -566,6 +700,12 @@ static void cache_fill_nolock(Class cls, SEL sel, IMP imp, id receiver)
     bucket_t *bucket = cache->find(key, receiver);
     if (bucket->key() == 0) cache->incrementOccupied();
     bucket->set(key, imp);
+
+    CACHE_COUNT(cls, fills, 1);
+    CACHE_COUNT(cls, fillProbes, 1 + 
+                cache_distance(cache_hash(key, cache->mask()), 
+                               (mask_t)(bucket - cache->buckets()), 
+                               cache->mask()));
 }
 
 void cache_fill(Class cls, SEL sel, IMP imp, id receiver)
@@ -574,7 +714,9 @@ void cache_fill(Class cls, SEL sel, IMP imp, id receiver)
     mutex_locker_t lock(cacheUpdateLock);
     cache_fill_nolock(cls, sel, imp, receiver);
 #else
-    _collecting_in_critical();
+    // Epoch 0 records nothing that would allow garbage to be freed.
+    mutex_locker_t lock(cacheUpdateLock);
+    cache_quiescent_epoch(0);
     return;
 #endif
 }
@@ -594,6 +736,8 @@ void cache_erase_nolock(Class cls)
         auto buckets = emptyBucketsForCapacity(capacity);
         cache->setBucketsAndMask(buckets, capacity - 1); // also clears occupied
 
+        CACHE_COUNT(cls, flushes, 1);
+        CACHE_COUNT(cls, garbageBytes, cache_t::bytesForCapacity(capacity));
         cache_collect_free(oldBuckets, capacity);
         cache_collect(false);
     }
@@ -607,6 +751,7 @@ void cache_delete(Class cls)
         if (PrintCaches) recordDeadCache(cls->cache.capacity());
         free(cls->cache.buckets());
     }
+    if (cache_statistics) cache_statistics->erase(cls);
 }
 
 
@@ -614,7 +759,167 @@ void cache_delete(Class cls)
 * cache collection.
 **********************************************************************/
 
-#if !TARGET_OS_WIN32
+/***********************************************************************
+* Cache garbage reclamation.
+*
+* Discarded buckets are retired to the garbage list, tagged with the 
+* current garbage epoch, and each collection then advances the epoch. 
+* A thread passes a quiescent state when it is known to be outside the 
+* cache readers: any cache lookup it starts afterwards reloads the 
+* class's buckets and cannot reach garbage that was already 
+* disconnected. Garbage retired in epoch E may be freed once every 
+* live thread has passed a quiescent state after E.
+*
+* Quiescent states are observed without stopping any thread:
+*
+* 1. Threads announce them. cache_quiescent_state() is called where a 
+*    thread cannot be inside a cache reader: the messenger's cache miss 
+*    path and autorelease pool pops. The announcement is one store to 
+*    the thread's own cache_reader_t, made only when the epoch changed.
+*
+* 2. The collector asks the kernel which threads are blocked in a 
+*    system call. The cache readers make no system calls, so such a 
+*    thread is outside them. This covers threads that have never 
+*    entered the runtime and threads that sleep for a long time.
+*
+* A thread that does neither, such as one that runs nothing but cache 
+* hits, holds back collection until it does. Its garbage waits; 
+* nothing is freed early.
+*
+* Threads are identified by kernel thread ID. A reused ID carries only 
+* observations made before its previous thread died, which are older 
+* than any garbage the new thread could have seen.
+**********************************************************************/
+#if __linux__
+typedef pid_t cache_thread_t;
+#elif !TARGET_OS_WIN32
+typedef mach_port_t cache_thread_t;
+#else
+typedef DWORD cache_thread_t;
+#endif
+
+// One per thread that has announced a quiescent state. 
+// Never freed; reused after the thread exits.
+struct cache_reader_t {
+    cache_reader_t *next;
+    std::atomic<cache_thread_t> thread;     // 0 while unused
+    std::atomic<uint64_t> quiescentEpoch;   // last epoch announced
+};
+
+static std::atomic<cache_reader_t *> cache_readers;
+
+// Number of collections so far. Garbage is tagged with this.
+static std::atomic<uint64_t> garbage_epoch;
+
+typedef objc::DenseMap<cache_thread_t, uint64_t> QuiescentEpochMap;
+
+// Last epoch in which the collector saw each thread blocked.
+static QuiescentEpochMap *thread_quiescent_epochs;
+static QuiescentEpochMap *thread_quiescent_epochs_scratch;
+
+static cache_thread_t cache_current_thread(void)
+{
+#if __linux__
+    return (pid_t)syscall(SYS_gettid);
+#elif !TARGET_OS_WIN32
+    return pthread_mach_thread_np(pthread_self());
+#else
+    return GetCurrentThreadId();
+#endif
+}
+
+
+/***********************************************************************
+* cache_quiescent_state.
+* Announces that the current thread is not reading any method cache.
+* Call only where no cache reader can be on this thread's stack.
+**********************************************************************/
+void cache_quiescent_state(void)
+{
+    _objc_pthread_data *data = _objc_fetch_pthread_data(YES);
+    cache_reader_t *reader = data->cacheReader;
+
+    if (slowpath(!reader)) {
+        cache_thread_t self = cache_current_thread();
+
+        // Reuse the record of a thread that exited, or add one.
+        for (reader = cache_readers.load(std::memory_order_acquire); 
+             reader; 
+             reader = reader->next) 
+        {
+            cache_thread_t unused = 0;
+            if (reader->thread.compare_exchange_strong(unused, self)) break;
+        }
+        if (!reader) {
+            reader = (cache_reader_t *)calloc(1, sizeof(cache_reader_t));
+            reader->thread.store(self, std::memory_order_relaxed);
+            cache_reader_t *head = cache_readers.load(std::memory_order_relaxed);
+            do {
+                reader->next = head;
+            } while (!cache_readers.compare_exchange_weak(head, reader, 
+                                                          std::memory_order_release, 
+                                                          std::memory_order_relaxed));
+        }
+        data->cacheReader = reader;
+    }
+
+    // Pairs with the fetch_add in cache_collect(): an epoch loaded here 
+    // was advanced after the garbage it frees was disconnected.
+    uint64_t epoch = garbage_epoch.load(std::memory_order_seq_cst);
+    if (reader->quiescentEpoch.load(std::memory_order_relaxed) != epoch) {
+        // Release: this thread's earlier cache reads are complete.
+        reader->quiescentEpoch.store(epoch, std::memory_order_release);
+    }
+}
+
+
+/***********************************************************************
+* _destroyCacheReader.
+* Called from _objc_pthread_destroyspecific(). 
+* The thread reads no caches after this.
+**********************************************************************/
+void _destroyCacheReader(struct cache_reader_t *reader)
+{
+    if (!reader) return;
+    reader->quiescentEpoch.store(0, std::memory_order_relaxed);
+    reader->thread.store(0, std::memory_order_release);
+}
+
+
+#if __linux__
+
+// Calls fn with the ID of every thread in this process.
+template <typename Fn>
+static void cache_enumerate_threads(const Fn& fn)
+{
+    DIR *dir = opendir("/proc/self/task");
+    if (!dir) _objc_fatal("can't enumerate threads (errno %d)", errno);
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] < '0'  ||  entry->d_name[0] > '9') continue;
+        fn((cache_thread_t)atoi(entry->d_name));
+    }
+    closedir(dir);
+}
+
+// Returns true if thread is blocked in a system call right now.
+static bool cache_thread_is_blocked(cache_thread_t thread)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/syscall", (int)thread);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    char buf[32];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return false;
+
+    // The number of the system call the thread is in, "running", or 
+    // "-1 ..." if it is blocked outside a system call (a page fault, 
+    // which a cache reader can take).
+    return buf[0] >= '0'  &&  buf[0] <= '9';
+}
+
+#elif !TARGET_OS_WIN32
 
 // A sentinel (magic value) to report bad thread_get_state status.
 // Must not be a valid PC.
@@ -656,32 +961,29 @@ static uintptr_t _get_pc_for_thread(thread_t thread)
 }
 #endif
 
-#endif
-
-/***********************************************************************
-* _collecting_in_critical.
-* Returns TRUE if some thread is currently executing a cache-reading 
-* function. Collection of cache garbage is not allowed when a cache-
-* reading function is in progress because it might still be using 
-* the garbage memory.
-**********************************************************************/
 OBJC_EXPORT uintptr_t objc_entryPoints[];
 OBJC_EXPORT uintptr_t objc_exitPoints[];
 
-static int _collecting_in_critical(void)
+static bool _pc_in_cache_reader(uintptr_t pc)
+{
+    for (int region = 0; objc_entryPoints[region] != 0; region++) {
+        if (pc >= objc_entryPoints[region]  &&  
+            pc <= objc_exitPoints[region]) 
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Calls fn with the port of every thread in this task.
+template <typename Fn>
+static void cache_enumerate_threads(const Fn& fn)
 {
-#if TARGET_OS_WIN32
-    return TRUE;
-#else
     thread_act_port_array_t threads;
     unsigned number;
-    unsigned count;
     kern_return_t ret;
-    int result;
 
-    mach_port_t mythread = pthread_mach_thread_np(pthread_self());
-
-    // Get a list of all the threads in the current task
 #if !DEBUG_TASK_THREADS
     ret = task_threads(mach_task_self(), &threads, &number);
 #else
@@ -693,50 +995,101 @@ static int _collecting_in_critical(void)
         _objc_fatal("task_threads failed (result 0x%x)\n", ret);
     }
 
-    // Check whether any thread is in the cache lookup code
-    result = FALSE;
-    for (count = 0; count < number; count++)
-    {
-        int region;
-        uintptr_t pc;
+    for (unsigned count = 0; count < number; count++) {
+        fn(threads[count]);
+        mach_port_deallocate(mach_task_self(), threads[count]);
+    }
+    vm_deallocate(mach_task_self(), (vm_address_t)threads, 
+                  sizeof(threads[0]) * number);
+}
 
-        // Don't bother checking ourselves
-        if (threads[count] == mythread)
-            continue;
+// Returns true if thread is blocked outside the cache readers right now.
+// Running threads are not touched. A waiting thread may be in a page 
+// fault inside a reader, so its saved PC is checked; it is already 
+// stopped and thread_get_state only copies that state out.
+static bool cache_thread_is_blocked(cache_thread_t thread)
+{
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    kern_return_t ret = thread_info(thread, THREAD_BASIC_INFO, 
+                                    (thread_info_t)&info, &count);
+    if (ret != KERN_SUCCESS  ||  info.run_state != TH_STATE_WAITING) {
+        return false;
+    }
+    uintptr_t pc = _get_pc_for_thread(thread);
+    return pc != PC_SENTINEL  &&  !_pc_in_cache_reader(pc);
+}
 
-        // Find out where thread is executing
-        pc = _get_pc_for_thread (threads[count]);
+#endif
 
-        // Check for bad status, and if so, assume the worse (can't collect)
-        if (pc == PC_SENTINEL)
-        {
-            result = TRUE;
-            goto done;
+
+/***********************************************************************
+* cache_quiescent_epoch.
+* Returns the oldest epoch in which any live thread is known to have 
+* passed a quiescent state, counting threads seen blocked now as 
+* quiescent in epoch. Garbage retired in an earlier epoch is no 
+* longer reachable by any thread.
+* Cache locks: cacheUpdateLock must be held by the caller.
+**********************************************************************/
+static uint64_t cache_quiescent_epoch(uint64_t epoch)
+{
+    cacheUpdateLock.assertLocked();
+
+#if TARGET_OS_WIN32
+    return 0;
+#else
+    if (!thread_quiescent_epochs) {
+        thread_quiescent_epochs = new QuiescentEpochMap;
+        thread_quiescent_epochs_scratch = new QuiescentEpochMap;
+    }
+    QuiescentEpochMap& previous = *thread_quiescent_epochs;
+    QuiescentEpochMap& current = *thread_quiescent_epochs_scratch;
+
+    // Announcements. Acquire pairs with the release in 
+    // cache_quiescent_state(): that thread's reads are complete.
+    QuiescentEpochMap announced;
+    for (cache_reader_t *reader = cache_readers.load(std::memory_order_acquire);
+         reader; 
+         reader = reader->next)
+    {
+        cache_thread_t thread = reader->thread.load(std::memory_order_acquire);
+        if (thread) {
+            announced[thread] = 
+                reader->quiescentEpoch.load(std::memory_order_acquire);
         }
-        
-        // Check whether it is in the cache lookup code
-        for (region = 0; objc_entryPoints[region] != 0; region++)
-        {
-            if ((pc >= objc_entryPoints[region]) &&
-                (pc <= objc_exitPoints[region])) 
-            {
-                result = TRUE;
-                goto done;
+    }
+
+    // Threads that no longer exist are dropped from the map.
+    cache_thread_t self = cache_current_thread();
+    uint64_t oldest = epoch;
+    cache_enumerate_threads([&](cache_thread_t thread) {
+        uint64_t quiescent = 0;
+        if (thread == self) {
+            // We hold cacheUpdateLock, so we are not reading a cache.
+            quiescent = epoch;
+        } else {
+            auto it = announced.find(thread);
+            if (it != announced.end()) quiescent = it->second;
+            if (quiescent < epoch) {
+                if (cache_thread_is_blocked(thread)) {
+                    quiescent = epoch;
+                } else {
+                    auto prev = previous.find(thread);
+                    if (prev != previous.end()  &&  prev->second > quiescent) {
+                        quiescent = prev->second;
+                    }
+                }
             }
         }
-    }
 
- done:
-    // Deallocate the port rights for the threads
-    for (count = 0; count < number; count++) {
-        mach_port_deallocate(mach_task_self (), threads[count]);
-    }
+        current[thread] = quiescent;
+        if (quiescent < oldest) oldest = quiescent;
+    });
 
-    // Deallocate the thread list
-    vm_deallocate (mach_task_self (), (vm_address_t) threads, sizeof(threads[0]) * number);
+    previous.swap(current);
+    current.clear();
 
-    // Return our finding
-    return result;
+    return oldest;
 #endif
 }
 
@@ -746,14 +1099,21 @@ static int _collecting_in_critical(void)
 * one more ref in the garbage.
 **********************************************************************/
 
+struct cache_garbage_t {
+    bucket_t *buckets;
+    size_t bytes;
+    uint64_t epoch;         // garbage_epoch when retired
+    uint64_t retireTime;    // nanoseconds() when retired
+};
+
 // amount of memory represented by all refs in the garbage
 static size_t garbage_byte_size = 0;
 
 // do not empty the garbage until garbage_byte_size gets at least this big
 static size_t garbage_threshold = 32*1024;
 
-// table of refs to free
-static bucket_t **garbage_refs = 0;
+// table of refs to free, oldest first
+static cache_garbage_t *garbage_refs = 0;
 
 // current number of refs in garbage_refs
 static size_t garbage_count = 0;
@@ -766,6 +1126,13 @@ enum {
     INIT_GARBAGE_COUNT = 128
 };
 
+// reclamation counters, reported by _class_getCacheStatistics(Nil)
+static size_t garbage_max_byte_size = 0;
+static size_t garbage_reclaimed_bytes = 0;
+static size_t garbage_reclaimed_count = 0;
+static uint64_t garbage_reclaim_latency = 0;
+static uint64_t garbage_max_reclaim_latency = 0;
+
 static void _garbage_make_room(void)
 {
     static int first = 1;
@@ -774,16 +1141,16 @@ static void _garbage_make_room(void)
     if (first)
     {
         first = 0;
-        garbage_refs = (bucket_t**)
-            malloc(INIT_GARBAGE_COUNT * sizeof(void *));
+        garbage_refs = (cache_garbage_t *)
+            malloc(INIT_GARBAGE_COUNT * sizeof(cache_garbage_t));
         garbage_max = INIT_GARBAGE_COUNT;
     }
 
     // Double the table if it is full
     else if (garbage_count == garbage_max)
     {
-        garbage_refs = (bucket_t**)
-            realloc(garbage_refs, garbage_max * 2 * sizeof(void *));
+        garbage_refs = (cache_garbage_t *)
+            realloc(garbage_refs, garbage_max * 2 * sizeof(cache_garbage_t));
         garbage_max *= 2;
     }
 }
@@ -803,8 +1170,57 @@ static void cache_collect_free(bucket_t *data, mask_t capacity)
     if (PrintCaches) recordDeadCache(capacity);
 
     _garbage_make_room ();
-    garbage_byte_size += cache_t::bytesForCapacity(capacity);
-    garbage_refs[garbage_count++] = data;
+    size_t bytes = cache_t::bytesForCapacity(capacity);
+    garbage_byte_size += bytes;
+    garbage_refs[garbage_count++] = 
+        cache_garbage_t{data, bytes, 
+                        garbage_epoch.load(std::memory_order_relaxed), 
+                        nanoseconds()};
+
+    if (garbage_byte_size > garbage_max_byte_size) {
+        garbage_max_byte_size = garbage_byte_size;
+    }
+}
+
+
+/***********************************************************************
+* cache_free_garbage.  Free garbage retired before epoch oldest.
+* Returns the number of bytes freed.
+* Cache locks: cacheUpdateLock must be held by the caller.
+**********************************************************************/
+static size_t cache_free_garbage(uint64_t oldest)
+{
+    cacheUpdateLock.assertLocked();
+
+    if (garbage_count == 0) return 0;
+
+    // Garbage is in epoch order. Free the prefix older than oldest.
+    uint64_t now = nanoseconds();
+    size_t freed = 0;
+    size_t bytes = 0;
+    while (freed < garbage_count  &&  garbage_refs[freed].epoch < oldest) {
+        cache_garbage_t& dead = garbage_refs[freed];
+        uint64_t latency = now - dead.retireTime;
+        garbage_reclaim_latency += latency;
+        if (latency > garbage_max_reclaim_latency) {
+            garbage_max_reclaim_latency = latency;
+        }
+        bytes += dead.bytes;
+        free(dead.buckets);
+        freed++;
+    }
+
+    // Move the rest down.
+    // Erase the vacated entries so debugging tools don't see stale pointers.
+    memmove(garbage_refs, garbage_refs + freed, 
+            (garbage_count - freed) * sizeof(cache_garbage_t));
+    garbage_count -= freed;
+    bzero(garbage_refs + garbage_count, freed * sizeof(cache_garbage_t));
+
+    garbage_byte_size -= bytes;
+    garbage_reclaimed_bytes += bytes;
+    garbage_reclaimed_count += freed;
+    return bytes;
 }
 
 
@@ -822,43 +1238,31 @@ void cache_collect(bool collectALot)
         return;
     }
 
-    // Synchronize collection with objc_msgSend and other cache readers
-    if (!collectALot) {
-        if (_collecting_in_critical ()) {
-            // objc_msgSend (or other cache reader) is currently looking in
-            // the cache and might still be using some garbage.
-            if (PrintCaches) {
-                _objc_inform ("CACHES: not collecting; "
-                              "objc_msgSend in progress");
-            }
-            return;
-        }
-    } 
-    else {
-        // No excuses.
-        while (_collecting_in_critical()) 
-            ;
+    // Synchronize collection with objc_msgSend and other cache readers.
+    // Without collectALot, free whatever the threads' quiescent states 
+    // allow now and leave the rest for a later call.
+    // With collectALot, check again until everything is freed, but 
+    // give up eventually: a thread that only ever hits in its caches 
+    // passes no quiescent state we can see.
+    size_t freed = 0;
+    int tries = 0;
+    while (true) {
+        // seq_cst pairs with the load in cache_quiescent_state().
+        uint64_t epoch = 
+            garbage_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+        freed += cache_free_garbage(cache_quiescent_epoch(epoch));
+        if (!collectALot  ||  garbage_count == 0  ||  ++tries == 100) break;
+        sched_yield();
     }
 
-    // No cache readers in progress - garbage is now deletable
-
     // Log our progress
     if (PrintCaches) {
         cache_collections++;
-        _objc_inform ("CACHES: COLLECTING %zu bytes (%zu allocations, %zu collections)", garbage_byte_size, cache_allocations, cache_collections);
+        _objc_inform ("CACHES: COLLECTING %zu bytes, %zu bytes still in use "
+                      "(%zu allocations, %zu collections)", 
+                      freed, garbage_byte_size, 
+                      cache_allocations, cache_collections);
     }
-    
-    // Dispose all refs now in the garbage
-    // Erase each entry so debugging tools don't see stale pointers.
-    while (garbage_count--) {
-        auto dead = garbage_refs[garbage_count];
-        garbage_refs[garbage_count] = nil;
-        free(dead);
-    }
-    
-    // Clear the garbage count and total size indicator
-    garbage_count = 0;
-    garbage_byte_size = 0;
 
     if (PrintCaches) {
         size_t i;
@@ -885,6 +1289,146 @@ void cache_collect(bool collectALot)
 }
 
 
+/***********************************************************************
+* Cache statistics queries. See objc-internal.h.
+**********************************************************************/
+
+static void addCountedStatistics(objc_cache_statistics *out, 
+                                 const CacheStatistics& stats)
+{
+    out->fills += stats.fills;
+    out->fillProbes += stats.fillProbes;
+    out->expansions += stats.expansions;
+    out->flushes += stats.flushes;
+    out->garbageBytes += stats.garbageBytes;
+}
+
+// Add the size of cls's cache and the probe length 
+// of every entry currently in it.
+static void addCurrentStatistics(objc_cache_statistics *out, Class cls)
+{
+    cacheUpdateLock.assertLocked();
+
+    cache_t *cache = getCache(cls);
+    bucket_t *b = cache->buckets();
+    mask_t m = cache->mask();
+    mask_t capacity = cache->capacity();
+
+    out->capacity += capacity;
+    out->occupied += cache->occupied();
+    for (mask_t i = 0; i < capacity; i++) {
+        cache_key_t k = b[i].key();
+        if (k) out->hitProbes += 1 + cache_distance(cache_hash(k, m), i, m);
+    }
+}
+
+static void addGarbageStatistics(objc_cache_statistics *out)
+{
+    cacheUpdateLock.assertLocked();
+
+    out->retainedGarbageBytes = garbage_byte_size;
+    out->maxRetainedGarbageBytes = garbage_max_byte_size;
+    out->reclaimedGarbageBytes = garbage_reclaimed_bytes;
+    out->reclaimedGarbageCount = garbage_reclaimed_count;
+    out->garbageScans = garbage_epoch.load(std::memory_order_relaxed);
+    out->reclaimLatency = garbage_reclaim_latency;
+    out->maxReclaimLatency = garbage_max_reclaim_latency;
+}
+
+BOOL _class_getCacheStatistics(Class cls, objc_cache_statistics *outStats)
+{
+    mutex_locker_t lock(cacheUpdateLock);
+
+    bzero(outStats, sizeof(*outStats));
+    if (!PrintCacheStatistics  ||  !cache_statistics) return NO;
+
+    if (cls) {
+        auto it = cache_statistics->find(cls);
+        if (it == cache_statistics->end()) return NO;
+        addCountedStatistics(outStats, it->second);
+        addCurrentStatistics(outStats, cls);
+    } else {
+        addCountedStatistics(outStats, cache_statistics_total);
+        for (auto& pair : *cache_statistics) {
+            addCurrentStatistics(outStats, pair.first);
+        }
+        addGarbageStatistics(outStats);
+    }
+    return YES;
+}
+
+static void printCacheStatistics(const char *name, bool isMeta, 
+                                 const objc_cache_statistics& stats)
+{
+    _objc_inform("CACHES: %s%s: %zu fills (%.2f probes), %zu expansions, "
+                 "%zu flushes, %zu bytes garbage, %u/%u occupied "
+                 "(%.2f probes per hit)", 
+                 name, isMeta ? " (meta)" : "", 
+                 stats.fills, 
+                 stats.fills ? (double)stats.fillProbes / stats.fills : 0.0, 
+                 stats.expansions, stats.flushes, stats.garbageBytes, 
+                 stats.occupied, stats.capacity, 
+                 stats.occupied ? (double)stats.hitProbes/stats.occupied : 0.0);
+}
+
+void _objc_printCacheStatistics(void)
+{
+    struct ClassStatistics {
+        Class cls;
+        objc_cache_statistics stats;
+    };
+    ClassStatistics *list = nil;
+    size_t count = 0;
+    objc_cache_statistics total;
+
+    // Copy everything under the lock and print it without the lock.
+    {
+        mutex_locker_t lock(cacheUpdateLock);
+        if (!cache_statistics) return;
+
+        list = (ClassStatistics *)
+            calloc(cache_statistics->size(), sizeof(ClassStatistics));
+        for (auto& pair : *cache_statistics) {
+            list[count].cls = pair.first;
+            addCountedStatistics(&list[count].stats, pair.second);
+            addCurrentStatistics(&list[count].stats, pair.first);
+            count++;
+        }
+        bzero(&total, sizeof(total));
+        addCountedStatistics(&total, cache_statistics_total);
+        addGarbageStatistics(&total);
+    }
+
+    // Busiest caches first.
+    std::sort(list, list + count, 
+              [](const ClassStatistics& a, const ClassStatistics& b) {
+                  return a.stats.fills > b.stats.fills;
+              });
+
+    for (size_t i = 0; i < count; i++) {
+        Class cls = list[i].cls;
+        printCacheStatistics(cls->nameForLogging(), cls->isMetaClass(), 
+                             list[i].stats);
+        total.capacity += list[i].stats.capacity;
+        total.occupied += list[i].stats.occupied;
+        total.hitProbes += list[i].stats.hitProbes;
+    }
+    printCacheStatistics("total", false, total);
+    _objc_inform("CACHES: garbage: %zu bytes retained (%zu max), "
+                 "%zu bytes in %zu blocks freed after %llu collections, "
+                 "%.3f ms average and %.3f ms max until freed", 
+                 total.retainedGarbageBytes, total.maxRetainedGarbageBytes, 
+                 total.reclaimedGarbageBytes, total.reclaimedGarbageCount, 
+                 (unsigned long long)total.garbageScans, 
+                 total.reclaimedGarbageCount 
+                 ? total.reclaimLatency / 1e6 / total.reclaimedGarbageCount 
+                 : 0.0, 
+                 total.maxReclaimLatency / 1e6);
+
+    free(list);
+}
+
+
 /***********************************************************************
 * objc_task_threads
 * Replacement for task_threads(). Define DEBUG_TASK_THREADS to debug 
@@ -966,7 +966,7 @@ _objc_constructOrFree(id bytes, Class cls)
     assert(cls->hasCxxCtor());  // for performance, not correctness
 
     id obj = object_cxxConstructFromClass(bytes, cls);
-    if (!obj) free(bytes);
+    if (!obj) free_instance(bytes);
 
     return obj;
 }
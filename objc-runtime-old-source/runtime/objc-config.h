@@ -159,6 +159,69 @@
 #   define SUPPORT_QOS_HACK 1
 #endif
 
+// Define SUPPORT_CONCURRENT_REFCOUNT=1 to keep side table retain counts 
+// in a lock-free open-addressed table instead of the per-SideTable 
+// RefcountMap. Weak references still use the SideTable locks.
+// It is off by default; define it as 1 in the build command to use it.
+// The old ABI always keeps RefcountMap.
+#ifndef SUPPORT_CONCURRENT_REFCOUNT
+#   define SUPPORT_CONCURRENT_REFCOUNT 0
+#elif SUPPORT_CONCURRENT_REFCOUNT  &&  !__OBJC2__
+#   undef SUPPORT_CONCURRENT_REFCOUNT
+#   define SUPPORT_CONCURRENT_REFCOUNT 0
+#endif
+
+// Define SUPPORT_PINNED_REFCOUNT=1 to let OBJC_PIN_OVERFLOWED_RETAIN_COUNTS 
+// keep the retain counts of nonpointer isa objects that overflow the isa 
+// in a lock-free table instead of trading them with the SideTable.
+#if !SUPPORT_NONPOINTER_ISA
+#   define SUPPORT_PINNED_REFCOUNT 0
+#else
+#   define SUPPORT_PINNED_REFCOUNT 1
+#endif
+
+// Define SUPPORT_INSTANCE_SLABS=1 to let classes opt in to slab 
+// allocation of their instances with _class_setUsesInstanceSlabs(). 
+// The slabs live in one reserved 1 GB region, so 64-bit only.
+#ifndef SUPPORT_INSTANCE_SLABS
+#   if __OBJC2__  &&  __LP64__
+#       define SUPPORT_INSTANCE_SLABS 1
+#   else
+#       define SUPPORT_INSTANCE_SLABS 0
+#   endif
+#endif
+
+// Define SUPPORT_SIMD_CACHE_FILL_PROBE=1 to search for a method cache 
+// fill's slot several buckets at a time with SSE2 or AVX2 compares in 
+// cache_t::find(). That is the fill path after a miss only. Cache hits 
+// are looked up by objc_msgSend and cache_getImp in assembly, which 
+// still probe one bucket at a time, so the bucket layout is unchanged.
+// Define this as 0 in the build command to use the scalar probe.
+#ifndef SUPPORT_SIMD_CACHE_FILL_PROBE
+#   if __OBJC2__  &&  __x86_64__  &&  __SSE2__
+#       define SUPPORT_SIMD_CACHE_FILL_PROBE 1
+#   else
+#       define SUPPORT_SIMD_CACHE_FILL_PROBE 0
+#   endif
+#endif
+
+// Define SUPPORT_PREOPT_SIDECAR=1 to read precomputed selector and class
+// tables for images outside the dyld shared cache from a file written
+// by objcopt and named by OBJC_PREOPT_SIDECAR.
+#if !__OBJC2__  ||  !__LP64__  ||  TARGET_OS_WIN32
+#   define SUPPORT_PREOPT_SIDECAR 0
+#else
+#   define SUPPORT_PREOPT_SIDECAR 1
+#endif
+
+// Define SUPPORT_LOCKFREE_ACCESSORS=1 to read atomic object properties 
+// and atomic structs without taking PropertyLocks or StructLocks. 
+// Setters and struct writers still lock.
+// Define this as 0 in the build command to compare with the locked readers.
+#ifndef SUPPORT_LOCKFREE_ACCESSORS
+#   define SUPPORT_LOCKFREE_ACCESSORS 1
+#endif
+
 // OBJC_INSTRUMENTED controls whether message dispatching is dynamically
 // monitored.  Monitoring introduces substantial overhead.
 // NOTE: To define this condition, do so in the build command, NOT by
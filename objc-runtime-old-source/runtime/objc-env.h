@@ -25,6 +25,13 @@ OPTION( PrintPoolHiwat,           OBJC_PRINT_POOL_HIGHWATER,       "log high-wat
 OPTION( PrintCustomRR,            OBJC_PRINT_CUSTOM_RR,            "log classes with un-optimized custom retain/release methods")
 OPTION( PrintCustomAWZ,           OBJC_PRINT_CUSTOM_AWZ,           "log classes with un-optimized custom allocWithZone methods")
 OPTION( PrintRawIsa,              OBJC_PRINT_RAW_ISA,              "log classes that require raw pointer isa fields")
+OPTION( PrintStripeStatistics,    OBJC_PRINT_STRIPE_STATISTICS,    "count lock contention on each stripe of the striped lock tables and print it at exit")
+OPTION( PrintCacheStatistics,     OBJC_PRINT_CACHE_STATISTICS,     "count method cache fills, probe lengths, expansions and garbage for each class and print them at exit")
+OPTION( PrintSlabStatistics,      OBJC_PRINT_SLAB_STATISTICS,      "print instance slab allocation rates and fragmentation at exit")
+OPTION( PrintCategoryStatistics,  OBJC_PRINT_CATEGORY_STATISTICS,  "print time spent methodizing classes and category method lists attached or deferred at exit")
+OPTION( PrintRetainCountStatistics, OBJC_PRINT_RETAIN_COUNT_STATISTICS, "count nonpointer isa retain count overflows, side table borrows, and pinned objects and print them at exit")
+OPTION( ProfileLocks,             OBJC_PROFILE_LOCKS,              "sample wait and hold times of runtime locks and print histograms for each lock at exit")
+OPTION( PrintSyncStatistics,      OBJC_PRINT_SYNC_STATISTICS,      "count @synchronized thin lock inflations and lock cache hits and print them at exit")
 
 OPTION( DebugUnload,              OBJC_DEBUG_UNLOAD,               "warn about poorly-behaving bundles when unloaded")
 OPTION( DebugFragileSuperclasses, OBJC_DEBUG_FRAGILE_SUPERCLASSES, "warn about subclasses that may have been broken by subsequent changes to superclasses")
@@ -40,4 +47,14 @@ OPTION( DisableVtables,           OBJC_DISABLE_VTABLES,            "disable vtab
 OPTION( DisablePreopt,            OBJC_DISABLE_PREOPTIMIZATION,    "disable preoptimization courtesy of dyld shared cache")
 OPTION( DisableTaggedPointers,    OBJC_DISABLE_TAGGED_POINTERS,    "disable tagged pointer optimization of NSNumber et al.") 
 OPTION( DisableNonpointerIsa,     OBJC_DISABLE_NONPOINTER_ISA,     "disable non-pointer isa fields")
+OPTION( DisableThinSyncLocks,     OBJC_DISABLE_THIN_SYNC_LOCKS,    "disable the single-word fast path for uncontended @synchronized")
+OPTION( DisableMethodIndex,       OBJC_DISABLE_METHOD_INDEX,       "disable hashed method tables for large classes and caching of failed method lookups")
+OPTION( DisableInstanceSlabs,     OBJC_DISABLE_INSTANCE_SLABS,     "ignore _class_setUsesInstanceSlabs() and allocate every instance with calloc")
+OPTION( DisableLockFreeLookup,    OBJC_DISABLE_LOCK_FREE_LOOKUP,   "disable method lookup without runtimeLock for initialized classes")
+OPTION( DeferCategoryMethods,     OBJC_DEFER_CATEGORY_METHODS,     "attach category methods to a class when its methods are first searched instead of when it is realized")
+OPTION( ParallelImageReading,     OBJC_PARALLEL_IMAGE_READING,     "fix up class, selector, and protocol references of loaded images on multiple threads")
+OPTION( ParallelLoad,             OBJC_PARALLEL_LOAD,              "call class +load methods on multiple threads; superclasses and earlier images still load first")
+OPTION( PoolPageArenas,           OBJC_POOL_PAGE_ARENAS,           "allocate autorelease pool pages from 2 MB arenas, superpage-backed where available")
+OPTION( PinOverflowedRetainCounts, OBJC_PIN_OVERFLOWED_RETAIN_COUNTS, "keep retain counts that overflow a nonpointer isa in a lock-free counter instead of trading them with the side table")
+OPTION( DeferSidetableRelease,    OBJC_DEFER_SIDETABLE_RELEASE,    "coalesce -retain/-release of raw isa objects in per-thread buffers; requires SUPPORT_CONCURRENT_REFCOUNT")
 OPTION( DisableInitializeForkSafety, OBJC_DISABLE_INITIALIZE_FORK_SAFETY, "disable safety checks for +initialize after fork")
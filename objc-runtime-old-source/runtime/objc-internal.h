@@ -97,6 +97,87 @@ OBJC_EXPORT void
 instrumentObjcMessageSends(BOOL flag)
     OBJC_AVAILABLE(10.0, 2.0, 9.0, 1.0, 2.0);
 
+#if __OBJC2__
+// Method cache statistics for one class, or for all classes if cls is Nil.
+// Counted only when OBJC_PRINT_CACHE_STATISTICS is set. Cache hits are 
+// not counted because they never leave objc_msgSend; every fill is a miss.
+struct objc_cache_statistics {
+    size_t fills;           // misses that added a method to the cache
+    size_t fillProbes;      // buckets examined to find a slot for those fills
+    size_t expansions;      // times the cache grew
+    size_t flushes;         // times the cache was emptied
+    size_t garbageBytes;    // discarded bucket memory handed to the collector
+    uint32_t capacity;      // current bucket count
+    uint32_t occupied;      // current entries
+    size_t hitProbes;       // buckets examined to find each current entry
+
+    // Discarded cache memory. Totals only (cls == Nil).
+    size_t retainedGarbageBytes;    // not yet safe to free
+    size_t maxRetainedGarbageBytes; // high-water mark of the above
+    size_t reclaimedGarbageBytes;   // freed so far
+    size_t reclaimedGarbageCount;   // blocks freed so far
+    uint64_t garbageScans;          // quiescent state checks by the collector
+    uint64_t reclaimLatency;        // nanoseconds from discard to free, summed
+    uint64_t maxReclaimLatency;     // nanoseconds, longest single block
+};
+
+// Returns NO if cls has no statistics or counting is disabled.
+OBJC_EXPORT BOOL
+_class_getCacheStatistics(Class _Nullable cls, 
+                          struct objc_cache_statistics * _Nonnull outStats);
+
+// Print statistics for every class with a cache, then the totals.
+OBJC_EXPORT void
+_objc_printCacheStatistics(void);
+#endif
+
+// Allocate instances of cls from size-segregated slabs with per-thread 
+// magazines instead of calloc(). Instances are still zeroed. They must 
+// be freed by the runtime (-dealloc, or object_dispose()), never with 
+// free(). Instances bigger than 256 bytes still come from calloc().
+OBJC_EXPORT void
+_class_setUsesInstanceSlabs(Class _Nonnull cls);
+
+// Instance slab statistics for one size class. Size classes are 
+// numbered from 0; returns NO past the last one, or if slabs are not 
+// supported. Counts from other threads may lag by a few thousand.
+struct objc_instance_slab_statistics {
+    size_t blockSize;       // bytes per block in this size class
+    uint64_t allocations;   // blocks handed out
+    uint64_t frees;         // blocks returned
+    size_t slabBytes;       // memory carved into blocks of this size
+    size_t liveBytes;       // blocks allocated and not yet freed
+    size_t depotBlocks;     // free blocks shared between threads
+    uint64_t elapsed;       // nanoseconds since the first slab was carved
+};
+
+OBJC_EXPORT BOOL
+_objc_getInstanceSlabStatistics(unsigned sizeClass, 
+                                struct objc_instance_slab_statistics * _Nonnull outStats);
+
+// Retain count transfers of objects with nonpointer isa since launch. 
+// Returns NO if nonpointer isa is not supported.
+struct objc_retain_count_statistics {
+    uint64_t overflows;     // inline retain counts that overflowed
+    uint64_t borrows;       // inline retain counts refilled from the side table
+    uint64_t pins;          // objects pinned by OBJC_PIN_OVERFLOWED_RETAIN_COUNTS
+};
+
+OBJC_EXPORT BOOL
+_objc_getRetainCountStatistics(struct objc_retain_count_statistics * _Nonnull outStats);
+
+// Tables read from the OBJC_PREOPT_SIDECAR file.
+// Returns NO if no sidecar file is in use.
+struct objc_preopt_sidecar_statistics {
+    uint32_t images;        // images in the sidecar
+    uint32_t loadedImages;  // loaded images whose UUIDs match the sidecar
+    uint32_t selectors;     // selector names in the sidecar
+    uint32_t classes;       // class names in the sidecar
+};
+
+OBJC_EXPORT BOOL
+_objc_getPreoptSidecarStatistics(struct objc_preopt_sidecar_statistics * _Nonnull outStats);
+
 // Initializer called by libSystem
 OBJC_EXPORT void
 _objc_init(void)
@@ -645,6 +726,20 @@ OBJC_EXPORT void
 _objc_autoreleasePoolPrint(void)
     OBJC_AVAILABLE(10.7, 5.0, 9.0, 1.0, 2.0);
 
+// Autorelease pool page counts for the calling thread. 
+// _objc_autoreleasePoolPrint() prints the same counts.
+struct objc_autorelease_pool_statistics {
+    uint64_t pagesAllocated;    // pages taken from malloc or an arena
+    uint64_t pagesRecycled;     // pages reused from a free list
+    uint32_t pagesInUse;        // pages holding this thread's pools
+    uint32_t pagesInUseHiwat;   // high-water mark of the above
+    uint32_t pagesCached;       // pages on this thread's free list
+    uint32_t pagesShared;       // pages on the process-wide free list
+};
+
+OBJC_EXPORT void
+_objc_autoreleasePoolGetStatistics(struct objc_autorelease_pool_statistics * _Nonnull outStats);
+
 OBJC_EXPORT BOOL
 objc_should_deallocate(id _Nonnull object)
     OBJC_AVAILABLE(10.7, 5.0, 9.0, 1.0, 2.0);
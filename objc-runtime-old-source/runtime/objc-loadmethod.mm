@@ -28,6 +28,8 @@
 
 #include "objc-loadmethod.h"
 #include "objc-private.h"
+#include "llvm-DenseMap.h"
+#include <atomic>
 
 typedef void(*load_method_t)(id, SEL);
 
@@ -179,6 +181,260 @@ void remove_category_from_loadable_list(Category cat)
 }
 
 
+/***********************************************************************
+* call_class_load
+* Call one class +load method.
+**********************************************************************/
+static void call_class_load(struct loadable_class *loadable)
+{
+    Class cls = loadable->cls;
+    load_method_t load_method = (load_method_t)loadable->method;
+    if (!cls) return;
+
+    if (PrintLoading) {
+        _objc_inform("LOAD: +[%s load]\n", cls->nameForLogging());
+    }
+    /// 调用 我们类编写的 +(void)load;
+    (*load_method)(cls, SEL_load);
+}
+
+
+/***********************************************************************
+* Load workers
+* With OBJC_PARALLEL_LOAD, call_class_loads() calls the +load methods 
+* of the detached list on a pool of worker threads. The list is 
+* superclass-first, so a class only waits for the nearest superclass 
+* that is also in the list. Its +load is handed out as soon as that 
+* superclass's +load returns, and unrelated classes run side by side. 
+*
+* Classes from different images are never mixed. The list is cut into 
+* runs of classes from one image, and each run finishes before the next 
+* one starts, as it would on one thread. Category +loads are still 
+* called afterwards by call_category_loads() on the calling thread.
+*
+* The calling thread holds loadMethodLock and works too, so a +load 
+* that it calls may load more images as usual. A +load called on a 
+* worker must not load images or wait for the calling thread, because 
+* the calling thread waits for it with loadMethodLock held. That is 
+* why parallel +load is opt-in.
+*
+* Locking: loadMethodLock must be held by the caller.
+**********************************************************************/
+#define LOAD_WORKERS_MAX 8
+#define LOAD_WORKERS_MIN_CLASSES 8
+
+namespace {
+
+class LoadWorkers {
+    struct loadable_class *classes;
+    int count;
+
+    // Schedule of the current run, indexed like classes. Each class 
+    // links the classes that wait for its +load through firstChild 
+    // and nextSibling. Classes that are ready to be called are on 
+    // a stack linked through next; each is pushed once and popped 
+    // once, so the stack has no ABA problem.
+    int *firstChild;
+    int *nextSibling;
+    int *next;
+    std::atomic<int> top;
+    semaphore_t ready;
+    int runCount;
+    std::atomic<int> called;
+
+    pthread_t threads[LOAD_WORKERS_MAX];
+    uint32_t threadCount;
+    bool exiting;
+    semaphore_t go;
+    semaphore_t done;
+
+    void push(int i) {
+        int oldTop = top.load(std::memory_order_relaxed);
+        do {
+            next[i] = oldTop;
+        } while (!top.compare_exchange_weak(oldTop, i, 
+                                            std::memory_order_release, 
+                                            std::memory_order_relaxed));
+        semaphore_signal(ready);
+    }
+
+    // Only called after a wait on ready, so the stack is not empty.
+    int pop() {
+        int oldTop = top.load(std::memory_order_acquire);
+        while (!top.compare_exchange_weak(oldTop, next[oldTop], 
+                                          std::memory_order_acquire, 
+                                          std::memory_order_acquire))
+            ;
+        return oldTop;
+    }
+
+    // Calls +load methods from the stack until the whole run is called.
+    void work() {
+        while (true) {
+            semaphore_wait(ready);
+            // A thread woken for a ready class always finds 
+            // called < runCount, so this one was woken to leave.
+            if (called.load(std::memory_order_acquire) == runCount) return;
+
+            int i = pop();
+            call_class_load(&classes[i]);
+            for (int c = firstChild[i]; c >= 0; c = nextSibling[c]) {
+                push(c);
+            }
+            if (called.fetch_add(1, std::memory_order_acq_rel) + 1 == 
+                runCount) 
+            {
+                // Wake every thread, this one included, to leave.
+                for (uint32_t t = 0; t <= threadCount; t++) {
+                    semaphore_signal(ready);
+                }
+            }
+        }
+    }
+
+    static void *workerMain(void *arg) {
+        LoadWorkers *workers = (LoadWorkers *)arg;
+        while (true) {
+            semaphore_wait(workers->go);
+            if (workers->exiting) return nil;
+            void *pool = objc_autoreleasePoolPush();
+            workers->work();
+            objc_autoreleasePoolPop(pool);
+            semaphore_signal(workers->done);
+        }
+    }
+
+    // Returns the end of the run of classes from the same image 
+    // as classes[first]. Removed classes join any run.
+    int runEnd(int first) {
+        int end = first + 1;
+        Class firstCls = classes[first].cls;
+        const header_info *hi = firstCls ? _headerForClass(firstCls) : nil;
+        while (end < count) {
+            Class cls = classes[end].cls;
+            if (cls  &&  (!hi  ||  !_headerContainsClass(hi, cls))) break;
+            end++;
+        }
+        return end;
+    }
+
+    // Links each class of the run [first, end) to the nearest of its 
+    // superclasses in the run. Classes that wait for no other are 
+    // linked through nextSibling from roots, last class first. 
+    // Returns the number of classes to call.
+    int schedule(int first, int end, objc::DenseMap<Class, int>& indexes, 
+                 int& roots) 
+    {
+        int classCount = 0;
+        roots = -1;
+        for (int i = first; i < end; i++) {
+            firstChild[i] = -1;
+            nextSibling[i] = -1;
+            next[i] = -1;
+            Class cls = classes[i].cls;
+            if (!cls) continue;
+            classCount++;
+
+            int parent = -1;
+            for (Class sup = cls->superclass; sup; sup = sup->superclass) {
+                auto it = indexes.find(sup);
+                if (it != indexes.end()  &&  it->second >= first) {
+                    parent = it->second;
+                    break;
+                }
+            }
+            // Prepending pushes later classes first, so earlier 
+            // classes are popped first.
+            if (parent >= 0) {
+                nextSibling[i] = firstChild[parent];
+                firstChild[parent] = i;
+            } else {
+                nextSibling[i] = roots;
+                roots = i;
+            }
+            indexes[cls] = i;
+        }
+        return classCount;
+    }
+
+    void callRun(int first, int end, objc::DenseMap<Class, int>& indexes) {
+        int roots;
+        runCount = schedule(first, end, indexes, roots);
+        if (runCount < 2  ||  threadCount == 0) {
+            for (int i = first; i < end; i++) call_class_load(&classes[i]);
+            return;
+        }
+
+        called.store(0, std::memory_order_relaxed);
+        top.store(-1, std::memory_order_relaxed);
+        for (int i = roots; i >= 0; i = nextSibling[i]) push(i);
+
+        // The semaphores order these stores before the workers' loads.
+        for (uint32_t t = 0; t < threadCount; t++) semaphore_signal(go);
+        work();
+        for (uint32_t t = 0; t < threadCount; t++) semaphore_wait(done);
+    }
+
+public:
+    // Returns the number of workers worth starting for these classes, 
+    // or 0 to call them on the calling thread only.
+    static uint32_t countFor(int count) {
+        if (!ParallelLoad  ||  count < LOAD_WORKERS_MIN_CLASSES) return 0;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus < 2) return 0;
+        // The calling thread is one of the callers.
+        uint32_t workers = (uint32_t)MIN(cpus, LOAD_WORKERS_MAX + 1) - 1;
+        return MIN(workers, (uint32_t)count / 2);
+    }
+
+    LoadWorkers(struct loadable_class *newClasses, int newCount, 
+                uint32_t workers)
+        : classes(newClasses), count(newCount), top(-1), runCount(0), 
+          called(0), threadCount(0), exiting(false)
+    {
+        firstChild = (int *)malloc(3 * count * sizeof(int));
+        nextSibling = firstChild + count;
+        next = nextSibling + count;
+        ready = create_semaphore();
+        go = create_semaphore();
+        done = create_semaphore();
+        for (uint32_t t = 0; t < workers; t++) {
+            if (pthread_create(&threads[threadCount], nil, 
+                               &workerMain, this) != 0) 
+            {
+                break;
+            }
+            threadCount++;
+        }
+    }
+
+    ~LoadWorkers() {
+        exiting = true;
+        for (uint32_t t = 0; t < threadCount; t++) semaphore_signal(go);
+        for (uint32_t t = 0; t < threadCount; t++) {
+            pthread_join(threads[t], nil);
+        }
+        semaphore_destroy(mach_task_self(), ready);
+        semaphore_destroy(mach_task_self(), go);
+        semaphore_destroy(mach_task_self(), done);
+        free(firstChild);
+    }
+
+    uint32_t workerCount() const { return threadCount; }
+
+    void callAll() {
+        objc::DenseMap<Class, int> indexes;
+        for (int first = 0; first < count; ) {
+            int end = runEnd(first);
+            callRun(first, end, indexes);
+            first = end;
+        }
+    }
+};
+
+}
+
+
 /***********************************************************************
 * call_class_loads
 * Call all pending class +load methods.
@@ -199,16 +455,18 @@ static void call_class_loads(void)
     loadable_classes_used = 0;
     
     // Call all +loads for the detached list.
-    for (i = 0; i < used; i++) {
-        Class cls = classes[i].cls;
-        load_method_t load_method = (load_method_t)classes[i].method;
-        if (!cls) continue; 
-
+    uint32_t workerCount = LoadWorkers::countFor(used);
+    if (workerCount) {
+        LoadWorkers workers(classes, used, workerCount);
         if (PrintLoading) {
-            _objc_inform("LOAD: +[%s load]\n", cls->nameForLogging());
+            _objc_inform("LOAD: calling %d class +loads on %u threads", 
+                         used, workers.workerCount() + 1);
+        }
+        workers.callAll();
+    } else {
+        for (i = 0; i < used; i++) {
+            call_class_load(&classes[i]);
         }
-        /// 调用 我们类编写的 +(void)load;
-        (*load_method)(cls, SEL_load);
     }
     
     // Destroy the detached list.
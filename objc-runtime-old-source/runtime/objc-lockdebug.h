@@ -26,23 +26,31 @@ extern void lockdebug_assert_all_locks_locked();
 extern void lockdebug_assert_no_locks_locked();
 extern void lockdebug_setInForkPrepare(bool);
 extern void lockdebug_lock_precedes_lock(const void *oldlock, const void *newlock);
+extern const void *lockdebug_lend_locks();
+extern void lockdebug_borrow_locks(const void *loan);
+extern void lockdebug_return_locks(const void *loan);
+extern void lockdebug_end_loan(const void *loan);
 #else
 static inline void lockdebug_assert_all_locks_locked() { }
 static inline void lockdebug_assert_no_locks_locked() { }
 static inline void lockdebug_setInForkPrepare(bool) { }
 static inline void lockdebug_lock_precedes_lock(const void *, const void *) { }
+static inline const void *lockdebug_lend_locks() { return nil; }
+static inline void lockdebug_borrow_locks(const void *) { }
+static inline void lockdebug_return_locks(const void *) { }
+static inline void lockdebug_end_loan(const void *) { }
 #endif
 
 extern void lockdebug_remember_mutex(mutex_tt<true> *lock);
 extern void lockdebug_mutex_lock(mutex_tt<true> *lock);
-extern void lockdebug_mutex_try_lock(mutex_tt<true> *lock);
+extern void lockdebug_mutex_try_lock_success(mutex_tt<true> *lock);
 extern void lockdebug_mutex_unlock(mutex_tt<true> *lock);
 extern void lockdebug_mutex_assert_locked(mutex_tt<true> *lock);
 extern void lockdebug_mutex_assert_unlocked(mutex_tt<true> *lock);
 
 static inline void lockdebug_remember_mutex(mutex_tt<false> *lock) { }
 static inline void lockdebug_mutex_lock(mutex_tt<false> *lock) { }
-static inline void lockdebug_mutex_try_lock(mutex_tt<false> *lock) { }
+static inline void lockdebug_mutex_try_lock_success(mutex_tt<false> *lock) { }
 static inline void lockdebug_mutex_unlock(mutex_tt<false> *lock) { }
 static inline void lockdebug_mutex_assert_locked(mutex_tt<false> *lock) { }
 static inline void lockdebug_mutex_assert_unlocked(mutex_tt<false> *lock) { }
@@ -109,3 +117,35 @@ static inline void lockdebug_rwlock_assert_reading(rwlock_tt<false> *) { }
 static inline void lockdebug_rwlock_assert_writing(rwlock_tt<false> *) { }
 static inline void lockdebug_rwlock_assert_locked(rwlock_tt<false> *) { }
 static inline void lockdebug_rwlock_assert_unlocked(rwlock_tt<false> *) { }
+
+
+// Lock contention profiling for OBJC_PROFILE_LOCKS, in every build.
+// The hooks cost one predictable branch when the option is off.
+// See objc-lockdebug.mm.
+
+enum lockprof_kind { lockprof_lock, lockprof_read, lockprof_write };
+
+extern bool ProfileLocks;
+extern void lockprof_name_lock(const void *lock, size_t size, const char *name);
+extern void lockprof_init();
+extern void lockprof_print();
+extern void lockprof_forceReset();
+extern uint64_t lockprof_sample_slow();
+extern void lockprof_locked_slow(const void *lock, lockprof_kind kind, 
+                                 uint64_t start);
+extern void lockprof_unlock_slow(const void *lock);
+
+// Returns a start time if this acquisition is sampled, or 0.
+static inline uint64_t lockprof_will_lock() {
+    if (fastpath(!ProfileLocks)) return 0;
+    return lockprof_sample_slow();
+}
+
+static inline void lockprof_did_lock(const void *lock, lockprof_kind kind, 
+                                     uint64_t start) {
+    if (slowpath(start)) lockprof_locked_slow(lock, kind, start);
+}
+
+static inline void lockprof_will_unlock(const void *lock) {
+    if (slowpath(ProfileLocks)) lockprof_unlock_slow(lock);
+}
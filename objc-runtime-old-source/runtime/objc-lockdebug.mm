@@ -24,6 +24,7 @@
 /***********************************************************************
 * objc-lock.m
 * Error-checking locks for debugging.
+* Lock contention profiling.
 **********************************************************************/
 
 #include "objc-private.h"
@@ -338,6 +339,60 @@ lockdebug_assert_no_locks_locked()
 }
 
 
+/***********************************************************************
+* Lock loans
+* A thread that holds locks while it waits for helper threads may lend 
+* them to the helpers, so ownership assertions pass on the helpers. 
+* The loan is a snapshot of the lender's locks when it is made, so 
+* the lender may take and release other locks while the loan is out. 
+* The lender must keep every lent lock until it ends the loan, and 
+* must not end the loan until every borrower has returned it.
+**********************************************************************/
+
+const void *
+lockdebug_lend_locks()
+{
+    return new objc_lock_list(ownedLocks());
+}
+
+void
+lockdebug_borrow_locks(const void *loan)
+{
+    auto& owned = ownedLocks();
+
+    if (!owned.empty()) {
+        _objc_fatal("borrowing locks while already owning locks");
+    }
+    owned = *(const objc_lock_list *)loan;
+}
+
+void
+lockdebug_return_locks(const void *loan)
+{
+    auto& owned = ownedLocks();
+
+    if (owned.size() != ((const objc_lock_list *)loan)->size()) {
+        _objc_fatal("returning borrowed locks while owning other locks");
+    }
+    owned.clear();
+}
+
+void
+lockdebug_end_loan(const void *loan)
+{
+    auto& owned = ownedLocks();
+    auto lent = (const objc_lock_list *)loan;
+
+    for (const auto& l : *lent) {
+        if (!hasLock(owned, l.first, l.second.k)) {
+            _objc_fatal("lent lock %p:%d was released before the loan ended",
+                        l.first, l.second.k);
+        }
+    }
+    delete lent;
+}
+
+
 /***********************************************************************
 * Mutex checking
 **********************************************************************/
@@ -619,4 +674,295 @@ lockdebug_rwlock_assert_unlocked(rwlock_t *lock)
 }
 
 
+// LOCKDEBUG  &&  !TARGET_OS_WIN32
+#endif
+
+
+/***********************************************************************
+* Lock contention profiling.
+* With OBJC_PROFILE_LOCKS, each thread samples on average one in every 
+* LOCKPROF_INTERVAL of its mutex and rwlock acquisitions. The gap between 
+* samples is random so that code taking locks in a fixed pattern does not 
+* always sample the same lock. A sample 
+* records how long the thread waited for the lock and, when the thread 
+* unlocks it, how long the lock was held. Samples are added to log2 
+* histograms for the lock's name, kept separately for exclusive, read, 
+* and write acquisitions. Striped locks share the name of their table.
+* Locks with no name are counted as "other locks".
+*
+* Nothing here takes a lock. Histograms are updated with relaxed atomics,
+* and each thread remembers its sampled locks in its own tls buffer.
+* Monitors and recursive mutexes are not profiled.
+**********************************************************************/
+
+#if !TARGET_OS_WIN32
+
+#include <atomic>
+
+#define LOCKPROF_INTERVAL 16
+#define LOCKPROF_NAMES 32
+#define LOCKPROF_BUCKETS 32
+#define LOCKPROF_HELD 8
+#define LOCKPROF_KINDS 3
+
+struct lockprof_histogram {
+    std::atomic<uint64_t> samples;
+    std::atomic<uint64_t> totalNs;
+    std::atomic<uint64_t> maxNs;
+    // Bucket 0 counts 0 ns. Bucket b counts [2^(b-1), 2^b) ns.
+    std::atomic<uint64_t> buckets[LOCKPROF_BUCKETS];
+
+    static unsigned bucketFor(uint64_t ns) {
+        if (ns == 0) return 0;
+        return MIN(64 - __builtin_clzll(ns), LOCKPROF_BUCKETS - 1);
+    }
+
+    void add(uint64_t ns) {
+        samples.fetch_add(1, std::memory_order_relaxed);
+        totalNs.fetch_add(ns, std::memory_order_relaxed);
+        buckets[bucketFor(ns)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = maxNs.load(std::memory_order_relaxed);
+        while (ns > max  &&  
+               !maxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+        { }
+    }
+};
+
+struct lockprof_name {
+    const char *name;
+    uintptr_t begin;
+    uintptr_t end;
+    lockprof_histogram wait[LOCKPROF_KINDS];
+    lockprof_histogram hold[LOCKPROF_KINDS];
+};
+
+struct lockprof_held {
+    const void *lock;
+    lockprof_name *name;
+    lockprof_kind kind;
+    uint64_t start;
+};
+
+struct lockprof_thread {
+    unsigned countdown;
+    uint32_t random;
+    unsigned heldCount;
+    lockprof_held held[LOCKPROF_HELD];
+};
+
+// lockNames[0] is "other locks". Names are added before lockprof_init().
+static lockprof_name lockNames[LOCKPROF_NAMES] = { { "other locks" } };
+static unsigned lockNameCount = 1;
+
+static tls_key_t lockprof_tls;
+static mach_timebase_info_data_t lockprof_timebase;
+static bool lockprof_ready;
+
+
+static uint64_t
+lockprof_ns(uint64_t ticks)
+{
+    return ticks * lockprof_timebase.numer / lockprof_timebase.denom;
+}
+
+
+static lockprof_name *
+lockprof_name_for(const void *lock)
+{
+    uintptr_t addr = (uintptr_t)lock;
+    for (unsigned i = 1; i < lockNameCount; i++) {
+        if (addr >= lockNames[i].begin  &&  addr < lockNames[i].end) {
+            return &lockNames[i];
+        }
+    }
+    return &lockNames[0];
+}
+
+
+static void
+lockprof_destroy_thread(void *value)
+{
+    free(value);
+}
+
+
+static lockprof_thread *
+lockprof_current_thread(bool create)
+{
+    auto t = (lockprof_thread *)tls_get(lockprof_tls);
+    if (!t  &&  create) {
+        t = (lockprof_thread *)calloc(1, sizeof(lockprof_thread));
+        if (!t) return nil;
+        t->random = (uint32_t)(uintptr_t)t | 1;
+        tls_set(lockprof_tls, t);
+    }
+    return t;
+}
+
+
+/***********************************************************************
+* lockprof_name_lock
+* Name the lock at [lock, lock+size) in the profile. 
+* size may cover a whole StripedMap.
+* Called by _objc_init() before lockprof_init().
+**********************************************************************/
+void
+lockprof_name_lock(const void *lock, size_t size, const char *name)
+{
+    assert(!lockprof_ready);
+    if (lockNameCount == LOCKPROF_NAMES) return;
+    lockprof_name& n = lockNames[lockNameCount++];
+    n.name = name;
+    n.begin = (uintptr_t)lock;
+    n.end = (uintptr_t)lock + size;
+}
+
+
+void
+lockprof_init()
+{
+    mach_timebase_info(&lockprof_timebase);
+    lockprof_tls = tls_create(&lockprof_destroy_thread);
+    lockprof_ready = true;
+}
+
+
+uint64_t
+lockprof_sample_slow()
+{
+    if (!lockprof_ready) return 0;
+    lockprof_thread *t = lockprof_current_thread(true);
+    if (!t) return 0;
+    if (t->countdown > 0) {
+        t->countdown--;
+        return 0;
+    }
+    // xorshift32. The next sample is 1 to 2*LOCKPROF_INTERVAL-1 
+    // acquisitions away.
+    t->random ^= t->random << 13;
+    t->random ^= t->random >> 17;
+    t->random ^= t->random << 5;
+    t->countdown = t->random % (2*LOCKPROF_INTERVAL - 1);
+    if (t->heldCount == LOCKPROF_HELD) return 0;
+    // 0 means "not sampled".
+    return nanoseconds() | 1;
+}
+
+
+void
+lockprof_locked_slow(const void *lock, lockprof_kind kind, uint64_t start)
+{
+    uint64_t now = nanoseconds();
+    lockprof_name *name = lockprof_name_for(lock);
+    name->wait[kind].add(lockprof_ns(now - MIN(start, now)));
+
+    lockprof_thread *t = lockprof_current_thread(false);
+    if (!t  ||  t->heldCount == LOCKPROF_HELD) return;
+    t->held[t->heldCount++] = lockprof_held{lock, name, kind, now};
+}
+
+
+void
+lockprof_unlock_slow(const void *lock)
+{
+    if (!lockprof_ready) return;
+    lockprof_thread *t = lockprof_current_thread(false);
+    if (!t  ||  t->heldCount == 0) return;
+
+    for (unsigned i = t->heldCount; i-- > 0; ) {
+        lockprof_held& h = t->held[i];
+        if (h.lock != lock) continue;
+        h.name->hold[h.kind].add(lockprof_ns(nanoseconds() - h.start));
+        t->held[i] = t->held[--t->heldCount];
+        return;
+    }
+}
+
+
+// fork() child. Locks held across fork() are reset, not unlocked.
+void
+lockprof_forceReset()
+{
+    if (!lockprof_ready) return;
+    lockprof_thread *t = lockprof_current_thread(false);
+    if (t) t->heldCount = 0;
+}
+
+
+static void
+lockprof_format_ns(char *buf, size_t size, uint64_t ns)
+{
+    if (ns < 1000) snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) {
+        snprintf(buf, size, "%lluus", (unsigned long long)ns / 1000);
+    }
+    else snprintf(buf, size, "%llums", (unsigned long long)ns / 1000000);
+}
+
+
+/***********************************************************************
+* lockprof_print
+* Print each lock's wait and hold histograms at exit, 
+* most total wait time first.
+**********************************************************************/
+void
+lockprof_print()
+{
+    static const char * const kindNames[LOCKPROF_KINDS] = 
+        { "", " (read)", " (write)" };
+
+    struct entry { lockprof_name *name; unsigned kind; uint64_t wait; };
+    entry entries[LOCKPROF_NAMES * LOCKPROF_KINDS];
+    unsigned count = 0;
+    for (unsigned i = 0; i < lockNameCount; i++) {
+        for (unsigned k = 0; k < LOCKPROF_KINDS; k++) {
+            auto& wait = lockNames[i].wait[k];
+            if (wait.samples.load(std::memory_order_relaxed) == 0) continue;
+            entry e = { &lockNames[i], k, 
+                        wait.totalNs.load(std::memory_order_relaxed) };
+            unsigned j = count++;
+            while (j > 0  &&  entries[j-1].wait < e.wait) {
+                entries[j] = entries[j-1];
+                j--;
+            }
+            entries[j] = e;
+        }
+    }
+
+    _objc_inform("LOCKS: wait and hold times of about 1 in %d "
+                 "acquisitions per thread", LOCKPROF_INTERVAL);
+    for (unsigned i = 0; i < count; i++) {
+        const char *name = entries[i].name->name;
+        const char *kind = kindNames[entries[i].kind];
+        auto& wait = entries[i].name->wait[entries[i].kind];
+        auto& hold = entries[i].name->hold[entries[i].kind];
+        uint64_t waits = wait.samples.load(std::memory_order_relaxed);
+        uint64_t holds = hold.samples.load(std::memory_order_relaxed);
+        double waitTotal = wait.totalNs.load(std::memory_order_relaxed);
+        double holdTotal = hold.totalNs.load(std::memory_order_relaxed);
+
+        _objc_inform("LOCKS: %s%s: %llu samples, wait %.2f us total, "
+                     "%.2f us max; hold %.2f us average, %.2f us max", 
+                     name, kind, (unsigned long long)waits, 
+                     waitTotal / 1000.0, 
+                     wait.maxNs.load(std::memory_order_relaxed) / 1000.0, 
+                     holds ? holdTotal / 1000.0 / holds : 0.0, 
+                     hold.maxNs.load(std::memory_order_relaxed) / 1000.0);
+
+        for (unsigned b = 0; b < LOCKPROF_BUCKETS; b++) {
+            uint64_t w = wait.buckets[b].load(std::memory_order_relaxed);
+            uint64_t h = hold.buckets[b].load(std::memory_order_relaxed);
+            if (w == 0  &&  h == 0) continue;
+            char lo[16], hi[16];
+            lockprof_format_ns(lo, sizeof(lo), b ? 1ULL << (b-1) : 0);
+            if (b == LOCKPROF_BUCKETS - 1) strlcpy(hi, "...", sizeof(hi));
+            else lockprof_format_ns(hi, sizeof(hi), 1ULL << b);
+            _objc_inform("LOCKS: %s%s:   [%s, %s) wait %llu, hold %llu", 
+                         name, kind, lo, hi, 
+                         (unsigned long long)w, (unsigned long long)h);
+        }
+    }
+}
+
+// !TARGET_OS_WIN32
 #endif
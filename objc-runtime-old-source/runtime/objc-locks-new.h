@@ -35,4 +35,8 @@
 extern rwlock_t runtimeLock;
 extern mutex_t DemangleCacheLock;
 
+// Lock-free method lookups are counted, not locked. 
+// A lookup in progress at fork() is never finished in the child.
+extern void LockFreeLookupsForceReset();
+
 #endif
@@ -42,10 +42,23 @@ extern recursive_mutex_t loadMethodLock;
 extern mutex_t crashlog_lock;
 extern spinlock_t objcMsgLogLock;
 extern mutex_t AltHandlerDebugLock;
-extern mutex_t AssociationsManagerLock;
+extern spinlock_t PoolPageLock;
+extern mutex_t TrampolineLock;
+#if SUPPORT_INSTANCE_SLABS
+extern spinlock_t InstanceSlabLock;
+#endif
 extern StripedMap<spinlock_t> PropertyLocks;
-extern StripedMap<spinlock_t> StructLocks;
+extern StripedMap<seqlock_t> StructLocks;
 extern StripedMap<spinlock_t> CppObjectLocks;
+#if SUPPORT_LOCKFREE_ACCESSORS
+// Not a lock, but reset in the fork child like one.
+extern StripedMap<readcount_t> PropertyReaders;
+#endif
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+extern mutex_t RefcountTableLock;
+// Not a lock, but the tables' reader counts are reset in the fork child.
+extern void RefcountTablesForceReset();
+#endif
 
 // SideTable lock is buried awkwardly. Call a function to manipulate it.
 extern void SideTableLockAll();
@@ -56,6 +69,32 @@ extern void SideTableLocksPrecedeLock(const void *newlock);
 extern void SideTableLocksSucceedLock(const void *oldlock);
 extern void SideTableLocksPrecedeLocks(StripedMap<spinlock_t>& newlocks);
 extern void SideTableLocksSucceedLocks(StripedMap<spinlock_t>& oldlocks);
+extern void SideTablePrintStatistics();
+extern void SideTableNameProfiledLocks();
+
+// Associated object locks are striped too. See objc-references.mm.
+extern void AssociationsLockAll();
+extern void AssociationsUnlockAll();
+extern void AssociationsForceResetAll();
+extern void AssociationsDefineLockOrder();
+extern void AssociationsLocksPrecedeLock(const void *newlock);
+extern void AssociationsLocksSucceedLock(const void *oldlock);
+extern void AssociationsLocksSucceedLocks(StripedMap<spinlock_t>& oldlocks);
+extern void AssociationsLocksPrecedeSideTableLocks();
+extern void AssociationsPrintStatistics();
+extern void AssociationsNameProfiledLocks();
+
+#if __OBJC2__
+// Selector table shard locks. See objc-sel.mm.
+extern void SelectorLocksLockAll();
+extern void SelectorLocksUnlockAll();
+extern void SelectorLocksForceResetAll();
+extern void SelectorLocksDefineLockOrder();
+extern void SelectorLocksPrecedeLock(const void *newlock);
+extern void SelectorLocksSucceedLock(const void *oldlock);
+extern void SelectorLocksPrintStatistics();
+extern void SelectorLocksNameProfiledLocks();
+#endif
 
 #if __OBJC2__
 #include "objc-locks-new.h"
@@ -303,7 +303,11 @@ objc_object::changeIsa(Class newCls)
         // Copy oldisa's retain count et al to side table.
         // oldisa.has_assoc: nothing to do
         // oldisa.has_cxx_dtor: nothing to do
-        sidetable_moveExtraRC_nolock(oldisa.extra_rc, 
+        size_t extra_rc = oldisa.extra_rc;
+        if (oldisa.has_sidetable_rc  &&  PinOverflowedRetainCounts) {
+            extra_rc += pinned_moveRC_nolock();
+        }
+        sidetable_moveExtraRC_nolock(extra_rc, 
                                      oldisa.deallocating, 
                                      oldisa.weakly_referenced);
     }
@@ -427,7 +431,7 @@ objc_object::rootDealloc()
                  !isa.has_sidetable_rc))
     {
         assert(!sidetable_present());
-        free(this);
+        free_instance(this);
     } 
     else {
         object_dispose((id)this);
@@ -477,12 +481,15 @@ objc_object::rootRetain(bool tryRetain, bool handleOverflow)
 
     bool sideTableLocked = false;
     bool transcribeToSideTable = false;
+    bool pinRetainCount = false;
 
     isa_t oldisa;
     isa_t newisa;
 
+ retry:
     do {
         transcribeToSideTable = false;
+        pinRetainCount = false;
         oldisa = LoadExclusive(&isa.bits);
         newisa = oldisa;
         if (slowpath(!newisa.nonpointer)) {
@@ -497,6 +504,16 @@ objc_object::rootRetain(bool tryRetain, bool handleOverflow)
             if (!tryRetain && sideTableLocked) sidetable_unlock();
             return nil;
         }
+        if (slowpath(newisa.has_sidetable_rc  &&  PinOverflowedRetainCounts)) {
+            // Pinned. The retain goes to the pinned count, not the isa.
+            ClearExclusive(&isa.bits);
+            if (!handleOverflow) return rootRetain_overflow(tryRetain);
+            if (!tryRetain && sideTableLocked) sidetable_unlock();
+            sideTableLocked = false;
+            if (pinned_retain(false)) return (id)this;
+            // changeIsa() moved the pinned count to the side table.
+            goto retry;
+        }
         uintptr_t carry;
         /// 这里引用计数 extra_rc + 1
         newisa.bits = addc(newisa.bits, RC_ONE, 0, &carry);  // extra_rc++
@@ -506,21 +523,34 @@ objc_object::rootRetain(bool tryRetain, bool handleOverflow)
                 ClearExclusive(&isa.bits);
                 return rootRetain_overflow(tryRetain);
             }
-            // Leave half of the retain counts inline and 
-            // prepare to copy the other half to the side table.
-            if (!tryRetain && !sideTableLocked) sidetable_lock();
-            sideTableLocked = true;
-            transcribeToSideTable = true;
-            newisa.extra_rc = RC_HALF;
-            newisa.has_sidetable_rc = true;
+            if (PinOverflowedRetainCounts) {
+                // Leave the inline count full and pin the object.
+                // This retain goes to the pinned count.
+                newisa = oldisa;
+                newisa.has_sidetable_rc = true;
+                pinRetainCount = true;
+            }
+            else {
+                // Leave half of the retain counts inline and 
+                // prepare to copy the other half to the side table.
+                if (!tryRetain && !sideTableLocked) sidetable_lock();
+                sideTableLocked = true;
+                transcribeToSideTable = true;
+                newisa.extra_rc = RC_HALF;
+                newisa.has_sidetable_rc = true;
+            }
         }
         /// 更新isa_t
     } while (slowpath(!StoreExclusive(&isa.bits, oldisa.bits, newisa.bits)));
     /// 当 引用计数 超过 isa.extra_rc 8位之后 就开启引用技术表来存储
     if (slowpath(transcribeToSideTable)) {
         // Copy the other half of the retain counts to the side table.
+        RetainCountStatistics::count(RetainCountStats.overflows);
         sidetable_addExtraRC_nolock(RC_HALF);
     }
+    else if (slowpath(pinRetainCount)) {
+        if (!pinned_retain(true)) goto retry;
+    }
 
     if (slowpath(!tryRetain && sideTableLocked)) sidetable_unlock();
     return (id)this;
@@ -570,6 +600,7 @@ objc_object::rootRelease(bool performDealloc, bool handleUnderflow)
     if (isTaggedPointer()) return false;
 
     bool sideTableLocked = false;
+    bool pinnedEmpty = false;
 
     isa_t oldisa;
     isa_t newisa;
@@ -584,6 +615,22 @@ objc_object::rootRelease(bool performDealloc, bool handleUnderflow)
             return sidetable_release(performDealloc);
         }
         // don't check newisa.fast_rr; we already called any RR overrides
+        if (slowpath(newisa.has_sidetable_rc  &&  !pinnedEmpty  &&  
+                     PinOverflowedRetainCounts))
+        {
+            // Pinned. Release from the pinned count first.
+            ClearExclusive(&isa.bits);
+            if (!handleUnderflow) return rootRelease_underflow(performDealloc);
+            bool moved;
+            if (pinned_release(&moved)) {
+                if (sideTableLocked) sidetable_unlock();
+                return false;
+            }
+            // Pinned count is empty: decrement the inline count instead.
+            // If changeIsa() moved it, the retry sees the raw isa.
+            if (!moved) pinnedEmpty = true;
+            goto retry;
+        }
         uintptr_t carry;
         newisa.bits = subc(newisa.bits, RC_ONE, 0, &carry);  // extra_rc--
         if (slowpath(carry)) {
@@ -619,8 +666,21 @@ objc_object::rootRelease(bool performDealloc, bool handleUnderflow)
             goto retry;
         }
 
+        // Retains may have added to the pinned count since we looked.
+        // Check again under the lock before deallocating.
+        if (PinOverflowedRetainCounts) {
+            bool moved;
+            if (pinned_release(&moved)) {
+                ClearExclusive(&isa.bits);
+                sidetable_unlock();
+                return false;
+            }
+            assert(!moved);  // changeIsa() takes the side table lock
+        }
+
         // Try to remove some retain counts from the side table.        
         size_t borrowed = sidetable_subExtraRC_nolock(RC_HALF);
+        if (borrowed > 0) RetainCountStatistics::count(RetainCountStats.borrows);
 
         // To avoid races, has_sidetable_rc must remain set 
         // even if the side table count is now zero.
@@ -725,6 +785,7 @@ objc_object::rootRetainCount()
         uintptr_t rc = 1 + bits.extra_rc;
         if (bits.has_sidetable_rc) {
             rc += sidetable_getExtraRC_nolock();
+            if (PinOverflowedRetainCounts) rc += pinned_getRC();
         }
         sidetable_unlock();
         return rc;
@@ -374,3 +374,433 @@ __END_DECLS
 
 // SUPPORT_PREOPT
 #endif
+
+
+/***********************************************************************
+* Preoptimization sidecar
+* Selector and class tables for images outside the dyld shared cache, 
+* precomputed by objcopt and mapped from the file named by 
+* OBJC_PREOPT_SIDECAR. A selector named in the sidecar is the sidecar's 
+* copy of the name, so registering it takes no lock and copies nothing. 
+* A class in an image whose UUID matches the sidecar is found by name 
+* in the sidecar instead of being added to the named class table.
+*
+* The sidecar is mapped once, before any selector is registered, 
+* and never unmapped.
+**********************************************************************/
+
+#if !SUPPORT_PREOPT_SIDECAR
+
+void preopt_sidecar_init(void)
+{
+}
+
+bool preoptSidecarAddHeader(const header_info *hi)
+{
+    return false;
+}
+
+void preoptSidecarRemoveHeader(const header_info *hi)
+{
+}
+
+bool preoptSidecarHasHeader(const header_info *hi)
+{
+    return false;
+}
+
+const objc_selopt_t *preoptSidecarSelectors(void)
+{
+    return nil;
+}
+
+unsigned getPreoptSidecarClassUnreasonableCount()
+{
+    return 0;
+}
+
+Class getPreoptSidecarClass(const char *name)
+{
+    return nil;
+}
+
+BOOL _objc_getPreoptSidecarStatistics(objc_preopt_sidecar_statistics *outStats)
+{
+    return NO;
+}
+
+// !SUPPORT_PREOPT_SIDECAR
+#else
+// SUPPORT_PREOPT_SIDECAR
+
+#include <objc-shared-cache.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+using objc_opt::objc_stringhash_t;
+using objc_opt::objc_stringhash_check_t;
+using objc_opt::objc_stringhash_offset_t;
+using objc_opt::objc_classheader_t;
+using objc_opt::objc_clsopt_t;
+using objc_opt::objc_sidecar_image_t;
+using objc_opt::objc_sidecar_t;
+
+static const objc_sidecar_t *sidecar;
+
+// Loaded header_info for each sidecar image, or nil.
+// Locking: runtimeLock
+static const header_info **sidecarHeaders;
+static uint32_t sidecarLoadedCount;
+
+
+/***********************************************************************
+* sidecarContains
+* Returns true if [offset, offset+len) lies within a sidecar of size bytes.
+**********************************************************************/
+static bool sidecarContains(int64_t offset, uint64_t len, size_t size)
+{
+    return offset >= 0  &&  (uint64_t)offset <= size  &&  
+        len <= size - (uint64_t)offset;
+}
+
+
+/***********************************************************************
+* checkSidecarTable
+* Checks a selopt or clsopt table at offset in the sidecar.
+* Every string must lie in the sidecar and every hash must land in 
+* the table, so lookups need no bounds checks of their own.
+* Returns nil or the reason the table is bad.
+**********************************************************************/
+static const char *
+checkSidecarTable(const objc_sidecar_t *sc, size_t size, 
+                  int32_t offset, bool isClassTable)
+{
+    if (!sidecarContains(offset, sizeof(objc_stringhash_t), size)) {
+        return "(table header is out of bounds)";
+    }
+    auto table = (const objc_stringhash_t *)((const uint8_t *)sc + offset);
+
+    uint64_t capacity = table->capacity;
+    uint64_t tabSize = (uint64_t)table->mask + 1;
+    if (capacity == 0  ||  (capacity & (capacity-1))  ||  
+        (tabSize & (tabSize-1))  ||  table->shift == 0  ||  
+        table->shift >= 64  ||  (1ULL << (64 - table->shift)) > capacity)
+    {
+        return "(table shape is bad)";
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        if (table->scramble[i] >= capacity) return "(table shape is bad)";
+    }
+
+    uint64_t tableSize = sizeof(objc_stringhash_t) + tabSize + 
+        capacity * sizeof(objc_stringhash_check_t) + 
+        capacity * sizeof(objc_stringhash_offset_t);
+    if (isClassTable) tableSize += capacity * sizeof(objc_classheader_t) + 
+                          sizeof(uint32_t);
+    if (!sidecarContains(offset, tableSize, size)) {
+        return "(table is out of bounds)";
+    }
+
+    const objc_stringhash_offset_t *offsets = table->offsets();
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (offsets[i] != 0  &&  
+            !sidecarContains((int64_t)offset + offsets[i], 1, size)) 
+        {
+            return "(string is out of bounds)";
+        }
+    }
+
+    if (!isClassTable) return nil;
+
+    auto classes = (const objc_clsopt_t *)table;
+    uint64_t dupCount = classes->duplicateCount();
+    tableSize += dupCount * sizeof(objc_classheader_t);
+    if (!sidecarContains(offset, tableSize, size)) {
+        return "(class table is out of bounds)";
+    }
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (offsets[i] == 0) continue;
+        const objc_classheader_t& c = classes->classOffsets()[i];
+        if (!c.isDuplicate()) {
+            if ((uint32_t)c.hiOffset >= sc->imageCount) {
+                return "(class image is out of bounds)";
+            }
+        } else if ((uint64_t)c.duplicateIndex() + c.duplicateCount() > dupCount) {
+            return "(duplicate class is out of bounds)";
+        }
+    }
+    const objc_classheader_t *dups = classes->duplicateOffsets();
+    for (uint64_t i = 0; i < dupCount; i++) {
+        if ((uint32_t)dups[i].hiOffset >= sc->imageCount) {
+            return "(class image is out of bounds)";
+        }
+    }
+
+    return nil;
+}
+
+
+/***********************************************************************
+* checkSidecar
+* Returns nil or the reason the mapped sidecar can't be used.
+**********************************************************************/
+static const char *
+checkSidecar(const objc_sidecar_t *sc, size_t size)
+{
+    if (size < sizeof(objc_sidecar_t)  ||  
+        sc->magic != objc_opt::SIDECAR_MAGIC)
+    {
+        return "(not a sidecar file)";
+    }
+    if (sc->version != objc_opt::SIDECAR_VERSION) {
+        return "(wrong sidecar version)";
+    }
+    // Every string ends before the end of the file.
+    if (((const char *)sc)[size-1] != '\0') {
+        return "(sidecar is truncated)";
+    }
+
+    if (!sidecarContains(sc->images_offset, 
+                         (uint64_t)sc->imageCount * sizeof(objc_sidecar_image_t), 
+                         size))
+    {
+        return "(image list is out of bounds)";
+    }
+    for (uint32_t i = 0; i < sc->imageCount; i++) {
+        if (!sidecarContains(sc->images()[i].name_offset, 1, size)) {
+            return "(image name is out of bounds)";
+        }
+    }
+
+    const char *failure;
+    if (sc->selopt_offset  &&  
+        (failure = checkSidecarTable(sc, size, sc->selopt_offset, false)))
+    {
+        return failure;
+    }
+    if (sc->clsopt_offset  &&  
+        (failure = checkSidecarTable(sc, size, sc->clsopt_offset, true)))
+    {
+        return failure;
+    }
+
+    return nil;
+}
+
+
+/***********************************************************************
+* preopt_sidecar_init
+* Map the OBJC_PREOPT_SIDECAR file, if any. 
+* Called by map_images_nolock() before sel_init().
+**********************************************************************/
+void preopt_sidecar_init(void)
+{
+    // Like the OBJC_ options, ignored when setuid or setgid.
+    if (issetugid()) return;
+    const char *path = getenv("OBJC_PREOPT_SIDECAR");
+    if (!path  ||  !*path) return;
+
+    const char *failure = nil;
+    void *map = MAP_FAILED;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        failure = "(can't open the sidecar file)";
+    }
+    else if (fstat(fd, &st) < 0  ||  st.st_size <= 0  ||  
+             st.st_size > INT32_MAX)
+    {
+        failure = "(sidecar file has a bad size)";
+    }
+    else {
+        map = mmap(nil, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) failure = "(can't map the sidecar file)";
+        else failure = checkSidecar((const objc_sidecar_t *)map, 
+                                    (size_t)st.st_size);
+    }
+    if (fd >= 0) close(fd);
+
+    if (failure) {
+        if (map != MAP_FAILED) munmap(map, (size_t)st.st_size);
+        if (PrintPreopt) {
+            _objc_inform("PREOPTIMIZATION: sidecar %s is DISABLED %s", 
+                         path, failure);
+        }
+        return;
+    }
+
+    sidecar = (const objc_sidecar_t *)map;
+    sidecarHeaders = (const header_info **)
+        calloc(sidecar->imageCount, sizeof(header_info *));
+
+    if (PrintPreopt) {
+        _objc_inform("PREOPTIMIZATION: sidecar %s is ENABLED "
+                     "(%u images, %u selectors, %u classes)", path, 
+                     sidecar->imageCount, 
+                     sidecar->selopt() ? sidecar->selopt()->occupied : 0, 
+                     sidecar->clsopt() ? sidecar->clsopt()->occupied : 0);
+    }
+}
+
+
+/***********************************************************************
+* imageUUID
+* Returns the LC_UUID of an image, or nil.
+**********************************************************************/
+static const uint8_t *imageUUID(const headerType *mhdr)
+{
+    auto cmd = (const struct load_command *)(mhdr + 1);
+    for (uint32_t i = 0; i < mhdr->ncmds; i++) {
+        if (cmd->cmd == LC_UUID) {
+            return ((const struct uuid_command *)cmd)->uuid;
+        }
+        cmd = (const struct load_command *)((const uint8_t *)cmd + cmd->cmdsize);
+    }
+    return nil;
+}
+
+
+/***********************************************************************
+* preoptSidecarAddHeader
+* Matches a newly loaded image outside the dyld shared cache with 
+* the sidecar by UUID. Returns true if the sidecar lists its classes.
+* Locking: runtimeLock must be held by the caller
+**********************************************************************/
+bool preoptSidecarAddHeader(const header_info *hi)
+{
+    runtimeLock.assertWriting();
+
+    if (!sidecar) return false;
+    const uint8_t *uuid = imageUUID(hi->mhdr());
+    if (!uuid) return false;
+
+    const objc_sidecar_image_t *images = sidecar->images();
+    for (uint32_t i = 0; i < sidecar->imageCount; i++) {
+        if (0 != memcmp(images[i].uuid, uuid, sizeof(images[i].uuid))) {
+            continue;
+        }
+        // Another copy of the same image is already loaded.
+        if (sidecarHeaders[i]) return false;
+
+        sidecarHeaders[i] = hi;
+        sidecarLoadedCount++;
+        if (PrintPreopt) {
+            _objc_inform("PREOPTIMIZATION: using sidecar classes for %s "
+                         "(sidecar image %s)", 
+                         hi->fname(), sidecar->imageName(i));
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+/***********************************************************************
+* preoptSidecarRemoveHeader
+* Forgets an image that is being unloaded.
+* Locking: runtimeLock must be held by the caller
+**********************************************************************/
+void preoptSidecarRemoveHeader(const header_info *hi)
+{
+    runtimeLock.assertWriting();
+
+    if (!sidecar) return;
+    for (uint32_t i = 0; i < sidecar->imageCount; i++) {
+        if (sidecarHeaders[i] == hi) {
+            sidecarHeaders[i] = nil;
+            sidecarLoadedCount--;
+            return;
+        }
+    }
+}
+
+
+bool preoptSidecarHasHeader(const header_info *hi)
+{
+    runtimeLock.assertLocked();
+
+    if (!sidecar) return false;
+    for (uint32_t i = 0; i < sidecar->imageCount; i++) {
+        if (sidecarHeaders[i] == hi) return true;
+    }
+    return false;
+}
+
+
+const objc_selopt_t *preoptSidecarSelectors(void)
+{
+    return sidecar ? sidecar->selopt() : nil;
+}
+
+
+unsigned getPreoptSidecarClassUnreasonableCount()
+{
+    const objc_clsopt_t *classes = sidecar ? sidecar->clsopt() : nil;
+    if (!classes) return 0;
+
+    // Overestimate, as for the shared cache.
+    return classes->capacity + classes->duplicateCount();
+}
+
+
+/***********************************************************************
+* getPreoptSidecarClass
+* Returns the class with the given name from a loaded sidecar image, 
+* or nil. Duplicate names resolve in sidecar image order.
+* The caller must remap the result.
+* Locking: runtimeLock must be read- or write-locked by the caller
+**********************************************************************/
+Class getPreoptSidecarClass(const char *name)
+{
+    runtimeLock.assertLocked();
+
+    const objc_clsopt_t *classes = sidecar ? sidecar->clsopt() : nil;
+    if (!classes  ||  sidecarLoadedCount == 0) return nil;
+
+    uint32_t h = classes->getIndex(name);
+    if (h == INDEX_NOT_FOUND) return nil;
+
+    const objc_classheader_t *list = &classes->classOffsets()[h];
+    uint32_t count = 1;
+    if (list->isDuplicate()) {
+        count = list->duplicateCount();
+        list = &classes->duplicateOffsets()[list->duplicateIndex()];
+    }
+    // Duplicates are not stored in any order; pick the first image.
+    const objc_classheader_t *best = nil;
+    for (uint32_t i = 0; i < count; i++) {
+        if (sidecarHeaders[list[i].hiOffset]  &&  
+            (!best  ||  list[i].hiOffset < best->hiOffset))
+        {
+            best = &list[i];
+        }
+    }
+
+    // no match that is loaded
+    if (!best) return nil;
+
+    const header_info *hi = sidecarHeaders[best->hiOffset];
+    return (Class)((uintptr_t)hi->mhdr() + best->clsOffset);
+}
+
+
+/***********************************************************************
+* _objc_getPreoptSidecarStatistics
+* Reports the tables in use from OBJC_PREOPT_SIDECAR.
+**********************************************************************/
+BOOL _objc_getPreoptSidecarStatistics(objc_preopt_sidecar_statistics *outStats)
+{
+    if (!sidecar) return NO;
+
+    rwlock_reader_t lock(runtimeLock);
+    outStats->images = sidecar->imageCount;
+    outStats->loadedImages = sidecarLoadedCount;
+    outStats->selectors = sidecar->selopt() ? sidecar->selopt()->occupied : 0;
+    outStats->classes = sidecar->clsopt() ? sidecar->clsopt()->occupied : 0;
+    return YES;
+}
+
+// SUPPORT_PREOPT_SIDECAR
+#endif
@@ -385,6 +385,7 @@ extern void _objc_fatal_with_reason(uint64_t reason, uint64_t flags,
 #   define SYNC_DATA_DIRECT_KEY  ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY1)
 #   define SYNC_COUNT_DIRECT_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY2)
 #   define AUTORELEASE_POOL_KEY  ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY3)
+#   define AUTORELEASE_POOL_CACHE_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY6)
 # if SUPPORT_RETURN_AUTORELEASE
 #   define RETURN_DISPOSITION_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY4)
 # endif
@@ -696,6 +697,7 @@ static bool is_valid_direct_key(tls_key_t k) {
     return (   k == SYNC_DATA_DIRECT_KEY
             || k == SYNC_COUNT_DIRECT_KEY
             || k == AUTORELEASE_POOL_KEY
+            || k == AUTORELEASE_POOL_CACHE_KEY
 #   if SUPPORT_RETURN_AUTORELEASE
             || k == RETURN_DISPOSITION_KEY
 #   endif
@@ -800,6 +802,7 @@ inline void os_unfair_lock_unlock_inline(os_unfair_lock *unfair_lock) {
 #endif
 
 #include "objc-lockdebug.h"
+#include <atomic>
 
 template <bool Debug>
 class mutex_tt : nocopy_t {
@@ -813,13 +816,24 @@ class mutex_tt : nocopy_t {
 
     void lock() {
         lockdebug_mutex_lock(this);
+        uint64_t start = lockprof_will_lock();
         /// os_unfair_lock 自旋锁 代替 spinlock_t
         os_unfair_lock_lock_with_options_inline
             (&mLock, OS_UNFAIR_LOCK_DATA_SYNCHRONIZATION);
+        lockprof_did_lock(this, lockprof_lock, start);
+    }
+
+    bool tryLock() {
+        if (os_unfair_lock_trylock(&mLock)) {
+            lockdebug_mutex_try_lock_success(this);
+            return true;
+        }
+        return false;
     }
 
     void unlock() {
         lockdebug_mutex_unlock(this);
+        lockprof_will_unlock(this);
 
         os_unfair_lock_unlock_inline(&mLock);
     }
@@ -1088,13 +1102,16 @@ class rwlock_tt : nocopy_t {
         lockdebug_rwlock_read(this);
 
         qosStartOverride();
+        uint64_t start = lockprof_will_lock();
         int err = pthread_rwlock_rdlock(&mLock);
         if (err) _objc_fatal("pthread_rwlock_rdlock failed (%d)", err);
+        lockprof_did_lock(this, lockprof_read, start);
     }
 
     void unlockRead()
     {
         lockdebug_rwlock_unlock_read(this);
+        lockprof_will_unlock(this);
 
         int err = pthread_rwlock_unlock(&mLock);
         if (err) _objc_fatal("pthread_rwlock_unlock failed (%d)", err);
@@ -1121,13 +1138,16 @@ class rwlock_tt : nocopy_t {
         lockdebug_rwlock_write(this);
 
         qosStartOverride();
+        uint64_t start = lockprof_will_lock();
         int err = pthread_rwlock_wrlock(&mLock);
         if (err) _objc_fatal("pthread_rwlock_wrlock failed (%d)", err);
+        lockprof_did_lock(this, lockprof_write, start);
     }
 
     void unlockWrite()
     {
         lockdebug_rwlock_unlock_write(this);
+        lockprof_will_unlock(this);
 
         int err = pthread_rwlock_unlock(&mLock);
         if (err) _objc_fatal("pthread_rwlock_unlock failed (%d)", err);
@@ -1176,6 +1196,104 @@ class rwlock_tt : nocopy_t {
 };
 
 
+// A spinlock_t whose holder advances a sequence number around each 
+// write, so readers can copy the memory it guards without the lock 
+// and retry if a write overlapped the copy.
+class seqlock_t : nocopy_t {
+  public:
+    // First, so a stripe of StripedMap<seqlock_t> is its lock for lockdebug.
+    spinlock_t slock;
+
+  private:
+    std::atomic<uintptr_t> seq;
+
+  public:
+    seqlock_t() : seq(0) { }
+
+    void lock() { slock.lock(); }
+    void unlock() { slock.unlock(); }
+    void forceReset() { slock.forceReset(); }
+
+    // Call with slock held.
+    void beginWrite() {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, 
+                  std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void endWrite() {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, 
+                  std::memory_order_release);
+    }
+
+    // Returns a value for endRead(). Waits while a write is in progress.
+    uintptr_t beginRead() {
+        uintptr_t s;
+        while ((s = seq.load(std::memory_order_acquire)) & 1) {
+            sched_yield();
+        }
+        return s;
+    }
+
+    // Returns false if the copy since beginRead() must be discarded.
+    bool endRead(uintptr_t s) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return seq.load(std::memory_order_relaxed) == s;
+    }
+};
+
+
+// Counts the readers of a pointer that writers replace and then free, 
+// so a writer can wait until no reader can still be using the old value. 
+// Readers never wait. There are two counts so that new readers can be 
+// sent to one while the writer waits for the other to drain.
+class readcount_t : nocopy_t {
+    std::atomic<uintptr_t> counts[2];
+    std::atomic<uintptr_t> current;
+
+  public:
+    readcount_t() { forceReset(); }
+
+    // Call before loading the pointer. Returns a value for leave().
+    unsigned enter() {
+        unsigned which = current.load(std::memory_order_relaxed) & 1;
+        counts[which].fetch_add(1, std::memory_order_seq_cst);
+        return which;
+    }
+
+    void leave(unsigned which) {
+        counts[which].fetch_sub(1, std::memory_order_release);
+    }
+
+    // Call after storing the new pointer with seq_cst ordering. 
+    // Returns once every reader that could have loaded the old 
+    // pointer has left. Any count seen at zero since the store 
+    // has no such readers, whichever writer flipped `current`.
+    void synchronize() {
+        bool drained[2] = { false, false };
+        while (!drained[0]  ||  !drained[1]) {
+            uintptr_t cur = current.load(std::memory_order_seq_cst);
+            unsigned which = cur & 1;
+            if (drained[which ^ 1]) {
+                // Send new readers to the drained count.
+                current.compare_exchange_strong(cur, cur + 1);
+            } else {
+                which ^= 1;
+            }
+            while (counts[which].load(std::memory_order_seq_cst) != 0) {
+                sched_yield();
+            }
+            drained[which] = true;
+        }
+    }
+
+    void forceReset() {
+        counts[0].store(0, std::memory_order_relaxed);
+        counts[1].store(0, std::memory_order_relaxed);
+        current.store(0, std::memory_order_relaxed);
+    }
+};
+
 #ifndef __LP64__
 typedef struct mach_header headerType;
 typedef struct segment_command segmentType;
@@ -225,6 +225,7 @@ static header_info * addHeader(const headerType *mhdr, const char *path, int &to
     if (bad_magic(mhdr)) return NULL;
 
     bool inSharedCache = false;
+    bool inSidecar = false;
 
     // Look for hinfo from the dyld shared cache.
     hi = preoptimizedHinfoForHeader(mhdr);
@@ -290,6 +291,10 @@ static header_info * addHeader(const headerType *mhdr, const char *path, int &to
 
         hi->setLoaded(true);
         hi->setAllClassesRealized(NO);
+
+        // Classes listed in the preoptimization sidecar 
+        // don't go in the named class table either.
+        inSidecar = preoptSidecarAddHeader(hi);
     }
 
 #if __OBJC2__
@@ -297,7 +302,9 @@ static header_info * addHeader(const headerType *mhdr, const char *path, int &to
         size_t count = 0;
         if (_getObjc2ClassList(hi, &count)) {
             totalClasses += (int)count;
-            if (!inSharedCache) unoptimizedTotalClasses += count;
+            if (!inSharedCache  &&  !inSidecar) {
+                unoptimizedTotalClasses += count;
+            }
         }
     }
 #endif
@@ -450,6 +457,7 @@ map_images_nolock(unsigned mhCount, const char * const mhPaths[],
     // fixme defer initialization until an objc-using image is found?
     if (firstTime) {
         preopt_init();
+        preopt_sidecar_init();
     }
 
     if (PrintImages) {
@@ -616,6 +624,7 @@ unmap_image_nolock(const struct mach_header *mh)
     }
 
     _unload_image(hi);
+    preoptSidecarRemoveHeader(hi);
 
     // Remove header_info from header list
     removeHeader(hi);
@@ -652,8 +661,8 @@ static void static_init()
 **********************************************************************/
 
 // Declare lock ordering.
+// Called by _objc_init() after the striped lock tables are built.
 #if LOCKDEBUG
-__attribute__((constructor))
 static void defineLockOrder()
 {
     // Every lock precedes crashlog_lock
@@ -670,11 +679,22 @@ static void defineLockOrder()
     lockdebug_lock_precedes_lock(&impLock, &crashlog_lock);
 #endif
     lockdebug_lock_precedes_lock(&selLock, &crashlog_lock);
+#if __OBJC2__
+    SelectorLocksPrecedeLock(&crashlog_lock);
+#endif
     lockdebug_lock_precedes_lock(&cacheUpdateLock, &crashlog_lock);
     lockdebug_lock_precedes_lock(&objcMsgLogLock, &crashlog_lock);
     lockdebug_lock_precedes_lock(&AltHandlerDebugLock, &crashlog_lock);
-    lockdebug_lock_precedes_lock(&AssociationsManagerLock, &crashlog_lock);
+    lockdebug_lock_precedes_lock(&PoolPageLock, &crashlog_lock);
+    lockdebug_lock_precedes_lock(&TrampolineLock, &crashlog_lock);
+#if SUPPORT_INSTANCE_SLABS
+    lockdebug_lock_precedes_lock(&InstanceSlabLock, &crashlog_lock);
+#endif
+    AssociationsLocksPrecedeLock(&crashlog_lock);
     SideTableLocksPrecedeLock(&crashlog_lock);
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+    lockdebug_lock_precedes_lock(&RefcountTableLock, &crashlog_lock);
+#endif
     PropertyLocks.precedeLock(&crashlog_lock);
     StructLocks.precedeLock(&crashlog_lock);
     CppObjectLocks.precedeLock(&crashlog_lock);
@@ -695,20 +715,28 @@ static void defineLockOrder()
     lockdebug_lock_precedes_lock(&loadMethodLock, &cacheUpdateLock);
     lockdebug_lock_precedes_lock(&loadMethodLock, &objcMsgLogLock);
     lockdebug_lock_precedes_lock(&loadMethodLock, &AltHandlerDebugLock);
-    lockdebug_lock_precedes_lock(&loadMethodLock, &AssociationsManagerLock);
+    lockdebug_lock_precedes_lock(&loadMethodLock, &PoolPageLock);
+    lockdebug_lock_precedes_lock(&loadMethodLock, &TrampolineLock);
+#if SUPPORT_INSTANCE_SLABS
+    lockdebug_lock_precedes_lock(&loadMethodLock, &InstanceSlabLock);
+#endif
+    AssociationsLocksSucceedLock(&loadMethodLock);
     SideTableLocksSucceedLock(&loadMethodLock);
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+    lockdebug_lock_precedes_lock(&loadMethodLock, &RefcountTableLock);
+#endif
     PropertyLocks.succeedLock(&loadMethodLock);
     StructLocks.succeedLock(&loadMethodLock);
     CppObjectLocks.succeedLock(&loadMethodLock);
 
-    // PropertyLocks and CppObjectLocks and AssociationManagerLock 
+    // PropertyLocks and CppObjectLocks and the association locks 
     // precede everything because they are held while objc_retain() 
     // or C++ copy are called.
     // (StructLocks do not precede everything because it calls memmove only.)
     auto PropertyAndCppObjectAndAssocLocksPrecedeLock = [&](const void *lock) {
         PropertyLocks.precedeLock(lock);
         CppObjectLocks.precedeLock(lock);
-        lockdebug_lock_precedes_lock(&AssociationsManagerLock, lock);
+        AssociationsLocksPrecedeLock(lock);
     };
 #if __OBJC2__
     PropertyAndCppObjectAndAssocLocksPrecedeLock(&runtimeLock);
@@ -724,16 +752,31 @@ static void defineLockOrder()
     PropertyAndCppObjectAndAssocLocksPrecedeLock(&cacheUpdateLock);
     PropertyAndCppObjectAndAssocLocksPrecedeLock(&objcMsgLogLock);
     PropertyAndCppObjectAndAssocLocksPrecedeLock(&AltHandlerDebugLock);
+    PropertyAndCppObjectAndAssocLocksPrecedeLock(&PoolPageLock);
+    PropertyAndCppObjectAndAssocLocksPrecedeLock(&TrampolineLock);
+#if SUPPORT_INSTANCE_SLABS
+    PropertyAndCppObjectAndAssocLocksPrecedeLock(&InstanceSlabLock);
+#endif
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+    PropertyAndCppObjectAndAssocLocksPrecedeLock(&RefcountTableLock);
+#endif
 
     SideTableLocksSucceedLocks(PropertyLocks);
     SideTableLocksSucceedLocks(CppObjectLocks);
-    SideTableLocksSucceedLock(&AssociationsManagerLock);
+    AssociationsLocksPrecedeSideTableLocks();
 
-    PropertyLocks.precedeLock(&AssociationsManagerLock);
-    CppObjectLocks.precedeLock(&AssociationsManagerLock);
+    AssociationsLocksSucceedLocks(PropertyLocks);
+    AssociationsLocksSucceedLocks(CppObjectLocks);
     
 #if __OBJC2__
     lockdebug_lock_precedes_lock(&classInitLock, &runtimeLock);
+    // sel_lock() callers insert into the selector table.
+    SelectorLocksSucceedLock(&selLock);
+#endif
+
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+    // The refcount tables may grow inside a SideTable lock.
+    SideTableLocksPrecedeLock(&RefcountTableLock);
 #endif
 
 #if __OBJC2__
@@ -761,6 +804,10 @@ static void defineLockOrder()
 
     // Striped locks use address order internally.
     SideTableDefineLockOrder();
+    AssociationsDefineLockOrder();
+#if __OBJC2__
+    SelectorLocksDefineLockOrder();
+#endif
     PropertyLocks.defineLockOrder();
     StructLocks.defineLockOrder();
     CppObjectLocks.defineLockOrder();
@@ -780,8 +827,11 @@ void _objc_atfork_prepare()
     loadMethodLock.lock();
     PropertyLocks.lockAll();
     CppObjectLocks.lockAll();
-    AssociationsManagerLock.lock();
+    AssociationsLockAll();
     SideTableLockAll();
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+    RefcountTableLock.lock();
+#endif
     classInitLock.enter();
 #if __OBJC2__
     runtimeLock.write();
@@ -793,9 +843,17 @@ void _objc_atfork_prepare()
     impLock.lock();
 #endif
     selLock.write();
+#if __OBJC2__
+    SelectorLocksLockAll();
+#endif
     cacheUpdateLock.lock();
     objcMsgLogLock.lock();
     AltHandlerDebugLock.lock();
+    PoolPageLock.lock();
+    TrampolineLock.lock();
+#if SUPPORT_INSTANCE_SLABS
+    InstanceSlabLock.lock();
+#endif
     StructLocks.lockAll();
     crashlog_lock.lock();
 
@@ -810,14 +868,25 @@ void _objc_atfork_parent()
     CppObjectLocks.unlockAll();
     StructLocks.unlockAll();
     PropertyLocks.unlockAll();
-    AssociationsManagerLock.unlock();
+    AssociationsUnlockAll();
     AltHandlerDebugLock.unlock();
+    PoolPageLock.unlock();
+    TrampolineLock.unlock();
+#if SUPPORT_INSTANCE_SLABS
+    InstanceSlabLock.unlock();
+#endif
     objcMsgLogLock.unlock();
     crashlog_lock.unlock();
     loadMethodLock.unlock();
     cacheUpdateLock.unlock();
     selLock.unlockWrite();
+#if __OBJC2__
+    SelectorLocksUnlockAll();
+#endif
     SideTableUnlockAll();
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+    RefcountTableLock.unlock();
+#endif
 #if __OBJC2__
     DemangleCacheLock.unlock();
     runtimeLock.unlockWrite();
@@ -844,17 +913,33 @@ void _objc_atfork_child()
     CppObjectLocks.forceResetAll();
     StructLocks.forceResetAll();
     PropertyLocks.forceResetAll();
-    AssociationsManagerLock.forceReset();
+#if SUPPORT_LOCKFREE_ACCESSORS
+    PropertyReaders.forceResetAll();
+#endif
+    AssociationsForceResetAll();
     AltHandlerDebugLock.forceReset();
+    PoolPageLock.forceReset();
+    TrampolineLock.forceReset();
+#if SUPPORT_INSTANCE_SLABS
+    InstanceSlabLock.forceReset();
+#endif
     objcMsgLogLock.forceReset();
     crashlog_lock.forceReset();
     loadMethodLock.forceReset();
     cacheUpdateLock.forceReset();
     selLock.forceReset();
+#if __OBJC2__
+    SelectorLocksForceResetAll();
+#endif
     SideTableForceResetAll();
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+    RefcountTableLock.forceReset();
+    RefcountTablesForceReset();
+#endif
 #if __OBJC2__
     DemangleCacheLock.forceReset();
     runtimeLock.forceReset();
+    LockFreeLookupsForceReset();
 #else
     impLock.forceReset();
     NXUniqueStringLock.forceReset();
@@ -862,11 +947,73 @@ void _objc_atfork_child()
     classLock.forceReset();
 #endif
     classInitLock.forceReset();
+    lockprof_forceReset();
 
     lockdebug_assert_no_locks_locked();
 }
 
 
+/***********************************************************************
+* printStripeStatistics
+* Print lock counts for each striped lock table at exit.
+* OBJC_PRINT_STRIPE_STATISTICS
+**********************************************************************/
+static void printStripeStatistics(void)
+{
+    SideTablePrintStatistics();
+    PropertyLocks.printStatistics("PropertyLocks");
+    StructLocks.printStatistics("StructLocks");
+    CppObjectLocks.printStatistics("CppObjectLocks");
+    AssociationsPrintStatistics();
+#if __OBJC2__
+    SelectorLocksPrintStatistics();
+#endif
+    _syncPrintStripeStatistics();
+}
+
+
+/***********************************************************************
+* nameProfiledLocks
+* Name each runtime lock for the lock profiler. Locks that are not named
+* here are counted as "other locks".
+* OBJC_PROFILE_LOCKS
+**********************************************************************/
+static void nameProfiledLocks(void)
+{
+#define NAME_LOCK(lock) lockprof_name_lock(&lock, sizeof(lock), #lock)
+#if __OBJC2__
+    NAME_LOCK(runtimeLock);
+    NAME_LOCK(DemangleCacheLock);
+    SelectorLocksNameProfiledLocks();
+#else
+    NAME_LOCK(classLock);
+    NAME_LOCK(methodListLock);
+    NAME_LOCK(NXUniqueStringLock);
+    NAME_LOCK(impLock);
+#endif
+    NAME_LOCK(selLock);
+    NAME_LOCK(cacheUpdateLock);
+    NAME_LOCK(crashlog_lock);
+    NAME_LOCK(objcMsgLogLock);
+    NAME_LOCK(AltHandlerDebugLock);
+    NAME_LOCK(PoolPageLock);
+    NAME_LOCK(TrampolineLock);
+#if SUPPORT_INSTANCE_SLABS
+    NAME_LOCK(InstanceSlabLock);
+#endif
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+    NAME_LOCK(RefcountTableLock);
+#endif
+#undef NAME_LOCK
+    SideTableNameProfiledLocks();
+    PropertyLocks.nameProfiledLocks("PropertyLocks");
+    StructLocks.nameProfiledLocks("StructLocks");
+    CppObjectLocks.nameProfiledLocks("CppObjectLocks");
+    AssociationsNameProfiledLocks();
+    _syncNameProfiledLocks();
+}
+
+
 /***********************************************************************
 * _objc_init
 * Bootstrap initialization. Registers our image notifier with dyld.
@@ -891,6 +1038,26 @@ void _objc_init(void)
     tls_init();
     static_init();
     lock_init();
+#if LOCKDEBUG
+    defineLockOrder();
+#endif
+    if (PrintStripeStatistics) atexit(printStripeStatistics);
+    if (PrintSyncStatistics) atexit(_syncPrintStatistics);
+#if __OBJC2__
+    if (PrintCacheStatistics) atexit(_objc_printCacheStatistics);
+    if (PrintCategoryStatistics) atexit(_objc_printCategoryStatistics);
+#endif
+#if SUPPORT_PINNED_REFCOUNT
+    if (PrintRetainCountStatistics) atexit(_objc_printRetainCountStatistics);
+#endif
+#if SUPPORT_INSTANCE_SLABS
+    if (PrintSlabStatistics) atexit(instance_slab_print_statistics);
+#endif
+    if (ProfileLocks) {
+        nameProfiledLocks();
+        lockprof_init();
+        atexit(lockprof_print);
+    }
     exception_init();
     //// dyld: the dynamic link editor
     /// dyld 动态连接器 通知注册 map_images, load_images, unmap_images 操作
@@ -899,29 +1066,43 @@ void _objc_init(void)
 
 
 /***********************************************************************
-* _headerForAddress.
+* _headerContainsAddress
+* Returns true if addr is in one of the image's data segments.
 * addr can be a class or a category
 **********************************************************************/
-static const header_info *_headerForAddress(void *addr)
+static bool _headerContainsAddress(const header_info *hi, void *addr)
 {
 #if __OBJC2__
     const char *segnames[] = { "__DATA", "__DATA_CONST", "__DATA_DIRTY" };
 #else
     const char *segnames[] = { "__OBJC" };
 #endif
+
+    for (size_t i = 0; i < sizeof(segnames)/sizeof(segnames[0]); i++) {
+        unsigned long seg_size;            
+        uint8_t *seg = getsegmentdata(hi->mhdr(), segnames[i], &seg_size);
+        if (!seg) continue;
+        
+        // Is the class in this header?
+        if ((uint8_t *)addr >= seg  &&  (uint8_t *)addr < seg + seg_size) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/***********************************************************************
+* _headerForAddress.
+* addr can be a class or a category
+**********************************************************************/
+static const header_info *_headerForAddress(void *addr)
+{
     header_info *hi;
 
     for (hi = FirstHeader; hi != NULL; hi = hi->getNext()) {
-        for (size_t i = 0; i < sizeof(segnames)/sizeof(segnames[0]); i++) {
-            unsigned long seg_size;            
-            uint8_t *seg = getsegmentdata(hi->mhdr(), segnames[i], &seg_size);
-            if (!seg) continue;
-            
-            // Is the class in this header?
-            if ((uint8_t *)addr >= seg  &&  (uint8_t *)addr < seg + seg_size) {
-                return hi;
-            }
-        }
+        if (_headerContainsAddress(hi, addr)) return hi;
     }
 
     // Not found
@@ -940,6 +1121,17 @@ const header_info *_headerForClass(Class cls)
 }
 
 
+/***********************************************************************
+* _headerContainsClass
+* Returns true if this class is in the given image. 
+* Cheaper than comparing _headerForClass(cls) with hi.
+**********************************************************************/
+bool _headerContainsClass(const header_info *hi, Class cls)
+{
+    return _headerContainsAddress(hi, cls);
+}
+
+
 /**********************************************************************
 * secure_open
 * Securely open a file from a world-writable directory (like /tmp)
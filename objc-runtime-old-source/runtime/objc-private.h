@@ -263,6 +263,13 @@ private:
     bool sidetable_addExtraRC_nolock(size_t delta_rc);
     size_t sidetable_subExtraRC_nolock(size_t delta_rc);
     size_t sidetable_getExtraRC_nolock();
+
+    // Pinned retain counts for nonpointer isa (see objc-refcount.h)
+    bool pinned_retain(bool pin);
+    bool pinned_release(bool *moved);
+    size_t pinned_getRC();
+    size_t pinned_moveRC_nolock();
+    void pinned_clearRC();
 #endif
 
     // Side-table-only retain count
@@ -284,6 +291,12 @@ private:
 #if DEBUG
     bool sidetable_present();
 #endif
+
+#if SUPPORT_CONCURRENT_REFCOUNT
+    // Publish several deferred releases at once.
+    friend struct RefcountBuffer;
+    uintptr_t sidetable_releaseBatch(size_t count);
+#endif
 };
 
 
@@ -332,7 +345,7 @@ typedef struct old_property *objc_property_t;
 #include "objc-loadmethod.h"
 
 
-#if SUPPORT_PREOPT  &&  __cplusplus
+#if (SUPPORT_PREOPT  ||  SUPPORT_PREOPT_SIDECAR)  &&  __cplusplus
 #include <objc-shared-cache.h>
 using objc_selopt_t = const objc_opt::objc_selopt_t;
 #else
@@ -557,6 +570,15 @@ extern unsigned getPreoptimizedClassUnreasonableCount();
 extern Class getPreoptimizedClass(const char *name);
 extern Class* copyPreoptimizedClasses(const char *name, int *outCount);
 
+/* preoptimization sidecar */
+extern void preopt_sidecar_init(void);
+extern bool preoptSidecarAddHeader(const header_info *hi);
+extern void preoptSidecarRemoveHeader(const header_info *hi);
+extern bool preoptSidecarHasHeader(const header_info *hi);
+extern const objc_selopt_t *preoptSidecarSelectors(void);
+extern unsigned getPreoptSidecarClassUnreasonableCount();
+extern Class getPreoptSidecarClass(const char *name);
+
 extern Class _calloc_class(size_t size);
 
 /* method lookup */
@@ -667,6 +689,10 @@ typedef struct {
     struct _objc_initializing_classes *initializingClasses; // for +initialize
     struct SyncCache *syncCache;  // for @synchronize
     struct alt_handler_list *handlerList;  // for exception alt handlers
+    struct RefcountBuffer *refcountBuffer;  // for deferred side table releases
+    struct InstanceSlabCache *instanceSlabCache;  // for slab instance allocation
+    struct TrampolineCache *trampolineCache;  // for imp_implementationWithBlock
+    struct cache_reader_t *cacheReader;  // for method cache garbage collection
     char *printableNames[4];  // temporary demangled names for logging
 
     // If you add new fields here, don't forget to update 
@@ -686,15 +712,33 @@ extern char * encoding_copyReturnType(const char *t);
 extern void encoding_getArgumentType(const char *t, unsigned int index, char *dst, size_t dst_len);
 extern char *encoding_copyArgumentType(const char *t, unsigned int index);
 
+#if __OBJC2__
+// objc-runtime-new.mm
+extern void _objc_printCategoryStatistics(void);
+#endif
+
 // sync.h
 extern void _destroySyncCache(struct SyncCache *cache);
+extern void _syncPrintStripeStatistics(void);
+extern void _syncNameProfiledLocks(void);
+extern void _syncPrintStatistics(void);
 
 // arr
 extern void arr_init(void);
+#if SUPPORT_PINNED_REFCOUNT
+extern void _objc_printRetainCountStatistics(void);
+#endif
 extern id objc_autoreleaseReturnValue(id obj);
 
 // block trampolines
 extern IMP _imp_implementationWithBlockNoCopy(id block);
+extern void _destroyTrampolineCache(struct TrampolineCache *cache);
+
+// method cache garbage collection
+#if __OBJC2__
+extern void cache_quiescent_state(void);
+extern void _destroyCacheReader(struct cache_reader_t *reader);
+#endif
 
 // layout.h
 typedef struct {
@@ -735,6 +779,7 @@ extern const char ** _objc_copyClassNamesForImage(header_info *hi, unsigned int
 
 
 extern const header_info *_headerForClass(Class cls);
+extern bool _headerContainsClass(const header_info *hi, Class cls);
 
 extern Class _class_remap(Class cls);
 extern Class _class_getNonMetaClass(Class cls, id obj);
@@ -862,85 +907,263 @@ class TimeLogger {
 // for cache-friendly lock striping. 
 // For example, this may be used as StripedMap<spinlock_t>
 // or as StripedMap<SomeStruct> where SomeStruct stores a spin lock.
+//
+// The stripes are allocated on first use, so a global StripedMap is 
+// constant-initialized and works before C++ static initializers run. 
+// The stripe count is the smallest power of two that is at least 
+// StripesPerCPU times the number of online CPUs, clamped to 
+// [MinStripeCount, MaxStripeCount]. Stripes are padded to a cache line. 
+// The map is never destroyed because other threads may still be locking 
+// stripes while the process exits.
+//
+// Each stripe counts its lock acquisitions and contended acquisitions 
+// when OBJC_PRINT_STRIPE_STATISTICS is set. Locks taken via lockStripe() 
+// are counted; locks taken directly are not.
 template<typename T>
 class StripedMap {
 
     enum { CacheLineSize = 64 };
 
 #if TARGET_OS_EMBEDDED
-    enum { StripeCount = 8 };
+    enum { MinStripeCount = 8, MaxStripeCount = 256, StripesPerCPU = 2 };
 #else
-    enum { StripeCount = 64 };
+    enum { MinStripeCount = 64, MaxStripeCount = 4096, StripesPerCPU = 4 };
 #endif
 
     struct PaddedT {
         T value alignas(CacheLineSize);
+        // Updated only while holding the stripe's lock.
+        size_t acquisitions;
+        size_t contentions;
     };
 
-    PaddedT array[StripeCount];
+    // nil until first use, and Allocating while one thread allocates.
+    std::atomic<PaddedT *> stripeArray;
+    unsigned int stripeCount;
+    unsigned int stripeShift;
+
+#define Allocating ((PaddedT *)1)
+
+    PaddedT *stripes() {
+        PaddedT *result = stripeArray.load(std::memory_order_acquire);
+        if (slowpath(result == nil  ||  result == Allocating)) {
+            result = allocateStripes();
+        }
+        return result;
+    }
+
+    const PaddedT *stripes() const {
+        return const_cast<StripedMap<T> *>(this)->stripes();
+    }
 
-    static unsigned int indexForPointer(const void *p) {
+    NEVER_INLINE PaddedT *allocateStripes() {
+        PaddedT *expected = nil;
+        if (!stripeArray.compare_exchange_strong(expected, Allocating, 
+                                                 std::memory_order_acquire)) 
+        {
+            // Another thread is allocating, or just finished.
+            PaddedT *result;
+            while ((result = stripeArray.load(std::memory_order_acquire)) 
+                   == Allocating) 
+            {
+                sched_yield();
+            }
+            return result;
+        }
+
+        unsigned int count = computeStripeCount();
+        void *buf;
+        if (posix_memalign(&buf, CacheLineSize, count * sizeof(PaddedT)) != 0)
+        {
+            _objc_fatal("could not allocate %u lock stripes", count);
+        }
+        PaddedT *result = (PaddedT *)buf;
+        for (unsigned int i = 0; i < count; i++) {
+            new (&result[i]) PaddedT();
+        }
+
+#if DEBUG
+        // Verify alignment expectations.
+        uintptr_t base = (uintptr_t)&result[0].value;
+        uintptr_t delta = (uintptr_t)&result[1].value - base;
+        assert(delta % CacheLineSize == 0);
+        assert(base % CacheLineSize == 0);
+        assert((count & (count-1)) == 0);
+#endif
+
+        // The release store publishes the count and shift with the stripes.
+        stripeCount = count;
+        stripeShift = WORD_BITS - __builtin_ctz(count);
+        stripeArray.store(result, std::memory_order_release);
+        return result;
+    }
+
+#undef Allocating
+
+    unsigned int indexForPointer(const void *p) const {
+        // Fibonacci hashing. The multiply folds every address bit 
+        // into the high bits, which select the stripe. The low 4 bits 
+        // are mixed in first because they are usually zero.
         uintptr_t addr = reinterpret_cast<uintptr_t>(p);
-        return ((addr >> 4) ^ (addr >> 9)) % StripeCount;
+        addr ^= addr >> 4;
+#if __LP64__
+        addr *= 0x9e3779b97f4a7c15;
+#else
+        addr *= 0x9e3779b9;
+#endif
+        return (unsigned int)(addr >> stripeShift);
+    }
+
+    static unsigned int computeStripeCount() {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus < 1) cpus = 1;
+        unsigned int count = MinStripeCount;
+        while (count < MaxStripeCount  &&  (long)count < cpus * StripesPerCPU) {
+            count *= 2;
+        }
+        return count;
     }
 
  public:
     T& operator[] (const void *p) { 
+        PaddedT *array = stripes();
         return array[indexForPointer(p)].value; 
     }
     const T& operator[] (const void *p) const { 
         return const_cast<StripedMap<T>>(this)[p]; 
     }
 
+    unsigned int getStripeCount() const { 
+        stripes();
+        return stripeCount; 
+    }
+
+    // Lock lock, which lives inside value, an element of some 
+    // StripedMap<T>. Counts the acquisition if statistics are enabled.
+    static void lockStripe(T& value, spinlock_t& lock) {
+        if (fastpath(!PrintStripeStatistics)) {
+            lock.lock();
+            return;
+        }
+        PaddedT *stripe = reinterpret_cast<PaddedT *>(&value);
+        if (!lock.tryLock()) {
+            lock.lock();
+            stripe->contentions++;
+        }
+        stripe->acquisitions++;
+    }
+
     // Shortcuts for StripedMaps of locks.
+    static void lockStripe(T& lock) {
+        lockStripe(lock, lock);
+    }
+
+    // Address-ordered lock discipline for a pair of stripes.
+    static void lockTwoStripes(T *lock1, T *lock2) {
+        if (lock1 < lock2) {
+            lockStripe(*lock1);
+            lockStripe(*lock2);
+        } else {
+            lockStripe(*lock2);
+            if (lock2 != lock1) lockStripe(*lock1);
+        }
+    }
+
     void lockAll() {
-        for (unsigned int i = 0; i < StripeCount; i++) {
+        PaddedT *array = stripes();
+        for (unsigned int i = 0; i < stripeCount; i++) {
             array[i].value.lock();
         }
     }
 
     void unlockAll() {
-        for (unsigned int i = 0; i < StripeCount; i++) {
+        PaddedT *array = stripes();
+        for (unsigned int i = 0; i < stripeCount; i++) {
             array[i].value.unlock();
         }
     }
 
     void forceResetAll() {
-        for (unsigned int i = 0; i < StripeCount; i++) {
+        PaddedT *array = stripes();
+        for (unsigned int i = 0; i < stripeCount; i++) {
             array[i].value.forceReset();
         }
     }
 
     void defineLockOrder() {
-        for (unsigned int i = 1; i < StripeCount; i++) {
+        PaddedT *array = stripes();
+        for (unsigned int i = 1; i < stripeCount; i++) {
             lockdebug_lock_precedes_lock(&array[i-1].value, &array[i].value);
         }
     }
 
     void precedeLock(const void *newlock) {
+        PaddedT *array = stripes();
         // assumes defineLockOrder is also called
-        lockdebug_lock_precedes_lock(&array[StripeCount-1].value, newlock);
+        lockdebug_lock_precedes_lock(&array[stripeCount-1].value, newlock);
     }
 
     void succeedLock(const void *oldlock) {
+        PaddedT *array = stripes();
         // assumes defineLockOrder is also called
         lockdebug_lock_precedes_lock(oldlock, &array[0].value);
     }
 
     const void *getLock(int i) {
-        if (i < StripeCount) return &array[i].value;
+        PaddedT *array = stripes();
+        if (i >= 0  &&  (unsigned int)i < stripeCount) return &array[i].value;
         else return nil;
     }
-    
-#if DEBUG
-    StripedMap() {
-        // Verify alignment expectations.
-        uintptr_t base = (uintptr_t)&array[0].value;
-        uintptr_t delta = (uintptr_t)&array[1].value - base;
-        assert(delta % CacheLineSize == 0);
-        assert(base % CacheLineSize == 0);
+
+    // For visiting every stripe, such as summing striped counters.
+    T& stripeAt(unsigned int i) {
+        PaddedT *array = stripes();
+        assert(i < stripeCount);
+        return array[i].value;
     }
-#endif
+
+    void getStatistics(unsigned int i, 
+                       size_t *outAcquisitions, size_t *outContentions) 
+    {
+        PaddedT *array = stripes();
+        assert(i < stripeCount);
+        *outAcquisitions = array[i].acquisitions;
+        *outContentions = array[i].contentions;
+    }
+
+    // Name every stripe's lock for OBJC_PROFILE_LOCKS.
+    void nameProfiledLocks(const char *name) {
+        PaddedT *array = stripes();
+        lockprof_name_lock(array, stripeCount * sizeof(PaddedT), name);
+    }
+
+    void printStatistics(const char *name) {
+        PaddedT *array = stripes();
+        size_t acquisitions = 0;
+        size_t contentions = 0;
+        size_t busiest = 0;
+        unsigned int used = 0;
+        for (unsigned int i = 0; i < stripeCount; i++) {
+            acquisitions += array[i].acquisitions;
+            contentions += array[i].contentions;
+            if (array[i].acquisitions) used++;
+            if (array[i].acquisitions > busiest) busiest = array[i].acquisitions;
+        }
+
+        _objc_inform("STRIPES: %s: %u stripes (%u used), %zu locks, "
+                     "%zu contended (%.1f%%), busiest stripe %zu locks", 
+                     name, stripeCount, used, acquisitions, contentions, 
+                     acquisitions ? 100.0 * contentions / acquisitions : 0.0,
+                     busiest);
+        for (unsigned int i = 0; i < stripeCount; i++) {
+            if (array[i].contentions == 0) continue;
+            _objc_inform("STRIPES: %s[%u]: %zu locks, %zu contended", 
+                         name, i, array[i].acquisitions, 
+                         array[i].contentions);
+        }
+    }
+
+    constexpr StripedMap() : stripeArray(nil), stripeCount(0), stripeShift(0) { }
 };
 
 
@@ -1057,6 +1280,12 @@ static uint32_t ptr_hash(uint32_t key)
 // Lock declarations
 #include "objc-locks.h"
 
+// Concurrent side table retain counts
+#include "objc-refcount.h"
+
+// Slab allocation of instances
+#include "objc-slab.h"
+
 // Inlined parts of objc_object's implementation
 #include "objc-object.h"
 
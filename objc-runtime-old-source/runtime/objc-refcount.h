@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2018 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-refcount.h
+* Concurrent side table retain counts and pinned retain counts.
+**********************************************************************/
+
+#ifndef _OBJC_REFCOUNT_H_
+#define _OBJC_REFCOUNT_H_
+
+#include "objc-config.h"
+
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+
+#include <atomic>
+#include <sched.h>
+
+/*
+The concurrent refcount table replaces SideTable::refcnts when the
+runtime is built with SUPPORT_CONCURRENT_REFCOUNT=1. A second table 
+holds pinned retain counts (see below).
+
+It is a single open-addressed table of (disguised object, refcount word)
+pairs. In ConcurrentRefcounts() the refcount word uses the same 
+SIDE_TABLE_* encoding as the RefcountMap it replaces; in PinnedRefcounts() 
+it is a plain count. Lookups and refcount updates never take a lock:
+keys are claimed with a compare-and-swap and refcount words are updated
+with a compare-and-swap loop. A refcount word of zero is equivalent to
+"no entry", so erasing an object just stores zero and leaves its key
+behind for the next object allocated at the same address.
+
+Only growth takes RefcountTableLock. The grower freezes every slot of the
+old storage by swapping in the MOVED sentinels, copies the live entries
+into the new storage, and then publishes it. Any thread that sees a
+sentinel waits for the new storage and retries. Erased keys are not 
+copied, so a table whose objects come and go is compacted at the same 
+size instead of growing.
+
+Every pass over the storage counts itself in `readers`, striped by 
+object address like PropertyReaders. After publishing the new storage 
+the grower waits for every reader that could have loaded the old one 
+and then frees it, so at most two storages exist at a time. Readers 
+never wait for the grower while counted except for the publish, which 
+comes before that wait, and grow() itself is called uncounted.
+*/
+
+class ConcurrentRefcountMap {
+    // Never a valid disguised object pointer (objects are 16-byte aligned).
+    static const uintptr_t KeyEmpty = 0;
+    static const uintptr_t KeyMoved = 1;
+    // Never a valid refcount word (pinned counts have no count bits set).
+    static const uintptr_t ValueMoved = ~(uintptr_t)0;
+
+    enum { InitialCapacity = 1024 };
+
+    struct Entry {
+        std::atomic<uintptr_t> key;
+        std::atomic<uintptr_t> value;
+    };
+
+    struct Storage {
+        uintptr_t mask;
+        std::atomic<uintptr_t> occupied;
+        Entry entries[0];
+
+        uintptr_t capacity() const { return mask + 1; }
+    };
+
+    std::atomic<Storage *> storage;
+    StripedMap<readcount_t> *readers;
+
+    // Counts a reader of storage for as long as it is in scope.
+    class ReadScope {
+        readcount_t& counts;
+        unsigned which;
+     public:
+        ReadScope(ConcurrentRefcountMap& map, const void *obj)
+            : counts((*map.readers)[obj]), which(counts.enter()) { }
+        ~ReadScope() { counts.leave(which); }
+    };
+
+    // Loads storage for a counted reader. Pairs with the seq_cst 
+    // store in grow() and readcount_t::synchronize().
+    Storage *currentStorage() {
+        return storage.load(std::memory_order_seq_cst);
+    }
+
+    // Same disguise as DisguisedPtr so `leaks` does not see the table
+    // as a root for every object with an extra retain count.
+    static uintptr_t disguise(objc_object *obj) {
+        return -(uintptr_t)obj;
+    }
+
+    static Storage *allocateStorage(uintptr_t capacity);
+
+    // Find obj's entry in s. Returns nil if there is no entry and
+    // insert is false. Sets *moved and returns nil if s is being
+    // migrated or is too full to insert.
+    static Entry *lookup(Storage *s, uintptr_t key, bool insert, bool *moved);
+
+    // Grow or compact storage s. Returns once s is no longer current.
+    // The caller must not be counted in readers.
+    void grow(Storage *s);
+
+    void waitForMigration(Storage *s) {
+        while (storage.load(std::memory_order_acquire) == s) {
+            sched_yield();
+        }
+    }
+
+ public:
+    void init() {
+        readers = new StripedMap<readcount_t>();
+        storage.store(allocateStorage(InitialCapacity),
+                      std::memory_order_release);
+    }
+
+    // Fork child. Readers that were counted in other threads are gone.
+    void forceResetReaders() {
+        if (readers) readers->forceResetAll();
+    }
+
+    // Returns obj's refcount word, or 0 if it has none.
+    uintptr_t load(objc_object *obj) {
+        uintptr_t key = disguise(obj);
+        ReadScope scope(*this, obj);
+        while (true) {
+            Storage *s = currentStorage();
+            bool moved = false;
+            Entry *e = lookup(s, key, false, &moved);
+            if (slowpath(moved)) { waitForMigration(s); continue; }
+            if (!e) return 0;
+            uintptr_t v = e->value.load(std::memory_order_acquire);
+            if (slowpath(v == ValueMoved)) { waitForMigration(s); continue; }
+            return v;
+        }
+    }
+
+    // Atomically replaces obj's refcount word v with fn(v).
+    // fn may be called more than once and must not have side effects.
+    // fn sees 0 if obj has no entry. No entry is created if fn returns
+    // its argument unchanged. Returns the old refcount word.
+    template <typename Fn>
+    uintptr_t update(objc_object *obj, const Fn& fn) {
+        uintptr_t key = disguise(obj);
+        bool insert = false;
+        while (true) {
+            Storage *s;
+            {
+                ReadScope scope(*this, obj);
+                s = currentStorage();
+                bool moved = false;
+                Entry *e = lookup(s, key, insert, &moved);
+                if (!moved) {
+                    if (!e) {
+                        // No entry. Only create one if fn actually 
+                        // changes the value.
+                        if (fn(0) == 0) return 0;
+                        insert = true;
+                        continue;
+                    }
+
+                    uintptr_t oldValue = 
+                        e->value.load(std::memory_order_relaxed);
+                    while (true) {
+                        if (slowpath(oldValue == ValueMoved)) break;
+                        uintptr_t newValue = fn(oldValue);
+                        if (newValue == oldValue) return oldValue;
+                        if (e->value.compare_exchange_weak(oldValue, newValue,
+                                                           std::memory_order_acq_rel,
+                                                           std::memory_order_relaxed))
+                        {
+                            return oldValue;
+                        }
+                    }
+                }
+                if (!moved  ||  !insert) {
+                    waitForMigration(s);
+                    continue;
+                }
+            }
+            // Out of room. grow() waits for counted readers, 
+            // so it is called outside the scope.
+            grow(s);
+        }
+    }
+
+    // Removes obj's refcount word. Returns the old refcount word.
+    uintptr_t erase(objc_object *obj) {
+        return update(obj, [](uintptr_t) -> uintptr_t { return 0; });
+    }
+
+    // Number of slots in use and allocated, for statistics.
+    void getSize(size_t *outOccupied, size_t *outCapacity) {
+        ReadScope scope(*this, nil);
+        Storage *s = currentStorage();
+        *outOccupied = s->occupied.load(std::memory_order_relaxed);
+        *outCapacity = s->capacity();
+    }
+};
+
+// SUPPORT_CONCURRENT_REFCOUNT || SUPPORT_PINNED_REFCOUNT
+#endif
+
+
+#if SUPPORT_CONCURRENT_REFCOUNT
+
+extern ConcurrentRefcountMap& ConcurrentRefcounts();
+
+
+// Per-thread deferred side table releases.
+// When OBJC_DEFER_SIDETABLE_RELEASE is set, -release of a raw-isa object
+// is recorded in a small per-thread buffer instead of being published.
+// A later -retain of the same object on the same thread cancels the
+// pending release without touching the shared table. Deferring a release
+// only ever keeps an object alive longer, so this is safe, but -dealloc
+// may run later than it otherwise would: the buffer is flushed when it
+// fills, when an autorelease pool is popped, and when the thread exits.
+struct RefcountBuffer {
+    enum { Capacity = 32 };
+
+    struct Entry {
+        objc_object *obj;
+        size_t pendingReleases;
+    };
+
+    unsigned count;
+    bool flushing;
+    Entry entries[Capacity];
+
+    // Returns true if obj's release was deferred.
+    static bool deferRelease(objc_object *obj);
+    // Returns true if obj's retain was absorbed by a pending release.
+    static bool cancelRelease(objc_object *obj);
+    // Publishes all of this thread's pending releases.
+    static void flush();
+    // Thread teardown.
+    static void destroy(RefcountBuffer *buffer);
+
+ private:
+    static RefcountBuffer *get(bool create);
+    void flushEntries();
+};
+
+// SUPPORT_CONCURRENT_REFCOUNT
+#endif
+
+
+#if SUPPORT_PINNED_REFCOUNT
+
+/*
+Pinned retain counts for nonpointer isa.
+
+Normally, when an object's inline extra_rc overflows, half of it moves to 
+the side table, and when extra_rc later underflows, half moves back. An 
+object whose count hovers around the inline limit - a singleton, a cached 
+string - takes the SideTable lock for each of those trips.
+
+With OBJC_PIN_OVERFLOWED_RETAIN_COUNTS, the first overflow instead sets 
+has_sidetable_rc and leaves extra_rc full. From then on the object is 
+pinned: every retain adds to its word in PinnedRefcounts(), and every 
+release subtracts from that word until it is zero and only then from 
+extra_rc. Neither takes a lock. Only the release that finds both empty 
+takes the SideTable lock, checks the pinned word again, and deallocates.
+-_tryRetain is always called with the SideTable lock held, so it can 
+not race with that decision.
+
+changeIsa() to a raw isa moves the pinned count to the side table and 
+leaves PinnedMoved behind. Retains and releases that see it start over.
+
+Deallocating a pinned object erases its address, so the set of keys 
+churns constantly. Each erase leaves a dead slot that the next compaction 
+drops, and compaction frees the storage it replaces, so the table stays 
+near the size of the live pinned set.
+*/
+static const uintptr_t PinnedMoved = ~(uintptr_t)0 - 1;
+
+extern ConcurrentRefcountMap& PinnedRefcounts();
+
+// Counts of retain count transfers, for OBJC_PRINT_RETAIN_COUNT_STATISTICS 
+// and _objc_getRetainCountStatistics().
+struct RetainCountStatistics {
+    std::atomic<uint64_t> overflows;  // extra_rc overflowed
+    std::atomic<uint64_t> borrows;    // extra_rc refilled from the side table
+    std::atomic<uint64_t> pins;       // objects pinned at their first overflow
+
+    static void count(std::atomic<uint64_t>& counter) {
+        counter.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+extern RetainCountStatistics RetainCountStats;
+
+// SUPPORT_PINNED_REFCOUNT
+#endif
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2018 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-refcount.mm
+* Concurrent side table retain counts and pinned retain counts.
+**********************************************************************/
+
+#include "objc-private.h"
+#include "objc-refcount.h"
+
+#if SUPPORT_CONCURRENT_REFCOUNT  ||  SUPPORT_PINNED_REFCOUNT
+
+mutex_t RefcountTableLock;
+
+#if SUPPORT_CONCURRENT_REFCOUNT
+// Zero-filled; initialized by arr_init() before any object is retained.
+static ConcurrentRefcountMap RefcountTable;
+
+ConcurrentRefcountMap& ConcurrentRefcounts()
+{
+    return RefcountTable;
+}
+#endif
+
+#if SUPPORT_PINNED_REFCOUNT
+// Zero-filled; initialized by arr_init() if OBJC_PIN_OVERFLOWED_RETAIN_COUNTS 
+// is set. Never used otherwise.
+static ConcurrentRefcountMap PinnedTable;
+
+ConcurrentRefcountMap& PinnedRefcounts()
+{
+    return PinnedTable;
+}
+
+RetainCountStatistics RetainCountStats;
+#endif
+
+
+ConcurrentRefcountMap::Storage *
+ConcurrentRefcountMap::allocateStorage(uintptr_t capacity)
+{
+    assert(capacity  &&  (capacity & (capacity-1)) == 0);
+    Storage *s = (Storage *)
+        calloc(1, sizeof(Storage) + capacity * sizeof(Entry));
+    if (!s) _objc_fatal("could not allocate refcount table of %lu entries",
+                        (unsigned long)capacity);
+    s->mask = capacity - 1;
+    return s;
+}
+
+
+ConcurrentRefcountMap::Entry *
+ConcurrentRefcountMap::lookup(Storage *s, uintptr_t key,
+                              bool insert, bool *moved)
+{
+    uintptr_t mask = s->mask;
+    uintptr_t begin = ptr_hash(key) & mask;
+    uintptr_t i = begin;
+    do {
+        Entry *e = &s->entries[i];
+        uintptr_t k = e->key.load(std::memory_order_acquire);
+        if (k == key) return e;
+        if (k == KeyMoved) {
+            *moved = true;
+            return nil;
+        }
+        if (k == KeyEmpty) {
+            if (!insert) return nil;
+
+            // Keep the table at most 3/4 full so probes stay short.
+            if (s->occupied.load(std::memory_order_relaxed) >=
+                s->capacity() / 4 * 3)
+            {
+                *moved = true;
+                return nil;
+            }
+            if (e->key.compare_exchange_strong(k, key,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_acquire))
+            {
+                s->occupied.fetch_add(1, std::memory_order_relaxed);
+                return e;
+            }
+            // Lost the race for this slot. Someone may have
+            // inserted the same key, or the table may be moving.
+            if (k == key) return e;
+            if (k == KeyMoved) {
+                *moved = true;
+                return nil;
+            }
+        }
+        i = (i + 1) & mask;
+    } while (i != begin);
+
+    // Table is full of other keys.
+    if (insert) *moved = true;
+    return nil;
+}
+
+
+void
+ConcurrentRefcountMap::grow(Storage *s)
+{
+    mutex_locker_t lock(RefcountTableLock);
+
+    if (storage.load(std::memory_order_acquire) != s) {
+        // Someone else already replaced it.
+        return;
+    }
+
+    // Count live entries to decide between compaction and growth.
+    // This is racy but only affects the choice of size:
+    // the new storage is never smaller than the old one.
+    uintptr_t oldCapacity = s->capacity();
+    uintptr_t live = 0;
+    for (uintptr_t i = 0; i < oldCapacity; i++) {
+        uintptr_t v = s->entries[i].value.load(std::memory_order_relaxed);
+        if (v != 0) live++;
+    }
+    uintptr_t newCapacity = oldCapacity;
+    if (live * 2 >= oldCapacity) newCapacity = oldCapacity * 2;
+
+    Storage *n = allocateStorage(newCapacity);
+    uintptr_t newMask = n->mask;
+    uintptr_t copied = 0;
+
+    for (uintptr_t i = 0; i < oldCapacity; i++) {
+        Entry *e = &s->entries[i];
+
+        // Freeze the slot. Empty keys become KeyMoved so nobody can
+        // claim them; values become ValueMoved so nobody can update them.
+        uintptr_t k = KeyEmpty;
+        if (e->key.compare_exchange_strong(k, KeyMoved,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_acquire))
+        {
+            continue;
+        }
+        // k now holds the slot's real key.
+        uintptr_t v = e->value.exchange(ValueMoved, std::memory_order_acq_rel);
+        if (v == 0) continue;
+
+        // Nobody else can see n yet, so plain probing is enough.
+        uintptr_t j = ptr_hash(k) & newMask;
+        while (n->entries[j].key.load(std::memory_order_relaxed) != KeyEmpty) {
+            j = (j + 1) & newMask;
+        }
+        n->entries[j].key.store(k, std::memory_order_relaxed);
+        n->entries[j].value.store(v, std::memory_order_relaxed);
+        copied++;
+    }
+
+    n->occupied.store(copied, std::memory_order_relaxed);
+
+    // Waiters spin until this store. seq_cst pairs with readers' 
+    // loads in currentStorage().
+    storage.store(n, std::memory_order_seq_cst);
+
+    // Free s once no reader can still be probing it.
+    for (unsigned int i = 0; i < readers->getStripeCount(); i++) {
+        readers->stripeAt(i).synchronize();
+    }
+    free(s);
+}
+
+void
+RefcountTablesForceReset()
+{
+#if SUPPORT_CONCURRENT_REFCOUNT
+    RefcountTable.forceResetReaders();
+#endif
+#if SUPPORT_PINNED_REFCOUNT
+    PinnedTable.forceResetReaders();
+#endif
+}
+
+// SUPPORT_CONCURRENT_REFCOUNT || SUPPORT_PINNED_REFCOUNT
+#endif
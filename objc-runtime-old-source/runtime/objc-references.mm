@@ -27,127 +27,33 @@
 
 #include "objc-private.h"
 #include <objc/message.h>
-#include <map>
+#include <atomic>
 
-#if _LIBCPP_VERSION
-#   include <unordered_map>
-#else
-#   include <tr1/unordered_map>
-    using namespace tr1;
-#endif
+/*
+  Associated objects live in a StripedMap of shards selected by object 
+  address. Each shard owns an open-addressed table with one 
+  ObjectAssociations per object. An ObjectAssociations stores up to 
+  InlineCount associations in place and spills the rest into a 
+  malloc'd overflow array.
+
+  Writers take the shard's lock and make the shard's sequence number 
+  odd while they change anything. Getters whose policy does not retain 
+  (ASSIGN and the NONATOMIC policies) read without the lock: they probe 
+  the table, copy the association, and retry if the sequence number 
+  changed meanwhile. Getters that must retain the value, or that would 
+  need to search the overflow array, take the lock.
 
+  A lock-free reader may still be probing a table after a writer has 
+  replaced it, so tables are never freed. A shard keeps its replaced 
+  tables and reuses one of the right size the next time it rehashes. 
+  Reused tables are only written while the sequence number is odd, so 
+  a reader still probing one will retry. Overflow arrays are only read 
+  under the lock and are freed normally.
+*/
 
 // wrap all the murky C++ details in a namespace to get them out of the way.
 
 namespace objc_references_support {
-    struct DisguisedPointerEqual {
-        bool operator()(uintptr_t p1, uintptr_t p2) const {
-            return p1 == p2;
-        }
-    };
-    
-    struct DisguisedPointerHash {
-        uintptr_t operator()(uintptr_t k) const {
-            // borrowed from CFSet.c
-#if __LP64__
-            uintptr_t a = 0x4368726973746F70ULL;
-            uintptr_t b = 0x686572204B616E65ULL;
-#else
-            uintptr_t a = 0x4B616E65UL;
-            uintptr_t b = 0x4B616E65UL; 
-#endif
-            uintptr_t c = 1;
-            a += k;
-#if __LP64__
-            a -= b; a -= c; a ^= (c >> 43);
-            b -= c; b -= a; b ^= (a << 9);
-            c -= a; c -= b; c ^= (b >> 8);
-            a -= b; a -= c; a ^= (c >> 38);
-            b -= c; b -= a; b ^= (a << 23);
-            c -= a; c -= b; c ^= (b >> 5);
-            a -= b; a -= c; a ^= (c >> 35);
-            b -= c; b -= a; b ^= (a << 49);
-            c -= a; c -= b; c ^= (b >> 11);
-            a -= b; a -= c; a ^= (c >> 12);
-            b -= c; b -= a; b ^= (a << 18);
-            c -= a; c -= b; c ^= (b >> 22);
-#else
-            a -= b; a -= c; a ^= (c >> 13);
-            b -= c; b -= a; b ^= (a << 8);
-            c -= a; c -= b; c ^= (b >> 13);
-            a -= b; a -= c; a ^= (c >> 12);
-            b -= c; b -= a; b ^= (a << 16);
-            c -= a; c -= b; c ^= (b >> 5);
-            a -= b; a -= c; a ^= (c >> 3);
-            b -= c; b -= a; b ^= (a << 10);
-            c -= a; c -= b; c ^= (b >> 15);
-#endif
-            return c;
-        }
-    };
-    
-    struct ObjectPointerLess {
-        bool operator()(const void *p1, const void *p2) const {
-            return p1 < p2;
-        }
-    };
-    
-    struct ObjcPointerHash {
-        uintptr_t operator()(void *p) const {
-            return DisguisedPointerHash()(uintptr_t(p));
-        }
-    };
-
-    // STL allocator that uses the runtime's internal allocator.
-    
-    template <typename T> struct ObjcAllocator {
-        typedef T                 value_type;
-        typedef value_type*       pointer;
-        typedef const value_type *const_pointer;
-        typedef value_type&       reference;
-        typedef const value_type& const_reference;
-        typedef size_t            size_type;
-        typedef ptrdiff_t         difference_type;
-
-        template <typename U> struct rebind { typedef ObjcAllocator<U> other; };
-
-        template <typename U> ObjcAllocator(const ObjcAllocator<U>&) {}
-        ObjcAllocator() {}
-        ObjcAllocator(const ObjcAllocator&) {}
-        ~ObjcAllocator() {}
-
-        pointer address(reference x) const { return &x; }
-        const_pointer address(const_reference x) const { 
-            return x;
-        }
-
-        pointer allocate(size_type n, const_pointer = 0) {
-            return static_cast<pointer>(::malloc(n * sizeof(T)));
-        }
-
-        void deallocate(pointer p, size_type) { ::free(p); }
-
-        size_type max_size() const { 
-            return static_cast<size_type>(-1) / sizeof(T);
-        }
-
-        void construct(pointer p, const value_type& x) { 
-            new(p) value_type(x); 
-        }
-
-        void destroy(pointer p) { p->~value_type(); }
-
-        void operator=(const ObjcAllocator&);
-
-    };
-
-    template<> struct ObjcAllocator<void> {
-        typedef void        value_type;
-        typedef void*       pointer;
-        typedef const void *const_pointer;
-        template <typename U> struct rebind { typedef ObjcAllocator<U> other; };
-    };
-  
     typedef uintptr_t disguised_ptr_t;
     inline disguised_ptr_t DISGUISE(id value) { return ~uintptr_t(value); }
     inline id UNDISGUISE(disguised_ptr_t dptr) { return id(~dptr); }
@@ -167,50 +73,288 @@ namespace objc_references_support {
         bool hasValue() { return _value != nil; }
     };
 
-#if TARGET_OS_WIN32
-    typedef hash_map<void *, ObjcAssociation> ObjectAssociationMap;
-    typedef hash_map<disguised_ptr_t, ObjectAssociationMap *> AssociationsHashMap;
-#else
-    typedef ObjcAllocator<std::pair<void * const, ObjcAssociation> > ObjectAssociationMapAllocator;
-    class ObjectAssociationMap : public std::map<void *, ObjcAssociation, ObjectPointerLess, ObjectAssociationMapAllocator> {
-    public:
-        void *operator new(size_t n) { return ::malloc(n); }
-        void operator delete(void *ptr) { ::free(ptr); }
+    struct ObjcAssociationEntry {
+        void *key;
+        ObjcAssociation association;
     };
-    typedef ObjcAllocator<std::pair<const disguised_ptr_t, ObjectAssociationMap*> > AssociationsHashMapAllocator;
-    class AssociationsHashMap : public unordered_map<disguised_ptr_t, ObjectAssociationMap *, DisguisedPointerHash, DisguisedPointerEqual, AssociationsHashMapAllocator> {
-    public:
-        void *operator new(size_t n) { return ::malloc(n); }
-        void operator delete(void *ptr) { ::free(ptr); }
+
+    // All associations of one object.
+    // The overflow array is used only while the inline entries are full.
+    struct ObjectAssociations {
+        enum { InlineCount = 4 };
+
+        // DISGUISE() never produces these.
+        static const disguised_ptr_t Empty = 0;
+        static const disguised_ptr_t Tombstone = 1;
+
+        disguised_ptr_t object;
+        uint32_t inlineCount;
+        uint32_t overflowCount;
+        uint32_t overflowCapacity;
+        ObjcAssociationEntry inlineEntries[InlineCount];
+        ObjcAssociationEntry *overflow;
+
+        ObjcAssociationEntry *find(void *key) {
+            for (uint32_t i = 0; i < inlineCount; i++) {
+                if (inlineEntries[i].key == key) return &inlineEntries[i];
+            }
+            for (uint32_t i = 0; i < overflowCount; i++) {
+                if (overflow[i].key == key) return &overflow[i];
+            }
+            return nil;
+        }
+
+        void add(void *key, ObjcAssociation association) {
+            if (inlineCount < InlineCount) {
+                inlineEntries[inlineCount++] = { key, association };
+                return;
+            }
+            if (overflowCount == overflowCapacity) {
+                overflowCapacity = overflowCapacity ? overflowCapacity*2 : 4;
+                overflow = (ObjcAssociationEntry *)
+                    realloc(overflow, overflowCapacity * sizeof(*overflow));
+            }
+            overflow[overflowCount++] = { key, association };
+        }
+
+        bool remove(void *key, ObjcAssociation *outOldAssociation) {
+            for (uint32_t i = 0; i < inlineCount; i++) {
+                if (inlineEntries[i].key != key) continue;
+                *outOldAssociation = inlineEntries[i].association;
+                if (overflowCount) {
+                    inlineEntries[i] = overflow[--overflowCount];
+                } else {
+                    inlineEntries[i] = inlineEntries[--inlineCount];
+                }
+                return true;
+            }
+            for (uint32_t i = 0; i < overflowCount; i++) {
+                if (overflow[i].key != key) continue;
+                *outOldAssociation = overflow[i].association;
+                overflow[i] = overflow[--overflowCount];
+                return true;
+            }
+            return false;
+        }
+    };
+
+    struct AssociationsTable {
+        uint32_t mask;
+        uint32_t occupied;  // objects plus tombstones
+        AssociationsTable *nextRetired;
+        ObjectAssociations entries[0];
+
+        uint32_t capacity() const { return mask + 1; }
+    };
+
+    struct AssociationsShard {
+        // Must be first. Lock ordering uses the address of each stripe.
+        spinlock_t slock;
+        // Odd while a writer is changing this shard.
+        std::atomic<uintptr_t> sequence;
+        std::atomic<AssociationsTable *> table;
+        // Replaced tables, kept for reuse. See above.
+        AssociationsTable *retired;
+
+        AssociationsShard() : sequence(0), table(nil), retired(nil) { }
+
+        void lock() { StripedMap<AssociationsShard>::lockStripe(*this, slock); }
+        void unlock() { slock.unlock(); }
+        void forceReset() { slock.forceReset(); }
+
+        void beginWrite() {
+            sequence.store(sequence.load(std::memory_order_relaxed) + 1, 
+                           std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        void endWrite() {
+            sequence.store(sequence.load(std::memory_order_relaxed) + 1, 
+                           std::memory_order_release);
+        }
     };
-#endif
 }
 
 using namespace objc_references_support;
 
-// class AssociationsManager manages a lock / hash table singleton pair.
-// Allocating an instance acquires the lock, and calling its assocations()
-// method lazily allocates the hash table.
+static StripedMap<AssociationsShard> AssociationsShards;
 
-spinlock_t AssociationsManagerLock;
-/// 全局AssociationsManager单例
+// class AssociationsManager locks the shard for one object.
+// Allocating an instance acquires the shard's lock and starts a write; 
+// destroying it ends the write and releases the lock.
+/// 按对象分片的AssociationsManager
 class AssociationsManager {
-    /// manager 里面 有一张 AssociationsHashMap hash 表
-    // associative references: object pointer -> PtrPtrHashMap.
-    static AssociationsHashMap *_map;
+    /// manager 对应对象所在的分片 分片里面有一张 AssociationsTable hash 表
+    AssociationsShard& _shard;
     /// 用自旋锁来保证操作associations操作是安全的
 public:
-    AssociationsManager()   { AssociationsManagerLock.lock(); }
-    ~AssociationsManager()  { AssociationsManagerLock.unlock(); }
-    
-    AssociationsHashMap &associations() {
-        if (_map == NULL)
-            _map = new AssociationsHashMap();
-        return *_map;
+    AssociationsManager(id object) : _shard(AssociationsShards[object]) {
+        _shard.lock();
+        _shard.beginWrite();
     }
+    ~AssociationsManager() {
+        _shard.endWrite();
+        _shard.unlock();
+    }
+
+    AssociationsShard& shard() { return _shard; }
 };
 
-AssociationsHashMap *AssociationsManager::_map = NULL;
+
+static ObjectAssociations *
+findObject(AssociationsTable *table, disguised_ptr_t object)
+{
+    if (!table) return nil;
+
+    // The probe is bounded by the table size because a lock-free reader 
+    // may be looking at a table that is being rewritten.
+    uint32_t mask = table->mask;
+    uint32_t begin = ptr_hash(object) & mask;
+    uint32_t i = begin;
+    do {
+        ObjectAssociations *refs = &table->entries[i];
+        disguised_ptr_t o = refs->object;
+        if (o == object) return refs;
+        if (o == ObjectAssociations::Empty) return nil;
+        i = (i + 1) & mask;
+    } while (i != begin);
+    return nil;
+}
+
+
+// Replace the shard's table with one that has room for another object.
+// Tombstones are dropped. The shard must be locked and in a write.
+static AssociationsTable *rehash(AssociationsShard& shard)
+{
+    AssociationsTable *oldTable = shard.table.load(std::memory_order_relaxed);
+
+    uint32_t live = 0;
+    if (oldTable) {
+        for (uint32_t i = 0; i < oldTable->capacity(); i++) {
+            disguised_ptr_t o = oldTable->entries[i].object;
+            if (o != ObjectAssociations::Empty  &&  
+                o != ObjectAssociations::Tombstone) 
+            {
+                live++;
+            }
+        }
+    }
+
+    uint32_t capacity = 4;
+    while (capacity < (live + 1) * 2) capacity *= 2;
+
+    // Reuse a retired table of this size if there is one.
+    AssociationsTable *newTable = nil;
+    for (AssociationsTable **tp = &shard.retired; *tp; tp = &(*tp)->nextRetired) {
+        if ((*tp)->capacity() == capacity) {
+            newTable = *tp;
+            *tp = newTable->nextRetired;
+            bzero(newTable->entries, capacity * sizeof(ObjectAssociations));
+            break;
+        }
+    }
+    if (!newTable) {
+        newTable = (AssociationsTable *)
+            calloc(1, sizeof(AssociationsTable) + 
+                   capacity * sizeof(ObjectAssociations));
+        newTable->mask = capacity - 1;
+    }
+    newTable->occupied = live;
+    newTable->nextRetired = nil;
+
+    if (oldTable) {
+        uint32_t mask = newTable->mask;
+        for (uint32_t i = 0; i < oldTable->capacity(); i++) {
+            ObjectAssociations *refs = &oldTable->entries[i];
+            if (refs->object == ObjectAssociations::Empty  ||  
+                refs->object == ObjectAssociations::Tombstone) 
+            {
+                continue;
+            }
+            uint32_t j = ptr_hash(refs->object) & mask;
+            while (newTable->entries[j].object != ObjectAssociations::Empty) {
+                j = (j + 1) & mask;
+            }
+            newTable->entries[j] = *refs;
+        }
+        oldTable->nextRetired = shard.retired;
+        shard.retired = oldTable;
+    }
+
+    shard.table.store(newTable, std::memory_order_release);
+    return newTable;
+}
+
+
+// Add an entry for object, which must not already have one.
+// The shard must be locked and in a write.
+static ObjectAssociations *
+insertObject(AssociationsShard& shard, disguised_ptr_t object)
+{
+    AssociationsTable *table = shard.table.load(std::memory_order_relaxed);
+    if (!table  ||  (table->occupied + 1) * 4 > table->capacity() * 3) {
+        table = rehash(shard);
+    }
+
+    uint32_t mask = table->mask;
+    uint32_t i = ptr_hash(object) & mask;
+    while (true) {
+        ObjectAssociations *refs = &table->entries[i];
+        if (refs->object == ObjectAssociations::Empty) table->occupied++;
+        if (refs->object == ObjectAssociations::Empty  ||  
+            refs->object == ObjectAssociations::Tombstone) 
+        {
+            bzero(refs, sizeof(*refs));
+            refs->object = object;
+            return refs;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+
+enum LockFreeLookupResult { LookupFound, LookupMissing, LookupNeedsLock };
+
+// Look up an association without taking the shard's lock.
+static LockFreeLookupResult 
+lockFreeLookup(AssociationsShard& shard, disguised_ptr_t object, void *key, 
+               ObjcAssociation *outAssociation)
+{
+    // A few attempts, then give up and wait for the writer on the lock.
+    for (int attempt = 0; attempt < 4; attempt++) {
+        uintptr_t sequence = shard.sequence.load(std::memory_order_acquire);
+        if (sequence & 1) continue;
+
+        LockFreeLookupResult result = LookupMissing;
+        ObjcAssociation association;
+        ObjectAssociations *refs = 
+            findObject(shard.table.load(std::memory_order_acquire), object);
+        if (refs) {
+            uint32_t count = refs->inlineCount;
+            if (count > ObjectAssociations::InlineCount) {
+                count = ObjectAssociations::InlineCount;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                if (refs->inlineEntries[i].key == key) {
+                    association = refs->inlineEntries[i].association;
+                    result = LookupFound;
+                    break;
+                }
+            }
+            if (result == LookupMissing  &&  refs->overflowCount) {
+                result = LookupNeedsLock;
+            }
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shard.sequence.load(std::memory_order_relaxed) == sequence) {
+            *outAssociation = association;
+            return result;
+        }
+    }
+    return LookupNeedsLock;
+}
+
 
 // expanded policy bits.
 
@@ -224,25 +368,42 @@ enum {
 }; 
 /// 从关联表里面取得value
 id _object_get_associative_reference(id object, void *key) {
+    disguised_ptr_t disguised_object = DISGUISE(object);
+    AssociationsShard& shard = AssociationsShards[object];
+
+    ObjcAssociation association;
+    switch (lockFreeLookup(shard, disguised_object, key, &association)) {
+    case LookupMissing:
+        return nil;
+    case LookupFound:
+        // Values that the getter does not retain can be returned 
+        // as is. Retaining needs the lock to keep the value alive.
+        if (!(association.policy() & OBJC_ASSOCIATION_GETTER_RETAIN)) {
+            return association.value();
+        }
+        break;
+    case LookupNeedsLock:
+        break;
+    }
+
     id value = nil;
     uintptr_t policy = OBJC_ASSOCIATION_ASSIGN;
     {
-        AssociationsManager manager;
-        AssociationsHashMap &associations(manager.associations());
-        disguised_ptr_t disguised_object = DISGUISE(object);
-        AssociationsHashMap::iterator i = associations.find(disguised_object);
-        if (i != associations.end()) {
-            ObjectAssociationMap *refs = i->second;
-            ObjectAssociationMap::iterator j = refs->find(key);
-            if (j != refs->end()) {
-                ObjcAssociation &entry = j->second;
-                value = entry.value();
-                policy = entry.policy();
+        shard.lock();
+        ObjectAssociations *refs = 
+            findObject(shard.table.load(std::memory_order_relaxed), 
+                       disguised_object);
+        if (refs) {
+            ObjcAssociationEntry *entry = refs->find(key);
+            if (entry) {
+                value = entry->association.value();
+                policy = entry->association.policy();
                 if (policy & OBJC_ASSOCIATION_GETTER_RETAIN) {
                     objc_retain(value);
                 }
             }
         }
+        shard.unlock();
     }
     if (value && (policy & OBJC_ASSOCIATION_GETTER_AUTORELEASE)) {
         objc_autorelease(value);
@@ -281,48 +442,37 @@ void _object_set_associative_reference(id object, void *key, id value, uintptr_t
     id new_value = value ? acquireValue(value, policy) : nil;
     {
         /// 关联对象Manager
-        AssociationsManager manager;
-        /// 关联表创建
-        AssociationsHashMap &associations(manager.associations());
+        AssociationsManager manager(object);
+        /// 关联表所在的分片
+        AssociationsShard& shard = manager.shard();
         /// 对象指针
         disguised_ptr_t disguised_object = DISGUISE(object);
+        /// 根据对象指针从分片的AssociationsTable表里面找到ObjectAssociations
+        ObjectAssociations *refs = 
+            findObject(shard.table.load(std::memory_order_relaxed), 
+                       disguised_object);
         if (new_value) {
             // break any existing association.
-            /// 根据对象指针从AssociationsHashMap表d里面找到ObjectAssociationMap
-            AssociationsHashMap::iterator i = associations.find(disguised_object);
-            if (i != associations.end()) {
-                // secondary table exists
-                ObjectAssociationMap *refs = i->second;
-                /// 根据key从ObjectAssociationMap找到ObjcAssociation
-                ObjectAssociationMap::iterator j = refs->find(key);
-                /// 找到了就把 policy，new_value 构造成ObjcAssociation 对象 放入表里
-                if (j != refs->end()) {
-                    old_association = j->second;
-                    j->second = ObjcAssociation(policy, new_value);
-                } else {
-                    /// 没找到就进行创建
-                    (*refs)[key] = ObjcAssociation(policy, new_value);
-                }
-            } else {
+            if (!refs) {
                 /// 没有就直接进行创建
                 // create the new association (first time).
-                ObjectAssociationMap *refs = new ObjectAssociationMap;
-                associations[disguised_object] = refs;
-                (*refs)[key] = ObjcAssociation(policy, new_value);
+                refs = insertObject(shard, disguised_object);
                 object->setHasAssociatedObjects();
             }
+            /// 根据key从ObjectAssociations找到ObjcAssociation
+            ObjcAssociationEntry *entry = refs->find(key);
+            /// 找到了就把 policy，new_value 构造成ObjcAssociation 对象 放入表里
+            if (entry) {
+                old_association = entry->association;
+                entry->association = ObjcAssociation(policy, new_value);
+            } else {
+                /// 没找到就进行创建
+                refs->add(key, ObjcAssociation(policy, new_value));
+            }
         } else {
             /// 没new_value 则进行移除
             // setting the association to nil breaks the association.
-            AssociationsHashMap::iterator i = associations.find(disguised_object);
-            if (i !=  associations.end()) {
-                ObjectAssociationMap *refs = i->second;
-                ObjectAssociationMap::iterator j = refs->find(key);
-                if (j != refs->end()) {
-                    old_association = j->second;
-                    refs->erase(j);
-                }
-            }
+            if (refs) refs->remove(key, &old_association);
         }
     }
     /// 释放之前的old_association
@@ -331,28 +481,90 @@ void _object_set_associative_reference(id object, void *key, id value, uintptr_t
 }
 /// 根据对象来移除里面的所有关联属性
 void _object_remove_assocations(id object) {
-    vector< ObjcAssociation,ObjcAllocator<ObjcAssociation> > elements;
+    ObjcAssociationEntry inlineEntries[ObjectAssociations::InlineCount];
+    uint32_t inlineCount = 0;
+    ObjcAssociationEntry *overflow = nil;
+    uint32_t overflowCount = 0;
     {
         /// 关联对象管理者
-        AssociationsManager manager;
-        /// 存放关联对象的HashMap
-        AssociationsHashMap &associations(manager.associations());
-        if (associations.size() == 0) return;
-        disguised_ptr_t disguised_object = DISGUISE(object);
-        AssociationsHashMap::iterator i = associations.find(disguised_object);
+        AssociationsManager manager(object);
+        /// 存放关联对象的分片
+        AssociationsShard& shard = manager.shard();
+        ObjectAssociations *refs = 
+            findObject(shard.table.load(std::memory_order_relaxed), 
+                       DISGUISE(object));
         /// 移除操作
-        if (i != associations.end()) {
+        if (refs) {
             // copy all of the associations that need to be removed.
-            ObjectAssociationMap *refs = i->second;
-            for (ObjectAssociationMap::iterator j = refs->begin(), end = refs->end(); j != end; ++j) {
-                elements.push_back(j->second);
-            }
-            // remove the secondary table.
-            delete refs;
-            associations.erase(i);
+            inlineCount = refs->inlineCount;
+            memcpy(inlineEntries, refs->inlineEntries, 
+                   inlineCount * sizeof(inlineEntries[0]));
+            overflow = refs->overflow;
+            overflowCount = refs->overflowCount;
+            // remove the object's entry.
+            bzero(refs, sizeof(*refs));
+            refs->object = ObjectAssociations::Tombstone;
         }
     }
     /// 释放
     // the calls to releaseValue() happen outside of the lock.
-    for_each(elements.begin(), elements.end(), ReleaseValue());
+    for (uint32_t i = 0; i < inlineCount; i++) {
+        ReleaseValue()(inlineEntries[i].association);
+    }
+    for (uint32_t i = 0; i < overflowCount; i++) {
+        ReleaseValue()(overflow[i].association);
+    }
+    free(overflow);
+}
+
+
+/***********************************************************************
+* Lock management for the association shards.
+* See the SideTable equivalents in NSObject.mm.
+**********************************************************************/
+
+void AssociationsLockAll() {
+    AssociationsShards.lockAll();
+}
+
+void AssociationsUnlockAll() {
+    AssociationsShards.unlockAll();
+}
+
+void AssociationsForceResetAll() {
+    AssociationsShards.forceResetAll();
+}
+
+void AssociationsDefineLockOrder() {
+    AssociationsShards.defineLockOrder();
+}
+
+void AssociationsLocksPrecedeLock(const void *newlock) {
+    AssociationsShards.precedeLock(newlock);
+}
+
+void AssociationsLocksSucceedLock(const void *oldlock) {
+    AssociationsShards.succeedLock(oldlock);
+}
+
+void AssociationsLocksSucceedLocks(StripedMap<spinlock_t>& oldlocks) {
+    int i = 0;
+    const void *oldlock;
+    while ((oldlock = oldlocks.getLock(i++))) {
+        AssociationsShards.succeedLock(oldlock);
+    }
+}
+
+void AssociationsLocksPrecedeSideTableLocks() {
+    // assumes AssociationsDefineLockOrder is also called
+    unsigned int last = AssociationsShards.getStripeCount() - 1;
+    SideTableLocksSucceedLock(AssociationsShards.getLock(last));
+}
+
+void AssociationsPrintStatistics() {
+    AssociationsShards.printStatistics("AssociationsShards");
+}
+
+void AssociationsNameProfiledLocks() {
+    AssociationsShards.nameProfiledLocks("AssociationsShards");
 }
@@ -429,8 +429,9 @@ struct locstamped_category_list_t {
 #define RW_CONSTRUCTING       (1<<26)
 // class allocated and registered
 #define RW_CONSTRUCTED        (1<<25)
-// available for use; was RW_FINALIZE_ON_MAIN_THREAD
-// #define RW_24 (1<<24)
+// class's instances are allocated from the instance slabs
+// (was RW_FINALIZE_ON_MAIN_THREAD)
+#define RW_INSTANCE_SLABS     (1<<24)
 // class +load has been called
 #define RW_LOADED             (1<<23)
 #if !SUPPORT_NONPOINTER_ISA
@@ -439,8 +440,9 @@ struct locstamped_category_list_t {
 #endif
 // class has instance-specific GC layout
 #define RW_HAS_INSTANCE_SPECIFIC_LAYOUT (1 << 21)
-// available for use
-// #define RW_20       (1<<20)
+// class has category method lists waiting to be attached
+// (OBJC_DEFER_CATEGORY_METHODS)
+#define RW_PENDING_CATEGORIES (1<<20)
 // class has started realizing but not yet completed it
 #define RW_REALIZING          (1<<19)
 
@@ -579,8 +581,25 @@ struct class_ro_t {
 *
 * countLists/beginLists/endLists iterate the metadata lists
 * count/begin/end iterate the underlying metadata elements
+*
+* Lock-free method lookup reads method lists without runtimeLock, 
+* so with LockFreeReaders attachLists() never modifies an array once 
+* it is installed. It installs a new array and frees the old one with 
+* freeAfterLockFreeLookups(). Other list arrays are only read with 
+* runtimeLock held and are grown in place.
 **********************************************************************/
-template <typename Element, typename List>
+extern void freeAfterLockFreeLookups(void *p);
+
+// freeAfterLockFreeLookups() inside a batch frees nothing until the 
+// outermost batch ends, and then waits once for all of it.
+// Locking: runtimeLock must be write-locked for the batch's lifetime.
+class LockFreeRetireBatch {
+ public:
+    LockFreeRetireBatch();
+    ~LockFreeRetireBatch();
+};
+
+template <typename Element, typename List, bool LockFreeReaders = false>
 class list_array_tt {
     struct array_t {
         uint32_t count;
@@ -654,7 +673,7 @@ class list_array_tt {
     }
 
     void setArray(array_t *array) {
-        arrayAndFlag = (uintptr_t)array | 1;
+        __atomic_store_n(&arrayAndFlag, (uintptr_t)array | 1, __ATOMIC_RELEASE);
     }
 
  public:
@@ -707,11 +726,26 @@ class list_array_tt {
             return &list;
         }
     }
+    // The lists as of one moment, for readers that do not hold 
+    // the lock that serializes attachLists(). A single list is 
+    // copied into single. Returns the number of lists.
+    uint32_t snapshotLists(List*& single, List**& outLists) {
+        uintptr_t bits = __atomic_load_n(&arrayAndFlag, __ATOMIC_ACQUIRE);
+        if (bits & 1) {
+            array_t *a = (array_t *)(bits & ~1);
+            outLists = a->lists;
+            return a->count;
+        }
+        single = (List *)bits;
+        outLists = &single;
+        return single ? 1 : 0;
+    }
+
     /// 添加方法
     void attachLists(List* const * addedLists, uint32_t addedCount) {
         if (addedCount == 0) return;
 
-        if (hasArray()) {
+        if (hasArray()  &&  !LockFreeReaders) {
             // many lists -> many lists
             uint32_t oldCount = array()->count;
             uint32_t newCount = oldCount + addedCount;
@@ -724,20 +758,37 @@ class list_array_tt {
             memcpy(array()->lists, addedLists, 
                    addedCount * sizeof(array()->lists[0]));
         }
+        else if (hasArray()) {
+            // many lists -> many lists, without touching the old array
+            array_t *oldArray = array();
+            uint32_t oldCount = oldArray->count;
+            uint32_t newCount = oldCount + addedCount;
+            array_t *newArray = (array_t *)malloc(array_t::byteSize(newCount));
+            newArray->count = newCount;
+            /// lists 是 类方法列表   addedLists 是分类方法列表
+            /// 旧的在后面 新的拷贝到前面
+            memcpy(newArray->lists + addedCount, oldArray->lists,
+                   oldCount * sizeof(newArray->lists[0]));
+            memcpy(newArray->lists, addedLists, 
+                   addedCount * sizeof(newArray->lists[0]));
+            setArray(newArray);
+            freeAfterLockFreeLookups(oldArray);
+        }
         else if (!list  &&  addedCount == 1) {
             // 0 lists -> 1 list
-            list = addedLists[0];
+            __atomic_store_n(&list, addedLists[0], __ATOMIC_RELEASE);
         } 
         else {
             // 1 list -> many lists
             List* oldList = list;
             uint32_t oldCount = oldList ? 1 : 0;
             uint32_t newCount = oldCount + addedCount;
-            setArray((array_t *)malloc(array_t::byteSize(newCount)));
-            array()->count = newCount;
-            if (oldList) array()->lists[addedCount] = oldList;
-            memcpy(array()->lists, addedLists, 
-                   addedCount * sizeof(array()->lists[0]));
+            array_t *newArray = (array_t *)malloc(array_t::byteSize(newCount));
+            newArray->count = newCount;
+            if (oldList) newArray->lists[addedCount] = oldList;
+            memcpy(newArray->lists, addedLists, 
+                   addedCount * sizeof(newArray->lists[0]));
+            setArray(newArray);
         }
     }
 
@@ -775,9 +826,9 @@ class list_array_tt {
 
 
 class method_array_t : 
-    public list_array_tt<method_t, method_list_t> 
+    public list_array_tt<method_t, method_list_t, true> 
 {
-    typedef list_array_tt<method_t, method_list_t> Super;
+    typedef list_array_tt<method_t, method_list_t, true> Super;
 
  public:
     method_list_t **beginCategoryMethodLists() {
@@ -820,6 +871,8 @@ class protocol_array_t :
 在运行期，类第一次被调用的时候，class_rw_t会被初始化，category中的内容也是在这个时候被添加进来的。
 class_rw_t不仅仅用来存放运行时添加的信息，编译期确定下来的信息也会被拷贝进去
 */
+struct method_index_t;
+
 struct class_rw_t {
     // Be warned that Symbolication knows the layout of this structure.
     uint32_t flags;
@@ -840,6 +893,10 @@ struct class_rw_t {
     uint32_t index;
 #endif
 
+    // Flattened method table and known-missing selectors, or nil.
+    // Built lazily by method lookup. See objc-runtime-new.mm.
+    method_index_t *methodIndex;
+
     void setFlags(uint32_t set) 
     {
         OSAtomicOr32Barrier(set, &flags);
@@ -1028,6 +1085,9 @@ public:
         // Set during realization or construction only. No locking needed.
         assert(data()->flags & RW_REALIZING);
 
+        // Slab-allocated instances never use the fast path.
+        if (data()->flags & RW_INSTANCE_SLABS) return;
+
         // Round up to 16-byte boundary, then divide to get 16-byte units
         newSize = ((newSize + 15) & ~15) / 16;
         
@@ -1045,6 +1105,19 @@ public:
     bool canAllocFast() {
         return bits & FAST_ALLOC;
     }
+
+    // Zero the fast instance size so FAST_ALLOC stays clear
+    // and callAlloc() never takes the calloc shortcut.
+    void clearFastAlloc()
+    {
+        int shift = WORD_BITS - FAST_SHIFTED_SIZE_SHIFT;
+        uintptr_t oldBits;
+        uintptr_t newBits;
+        do {
+            oldBits = LoadExclusive(&bits);
+            newBits = ((oldBits << shift) >> shift) & ~FAST_ALLOC;
+        } while (!StoreReleaseExclusive(&bits, oldBits, newBits));
+    }
 #else
     size_t fastInstanceSize() {
         abort();
@@ -1055,6 +1128,9 @@ public:
     bool canAllocFast() {
         return false;
     }
+    void clearFastAlloc() {
+        // nothing
+    }
 #endif
 
     void setClassArrayIndex(unsigned Idx) {
@@ -1179,6 +1255,16 @@ struct objc_class : objc_object {
         bits.setHasCxxDtor();
     }
 
+#if SUPPORT_INSTANCE_SLABS
+    bool usesInstanceSlabs() {
+        return data()->flags & RW_INSTANCE_SLABS;
+    }
+    void setUsesInstanceSlabs() {
+        data()->setFlags(RW_INSTANCE_SLABS);
+        bits.clearFastAlloc();
+    }
+#endif
+
     /// 是否是swift
     bool isSwift() {
         return bits.isSwift();
@@ -1251,6 +1337,12 @@ struct objc_class : objc_object {
         return data()->flags & RW_REALIZED;
     }
 
+    // Locking: To prevent concurrent attachment, hold runtimeLock.
+    bool hasPendingCategories() {
+        assert(isRealized());
+        return data()->flags & RW_PENDING_CATEGORIES;
+    }
+
     // Returns true if this is an unrealized future class.
     // Locking: To prevent concurrent realization, hold runtimeLock.
     bool isFuture() { 
@@ -35,6 +35,7 @@
 #include <Block.h>
 #include <objc/message.h>
 #include <mach/shared_region.h>
+#include <atomic>
 
 #define newprotocol(p) ((protocol_t *)p)
 
@@ -43,6 +44,7 @@ static void detach_class(Class cls, bool isMeta);
 static void free_class(Class cls);
 static Class setSuperclass(Class cls, Class newSuper);
 static Class realizeClass(Class cls);
+static Class remapClass(Class cls);
 static method_t *getMethodNoSuper_nolock(Class cls, SEL sel);
 static method_t *getMethod_nolock(Class cls, SEL sel);
 static IMP addMethod(Class cls, SEL name, IMP imp, const char *types, bool replace);
@@ -53,6 +55,8 @@ static bool methodListImplementsAWZ(const method_list_t *mlist);
 static void updateCustomRR_AWZ(Class cls, method_t *meth);
 static method_t *search_method_list(const method_list_t *mlist, SEL sel);
 static void flushCaches(Class cls);
+static void invalidateMethodIndex(Class cls);
+static void clearMissingMethods(Class cls);
 #if SUPPORT_FIXUP
 static void fixupMessageRef(message_ref_t *msg);
 #endif
@@ -616,30 +620,21 @@ prepareMethodLists(Class cls, method_list_t **addedLists, int addedCount,
 }
 
 
-// Attach method lists and properties and protocols from categories to a class.
+// Attach method lists from categories to a class.
 // Assumes the categories in cats are all loaded and sorted by load order, 
 // oldest categories first.
-// 整合 属性列表、协议列表、方法列表
 static void 
-attachCategories(Class cls, category_list *cats, bool flush_caches)
+attachCategoryMethods(Class cls, category_list *cats, bool flush_caches)
 {
-    if (!cats) return;
     if (PrintReplacedMethods) printReplacements(cls, cats);
 
     bool isMeta = cls->isMetaClass();
 
-    // fixme rearrange to remove these intermediate allocations
     /// 待放入的二维数组[[method1, method2], []];
     method_list_t **mlists = (method_list_t **)
         malloc(cats->count * sizeof(*mlists));
-    property_list_t **proplists = (property_list_t **)
-        malloc(cats->count * sizeof(*proplists));
-    protocol_list_t **protolists = (protocol_list_t **)
-        malloc(cats->count * sizeof(*protolists));
 
     int mcount = 0;
-    int propcount = 0;
-    int protocount = 0;
     int i = cats->count;
     bool fromBundle = NO;
     while (i--) { // 最先访问最后编译的分类
@@ -651,6 +646,337 @@ attachCategories(Class cls, category_list *cats, bool flush_caches)
             mlists[mcount++] = mlist;
             fromBundle |= entry.hi->isBundle();
         }
+    }
+    /// 取得 class_rw_t
+    auto rw = cls->data();
+    /// 合并
+    prepareMethodLists(cls, mlists, mcount, NO, fromBundle);
+    rw->methods.attachLists(mlists, mcount);
+    if (mcount > 0) invalidateMethodIndex(cls);
+    free(mlists);
+    /// 刷新方法缓存
+    if (flush_caches  &&  mcount > 0) flushCaches(cls);
+}
+
+
+/***********************************************************************
+* Deferred category methods
+* With OBJC_DEFER_CATEGORY_METHODS, the method lists of categories 
+* attached to a class that has not started +initialize are set aside 
+* instead of being fixed up and attached. Properties and protocols are 
+* still attached right away.
+*
+* The pending method lists are attached, oldest category first as 
+* usual, before anything searches the class's methods: 
+* lookUpImpOrForward() attaches them for the class and its 
+* superclasses, class_copyMethodList() and addMethod() for the class, 
+* and setInitialized() at the latest. Initialized classes never have 
+* pending categories, so lock-free lookups and method caches never 
+* see them. Categories whose classes never get that far are never 
+* fixed up or attached at all.
+*
+* OBJC_PRINT_CATEGORY_STATISTICS prints the time spent in 
+* methodizeClass() and the method lists attached and deferred.
+* The statistics are updated with runtimeLock held and read at exit 
+* without it, so they are relaxed atomics.
+* Locking: runtimeLock must be held by the caller.
+**********************************************************************/
+static size_t PendingCategoryClasses;
+
+static struct {
+    std::atomic<size_t> classes;            // classes methodized
+    std::atomic<uint64_t> time;             // nanoseconds in methodizeClass()
+    std::atomic<uint64_t> slowestTime;
+    std::atomic<char> slowestClass[64];     // name, copied byte by byte
+    std::atomic<bool> slowestIsMeta;
+    std::atomic<size_t> listsAttached;      // category method lists attached eagerly
+    std::atomic<size_t> bytesAttached;
+    std::atomic<size_t> listsDeferred;      // category method lists set aside
+    std::atomic<size_t> bytesDeferred;
+    std::atomic<size_t> listsAttachedLate;  // pending lists attached later
+    std::atomic<size_t> bytesAttachedLate;
+} CategoryStats;
+
+static void countCategoryMethods(category_list *cats, bool isMeta, 
+                                 std::atomic<size_t>& lists, 
+                                 std::atomic<size_t>& bytes)
+{
+    for (uint32_t i = 0; i < cats->count; i++) {
+        method_list_t *mlist = cats->list[i].cat->methodsForMeta(isMeta);
+        if (mlist) {
+            lists.fetch_add(1, std::memory_order_relaxed);
+            bytes.fetch_add(mlist->byteSize(), std::memory_order_relaxed);
+        }
+    }
+}
+
+
+/***********************************************************************
+* pendingCategories
+* Returns the class => categories map of deferred category methods.
+* Locking: runtimeLock must be held by the caller.
+**********************************************************************/
+static NXMapTable *pendingCategories(void)
+{
+    runtimeLock.assertWriting();
+
+    static NXMapTable *category_map = nil;
+
+    if (category_map) return category_map;
+
+    category_map = NXCreateMapTable(NXPtrValueMapPrototype, 16);
+
+    return category_map;
+}
+
+
+/***********************************************************************
+* shouldDeferCategoryMethods
+* Returns YES if category methods for cls should be set aside.
+* A class with pending categories always defers more of them 
+* so the categories are attached in order.
+* Locking: runtimeLock must be held by the caller.
+**********************************************************************/
+static bool shouldDeferCategoryMethods(Class cls)
+{
+    runtimeLock.assertWriting();
+
+    if (cls->hasPendingCategories()) return YES;
+    return DeferCategoryMethods  &&  
+        !cls->isInitialized()  &&  !cls->isInitializing();
+}
+
+
+/***********************************************************************
+* addPendingCategories
+* Sets aside the method lists of categories for later attachment.
+* Locking: runtimeLock must be held by the caller.
+**********************************************************************/
+static void addPendingCategories(Class cls, category_list *cats)
+{
+    runtimeLock.assertWriting();
+
+    if (PrintCategoryStatistics) {
+        countCategoryMethods(cats, cls->isMetaClass(), 
+                             CategoryStats.listsDeferred, 
+                             CategoryStats.bytesDeferred);
+    }
+
+    NXMapTable *map = pendingCategories();
+    category_list *list = (category_list *)NXMapGet(map, cls);
+    uint32_t oldCount = list ? list->count : 0;
+    list = (category_list *)
+        realloc(list, sizeof(*list) + 
+                sizeof(list->list[0]) * (oldCount + cats->count));
+    memcpy(&list->list[oldCount], &cats->list[0], 
+           sizeof(list->list[0]) * cats->count);
+    list->count = oldCount + cats->count;
+    NXMapInsert(map, cls, list);
+
+    if (!cls->hasPendingCategories()) {
+        cls->data()->setFlags(RW_PENDING_CATEGORIES);
+        PendingCategoryClasses++;
+    }
+}
+
+
+/***********************************************************************
+* removePendingCategory
+* Forgets a deferred category whose image is being unloaded.
+* Locking: runtimeLock must be held by the caller.
+**********************************************************************/
+static void removePendingCategory(category_t *cat, Class cls)
+{
+    runtimeLock.assertWriting();
+
+    if (!cls->isRealized()  ||  !cls->hasPendingCategories()) return;
+
+    category_list *list = (category_list *)NXMapGet(pendingCategories(), cls);
+    if (!list) return;
+
+    for (uint32_t i = 0; i < list->count; i++) {
+        if (list->list[i].cat == cat) {
+            // shift entries to preserve list order
+            memmove(&list->list[i], &list->list[i+1], 
+                    (list->count-i-1) * sizeof(list->list[i]));
+            list->count--;
+            return;
+        }
+    }
+}
+
+
+/***********************************************************************
+* removeAllPendingCategories
+* Forgets all deferred categories for a class that is being freed.
+* Locking: runtimeLock must be held by the caller.
+**********************************************************************/
+static void removeAllPendingCategories(Class cls)
+{
+    runtimeLock.assertWriting();
+
+    if (!cls->isRealized()  ||  !cls->hasPendingCategories()) return;
+
+    void *list = NXMapRemove(pendingCategories(), cls);
+    if (list) free(list);
+    cls->data()->clearFlags(RW_PENDING_CATEGORIES);
+    PendingCategoryClasses--;
+}
+
+
+/***********************************************************************
+* attachPendingCategories
+* Attaches a class's deferred category methods, if any.
+* Locking: runtimeLock must be write-locked by the caller.
+**********************************************************************/
+static void attachPendingCategories(Class cls)
+{
+    runtimeLock.assertWriting();
+
+    if (!cls->hasPendingCategories()) return;
+
+    category_list *cats = (category_list *)
+        NXMapRemove(pendingCategories(), cls);
+    cls->data()->clearFlags(RW_PENDING_CATEGORIES);
+    PendingCategoryClasses--;
+    if (!cats) return;
+
+    if (PrintConnecting) {
+        _objc_inform("CLASS: attaching %u deferred categories to class "
+                     "'%s' %s", cats->count, cls->nameForLogging(), 
+                     cls->isMetaClass() ? "(meta)" : "");
+    }
+    if (PrintCategoryStatistics) {
+        countCategoryMethods(cats, cls->isMetaClass(), 
+                             CategoryStats.listsAttachedLate, 
+                             CategoryStats.bytesAttachedLate);
+    }
+
+    // Failed lookups were flushed when the categories were set aside, 
+    // and nothing has been cached since because cls is not initialized.
+    attachCategoryMethods(cls, cats, false /*don't flush caches*/);
+    free(cats);
+}
+
+
+/***********************************************************************
+* lookupHasPendingCategories
+* Returns YES if cls or a superclass has deferred category methods, 
+* which a method lookup in cls may search.
+* Locking: runtimeLock must be held by the caller.
+**********************************************************************/
+static bool lookupHasPendingCategories(Class cls)
+{
+    runtimeLock.assertLocked();
+
+    if (PendingCategoryClasses == 0) return NO;
+
+    for (Class c = cls; c; c = c->superclass) {
+        if (c->hasPendingCategories()) return YES;
+    }
+    return NO;
+}
+
+
+/***********************************************************************
+* attachPendingCategoriesForLookup
+* Attaches deferred category methods of cls and its superclasses.
+* Locking: runtimeLock must be write-locked by the caller.
+**********************************************************************/
+static void attachPendingCategoriesForLookup(Class cls)
+{
+    runtimeLock.assertWriting();
+
+    if (PendingCategoryClasses == 0) return;
+
+    for (Class c = cls; c; c = c->superclass) {
+        attachPendingCategories(c);
+    }
+}
+
+
+/***********************************************************************
+* _objc_printCategoryStatistics
+* Prints CategoryStats at exit.
+* OBJC_PRINT_CATEGORY_STATISTICS
+* Locking: none. Another thread may hold runtimeLock while the 
+* process exits, so the counters are read without it.
+**********************************************************************/
+void _objc_printCategoryStatistics(void)
+{
+    auto& s = CategoryStats;
+    auto relaxed = std::memory_order_relaxed;
+    size_t classes = s.classes.load(relaxed);
+    uint64_t time = s.time.load(relaxed);
+    char slowestClass[sizeof(s.slowestClass)];
+    for (size_t i = 0; i < sizeof(slowestClass); i++) {
+        slowestClass[i] = s.slowestClass[i].load(relaxed);
+    }
+    slowestClass[sizeof(slowestClass) - 1] = '\0';
+    size_t listsDeferred = s.listsDeferred.load(relaxed);
+    size_t bytesDeferred = s.bytesDeferred.load(relaxed);
+    size_t listsAttachedLate = s.listsAttachedLate.load(relaxed);
+    size_t bytesAttachedLate = s.bytesAttachedLate.load(relaxed);
+
+    _objc_inform("CATEGORIES: %zu classes methodized in %.3f ms "
+                 "(%.2f us per class)", classes, time / 1000000.0, 
+                 classes ? time / 1000.0 / classes : 0.0);
+    if (slowestClass[0]) {
+        _objc_inform("CATEGORIES: slowest class %s%s methodized in %.2f us", 
+                     slowestClass, 
+                     s.slowestIsMeta.load(relaxed) ? " (meta)" : "", 
+                     s.slowestTime.load(relaxed) / 1000.0);
+    }
+    _objc_inform("CATEGORIES: %zu method lists (%zu bytes) attached "
+                 "right away", 
+                 s.listsAttached.load(relaxed), s.bytesAttached.load(relaxed));
+    _objc_inform("CATEGORIES: %zu method lists (%zu bytes) deferred, "
+                 "%zu (%zu bytes) attached later, "
+                 "%zu (%zu bytes) never attached", 
+                 listsDeferred, bytesDeferred, 
+                 listsAttachedLate, bytesAttachedLate, 
+                 listsDeferred - listsAttachedLate, 
+                 bytesDeferred - bytesAttachedLate);
+}
+
+
+// Attach method lists and properties and protocols from categories to a class.
+// Assumes the categories in cats are all loaded and sorted by load order, 
+// oldest categories first.
+// 整合 属性列表、协议列表、方法列表
+static void 
+attachCategories(Class cls, category_list *cats, bool flush_caches)
+{
+    if (!cats) return;
+
+    LockFreeRetireBatch retireBatch;
+
+    if (shouldDeferCategoryMethods(cls)) {
+        addPendingCategories(cls, cats);
+        // Forget failed lookups that the pending methods may answer.
+        if (flush_caches) flushCaches(cls);
+    } else {
+        if (PrintCategoryStatistics) {
+            countCategoryMethods(cats, cls->isMetaClass(), 
+                                 CategoryStats.listsAttached, 
+                                 CategoryStats.bytesAttached);
+        }
+        attachCategoryMethods(cls, cats, flush_caches);
+    }
+
+    bool isMeta = cls->isMetaClass();
+
+    // fixme rearrange to remove these intermediate allocations
+    property_list_t **proplists = (property_list_t **)
+        malloc(cats->count * sizeof(*proplists));
+    protocol_list_t **protolists = (protocol_list_t **)
+        malloc(cats->count * sizeof(*protolists));
+
+    int propcount = 0;
+    int protocount = 0;
+    int i = cats->count;
+    while (i--) {
+        auto& entry = cats->list[i];
 
         property_list_t *proplist = 
             entry.cat->propertiesForMeta(isMeta, entry.hi);
@@ -665,12 +991,6 @@ attachCategories(Class cls, category_list *cats, bool flush_caches)
     }
     /// 取得 class_rw_t
     auto rw = cls->data();
-    /// 合并
-    prepareMethodLists(cls, mlists, mcount, NO, fromBundle);
-    rw->methods.attachLists(mlists, mcount);
-    free(mlists);
-    /// 刷新方法缓存
-    if (flush_caches  &&  mcount > 0) flushCaches(cls);
 
     rw->properties.attachLists(proplists, propcount);
     free(proplists);
@@ -690,6 +1010,7 @@ static void methodizeClass(Class cls)
 {
     runtimeLock.assertWriting();
 
+    uint64_t start = PrintCategoryStatistics ? nanoseconds() : 0;
     bool isMeta = cls->isMetaClass();
     auto rw = cls->data();
     auto ro = rw->ro;
@@ -705,6 +1026,7 @@ static void methodizeClass(Class cls)
     if (list) {
         prepareMethodLists(cls, &list, 1, YES, isBundleClass(cls));
         rw->methods.attachLists(&list, 1);
+        invalidateMethodIndex(cls);
     }
     /// 属性列表
     property_list_t *proplist = ro->baseProperties;
@@ -740,6 +1062,23 @@ static void methodizeClass(Class cls)
     
     if (cats) free(cats);
 
+    if (PrintCategoryStatistics) {
+        uint64_t time = nanoseconds() - start;
+        auto relaxed = std::memory_order_relaxed;
+        CategoryStats.classes.fetch_add(1, relaxed);
+        CategoryStats.time.fetch_add(time, relaxed);
+        if (time > CategoryStats.slowestTime.load(relaxed)) {
+            const char *name = cls->mangledName();
+            size_t len = strnlen(name, sizeof(CategoryStats.slowestClass) - 1);
+            for (size_t i = 0; i <= len; i++) {
+                CategoryStats.slowestClass[i].store(i < len ? name[i] : '\0', 
+                                                    relaxed);
+            }
+            CategoryStats.slowestTime.store(time, relaxed);
+            CategoryStats.slowestIsMeta.store(isMeta, relaxed);
+        }
+    }
+
 #if DEBUG
     // Debug: sanity-check all SELs; log method list contents
     for (const auto& meth : rw->methods) {
@@ -977,7 +1316,12 @@ static Class getClass_impl(const char *name)
     if (result) return result;
 
     // Try table from dyld shared cache
-    return getPreoptimizedClass(name);
+    result = getPreoptimizedClass(name);
+    if (result) return result;
+
+    // Try table from the preoptimization sidecar.
+    // Its classes may have been ignored or replaced by readClass().
+    return remapClass(getPreoptSidecarClass(name));
 }
 
 static Class getClass(const char *name)
@@ -1054,7 +1398,8 @@ unsigned unreasonableClassCount()
     runtimeLock.assertLocked();
 
     int base = NXCountMapTable(gdb_objc_realized_classes) +
-        getPreoptimizedClassUnreasonableCount();
+        getPreoptimizedClassUnreasonableCount() + 
+        getPreoptSidecarClassUnreasonableCount();
 
     // Provide lots of slack here. Some iterations touch metaclasses too.
     // Some iterations backtrack (like realized class iteration).
@@ -1551,7 +1896,7 @@ static protocol_t *remapProtocol(protocol_ref_t proto)
 * Fix up a protocol ref, in case the protocol referenced has been reallocated.
 * Locking: runtimeLock must be read- or write-locked by the caller
 **********************************************************************/
-static size_t UnfixedProtocolReferences;
+static std::atomic<size_t> UnfixedProtocolReferences;
 static void remapProtocolRef(protocol_t **protoref)
 {
     runtimeLock.assertLocked();
@@ -1559,7 +1904,7 @@ static void remapProtocolRef(protocol_t **protoref)
     protocol_t *newproto = remapProtocol((protocol_ref_t)*protoref);
     if (*protoref != newproto) {
         *protoref = newproto;
-        UnfixedProtocolReferences++;
+        UnfixedProtocolReferences.fetch_add(1, std::memory_order_relaxed);
     }
 }
 
@@ -1974,6 +2319,9 @@ BOOL _class_isFutureClass(Class cls)
 }
 
 
+// Incremented by every flushCaches(). See "Lock-free method lookup".
+static std::atomic<uint64_t> methodListsVersion;
+
 /***********************************************************************
 * _objc_flush_caches
 * Flushes all caches.
@@ -1987,14 +2335,22 @@ static void flushCaches(Class cls)
 
     mutex_locker_t lock(cacheUpdateLock);
 
+    // Stop lock-free lookups that searched the old method lists 
+    // from filling caches after this flush.
+    methodListsVersion.fetch_add(1, std::memory_order_release);
+
+    // Failed lookups remembered by the method index are 
+    // invalidated by the same changes that flush the caches.
     if (cls) {
         foreach_realized_class_and_subclass(cls, ^(Class c){
             cache_erase_nolock(c);
+            clearMissingMethods(c);
         });
     }
     else {
         foreach_realized_class_and_metaclass(^(Class c){
             cache_erase_nolock(c);
+            clearMissingMethods(c);
         });
     }
 }
@@ -2148,7 +2504,8 @@ bool mustReadClasses(header_info *hi)
 *
 * Locking: runtimeLock acquired by map_images or objc_readClassPair
 **********************************************************************/
-Class readClass(Class cls, bool headerIsBundle, bool headerIsPreoptimized)
+Class readClass(Class cls, bool headerIsBundle, bool headerIsPreoptimized, 
+                bool headerInSidecar)
 {
     const char *mangledName = cls->mangledName();
     
@@ -2212,6 +2569,12 @@ Class readClass(Class cls, bool headerIsBundle, bool headerIsPreoptimized)
         // fixme strict assert doesn't work because of duplicates
         // assert(cls == getClass(name));
         assert(getClass(mangledName));
+    } else if (headerInSidecar  &&  !replacing  &&  
+               getClass(mangledName) == cls) 
+    {
+        // class list built in the preoptimization sidecar
+        // Duplicates of an earlier class fail the test above and 
+        // are added below, which keeps the earlier class.
     } else {
         addNamedClass(cls, mangledName, replacing);
     }
@@ -2316,6 +2679,199 @@ readProtocol(protocol_t *newproto, Class protocol_class,
     }
 }
 
+/***********************************************************************
+* Image reading workers
+* With OBJC_PARALLEL_IMAGE_READING, _read_images() runs the per-image 
+* phases that only rewrite the image's own references on a pool of 
+* worker threads: class ref remapping, selector ref uniquing, 
+* objc_msgSend_fixup repair, and @protocol ref remapping. Each phase 
+* hands out whole images from a shared index, and the calling thread 
+* works too. Reading classes and protocols stays serial because it 
+* inserts into global maps.
+*
+* The calling thread holds runtimeLock (and selLock during selector 
+* fixups) and waits for the workers, which only read the runtime's 
+* tables. For lockdebug's ownership checks, the workers borrow a 
+* snapshot of the locks the caller holds before the phase starts; 
+* the selector shard locks each thread takes during the phase stay 
+* its own. A phase must not acquire runtimeLock.
+*
+* Locking: runtimeLock must be write-locked by the caller.
+**********************************************************************/
+typedef void (*image_phase_t)(header_info *hi, void *ctx);
+
+#define IMAGE_WORKERS_MAX 8
+
+namespace {
+
+class ImageWorkers {
+    header_info **hList;
+    uint32_t hCount;
+    pthread_t threads[IMAGE_WORKERS_MAX];
+    uint32_t threadCount;
+
+    // Current phase. Written by the caller while the workers wait.
+    image_phase_t phase;
+    void *ctx;
+    const void *locks;
+    std::atomic<uint32_t> nextImage;
+    bool exiting;
+
+    semaphore_t go;
+    semaphore_t done;
+
+    void runPhase() {
+        uint32_t i;
+        while ((i = nextImage.fetch_add(1, std::memory_order_relaxed)) 
+               < hCount) 
+        {
+            phase(hList[i], ctx);
+        }
+    }
+
+    static void *workerMain(void *arg) {
+        ImageWorkers *workers = (ImageWorkers *)arg;
+        while (true) {
+            semaphore_wait(workers->go);
+            if (workers->exiting) return nil;
+            lockdebug_borrow_locks(workers->locks);
+            workers->runPhase();
+            lockdebug_return_locks(workers->locks);
+            semaphore_signal(workers->done);
+        }
+    }
+
+public:
+    // Returns the number of workers worth starting for these images, 
+    // or 0 to read them on the calling thread only.
+    static uint32_t countFor(uint32_t hCount) {
+        if (!ParallelImageReading  ||  hCount < 2) return 0;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus < 2) return 0;
+        // The calling thread is one of the readers.
+        uint32_t count = (uint32_t)MIN(cpus, IMAGE_WORKERS_MAX + 1) - 1;
+        return MIN(count, hCount - 1);
+    }
+
+    ImageWorkers(header_info **newList, uint32_t newCount, uint32_t count)
+        : hList(newList), hCount(newCount), threadCount(0), 
+          phase(nil), ctx(nil), locks(nil), nextImage(0), exiting(false)
+    {
+        go = create_semaphore();
+        done = create_semaphore();
+        for (uint32_t t = 0; t < count; t++) {
+            if (pthread_create(&threads[threadCount], nil, 
+                               &workerMain, this) != 0) 
+            {
+                break;
+            }
+            threadCount++;
+        }
+    }
+
+    ~ImageWorkers() {
+        exiting = true;
+        for (uint32_t t = 0; t < threadCount; t++) semaphore_signal(go);
+        for (uint32_t t = 0; t < threadCount; t++) {
+            pthread_join(threads[t], nil);
+        }
+        semaphore_destroy(mach_task_self(), go);
+        semaphore_destroy(mach_task_self(), done);
+    }
+
+    uint32_t count() const { return threadCount; }
+
+    void run(image_phase_t newPhase, void *newCtx) {
+        phase = newPhase;
+        ctx = newCtx;
+        locks = lockdebug_lend_locks();
+        nextImage.store(0, std::memory_order_relaxed);
+        // The semaphores order these stores before the workers' loads.
+        for (uint32_t t = 0; t < threadCount; t++) semaphore_signal(go);
+        runPhase();
+        for (uint32_t t = 0; t < threadCount; t++) semaphore_wait(done);
+        lockdebug_end_loan(locks);
+        locks = nil;
+    }
+};
+
+}
+
+
+/***********************************************************************
+* forEachImage
+* Calls phase for every image, on the workers if there are any.
+* Locking: runtimeLock must be write-locked by the caller.
+**********************************************************************/
+static void forEachImage(ImageWorkers *workers, 
+                         header_info **hList, uint32_t hCount, 
+                         image_phase_t phase, void *ctx = nil)
+{
+    if (workers) {
+        workers->run(phase, ctx);
+    } else {
+        for (uint32_t i = 0; i < hCount; i++) phase(hList[i], ctx);
+    }
+}
+
+
+// Image phases for _read_images(). Each one may run on a worker thread.
+
+static void remapClassRefsInImage(header_info *hi, void *ctx __unused)
+{
+    size_t count;
+    Class *classrefs = _getObjc2ClassRefs(hi, &count);
+    for (size_t i = 0; i < count; i++) {
+        remapClassRef(&classrefs[i]);
+    }
+    // fixme why doesn't test future1 catch the absence of this?
+    classrefs = _getObjc2SuperRefs(hi, &count);
+    for (size_t i = 0; i < count; i++) {
+        remapClassRef(&classrefs[i]);
+    }
+}
+
+static void fixupSelectorRefsInImage(header_info *hi, void *ctx)
+{
+    if (hi->isPreoptimized()) return;
+
+    size_t count;
+    bool isBundle = hi->isBundle();
+    SEL *sels = _getObjc2SelectorRefs(hi, &count);
+    ((std::atomic<size_t> *)ctx)->fetch_add(count, std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+        const char *name = sel_cname(sels[i]);
+        sels[i] = sel_registerNameNoLock(name, isBundle);
+    }
+}
+
+#if SUPPORT_FIXUP
+static void fixupMessageRefsInImage(header_info *hi, void *ctx __unused)
+{
+    size_t count;
+    message_ref_t *refs = _getObjc2MessageRefs(hi, &count);
+    if (count == 0) return;
+
+    if (PrintVtables) {
+        _objc_inform("VTABLES: repairing %zu unsupported vtable dispatch "
+                     "call sites in %s", count, hi->fname());
+    }
+    for (size_t i = 0; i < count; i++) {
+        fixupMessageRef(refs+i);
+    }
+}
+#endif
+
+static void remapProtocolRefsInImage(header_info *hi, void *ctx __unused)
+{
+    size_t count;
+    protocol_t **protolist = _getObjc2ProtocolRefs(hi, &count);
+    for (size_t i = 0; i < count; i++) {
+        remapProtocolRef(&protolist[i]);
+    }
+}
+
+
 /***********************************************************************
 * _read_images /// 解析 二进制文件
 * Perform initial processing of the headers in the linked 
@@ -2338,6 +2894,10 @@ void _read_images(header_info **hList, uint32_t hCount, int totalClasses, int un
 
     runtimeLock.assertWriting();
 
+    // Method list arrays replaced while attaching categories are 
+    // freed once, at the end.
+    LockFreeRetireBatch retireBatch;
+
 #define EACH_HEADER \
     hIndex = 0;         \
     hIndex < hCount && (hi = hList[hIndex]); \
@@ -2405,10 +2965,11 @@ void _read_images(header_info **hList, uint32_t hCount, int totalClasses, int un
         }
 
         // namedClasses
-        // Preoptimized classes don't go in this table.
+        // Preoptimized classes and sidecar classes don't go in this table.
+        // unoptimizedTotalClasses counts shared cache images only 
+        // when the shared cache is preoptimized.
         // 4/3 is NXMapTable's load factor
-        int namedClassesSize = 
-            (isPreoptimized() ? unoptimizedTotalClasses : totalClasses) * 4 / 3;
+        int namedClassesSize = unoptimizedTotalClasses * 4 / 3;
         gdb_objc_realized_classes =
             NXCreateMapTable(NXStrValueMapPrototype, namedClassesSize);
 
@@ -2426,11 +2987,13 @@ void _read_images(header_info **hList, uint32_t hCount, int totalClasses, int un
 
         bool headerIsBundle = hi->isBundle();
         bool headerIsPreoptimized = hi->isPreoptimized();
+        bool headerInSidecar = preoptSidecarHasHeader(hi);
 
         classref_t *classlist = _getObjc2ClassList(hi, &count);
         for (i = 0; i < count; i++) {
             Class cls = (Class)classlist[i];
-            Class newCls = readClass(cls, headerIsBundle, headerIsPreoptimized);
+            Class newCls = readClass(cls, headerIsBundle, 
+                                     headerIsPreoptimized, headerInSidecar);
 
             if (newCls != cls  &&  newCls) {
                 // Class was moved but not deleted. Currently this occurs 
@@ -2446,58 +3009,39 @@ void _read_images(header_info **hList, uint32_t hCount, int totalClasses, int un
 
     ts.log("IMAGE TIMES: discover classes");
 
+    // The remaining reference fixups may run on worker threads.
+    ImageWorkers *workers = nil;
+    if (uint32_t workerCount = ImageWorkers::countFor(hCount)) {
+        workers = new ImageWorkers(hList, hCount, workerCount);
+        if (PrintImageTimes) {
+            _objc_inform("IMAGE TIMES: %u worker threads for %u images", 
+                         workers->count(), hCount);
+        }
+        ts.log("IMAGE TIMES: start workers");
+    }
+
     // Fix up remapped classes
     // Class list and nonlazy class list remain unremapped.
     // Class refs and super refs are remapped for message dispatching.
     
     if (!noClassesRemapped()) {
-        for (EACH_HEADER) {
-            Class *classrefs = _getObjc2ClassRefs(hi, &count);
-            for (i = 0; i < count; i++) {
-                remapClassRef(&classrefs[i]);
-            }
-            // fixme why doesn't test future1 catch the absence of this?
-            classrefs = _getObjc2SuperRefs(hi, &count);
-            for (i = 0; i < count; i++) {
-                remapClassRef(&classrefs[i]);
-            }
-        }
+        forEachImage(workers, hList, hCount, &remapClassRefsInImage);
     }
 
     ts.log("IMAGE TIMES: remap classes");
 
     // Fix up @selector references
-    static size_t UnfixedSelectors;
+    static std::atomic<size_t> UnfixedSelectors;
     sel_lock();
-    for (EACH_HEADER) {
-        if (hi->isPreoptimized()) continue;
-
-        bool isBundle = hi->isBundle();
-        SEL *sels = _getObjc2SelectorRefs(hi, &count);
-        UnfixedSelectors += count;
-        for (i = 0; i < count; i++) {
-            const char *name = sel_cname(sels[i]);
-            sels[i] = sel_registerNameNoLock(name, isBundle);
-        }
-    }
+    forEachImage(workers, hList, hCount, 
+                 &fixupSelectorRefsInImage, &UnfixedSelectors);
     sel_unlock();
 
     ts.log("IMAGE TIMES: fix up selector references");
 
 #if SUPPORT_FIXUP
     // Fix up old objc_msgSend_fixup call sites
-    for (EACH_HEADER) {
-        message_ref_t *refs = _getObjc2MessageRefs(hi, &count);
-        if (count == 0) continue;
-
-        if (PrintVtables) {
-            _objc_inform("VTABLES: repairing %zu unsupported vtable dispatch "
-                         "call sites in %s", count, hi->fname());
-        }
-        for (i = 0; i < count; i++) {
-            fixupMessageRef(refs+i);
-        }
-    }
+    forEachImage(workers, hList, hCount, &fixupMessageRefsInImage);
 
     ts.log("IMAGE TIMES: fix up objc_msgSend_fixup");
 #endif
@@ -2524,14 +3068,14 @@ void _read_images(header_info **hList, uint32_t hCount, int totalClasses, int un
     // Fix up @protocol references
     // Preoptimized images may have the right 
     // answer already but we don't know for sure.
-    for (EACH_HEADER) {
-        protocol_t **protolist = _getObjc2ProtocolRefs(hi, &count);
-        for (i = 0; i < count; i++) {
-            remapProtocolRef(&protolist[i]);
-        }
-    }
+    forEachImage(workers, hList, hCount, &remapProtocolRefsInImage);
 
     ts.log("IMAGE TIMES: fix up @protocol references");
+
+    if (workers) {
+        delete workers;
+        ts.log("IMAGE TIMES: stop workers");
+    }
     /// 入口对类的处理
     // Realize non-lazy classes (for +load methods and static instances)
     for (EACH_HEADER) {
@@ -2693,7 +3237,7 @@ void _read_images(header_info **hList, uint32_t hCount, int totalClasses, int un
         }
 
         _objc_inform("PREOPTIMIZATION: %zu selector references not "
-                     "pre-optimized", UnfixedSelectors);
+                     "pre-optimized", UnfixedSelectors.load());
         _objc_inform("PREOPTIMIZATION: %u/%u (%.3g%%) method lists pre-sorted",
                      PreoptOptimizedMethodLists, PreoptTotalMethodLists, 
                      PreoptTotalMethodLists
@@ -2705,7 +3249,7 @@ void _read_images(header_info **hList, uint32_t hCount, int totalClasses, int un
                      ? 100.0*PreoptOptimizedClasses/PreoptTotalClasses
                      : 0.0);
         _objc_inform("PREOPTIMIZATION: %zu protocol references not "
-                     "pre-optimized", UnfixedProtocolReferences);
+                     "pre-optimized", UnfixedProtocolReferences.load());
     }
 
 #undef EACH_HEADER
@@ -2799,6 +3343,10 @@ void _unload_image(header_info *hi)
         // unattached list
         removeUnattachedCategoryForClass(cat, cls);
 
+        // deferred category methods
+        removePendingCategory(cat, cls);
+        removePendingCategory(cat, cls->ISA());
+
         // +load queue
         remove_category_from_loadable_list(cat);
     }
@@ -3986,6 +4534,11 @@ class_copyMethodList(Class cls, unsigned int *outCount)
         return nil;
     }
 
+    if (cls->isRealized()  &&  cls->hasPendingCategories()) {
+        rwlock_writer_t lock(runtimeLock);
+        attachPendingCategories(cls);
+    }
+
     rwlock_reader_t lock(runtimeLock);
     
     assert(cls->isRealized());
@@ -4492,6 +5045,235 @@ static method_t *search_method_list(const method_list_t *mlist, SEL sel)
 
     return nil;
 }
+
+/***********************************************************************
+* Method index.
+* A class with many methods, or with many method lists from categories, 
+* gets a flattened open-addressed table from selector to method_t. 
+* A lookup then costs one hash probe instead of a binary search of 
+* each method list. The table is built by the first lookup and thrown 
+* away whenever another method list is attached to the class.
+*
+* The index also remembers a few selectors that neither the class nor 
+* any superclass implements, so repeated failed lookups for forwarded 
+* messages skip the superclass walk. Those are cleared whenever the 
+* class's method cache is flushed, which happens whenever a method is 
+* added to the class or to any superclass.
+*
+* Locking: the index is built with runtimeLock read-locked. 
+* Concurrent builders race to install it and the loser frees its copy. 
+* It is changed, discarded, and cleared of missing selectors only with 
+* runtimeLock write-locked. Lock-free lookups read the index, 
+* including the missing selectors, but never build one.
+**********************************************************************/
+
+// Classes with at least this many methods or method lists get a table.
+#define METHOD_INDEX_MIN_METHODS 32
+#define METHOD_INDEX_MIN_LISTS 4
+
+// Number of failed lookups remembered per class.
+#define METHOD_INDEX_MISSING 8
+
+struct method_index_t {
+    std::atomic<SEL> missing[METHOD_INDEX_MISSING];
+    std::atomic<uint32_t> nextMissing;
+
+    // table size - 1, or 0 if there is no table
+    uint32_t mask;
+    uint32_t count;
+
+    // name is set last, so a lock-free reader never sees 
+    // a name without its method.
+    struct entry {
+        std::atomic<SEL> name;
+        method_t *meth;
+    } table[0];
+};
+
+static inline uint32_t method_index_hash(SEL sel, uint32_t mask)
+{
+    return (uint32_t)(((uint64_t)(uintptr_t)sel * 0x9e3779b97f4a7c15ULL) >> 32)
+        & mask;
+}
+
+// Build an index with a table for count methods, or none if count is 0.
+static method_index_t *newMethodIndex(Class cls, uint32_t count)
+{
+    uint32_t capacity = 0;
+    if (count > 0) {
+        // Keep the table at most half full.
+        capacity = 4;
+        while (capacity < count * 2) capacity *= 2;
+    }
+
+    method_index_t *index = (method_index_t *)
+        calloc(1, sizeof(method_index_t) + 
+               capacity * sizeof(method_index_t::entry));
+    index->mask = capacity ? capacity - 1 : 0;
+    if (!capacity) return index;
+
+    // Earlier lists and earlier methods in each list win, 
+    // matching the order searched by search_method_list().
+    for (auto mlists = cls->data()->methods.beginLists(), 
+              end = cls->data()->methods.endLists(); 
+         mlists != end;
+         ++mlists)
+    {
+        for (auto& meth : **mlists) {
+            uint32_t i = method_index_hash(meth.name, index->mask);
+            SEL name;
+            while ((name = index->table[i].name.load(std::memory_order_relaxed))
+                   &&  name != meth.name)
+            {
+                i = (i + 1) & index->mask;
+            }
+            if (!name) {
+                index->table[i].meth = &meth;
+                index->table[i].name.store(meth.name, 
+                                           std::memory_order_relaxed);
+                index->count++;
+            }
+        }
+    }
+
+    return index;
+}
+
+static method_index_t *installMethodIndex(Class cls, method_index_t *index)
+{
+    auto rw = cls->data();
+    if (! OSAtomicCompareAndSwapPtrBarrier(nil, index, 
+                                           (void**)&rw->methodIndex)) 
+    {
+        free(index);
+    }
+    return rw->methodIndex;
+}
+
+// Returns the number of methods in lists if they deserve a table, or 0.
+static uint32_t methodIndexSize(method_list_t * const *lists, 
+                                uint32_t listCount)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < listCount; i++) {
+        count += lists[i]->count;
+    }
+    if (count < METHOD_INDEX_MIN_METHODS  &&  
+        listCount < METHOD_INDEX_MIN_LISTS) 
+    {
+        return 0;
+    }
+    return count;
+}
+
+// Returns cls's index if it has a table, building it if cls is large enough.
+static method_index_t *methodIndexForLookup(Class cls)
+{
+    auto rw = cls->data();
+    method_index_t *index = rw->methodIndex;
+    if (index) return index->mask ? index : nil;
+
+    auto lists = rw->methods.beginLists();
+    uint32_t count = 
+        methodIndexSize(lists, (uint32_t)(rw->methods.endLists() - lists));
+    if (count == 0) return nil;
+
+    index = installMethodIndex(cls, newMethodIndex(cls, count));
+    return index->mask ? index : nil;
+}
+
+static method_t *searchMethodIndex(method_index_t *index, SEL sel)
+{
+    uint32_t i = method_index_hash(sel, index->mask);
+    while (true) {
+        auto& entry = index->table[i];
+        SEL name = entry.name.load(std::memory_order_acquire);
+        if (name == sel) return entry.meth;
+        if (!name) return nil;
+        i = (i + 1) & index->mask;
+    }
+}
+
+static bool indexHasMissingMethod(method_index_t *index, SEL sel)
+{
+    for (auto& missing : index->missing) {
+        if (missing.load(std::memory_order_relaxed) == sel) return true;
+    }
+    return false;
+}
+
+// Returns true if sel was recorded as missing from cls and its superclasses.
+static bool isKnownMissingMethod(Class cls, SEL sel)
+{
+    runtimeLock.assertLocked();
+
+    method_index_t *index = cls->data()->methodIndex;
+    return index  &&  indexHasMissingMethod(index, sel);
+}
+
+// Records that neither cls nor any superclass implements sel.
+static void noteMissingMethod(Class cls, SEL sel)
+{
+    runtimeLock.assertLocked();
+
+    if (DisableMethodIndex) return;
+
+    method_index_t *index = cls->data()->methodIndex;
+    if (!index) index = installMethodIndex(cls, newMethodIndex(cls, 0));
+
+    uint32_t slot = index->nextMissing.fetch_add(1, std::memory_order_relaxed);
+    index->missing[slot % METHOD_INDEX_MISSING].store
+        (sel, std::memory_order_relaxed);
+}
+
+static void clearMissingMethods(Class cls)
+{
+    runtimeLock.assertWriting();
+
+    method_index_t *index = cls->data()->methodIndex;
+    if (!index) return;
+    for (auto& missing : index->missing) {
+        missing.store(nil, std::memory_order_relaxed);
+    }
+}
+
+static void invalidateMethodIndex(Class cls)
+{
+    runtimeLock.assertWriting();
+
+    auto rw = cls->data();
+    method_index_t *index = rw->methodIndex;
+    if (index) {
+        __atomic_store_n(&rw->methodIndex, nil, __ATOMIC_RELEASE);
+        freeAfterLockFreeLookups(index);
+    }
+}
+
+// Add a method whose name is not already in cls's method lists.
+// Cheaper than rebuilding the table when methods are added one by one.
+static void addToMethodIndex(Class cls, method_t *meth)
+{
+    runtimeLock.assertWriting();
+
+    method_index_t *index = cls->data()->methodIndex;
+    if (!index) return;
+
+    if (!index->mask  ||  (index->count + 1) * 2 > index->mask + 1) {
+        invalidateMethodIndex(cls);
+        return;
+    }
+
+    uint32_t i = method_index_hash(meth->name, index->mask);
+    while (SEL name = index->table[i].name.load(std::memory_order_relaxed)) {
+        assert(name != meth->name);
+        i = (i + 1) & index->mask;
+    }
+    index->table[i].meth = meth;
+    index->table[i].name.store(meth->name, std::memory_order_release);
+    index->count++;
+}
+
+
 /// 查找方法列表 但不查找super class 的方法列表
 static method_t *
 getMethodNoSuper_nolock(Class cls, SEL sel)
@@ -4501,6 +5283,12 @@ getMethodNoSuper_nolock(Class cls, SEL sel)
     assert(cls->isRealized());
     // fixme nil cls? 
     // fixme nil sel?
+
+    if (!DisableMethodIndex) {
+        method_index_t *index = methodIndexForLookup(cls);
+        if (index) return searchMethodIndex(index, sel);
+    }
+
     ///
     for (auto mlists = cls->data()->methods.beginLists(), 
               end = cls->data()->methods.endLists(); 
@@ -4599,6 +5387,250 @@ log_and_fill_cache(Class cls, IMP imp, SEL sel, id receiver, Class implementer)
 }
 
 
+/***********************************************************************
+* Lock-free method lookup.
+* Most method cache misses are for classes that are already realized 
+* and initialized. lookUpImpOrForward() searches those classes' method 
+* lists and fills the cache without runtimeLock. Anything unusual 
+* falls back to the locked search: unrealized or uninitialized classes, 
+* forwarding and method resolvers, message logging, and large classes 
+* whose method index has not been built yet.
+*
+* Writers still hold runtimeLock for writing. Two things keep them 
+* safe against lock-free readers.
+*
+* Memory: method list arrays and method indexes are replaced, never 
+* modified in place except by single atomic stores, and the memory 
+* they replace is freed by freeAfterLockFreeLookups(). Each lock-free 
+* lookup counts itself in one of two phases. The writer flips the 
+* phase and waits for the old phase's count to drain, twice, so every 
+* lookup that might have seen the old memory has finished. Image 
+* loading and category attachment retire memory in a 
+* LockFreeRetireBatch and wait once for all of it.
+*
+* Cache consistency: method lookup and cache fill must be atomic with 
+* respect to method addition; see lookUpImpOrForward(). Every change 
+* that can alter a lookup's result is followed by flushCaches(), which 
+* increments methodListsVersion with cacheUpdateLock held. A lock-free 
+* lookup reads the version before searching and fills the cache only 
+* if the version is unchanged, checked with cacheUpdateLock held. 
+* Otherwise it retries with runtimeLock.
+**********************************************************************/
+
+// Superclass chains longer than this are left to the locked search, 
+// which diagnoses cycles.
+#define LOCK_FREE_LOOKUP_MAX_DEPTH 256
+
+struct LockFreeLookupCount {
+    std::atomic<uintptr_t> count[2];
+};
+
+static StripedMap<LockFreeLookupCount> LockFreeLookups;
+static std::atomic<unsigned> lockFreeLookupPhase;
+
+static unsigned enterLockFreeLookup(LockFreeLookupCount& counts)
+{
+    unsigned phase = lockFreeLookupPhase.load(std::memory_order_relaxed) & 1;
+    counts.count[phase].fetch_add(1, std::memory_order_relaxed);
+    // Order the count before every read of the lookup. 
+    // Pairs with the fence in waitForLockFreeLookups().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return phase;
+}
+
+static void exitLockFreeLookup(LockFreeLookupCount& counts, unsigned phase)
+{
+    counts.count[phase].fetch_sub(1, std::memory_order_release);
+}
+
+static void waitForLockFreeLookups()
+{
+    runtimeLock.assertWriting();
+
+    // Order the caller's unpublishing stores before the phase flip.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // A lookup may read the phase just before a flip and count itself 
+    // just after the wait for that phase. The second flip waits for it.
+    for (int flips = 0; flips < 2; flips++) {
+        unsigned old = lockFreeLookupPhase.fetch_add(1) & 1;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (unsigned int i = 0; i < LockFreeLookups.getStripeCount(); i++) {
+            auto& count = LockFreeLookups.stripeAt(i).count[old];
+            while (count.load(std::memory_order_acquire) != 0) {
+                sched_yield();
+            }
+        }
+    }
+}
+
+// Memory retired inside a LockFreeRetireBatch. Protected by runtimeLock.
+static unsigned lockFreeRetireDepth;
+static std::vector<void *> *lockFreeRetired;
+
+/***********************************************************************
+* freeAfterLockFreeLookups
+* Frees memory that lock-free method lookups may still be reading, 
+* once they have finished. The caller must already have removed 
+* every pointer to p that such a lookup could load.
+* Inside a LockFreeRetireBatch, p is freed when the batch ends.
+* Locking: runtimeLock must be write-locked by the caller, 
+*   and cacheUpdateLock must not be held.
+**********************************************************************/
+void freeAfterLockFreeLookups(void *p)
+{
+    runtimeLock.assertWriting();
+
+    if (!p) return;
+    if (DisableLockFreeLookup) {
+        free(p);
+    } else if (lockFreeRetireDepth > 0) {
+        if (!lockFreeRetired) lockFreeRetired = new std::vector<void *>;
+        lockFreeRetired->push_back(p);
+    } else {
+        waitForLockFreeLookups();
+        free(p);
+    }
+}
+
+LockFreeRetireBatch::LockFreeRetireBatch()
+{
+    runtimeLock.assertWriting();
+    lockFreeRetireDepth++;
+}
+
+LockFreeRetireBatch::~LockFreeRetireBatch()
+{
+    runtimeLock.assertWriting();
+    if (--lockFreeRetireDepth > 0) return;
+    if (!lockFreeRetired  ||  lockFreeRetired->empty()) return;
+
+    waitForLockFreeLookups();
+    for (void *p : *lockFreeRetired) free(p);
+    lockFreeRetired->clear();
+}
+
+void LockFreeLookupsForceReset()
+{
+    for (unsigned int i = 0; i < LockFreeLookups.getStripeCount(); i++) {
+        auto& counts = LockFreeLookups.stripeAt(i);
+        counts.count[0].store(0, std::memory_order_relaxed);
+        counts.count[1].store(0, std::memory_order_relaxed);
+    }
+}
+
+
+/***********************************************************************
+* getMethodNoSuper_lockFree
+* Like getMethodNoSuper_nolock(), for a lock-free lookup. 
+* Returns false if cls should be searched with runtimeLock instead.
+**********************************************************************/
+static bool 
+getMethodNoSuper_lockFree(Class cls, SEL sel, method_t **outMeth)
+{
+    auto rw = cls->data();
+
+    method_index_t *index = 
+        __atomic_load_n(&rw->methodIndex, __ATOMIC_ACQUIRE);
+    if (index  &&  index->mask) {
+        *outMeth = searchMethodIndex(index, sel);
+        return true;
+    }
+
+    method_list_t *single;
+    method_list_t **lists;
+    uint32_t count = rw->methods.snapshotLists(single, lists);
+
+    // Build the index with the lock held.
+    if (!index  &&  !DisableMethodIndex  &&  methodIndexSize(lists, count)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (method_t *m = search_method_list(lists[i], sel)) {
+            *outMeth = m;
+            return true;
+        }
+    }
+
+    *outMeth = nil;
+    return true;
+}
+
+
+/***********************************************************************
+* lookUpImpLockFree
+* Searches cls and its superclasses and fills cls's cache, 
+* without runtimeLock. 
+* Returns nil if the locked search must be used instead, 
+* including when no implementation is found.
+* Locking: runtimeLock must not be held by the caller.
+**********************************************************************/
+static IMP lookUpImpLockFree(Class cls, SEL sel, id inst)
+{
+    // Initialization finishes after realization. The metaclass check 
+    // keeps a metaclass that is still a class_ro_t from being read.
+    if (!cls->isRealized()  ||  !cls->getMeta()->isRealized()  ||  
+        !cls->isInitialized()) 
+    {
+        return nil;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+#if SUPPORT_MESSAGE_LOGGING
+    if (objcMsgLogEnabled) return nil;
+#endif
+
+    LockFreeLookupCount& counts = LockFreeLookups[pthread_self()];
+    unsigned phase = enterLockFreeLookup(counts);
+    uint64_t version = methodListsVersion.load(std::memory_order_acquire);
+
+    // Known failures go straight to the locked search and the resolver.
+    method_index_t *index = 
+        __atomic_load_n(&cls->data()->methodIndex, __ATOMIC_ACQUIRE);
+    if (index  &&  indexHasMissingMethod(index, sel)) {
+        exitLockFreeLookup(counts, phase);
+        return nil;
+    }
+
+    IMP imp = nil;
+    unsigned depth = 0;
+    for (Class curClass = cls; 
+         curClass != nil  &&  depth < LOCK_FREE_LOOKUP_MAX_DEPTH; 
+         curClass = curClass->superclass, depth++)
+    {
+        if (curClass != cls) {
+            IMP cached = cache_getImp(curClass, sel);
+            if (cached) {
+                // A forward:: entry needs cls's method resolver.
+                if (cached != (IMP)_objc_msgForward_impcache) imp = cached;
+                break;
+            }
+        }
+
+        method_t *meth;
+        if (!getMethodNoSuper_lockFree(curClass, sel, &meth)) break;
+        if (meth) {
+            imp = meth->imp;
+            break;
+        }
+    }
+
+    if (imp) {
+        mutex_locker_t lock(cacheUpdateLock);
+        if (methodListsVersion.load(std::memory_order_relaxed) == version) {
+            cache_fill_nolock(cls, sel, imp, inst);
+        } else {
+            // Method lists changed during the search.
+            imp = nil;
+        }
+    }
+
+    exitLockFreeLookup(counts, phase);
+    return imp;
+}
+
+
 /***********************************************************************
 * _class_lookupMethodAndLoadCache.
 * Method lookup for dispatchers ONLY. OTHER CODE SHOULD USE lookUpImp().
@@ -4607,6 +5639,8 @@ log_and_fill_cache(Class cls, IMP imp, SEL sel, id receiver, Class implementer)
 **********************************************************************/
 IMP _class_lookupMethodAndLoadCache3(id obj, SEL sel, Class cls)
 {
+    // The messenger is done with the cache.
+    cache_quiescent_state();
     return lookUpImpOrForward(cls, sel, obj, 
                               YES/*initialize*/, NO/*cache*/, YES/*resolver*/);
 }
@@ -4639,6 +5673,12 @@ IMP lookUpImpOrForward(Class cls, SEL sel, id inst,
         if (imp) return imp;
     }
 
+    // Search initialized classes without runtimeLock if possible.
+    if (!DisableLockFreeLookup) {
+        imp = lookUpImpLockFree(cls, sel, inst);
+        if (imp) return imp;
+    }
+
     // runtimeLock is held during isRealized and isInitialized checking
     // to prevent races against concurrent realization.
 
@@ -4650,7 +5690,7 @@ IMP lookUpImpOrForward(Class cls, SEL sel, id inst,
 
     runtimeLock.read();
 
-    if (!cls->isRealized()) {
+    if (!cls->isRealized()  ||  lookupHasPendingCategories(cls)) {
         // Drop the read-lock and acquire the write-lock.
         // realizeClass() checks isRealized() again to prevent
         // a race while the lock is down.
@@ -4658,6 +5698,7 @@ IMP lookUpImpOrForward(Class cls, SEL sel, id inst,
         runtimeLock.write();
 
         realizeClass(cls);
+        attachPendingCategoriesForLookup(cls);
 
         runtimeLock.unlockWrite();
         runtimeLock.read();
@@ -4682,6 +5723,10 @@ IMP lookUpImpOrForward(Class cls, SEL sel, id inst,
     imp = cache_getImp(cls, sel);
     if (imp) goto done;
 
+    // Skip the method lists if an earlier search of this class 
+    // and all of its superclasses failed.
+    if (isKnownMissingMethod(cls, sel)) goto missing;
+
     // Try this class's method lists.
     {
         Method meth = getMethodNoSuper_nolock(cls, sel);
@@ -4695,7 +5740,8 @@ IMP lookUpImpOrForward(Class cls, SEL sel, id inst,
     // Try superclass caches and method lists.
     {
         unsigned attempts = unreasonableClassCount();
-        for (Class curClass = cls->superclass;
+        Class curClass;
+        for (curClass = cls->superclass;
              curClass != nil;
              curClass = curClass->superclass)
         {
@@ -4728,8 +5774,12 @@ IMP lookUpImpOrForward(Class cls, SEL sel, id inst,
                 goto done;
             }
         }
+
+        // Every superclass was searched, not stopped by a forward:: entry.
+        if (!curClass) noteMissingMethod(cls, sel);
     }
 
+ missing:
     // No implementation found. Try method resolver once.
 
     if (resolver  &&  !triedResolver) {
@@ -4864,6 +5914,14 @@ objc_class::setInitialized()
     cls = (Class)this;
     metacls = cls->ISA();
 
+    // Attach deferred category methods before scanning them. 
+    // cls is initializing, so no more will be deferred.
+    if (cls->hasPendingCategories()  ||  metacls->hasPendingCategories()) {
+        rwlock_writer_t lock(runtimeLock);
+        attachPendingCategories(cls);
+        attachPendingCategories(metacls);
+    }
+
     rwlock_reader_t lock(runtimeLock);
 
     // Scan metaclass for custom AWZ.
@@ -5489,6 +6547,9 @@ addMethod(Class cls, SEL name, IMP imp, const char *types, bool replace)
     assert(types);
     assert(cls->isRealized());
 
+    // Added methods go in front of the categories.
+    attachPendingCategories(cls);
+
     method_t *m;
     if ((m = getMethodNoSuper_nolock(cls, name))) {
         // already exists
@@ -5510,6 +6571,7 @@ addMethod(Class cls, SEL name, IMP imp, const char *types, bool replace)
 
         prepareMethodLists(cls, &newlist, 1, NO, NO);
         cls->data()->methods.attachLists(&newlist, 1);
+        addToMethodIndex(cls, &newlist->first);
         flushCaches(cls);
 
         result = nil;
@@ -5747,6 +6809,8 @@ objc_duplicateClass(Class original, const char *name,
     assert(original->isRealized());
     assert(!original->isMetaClass());
 
+    attachPendingCategories(original);
+
     duplicate = alloc_class_for_subclass(original, extraBytes);
 
     duplicate->initClassIsa(original->ISA());
@@ -6006,7 +7070,8 @@ Class objc_readClassPair(Class bits, const struct objc_image_info *info)
         return nil;
     }
 
-    Class cls = readClass(bits, false/*bundle*/, false/*shared cache*/);
+    Class cls = readClass(bits, false/*bundle*/, false/*shared cache*/, 
+                          false/*sidecar*/);
     if (cls != bits) {
         // This function isn't allowed to remap anything.
         _objc_fatal("objc_readClassPair for class %s changed %p to %p", 
@@ -6031,6 +7096,7 @@ static void detach_class(Class cls, bool isMeta)
 
     // categories not yet attached to this class
     removeAllUnattachedCategoriesForClass(cls);
+    removeAllPendingCategories(cls);
 
     // superclass's subclass list
     if (cls->isRealized()) {
@@ -6065,6 +7131,7 @@ static void free_class(Class cls)
     auto ro = rw->ro;
 
     cache_delete(cls);
+    invalidateMethodIndex(cls);
     
     for (auto& meth : rw->methods) {
         try_free(meth.types);
@@ -6203,16 +7270,23 @@ _class_createInstanceFromZone(Class cls, size_t extraBytes, void *zone,
     size_t size = cls->instanceSize(extraBytes);
     if (outAllocatedSize) *outAllocatedSize = size;
 
-    id obj;
+    id obj = nil;
+#if SUPPORT_INSTANCE_SLABS
+    if (!zone  &&  slowpath(cls->usesInstanceSlabs())) {
+        // Falls back to calloc if too big or out of slab space.
+        obj = (id)instance_slab_alloc(size);
+    }
+#endif
+
     if (!zone  &&  fast) {
-        obj = (id)calloc(1, size);
+        if (!obj) obj = (id)calloc(1, size);
         if (!obj) return nil;
         obj->initInstanceIsa(cls, hasCxxDtor);
     } 
     else {
         if (zone) {
             obj = (id)malloc_zone_calloc ((malloc_zone_t *)zone, 1, size);
-        } else {
+        } else if (!obj) {
             /// 这里初始化对象
             obj = (id)calloc(1, size);
         }
@@ -6365,12 +7439,31 @@ object_dispose(id obj)
     if (!obj) return nil;
     /// 自毁实例对象
     objc_destructInstance(obj);
-    free(obj);
+    free_instance(obj);
 
     return nil;
 }
 
 
+/***********************************************************************
+* _class_setUsesInstanceSlabs
+* Allocate cls's future instances from the instance slabs.
+* Does nothing with OBJC_DISABLE_INSTANCE_SLABS.
+* Locking: acquires runtimeLock
+**********************************************************************/
+void
+_class_setUsesInstanceSlabs(Class cls)
+{
+#if SUPPORT_INSTANCE_SLABS
+    if (!cls  ||  DisableInstanceSlabs) return;
+
+    rwlock_writer_t lock(runtimeLock);
+    realizeClass(cls);
+    cls->setUsesInstanceSlabs();
+#endif
+}
+
+
 /***********************************************************************
 * _objc_getFreedObjectClass
 * fixme
@@ -303,6 +303,16 @@ void environ_init(void)
         }
     }
 
+#if !SUPPORT_CONCURRENT_REFCOUNT
+    // Deferred releases are buffered in front of the concurrent 
+    // refcount table, which this runtime does not have.
+    if (DeferSidetableRelease) {
+        _objc_inform("OBJC_DEFER_SIDETABLE_RELEASE is not supported "
+                     "by this runtime and is ignored");
+        DeferSidetableRelease = false;
+    }
+#endif
+
     // Print OBJC_HELP and OBJC_PRINT_OPTIONS output.
     if (PrintHelp  ||  PrintOptions) {
         if (PrintHelp) {
@@ -312,6 +322,11 @@ void environ_init(void)
                 _objc_inform("OBJC_HELP is set");
             }
             _objc_inform("OBJC_PRINT_OPTIONS: list which options are set");
+#if SUPPORT_PREOPT_SIDECAR
+            _objc_inform("OBJC_PREOPT_SIDECAR: path of a file written by "
+                         "objcopt with selector and class tables for images "
+                         "outside the dyld shared cache");
+#endif
         }
         if (PrintOptions) {
             _objc_inform("OBJC_PRINT_OPTIONS is set");
@@ -400,6 +415,18 @@ void _objc_pthread_destroyspecific(void *arg)
 {
     _objc_pthread_data *data = (_objc_pthread_data *)arg;
     if (data != NULL) {
+#if SUPPORT_CONCURRENT_REFCOUNT
+        // Flush first: pending releases may run -dealloc.
+        RefcountBuffer::destroy(data->refcountBuffer);
+#endif
+#if SUPPORT_INSTANCE_SLABS
+        // After anything that may run -dealloc.
+        instance_slab_destroy_cache(data->instanceSlabCache);
+#endif
+        _destroyTrampolineCache(data->trampolineCache);
+#if __OBJC2__
+        _destroyCacheReader(data->cacheReader);
+#endif
         _destroyInitializingClassList(data->initializingClasses);
         _destroySyncCache(data->syncCache);
         _destroyAltHandlerList(data->handlerList);
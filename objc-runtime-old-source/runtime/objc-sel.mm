@@ -26,18 +26,224 @@
 #include "objc-private.h"
 #include "objc-cache.h"
 
+#include <atomic>
+
 #if SUPPORT_PREOPT
 static const objc_selopt_t *builtins = NULL;
 #endif
+#if SUPPORT_PREOPT_SIDECAR
+static const objc_selopt_t *sidecarBuiltins = NULL;
+#endif
 
 
 static size_t SelrefCount = 0;
 
-static NXMapTable *namedSelectors;
-
 static SEL search_builtins(const char *key);
 
 
+/***********************************************************************
+* Selector table
+* Selectors not in the shared cache are interned in a table sharded by 
+* name hash. Each shard is an open-addressed array of names that is 
+* searched without locks: a slot is written once, name last with a 
+* release store, and never changes again. Inserts take the shard's 
+* lock, search again, and fill the next empty slot.
+*
+* A shard grows by copying its names into a table twice the size and 
+* publishing that. Old tables are never freed because a lock-free 
+* reader may still be probing one. A reader that misses in an old 
+* table falls back to the locked search, which uses the current table.
+*
+* Copied selector names are bump-allocated from per-shard arenas 
+* instead of malloc'd one at a time. Selectors are never unregistered, 
+* so arena memory is never freed.
+*
+* Locking: the shard locks follow selLock, which sel_lock() callers 
+* hold across batches of sel_registerNameNoLock(). Lookups take no lock.
+**********************************************************************/
+
+namespace {
+
+#define SELECTOR_TABLE_MIN_CAPACITY 16
+#define SELECTOR_ARENA_SIZE 4096
+#define SELECTOR_ARENA_MAX_NAME (SELECTOR_ARENA_SIZE / 8)
+
+struct SelectorSlot {
+    // nil when empty. Set last, with release.
+    std::atomic<const char *> name;
+    uint32_t hash;
+};
+
+struct SelectorTable {
+    uint32_t mask;
+    uint32_t occupied;
+    SelectorTable *previous;  // kept for lock-free readers
+    SelectorSlot slots[0];
+
+    uint32_t capacity() const { return mask + 1; }
+
+    static SelectorTable *create(uint32_t capacity) {
+        SelectorTable *table = (SelectorTable *)
+            calloc(1, sizeof(SelectorTable) + capacity*sizeof(SelectorSlot));
+        table->mask = capacity - 1;
+        return table;
+    }
+
+    // Lock-free. The probe is bounded because a reader's table
+    // may be filled while it probes.
+    SEL find(const char *name, uint32_t hash) const {
+        uint32_t begin = hash & mask;
+        uint32_t i = begin;
+        do {
+            const char *s = slots[i].name.load(std::memory_order_acquire);
+            if (!s) return nil;
+            if (slots[i].hash == hash  &&  0 == strcmp(s, name)) {
+                return (SEL)s;
+            }
+            i = (i + 1) & mask;
+        } while (i != begin);
+        return nil;
+    }
+
+    // Shard must be locked, name must not be present, and there must
+    // be an empty slot.
+    void insert(const char *name, uint32_t hash) {
+        uint32_t i = hash & mask;
+        while (slots[i].name.load(std::memory_order_relaxed)) {
+            i = (i + 1) & mask;
+        }
+        slots[i].hash = hash;
+        slots[i].name.store(name, std::memory_order_release);
+        occupied++;
+    }
+};
+
+struct SelectorShard {
+    // Must be first. Lock ordering uses the address of each stripe.
+    spinlock_t slock;
+    std::atomic<SelectorTable *> table;
+    // Current string arena. Written only with the lock held.
+    char *arena;
+    size_t arenaUsed;
+    size_t arenaBytes;
+
+    SelectorShard() : table(nil), arena(nil), arenaUsed(0), arenaBytes(0) { }
+
+    void lock() { StripedMap<SelectorShard>::lockStripe(*this, slock); }
+    void unlock() { slock.unlock(); }
+    void forceReset() { slock.forceReset(); }
+};
+
+}
+
+static StripedMap<SelectorShard> SelectorShards;
+
+
+// _objc_strhash's low bits are weak (257 is 1 mod 256). 
+// Mix them before using the hash for both shard and slot.
+static inline uint32_t selector_hash(const char *name)
+{
+    uint32_t h = _objc_strhash(name);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline SelectorShard& selector_shard(uint32_t hash)
+{
+    return SelectorShards[(const void *)(uintptr_t)hash];
+}
+
+static SEL selector_find(const char *name, uint32_t hash)
+{
+    SelectorTable *table = 
+        selector_shard(hash).table.load(std::memory_order_acquire);
+    if (!table) return nil;
+    return table->find(name, hash);
+}
+
+
+// Copy a selector name into the shard's arena. Shard must be locked.
+static const char *selector_copy(SelectorShard& shard, const char *name)
+{
+    size_t size = strlen(name) + 1;
+    if (_dyld_is_memory_immutable(name, size)) return name;
+
+    if (size > SELECTOR_ARENA_MAX_NAME) {
+        return (const char *)memdup(name, size);
+    }
+
+    if (shard.arenaUsed + size > SELECTOR_ARENA_SIZE  ||  !shard.arena) {
+        // The rest of the old arena is wasted; at most 1/8 of it.
+        shard.arena = (char *)malloc(SELECTOR_ARENA_SIZE);
+        shard.arenaUsed = 0;
+        shard.arenaBytes += SELECTOR_ARENA_SIZE;
+    }
+    char *result = shard.arena + shard.arenaUsed;
+    memcpy(result, name, size);
+    shard.arenaUsed += size;
+    return result;
+}
+
+
+// Make room for one more name, keeping the table at most 3/4 full.
+// Shard must be locked.
+static SelectorTable *selector_grow(SelectorShard& shard)
+{
+    SelectorTable *oldTable = shard.table.load(std::memory_order_relaxed);
+    if (oldTable  &&  
+        (oldTable->occupied + 1) * 4 <= oldTable->capacity() * 3) 
+    {
+        return oldTable;
+    }
+
+    uint32_t capacity;
+    if (oldTable) {
+        capacity = oldTable->capacity() * 2;
+    } else {
+        // Spread the expected selector references over the shards.
+        size_t expected = SelrefCount / SelectorShards.getStripeCount();
+        capacity = SELECTOR_TABLE_MIN_CAPACITY;
+        while (capacity * 3 < expected * 4) capacity *= 2;
+    }
+
+    SelectorTable *newTable = SelectorTable::create(capacity);
+    if (oldTable) {
+        for (uint32_t i = 0; i < oldTable->capacity(); i++) {
+            const char *s = 
+                oldTable->slots[i].name.load(std::memory_order_relaxed);
+            if (s) newTable->insert(s, oldTable->slots[i].hash);
+        }
+    }
+    newTable->previous = oldTable;
+    shard.table.store(newTable, std::memory_order_release);
+    return newTable;
+}
+
+
+static SEL selector_insert(const char *name, uint32_t hash, bool copy)
+{
+    SelectorShard& shard = selector_shard(hash);
+    shard.lock();
+
+    // Rescan in case it was added, or the table replaced, 
+    // since the lock-free search.
+    SelectorTable *table = shard.table.load(std::memory_order_relaxed);
+    SEL result = table ? table->find(name, hash) : nil;
+    if (!result) {
+        table = selector_grow(shard);
+        result = (SEL)(copy ? selector_copy(shard, name) : name);
+        table->insert(sel_getName(result), hash);
+    }
+
+    shard.unlock();
+    return result;
+}
+
+
 /***********************************************************************
 * sel_init
 * Initialize selector tables and register selectors used internally.
@@ -62,6 +268,16 @@ void sel_init(size_t selrefCount)
         }
 #endif
 
+#if SUPPORT_PREOPT_SIDECAR
+    sidecarBuiltins = preoptSidecarSelectors();
+
+    if (PrintPreopt  &&  sidecarBuiltins) {
+        _objc_inform("PREOPTIMIZATION: using sidecar selopt at %p "
+                     "(%u selectors)", 
+                     sidecarBuiltins, sidecarBuiltins->occupied);
+    }
+#endif
+
     // Register selectors used by libobjc
 
 #define s(x) SEL_##x = sel_registerNameNoLock(#x, NO)
@@ -97,13 +313,6 @@ void sel_init(size_t selrefCount)
 }
 
 
-static SEL sel_alloc(const char *name, bool copy)
-{
-    selLock.assertWriting();
-    return (SEL)(copy ? strdupIfMutable(name) : name);    
-}
-
-
 const char *sel_getName(SEL sel) 
 {
     if (!sel) return "<null selector>";
@@ -119,18 +328,31 @@ BOOL sel_isMapped(SEL sel)
 
     if (sel == search_builtins(name)) return YES;
 
-    rwlock_reader_t lock(selLock);
-    if (namedSelectors) {
-        return (sel == (SEL)NXMapGet(namedSelectors, name));
-    }
-    return false;
+    uint32_t hash = selector_hash(name);
+    if (sel == selector_find(name, hash)) return YES;
+
+    // A lock-free miss may have raced with an insert or a table 
+    // replacement. Search again with the lock, as selector_insert() does.
+    SelectorShard& shard = selector_shard(hash);
+    shard.lock();
+    SelectorTable *table = shard.table.load(std::memory_order_relaxed);
+    SEL result = table ? table->find(name, hash) : nil;
+    shard.unlock();
+    return (sel == result);
 }
 
 
 static SEL search_builtins(const char *name) 
 {
 #if SUPPORT_PREOPT
-    if (builtins) return (SEL)builtins->get(name);
+    if (builtins) {
+        if (SEL result = (SEL)builtins->get(name)) return result;
+    }
+#endif
+#if SUPPORT_PREOPT_SIDECAR
+    // Names in both tables use the shared cache's copy, 
+    // because the shared cache's selector references already do.
+    if (sidecarBuiltins) return (SEL)sidecarBuiltins->get(name);
 #endif
     return nil;
 }
@@ -147,34 +369,13 @@ static SEL __sel_registerName(const char *name, int lock, int copy)
 
     result = search_builtins(name);
     if (result) return result;
-    
-    if (lock) selLock.read();
-    if (namedSelectors) {
-        result = (SEL)NXMapGet(namedSelectors, name);
-    }
-    if (lock) selLock.unlockRead();
+
+    uint32_t hash = selector_hash(name);
+    result = selector_find(name, hash);
     if (result) return result;
 
     // No match. Insert.
-
-    if (lock) selLock.write();
-
-    if (!namedSelectors) {
-        namedSelectors = NXCreateMapTable(NXStrValueMapPrototype, 
-                                          (unsigned)SelrefCount);
-    }
-    if (lock) {
-        // Rescan in case it was added while we dropped the lock
-        result = (SEL)NXMapGet(namedSelectors, name);
-    }
-    if (!result) {
-        result = sel_alloc(name, copy);
-        // fixme choose a better container (hash not map for starters)
-        NXMapInsert(namedSelectors, sel_getName(result), result);
-    }
-
-    if (lock) selLock.unlockWrite();
-    return result;
+    return selector_insert(name, hash, copy);
 }
 
 
@@ -197,6 +398,56 @@ void sel_unlock(void)
 }
 
 
+/***********************************************************************
+* Selector shard locks, for fork() and lock ordering.
+**********************************************************************/
+void SelectorLocksLockAll() {
+    SelectorShards.lockAll();
+}
+
+void SelectorLocksUnlockAll() {
+    SelectorShards.unlockAll();
+}
+
+void SelectorLocksForceResetAll() {
+    SelectorShards.forceResetAll();
+}
+
+void SelectorLocksDefineLockOrder() {
+    SelectorShards.defineLockOrder();
+}
+
+void SelectorLocksPrecedeLock(const void *newlock) {
+    SelectorShards.precedeLock(newlock);
+}
+
+void SelectorLocksSucceedLock(const void *oldlock) {
+    SelectorShards.succeedLock(oldlock);
+}
+
+void SelectorLocksNameProfiledLocks() {
+    SelectorShards.nameProfiledLocks("SelectorShards");
+}
+
+void SelectorLocksPrintStatistics() {
+    SelectorShards.printStatistics("SelectorShards");
+
+    size_t selectors = 0, capacity = 0, arenaBytes = 0;
+    for (unsigned int i = 0; i < SelectorShards.getStripeCount(); i++) {
+        SelectorShard& shard = SelectorShards.stripeAt(i);
+        SelectorTable *table = shard.table.load(std::memory_order_relaxed);
+        if (table) {
+            selectors += table->occupied;
+            capacity += table->capacity();
+        }
+        arenaBytes += shard.arenaBytes;
+    }
+    _objc_inform("STRIPES: SelectorShards: %zu selectors in %zu slots, "
+                 "%zu bytes of copied names", 
+                 selectors, capacity, arenaBytes);
+}
+
+
 // 2001/1/24
 // the majority of uses of this function (which used to return NULL if not found)
 // did not check for NULL, so, in fact, never return NULL
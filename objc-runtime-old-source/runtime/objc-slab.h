@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2018 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-slab.h
+* Slab allocation of instances.
+**********************************************************************/
+
+#ifndef _OBJC_SLAB_H_
+#define _OBJC_SLAB_H_
+
+#include "objc-config.h"
+
+#if SUPPORT_INSTANCE_SLABS
+
+/*
+Classes that opt in with _class_setUsesInstanceSlabs() get their
+instances from size-segregated slabs instead of calloc(). Blocks come
+in multiples of 16 bytes up to INSTANCE_SLAB_MAX_SIZE. Each thread
+keeps two magazines (small arrays of free blocks) per size class, so
+most allocations and frees touch no shared state. Full and empty
+magazines are exchanged with a per-size-class depot under
+InstanceSlabLock, and new blocks are carved from slab chunks in one
+reserved VM region.
+
+Freed blocks are zeroed before they go back into a magazine, and new
+chunks are zero-filled by the VM, so every block handed out is zeroed
+like calloc's. Slab memory is never returned to the system.
+
+The reserved region makes "is this a slab block?" a range check, so
+the dealloc path can tell slab blocks from malloc blocks without
+looking at the class. Slab blocks must never be passed to free().
+*/
+
+#define INSTANCE_SLAB_MAX_SIZE 256
+
+// The reserved slab region. Zero until the first slab is carved.
+// Size is set first, then Base is published with a release store, 
+// so a reader that sees a non-zero Base also sees Size.
+extern std::atomic<uintptr_t> InstanceSlabRegionBase;
+extern uintptr_t InstanceSlabRegionSize;
+
+static inline bool instance_slab_contains(const void *p)
+{
+    uintptr_t base = InstanceSlabRegionBase.load(std::memory_order_acquire);
+    return base  &&  (uintptr_t)p - base < InstanceSlabRegionSize;
+}
+
+// Returns a zeroed block of at least size bytes, or nil if size is
+// too big or the slab region is exhausted. Callers fall back to calloc.
+extern void *instance_slab_alloc(size_t size);
+
+// p must satisfy instance_slab_contains().
+extern void instance_slab_free(void *p);
+
+// Thread teardown.
+struct InstanceSlabCache;
+extern void instance_slab_destroy_cache(struct InstanceSlabCache *cache);
+
+extern void instance_slab_print_statistics(void);
+
+static inline void free_instance(void *p)
+{
+    if (slowpath(instance_slab_contains(p))) instance_slab_free(p);
+    else free(p);
+}
+
+#else
+
+static inline void free_instance(void *p)
+{
+    free(p);
+}
+
+// SUPPORT_INSTANCE_SLABS
+#endif
+
+#endif
@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2018 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-slab.mm
+* Slab allocation of instances.
+**********************************************************************/
+
+#include "objc-private.h"
+#include "objc-slab.h"
+
+#include <atomic>
+
+#if SUPPORT_INSTANCE_SLABS
+
+spinlock_t InstanceSlabLock;
+
+std::atomic<uintptr_t> InstanceSlabRegionBase;
+uintptr_t InstanceSlabRegionSize;
+
+#define SIZE_CLASSES (INSTANCE_SLAB_MAX_SIZE / 16)
+#define MAGAZINE_ROUNDS 64
+#define CHUNK_SIZE ((uintptr_t)64*1024)
+#define REGION_SIZE ((uintptr_t)1 << 30)
+#define REGION_CHUNKS (REGION_SIZE / CHUNK_SIZE)
+
+// Per-thread counts are folded into the depot at least this often.
+#define FOLD_THRESHOLD 4096
+
+struct InstanceMagazine {
+    InstanceMagazine *next;  // in a depot list
+    uint32_t count;
+    void *rounds[MAGAZINE_ROUNDS];
+
+    bool empty() const { return count == 0; }
+    bool full() const { return count == MAGAZINE_ROUNDS; }
+};
+
+// Shared state for one size class. Protected by InstanceSlabLock.
+struct InstanceSlabDepot {
+    InstanceMagazine *loaded;  // magazines holding at least one block
+    InstanceMagazine *empty;
+    uintptr_t chunkNext;       // uncarved part of the current chunk
+    uintptr_t chunkEnd;
+
+    uint64_t allocations;
+    uint64_t frees;
+    size_t slabBytes;
+    size_t depotBlocks;        // blocks in the loaded magazines
+};
+
+struct InstanceSlabCache {
+    InstanceMagazine *loaded[SIZE_CLASSES];
+    InstanceMagazine *previous[SIZE_CLASSES];
+    // Not yet folded into the depot.
+    uint32_t allocations[SIZE_CLASSES];
+    uint32_t frees[SIZE_CLASSES];
+};
+
+static InstanceSlabDepot Depots[SIZE_CLASSES];
+
+// Size class of each chunk in the region. Written under
+// InstanceSlabLock before any block of the chunk is handed out.
+static uint8_t ChunkSizeClass[REGION_CHUNKS];
+
+// Protected by InstanceSlabLock.
+static uintptr_t RegionNext;
+static uint64_t FirstSlabTime;
+
+
+static inline unsigned sizeClass(size_t size)
+{
+    return (unsigned)((size + 15) / 16) - 1;
+}
+
+static inline size_t blockSize(unsigned sc)
+{
+    return (sc + 1) * 16;
+}
+
+static InstanceSlabCache *slabCache(bool create)
+{
+    _objc_pthread_data *data = _objc_fetch_pthread_data(create);
+    if (!data) return nil;
+
+    InstanceSlabCache *cache = data->instanceSlabCache;
+    if (!cache  &&  create) {
+        cache = (InstanceSlabCache *)calloc(1, sizeof(*cache));
+        data->instanceSlabCache = cache;
+    }
+    return cache;
+}
+
+static InstanceMagazine *newMagazine()
+{
+    return (InstanceMagazine *)calloc(1, sizeof(InstanceMagazine));
+}
+
+
+/***********************************************************************
+* foldCounts
+* Add a thread's counts for one size class to the depot's.
+* Locking: InstanceSlabLock must be held
+**********************************************************************/
+static void foldCounts(InstanceSlabCache *cache, unsigned sc)
+{
+    InstanceSlabLock.assertLocked();
+    Depots[sc].allocations += cache->allocations[sc];
+    Depots[sc].frees += cache->frees[sc];
+    cache->allocations[sc] = 0;
+    cache->frees[sc] = 0;
+}
+
+static void foldCountsIfNeeded(InstanceSlabCache *cache, unsigned sc)
+{
+    if (slowpath(cache->allocations[sc] >= FOLD_THRESHOLD  ||
+                 cache->frees[sc] >= FOLD_THRESHOLD))
+    {
+        mutex_locker_t lock(InstanceSlabLock);
+        foldCounts(cache, sc);
+    }
+}
+
+
+/***********************************************************************
+* carve
+* Fill m with new blocks from the size class's current chunk,
+* starting a new chunk as needed. The region is reserved on first use.
+* Returns false if m is still empty because the region is used up.
+* Locking: InstanceSlabLock must be held
+**********************************************************************/
+static bool carve(unsigned sc, InstanceMagazine *m)
+{
+    InstanceSlabLock.assertLocked();
+    InstanceSlabDepot& depot = Depots[sc];
+    size_t size = blockSize(sc);
+    // Written only here, with InstanceSlabLock held.
+    uintptr_t base = InstanceSlabRegionBase.load(std::memory_order_relaxed);
+
+    while (!m->full()) {
+        if (depot.chunkEnd - depot.chunkNext < size) {
+            if (!base) {
+                vm_address_t region = 0;
+                kern_return_t kr =
+                    vm_allocate(mach_task_self(), &region,
+                                REGION_SIZE + CHUNK_SIZE,
+                                VM_FLAGS_ANYWHERE |
+                                VM_MAKE_TAG(VM_MEMORY_FOUNDATION));
+                if (kr != KERN_SUCCESS) break;
+                // Chunks are aligned so a block's chunk is a shift away.
+                base = (region + CHUNK_SIZE-1) & ~(CHUNK_SIZE-1);
+                RegionNext = base;
+                FirstSlabTime = nanoseconds();
+                // Readers load Base with acquire; publish it last.
+                InstanceSlabRegionSize = REGION_SIZE;
+                InstanceSlabRegionBase.store(base, std::memory_order_release);
+            }
+            if (RegionNext == base + REGION_SIZE) break;
+
+            ChunkSizeClass[(RegionNext - base) / CHUNK_SIZE]
+                = (uint8_t)sc;
+            depot.chunkNext = RegionNext;
+            depot.chunkEnd = RegionNext + CHUNK_SIZE;
+            depot.slabBytes += CHUNK_SIZE;
+            RegionNext += CHUNK_SIZE;
+        }
+
+        m->rounds[m->count++] = (void *)depot.chunkNext;
+        depot.chunkNext += size;
+    }
+
+    return !m->empty();
+}
+
+
+/***********************************************************************
+* allocSlow
+* The thread's loaded magazine for sc is missing or empty.
+* Swap in the previous magazine if it has blocks, otherwise trade
+* the empty magazine for a loaded one from the depot, otherwise
+* carve new blocks.
+* Locking: acquires InstanceSlabLock
+**********************************************************************/
+static void *allocSlow(InstanceSlabCache *cache, unsigned sc)
+{
+    InstanceMagazine *prev = cache->previous[sc];
+    if (prev  &&  !prev->empty()) {
+        cache->previous[sc] = cache->loaded[sc];
+        cache->loaded[sc] = prev;
+        return prev->rounds[--prev->count];
+    }
+
+    InstanceMagazine *m = cache->loaded[sc];
+    if (!m) {
+        m = newMagazine();
+        if (!m) return nil;
+        cache->loaded[sc] = m;
+    }
+
+    mutex_locker_t lock(InstanceSlabLock);
+    foldCounts(cache, sc);
+
+    InstanceSlabDepot& depot = Depots[sc];
+    if (InstanceMagazine *full = depot.loaded) {
+        depot.loaded = full->next;
+        depot.depotBlocks -= full->count;
+        m->next = depot.empty;
+        depot.empty = m;
+        cache->loaded[sc] = m = full;
+    }
+    else if (!carve(sc, m)) {
+        return nil;
+    }
+
+    return m->rounds[--m->count];
+}
+
+
+/***********************************************************************
+* instance_slab_alloc
+* Locking: none on the fast path
+**********************************************************************/
+void *instance_slab_alloc(size_t size)
+{
+    if (size > INSTANCE_SLAB_MAX_SIZE) return nil;
+
+    unsigned sc = sizeClass(size);
+    InstanceSlabCache *cache = slabCache(true);
+    if (!cache) return nil;
+
+    void *result;
+    InstanceMagazine *m = cache->loaded[sc];
+    if (fastpath(m  &&  !m->empty())) {
+        result = m->rounds[--m->count];
+    } else {
+        result = allocSlow(cache, sc);
+        if (!result) return nil;
+    }
+
+    cache->allocations[sc]++;
+    foldCountsIfNeeded(cache, sc);
+    return result;
+}
+
+
+/***********************************************************************
+* freeToDepot
+* Free a block with no per-thread cache, during thread teardown
+* or when no magazine could be allocated.
+* Locking: acquires InstanceSlabLock
+**********************************************************************/
+static void freeToDepot(unsigned sc, void *p)
+{
+    InstanceMagazine *spare = nil;
+    while (true) {
+        {
+            mutex_locker_t lock(InstanceSlabLock);
+            InstanceSlabDepot& depot = Depots[sc];
+            InstanceMagazine *m = depot.loaded;
+            if (!m  ||  m->full()) {
+                m = depot.empty;
+                if (m) depot.empty = m->next;
+                else if ((m = spare)) spare = nil;
+                if (m) {
+                    m->next = depot.loaded;
+                    depot.loaded = m;
+                }
+            }
+            if (m) {
+                m->rounds[m->count++] = p;
+                depot.depotBlocks++;
+                depot.frees++;
+                break;
+            }
+        }
+
+        // No room anywhere. Make some and try again.
+        spare = newMagazine();
+        if (!spare) return;  // out of memory; the block is lost
+    }
+
+    if (spare) free(spare);
+}
+
+
+/***********************************************************************
+* freeSlow
+* The thread's loaded magazine for sc is missing or full.
+* Swap in the previous magazine if it has room, otherwise trade
+* the full magazine for an empty one from the depot.
+* Locking: acquires InstanceSlabLock
+**********************************************************************/
+static void freeSlow(InstanceSlabCache *cache, unsigned sc, void *p)
+{
+    InstanceMagazine *m = cache->loaded[sc];
+    InstanceMagazine *prev = cache->previous[sc];
+
+    if (prev  &&  !prev->full()) {
+        cache->previous[sc] = m;
+        cache->loaded[sc] = m = prev;
+    }
+    else if (!m  ||  !prev) {
+        // Fewer than two magazines so far: start another.
+        InstanceMagazine *fresh = newMagazine();
+        if (!fresh) return freeToDepot(sc, p);
+        if (m) cache->previous[sc] = m;
+        cache->loaded[sc] = m = fresh;
+    }
+    else {
+        InstanceMagazine *fresh;
+        {
+            mutex_locker_t lock(InstanceSlabLock);
+            foldCounts(cache, sc);
+            InstanceSlabDepot& depot = Depots[sc];
+            m->next = depot.loaded;
+            depot.loaded = m;
+            depot.depotBlocks += m->count;
+            fresh = depot.empty;
+            if (fresh) depot.empty = fresh->next;
+        }
+        if (!fresh) fresh = newMagazine();
+        cache->loaded[sc] = m = fresh;
+        if (!fresh) return freeToDepot(sc, p);
+    }
+
+    m->rounds[m->count++] = p;
+    cache->frees[sc]++;
+}
+
+
+/***********************************************************************
+* instance_slab_free
+* Locking: none on the fast path
+**********************************************************************/
+void instance_slab_free(void *p)
+{
+    assert(instance_slab_contains(p));
+    // instance_slab_contains() already loaded Base with acquire.
+    uintptr_t base = InstanceSlabRegionBase.load(std::memory_order_relaxed);
+    unsigned sc = ChunkSizeClass[((uintptr_t)p - base) / CHUNK_SIZE];
+
+    // Blocks are always handed out zeroed.
+    bzero(p, blockSize(sc));
+
+    InstanceSlabCache *cache = slabCache(false);
+    if (slowpath(!cache)) return freeToDepot(sc, p);
+
+    InstanceMagazine *m = cache->loaded[sc];
+    if (fastpath(m  &&  !m->full())) {
+        m->rounds[m->count++] = p;
+        cache->frees[sc]++;
+    } else {
+        freeSlow(cache, sc, p);
+    }
+    foldCountsIfNeeded(cache, sc);
+}
+
+
+/***********************************************************************
+* instance_slab_destroy_cache
+* Return a thread's magazines and counts to the depots.
+* Locking: acquires InstanceSlabLock
+**********************************************************************/
+void instance_slab_destroy_cache(InstanceSlabCache *cache)
+{
+    if (!cache) return;
+
+    {
+        mutex_locker_t lock(InstanceSlabLock);
+        for (unsigned sc = 0; sc < SIZE_CLASSES; sc++) {
+            foldCounts(cache, sc);
+            InstanceSlabDepot& depot = Depots[sc];
+            InstanceMagazine *mags[2] = { cache->loaded[sc],
+                                          cache->previous[sc] };
+            for (InstanceMagazine *m : mags) {
+                if (!m) continue;
+                if (m->empty()) {
+                    m->next = depot.empty;
+                    depot.empty = m;
+                } else {
+                    m->next = depot.loaded;
+                    depot.loaded = m;
+                    depot.depotBlocks += m->count;
+                }
+            }
+        }
+    }
+
+    free(cache);
+}
+
+
+/***********************************************************************
+* _objc_getInstanceSlabStatistics
+* Locking: acquires InstanceSlabLock
+**********************************************************************/
+BOOL
+_objc_getInstanceSlabStatistics(unsigned sizeClass,
+                                struct objc_instance_slab_statistics *outStats)
+{
+    if (sizeClass >= SIZE_CLASSES) return NO;
+
+    // Make this thread's own counts current.
+    InstanceSlabCache *cache = slabCache(false);
+
+    mutex_locker_t lock(InstanceSlabLock);
+    if (cache) foldCounts(cache, sizeClass);
+
+    InstanceSlabDepot& depot = Depots[sizeClass];
+    bzero(outStats, sizeof(*outStats));
+    outStats->blockSize = blockSize(sizeClass);
+    outStats->allocations = depot.allocations;
+    outStats->frees = depot.frees;
+    outStats->slabBytes = depot.slabBytes;
+    // Other threads' unfolded counts may make frees lead allocations.
+    if (depot.allocations > depot.frees) {
+        outStats->liveBytes =
+            (size_t)(depot.allocations - depot.frees) * blockSize(sizeClass);
+    }
+    outStats->depotBlocks = depot.depotBlocks;
+    if (FirstSlabTime) outStats->elapsed = nanoseconds() - FirstSlabTime;
+    return YES;
+}
+
+
+/***********************************************************************
+* instance_slab_print_statistics
+* Print allocation rates and fragmentation of each size class in use.
+* OBJC_PRINT_SLAB_STATISTICS
+**********************************************************************/
+void instance_slab_print_statistics(void)
+{
+    for (unsigned sc = 0; sc < SIZE_CLASSES; sc++) {
+        struct objc_instance_slab_statistics stats;
+        _objc_getInstanceSlabStatistics(sc, &stats);
+        if (stats.slabBytes == 0) continue;
+
+        double seconds = stats.elapsed / 1e9;
+        _objc_inform("SLABS: %3zu-byte blocks: %llu allocations "
+                     "(%.0f/sec), %llu frees, %zu KB of slabs, "
+                     "%zu KB live (%.1f%% unused)",
+                     stats.blockSize,
+                     (unsigned long long)stats.allocations,
+                     seconds > 0 ? stats.allocations / seconds : 0.0,
+                     (unsigned long long)stats.frees,
+                     stats.slabBytes / 1024, stats.liveBytes / 1024,
+                     100.0 * (stats.slabBytes - stats.liveBytes)
+                     / stats.slabBytes);
+    }
+}
+
+#else
+
+BOOL
+_objc_getInstanceSlabStatistics(unsigned sizeClass __unused,
+                                struct objc_instance_slab_statistics *outStats __unused)
+{
+    return NO;
+}
+
+// SUPPORT_INSTANCE_SLABS
+#endif
@@ -23,6 +23,7 @@
 
 #include "objc-private.h"
 #include "objc-sync.h"
+#include <atomic>
 
 //
 // Allocate a lock only when needed.  Since few locks are needed at any point
@@ -56,11 +57,51 @@ typedef struct SyncCache {
   SYNC_COUNT_DIRECT_KEY == SyncCacheItem.lockCount
  */
 
+/*
+  Thin locks: each SyncList also carries a one-word lock shared by all 
+  objects that hash to it. A thread that finds the word free claims it 
+  for its object with a single compare-and-swap, and a thread that 
+  already owns it for the same object just bumps the recursion count. 
+  Neither touches a SyncData.
+
+  thinWord is 0 when free, ThinClaimed while a thread is trying to 
+  take it, or the locked object, possibly with ThinWaiters set. Every 
+  other acquire uses SyncData as before and counts itself in 
+  thinFatUsers while it does; the thin path is closed while that count 
+  is non-zero, so an object is never locked both ways at once. A 
+  SyncData acquire of an object that is currently thin-locked by 
+  another thread sets ThinWaiters and sleeps on thinWaiters until the 
+  owner's last exit.
+
+  The object is stored in thinWord only after thinFatUsers is seen to 
+  be zero. An exit that finds its object in thinWord therefore knows 
+  the thin lock is really held, and an exit by any thread other than 
+  the thin owner goes to SyncData like any other.
+
+  Tagged pointers and OBJC_DISABLE_THIN_SYNC_LOCKS always use SyncData.
+ */
+
+enum : uintptr_t {
+    ThinWaiters = 1,
+    ThinClaimed = 2,
+};
+
 struct SyncList {
     SyncData *data;
     spinlock_t lock;
 
-    SyncList() : data(nil), lock(fork_unsafe_lock) { }
+    std::atomic<uintptr_t> thinWord;
+    // Written only by the thin lock's owner. 
+    // Zero unless thinWord is thin-locked.
+    std::atomic<uintptr_t> thinOwner;
+    uintptr_t thinRecursion;
+    std::atomic<uintptr_t> thinFatUsers;
+    monitor_t thinWaiters;
+
+    SyncList() 
+        : data(nil), lock(fork_unsafe_lock), thinWord(0), thinOwner(0), 
+          thinRecursion(0), thinFatUsers(0), thinWaiters(fork_unsafe_lock) 
+    { }
 };
 
 // Use multiple parallel lists to decrease contention among unrelated objects.
@@ -68,6 +109,58 @@ struct SyncList {
 #define LIST_FOR_OBJ(obj) sDataLists[obj].data
 static StripedMap<SyncList> sDataLists;
 
+void _syncPrintStripeStatistics(void)
+{
+    sDataLists.printStatistics("SyncLists");
+}
+
+void _syncNameProfiledLocks(void)
+{
+    sDataLists.nameProfiledLocks("SyncLists");
+}
+
+
+// Counted only when OBJC_PRINT_SYNC_STATISTICS is set.
+static struct {
+    std::atomic<size_t> thinAcquires;
+    std::atomic<size_t> thinRecursions;
+    std::atomic<size_t> thinWaits;
+    std::atomic<size_t> fatAcquires;
+    std::atomic<size_t> fastCacheHits;
+    std::atomic<size_t> cacheHits;
+    std::atomic<size_t> listSearches;
+    std::atomic<size_t> allocations;
+} SyncStatistics;
+
+#define SYNC_COUNT(counter)                                             \
+    do {                                                                \
+        if (slowpath(PrintSyncStatistics)) {                            \
+            SyncStatistics.counter.fetch_add(1, std::memory_order_relaxed); \
+        }                                                               \
+    } while (0)
+
+void _syncPrintStatistics(void)
+{
+    size_t fast = SyncStatistics.fastCacheHits.load();
+    size_t cached = SyncStatistics.cacheHits.load();
+    size_t searched = SyncStatistics.listSearches.load();
+    size_t lookups = fast + cached + searched;
+
+    _objc_inform("SYNC: %zu thin acquires, %zu thin recursions, "
+                 "%zu inflated acquires (%zu waited for a thin lock)", 
+                 SyncStatistics.thinAcquires.load(), 
+                 SyncStatistics.thinRecursions.load(), 
+                 SyncStatistics.fatAcquires.load(), 
+                 SyncStatistics.thinWaits.load());
+    _objc_inform("SYNC: %zu id2data lookups: %zu fast cache hits (%.1f%%), "
+                 "%zu cache hits (%.1f%%), %zu list searches, "
+                 "%zu SyncData allocated", 
+                 lookups, 
+                 fast, lookups ? 100.0 * fast / lookups : 0.0, 
+                 cached, lookups ? 100.0 * cached / lookups : 0.0, 
+                 searched, SyncStatistics.allocations.load());
+}
+
 
 enum usage { ACQUIRE, RELEASE, CHECK };
 
@@ -123,6 +216,7 @@ static SyncData* id2data(id object, enum usage why)
         if (data->object == object) {
             // Found a match in fast cache.
             uintptr_t lockCount;
+            SYNC_COUNT(fastCacheHits);
 
             result = data;
             lockCount = (uintptr_t)tls_get_direct(SYNC_COUNT_DIRECT_KEY);
@@ -165,6 +259,7 @@ static SyncData* id2data(id object, enum usage why)
             if (item->data->object != object) continue;
 
             // Found a match.
+            SYNC_COUNT(cacheHits);
             result = item->data;
             if (result->threadCount <= 0  ||  item->lockCount <= 0) {
                 _objc_fatal("id2data cache is buggy");
@@ -199,7 +294,8 @@ static SyncData* id2data(id object, enum usage why)
     // We could keep the nodes in some hash table if we find that there are
     // more than 20 or so distinct locks active, but we don't do that now.
     
-    lockp->lock();
+    SYNC_COUNT(listSearches);
+    StripedMap<SyncList>::lockStripe(sDataLists[object], *lockp);
 
     {
         SyncData* p;
@@ -232,6 +328,7 @@ static SyncData* id2data(id object, enum usage why)
     // XXX calling malloc with a global lock held is bad practice,
     // might be worth releasing the lock, mallocing, and searching again.
     // But since we never free these guys we won't be stuck in malloc very often.
+    SYNC_COUNT(allocations);
     result = (SyncData*)calloc(sizeof(SyncData), 1);
     result->object = (objc_object *)object;
     result->threadCount = 1;
@@ -273,6 +370,150 @@ static SyncData* id2data(id object, enum usage why)
 }
 
 
+/***********************************************************************
+* Thin locks
+**********************************************************************/
+
+static inline bool useThinLock(id object)
+{
+    return !DisableThinSyncLocks  &&  !object->isTaggedPointer();
+}
+
+static inline uintptr_t thinSelf()
+{
+    return (uintptr_t)pthread_self();
+}
+
+
+// Wake everyone waiting for list's thin lock.
+static void thinWake(SyncList& list)
+{
+    list.thinWaiters.enter();
+    list.thinWaiters.notifyAll();
+    list.thinWaiters.leave();
+}
+
+
+// Sleep until object is no longer thin-locked in list.
+static void thinWait(SyncList& list, id object)
+{
+    SYNC_COUNT(thinWaits);
+
+    // ThinWaiters is set while holding thinWaiters, so the owner's 
+    // wakeup cannot come between the check and the wait.
+    list.thinWaiters.enter();
+    while (true) {
+        uintptr_t thinWord = list.thinWord.load(std::memory_order_acquire);
+        if ((thinWord & ~(uintptr_t)ThinWaiters) != (uintptr_t)object) break;
+        if (!(thinWord & ThinWaiters)  &&  
+            !list.thinWord.compare_exchange_weak(thinWord, 
+                                                 thinWord | ThinWaiters, 
+                                                 std::memory_order_relaxed))
+        {
+            continue;
+        }
+        list.thinWaiters.wait();
+    }
+    list.thinWaiters.leave();
+}
+
+
+// Free list's thin lock.
+static ALWAYS_INLINE void thinRelease(SyncList& list)
+{
+    list.thinOwner.store(0, std::memory_order_relaxed);
+    uintptr_t old = list.thinWord.exchange(0, std::memory_order_release);
+    if (slowpath(old & ThinWaiters)) thinWake(list);
+}
+
+
+// Register an inflated acquire of object. 
+// The caller then locks the object's SyncData.
+static NEVER_INLINE void thinEnterFat(SyncList& list, id object)
+{
+    SYNC_COUNT(fatAcquires);
+
+    // Pairs with the check of thinFatUsers in thinEnter(). At least one 
+    // of the two threads sees the other and stays out of the thin path.
+    list.thinFatUsers.fetch_add(1, std::memory_order_seq_cst);
+
+    // A thread that claimed the word may not have seen the increment. 
+    // Wait for it to either back off or publish its object.
+    uintptr_t thinWord;
+    while ((thinWord = list.thinWord.load(std::memory_order_seq_cst)) == 
+           ThinClaimed) 
+    {
+        sched_yield();
+    }
+
+    if ((thinWord & ~(uintptr_t)ThinWaiters) == (uintptr_t)object) {
+        // Someone else has object thin-locked. Wait for it.
+        // (Not this thread: that is handled by thinEnter.)
+        thinWait(list, object);
+    }
+}
+
+
+// Unregister an inflated acquire.
+static void thinExitFat(SyncList& list)
+{
+    list.thinFatUsers.fetch_sub(1, std::memory_order_release);
+}
+
+
+// Returns true if object is now thin-locked by this thread.
+// Returns false if the caller must lock the object's SyncData.
+static ALWAYS_INLINE bool thinEnter(SyncList& list, id object)
+{
+    uintptr_t self = thinSelf();
+    uintptr_t thinWord = 0;
+
+    if (list.thinWord.compare_exchange_strong(thinWord, ThinClaimed, 
+                                              std::memory_order_seq_cst, 
+                                              std::memory_order_relaxed))
+    {
+        if (fastpath(list.thinFatUsers.load(std::memory_order_seq_cst) == 0)) {
+            list.thinOwner.store(self, std::memory_order_relaxed);
+            list.thinRecursion = 1;
+            list.thinWord.store((uintptr_t)object, std::memory_order_release);
+            SYNC_COUNT(thinAcquires);
+            return true;
+        }
+        // Some object on this list is using SyncData, possibly this one.
+        // Back off until they are all done. Nobody waits on a claim, 
+        // so there is no one to wake.
+        list.thinWord.store(0, std::memory_order_release);
+    }
+    else if ((thinWord & ~(uintptr_t)ThinWaiters) == (uintptr_t)object  &&  
+             list.thinOwner.load(std::memory_order_relaxed) == self)
+    {
+        list.thinRecursion++;
+        SYNC_COUNT(thinRecursions);
+        return true;
+    }
+
+    thinEnterFat(list, object);
+    return false;
+}
+
+
+// Returns true if this thread had object thin-locked.
+// Returns false if the caller must unlock the object's SyncData, 
+// which also reports an exit by a thread that holds no lock at all.
+static ALWAYS_INLINE bool thinExit(SyncList& list, id object)
+{
+    uintptr_t thinWord = list.thinWord.load(std::memory_order_acquire);
+    if ((thinWord & ~(uintptr_t)ThinWaiters) != (uintptr_t)object  ||  
+        list.thinOwner.load(std::memory_order_relaxed) != thinSelf())
+    {
+        return false;
+    }
+
+    if (--list.thinRecursion == 0) thinRelease(list);
+    return true;
+}
+
+
 BREAKPOINT_FUNCTION(
     void objc_sync_nil(void)
 );
@@ -286,6 +527,9 @@ int objc_sync_enter(id obj)
     int result = OBJC_SYNC_SUCCESS;
 
     if (obj) {
+        if (useThinLock(obj)  &&  thinEnter(sDataLists[obj], obj)) {
+            return result;
+        }
         SyncData* data = id2data(obj, ACQUIRE);
         assert(data);
         data->mutex.lock();
@@ -308,6 +552,10 @@ int objc_sync_exit(id obj)
     int result = OBJC_SYNC_SUCCESS;
     
     if (obj) {
+        bool thin = useThinLock(obj);
+        if (thin  &&  thinExit(sDataLists[obj], obj)) {
+            return result;
+        }
         SyncData* data = id2data(obj, RELEASE); 
         if (!data) {
             result = OBJC_SYNC_NOT_OWNING_THREAD_ERROR;
@@ -315,6 +563,8 @@ int objc_sync_exit(id obj)
             bool okay = data->mutex.tryUnlock();
             if (!okay) {
                 result = OBJC_SYNC_NOT_OWNING_THREAD_ERROR;
+            } else if (thin) {
+                thinExitFat(sDataLists[obj]);
             }
         }
     } else {
@@ -48,6 +48,22 @@ deallocated by briefly placing it in the table just prior to invoking
 dealloc, and removing it via objc_clear_deallocating just prior to memory 
 reclamation.
 
+Each SideTable stripe has its own weak table, so the spin lock in question 
+covers only the referents that hash to that stripe. Two things keep the 
+lock hold times short even when the table is large:
+
+Resizing is incremental. weak_resize() keeps the previous entry array as 
+old_entries and every later mutation moves a few of its buckets into the 
+new array. Lookups check both arrays until the old one has drained.
+
+Clearing a dying referent with many referrers is done in batches. 
+weak_clear_no_lock() zeroes at most WEAK_CLEAR_BATCH referrers per call, 
+and the caller drops and retakes the stripe lock between calls, so weak 
+stores to unrelated objects in the same stripe are not stalled behind one 
+large clear. The dying referent keeps its entry until the last batch; 
+concurrent stores and loads see it as deallocating and never register or 
+retain it again.
+
 */
 
 // The address of a __weak variable.
@@ -126,6 +142,14 @@ struct weak_table_t {
     uintptr_t mask;
     // hash key 最大偏移值
     uintptr_t max_hash_displacement;
+    // Incremental resize. While old_entries is non-nil, entries from the
+    // previous array are still being moved into weak_entries, starting
+    // at migrate_index. num_entries counts weak_entries only.
+    weak_entry_t *old_entries;
+    size_t    old_num_entries;
+    uintptr_t old_mask;
+    uintptr_t old_max_hash_displacement;
+    size_t    migrate_index;
 };
 
 /// Adds an (object, weak pointer) pair to the weak table.
@@ -140,8 +164,16 @@ void weak_unregister_no_lock(weak_table_t *weak_table, id referent, id *referrer
 bool weak_is_registered_no_lock(weak_table_t *weak_table, id referent);
 #endif
 
-/// Called on object destruction. Sets all remaining weak pointers to nil.
-void weak_clear_no_lock(weak_table_t *weak_table, id referent);
+/// Position of a batched weak_clear_no_lock() between calls.
+struct weak_clear_cursor_t {
+    weak_referrer_t *referrers;
+    size_t begin;
+};
+
+/// Called on object destruction. Sets a batch of weak pointers to nil.
+/// Returns true if more remain; call again with the same cursor.
+bool weak_clear_no_lock(weak_table_t *weak_table, id referent, 
+                        weak_clear_cursor_t *cursor);
 
 __END_DECLS
 
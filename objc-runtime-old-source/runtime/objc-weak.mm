@@ -31,6 +31,14 @@
 #include <libkern/OSAtomic.h>
 
 #define TABLE_SIZE(entry) (entry->mask ? entry->mask + 1 : 0)
+#define OLD_TABLE_SIZE(table) (table->old_entries ? table->old_mask + 1 : 0)
+
+// Buckets of old_entries moved by each weak table mutation during
+// an incremental resize.
+#define WEAK_MIGRATE_BATCH 8
+
+// Referrers zeroed by each call to weak_clear_no_lock().
+#define WEAK_CLEAR_BATCH 256
 
 static void append_referrer(weak_entry_t *entry, objc_object **new_referrer);
 
@@ -208,6 +216,7 @@ static void remove_referrer(weak_entry_t *entry, objc_object **old_referrer)
 /** 
  * Add new_entry to the object's table of weak references.
  * Does not check whether the referent is already in the table.
+ * New entries always go into weak_entries, never old_entries.
  */
 static void weak_entry_insert(weak_table_t *weak_table, weak_entry_t *new_entry)
 {
@@ -232,29 +241,66 @@ static void weak_entry_insert(weak_table_t *weak_table, weak_entry_t *new_entry)
 }
 
 
+/**
+ * Move up to count buckets of an in-progress resize from old_entries
+ * into weak_entries. Frees old_entries once it is empty.
+ * Entry pointers obtained before this call may be invalidated by it.
+ */
+static void weak_migrate_some(weak_table_t *weak_table, size_t count)
+{
+    weak_entry_t *old_entries = weak_table->old_entries;
+    if (!old_entries) return;
+
+    size_t old_size = OLD_TABLE_SIZE(weak_table);
+    size_t index = weak_table->migrate_index;
+    size_t end = (count < old_size - index) ? index + count : old_size;
+    for ( ; index < end  &&  weak_table->old_num_entries > 0; index++) {
+        weak_entry_t *entry = &old_entries[index];
+        if (entry->referent) {
+            weak_entry_insert(weak_table, entry);
+            bzero(entry, sizeof(*entry));
+            weak_table->old_num_entries--;
+        }
+    }
+    weak_table->migrate_index = index;
+
+    if (index == old_size  ||  weak_table->old_num_entries == 0) {
+        weak_table->old_entries = nil;
+        weak_table->old_mask = 0;
+        weak_table->old_max_hash_displacement = 0;
+        weak_table->migrate_index = 0;
+        free(old_entries);
+    }
+}
+
+
+// Start an incremental resize to new_size buckets. The current entries
+// become old_entries and are moved over by later calls to
+// weak_migrate_some(). A resize still in progress is finished first.
 static void weak_resize(weak_table_t *weak_table, size_t new_size)
 {
-    size_t old_size = TABLE_SIZE(weak_table);
+    weak_migrate_some(weak_table, SIZE_MAX);
+    assert(!weak_table->old_entries);
 
     weak_entry_t *old_entries = weak_table->weak_entries;
     weak_entry_t *new_entries = (weak_entry_t *)
         calloc(new_size, sizeof(weak_entry_t));
 
+    if (old_entries  &&  weak_table->num_entries > 0) {
+        weak_table->old_entries = old_entries;
+        weak_table->old_num_entries = weak_table->num_entries;
+        weak_table->old_mask = weak_table->mask;
+        weak_table->old_max_hash_displacement = 
+            weak_table->max_hash_displacement;
+        weak_table->migrate_index = 0;
+    } else if (old_entries) {
+        free(old_entries);
+    }
+
     weak_table->mask = new_size - 1;
     weak_table->weak_entries = new_entries;
     weak_table->max_hash_displacement = 0;
-    weak_table->num_entries = 0;  // restored by weak_entry_insert below
-    
-    if (old_entries) {
-        weak_entry_t *entry;
-        weak_entry_t *end = old_entries + old_size;
-        for (entry = old_entries; entry < end; entry++) {
-            if (entry->referent) {
-                weak_entry_insert(weak_table, entry);
-            }
-        }
-        free(old_entries);
-    }
+    weak_table->num_entries = 0;  // restored by weak_migrate_some
 }
 
 // Grow the given zone's table of weak references if it is full.
@@ -262,8 +308,12 @@ static void weak_grow_maybe(weak_table_t *weak_table)
 {
     size_t old_size = TABLE_SIZE(weak_table);
 
-    // Grow if at least 3/4 full.
-    if (weak_table->num_entries >= old_size * 3 / 4) {
+    // Grow if at least 3/4 full, counting entries not yet migrated.
+    // The migration of a 3/4 full table finishes long before the 
+    // doubled table fills up again, so this rarely has to wait for it.
+    size_t num_entries = 
+        weak_table->num_entries + weak_table->old_num_entries;
+    if (num_entries >= old_size * 3 / 4) {
         weak_resize(weak_table, old_size ? old_size*2 : 64);
     }
 }
@@ -273,6 +323,9 @@ static void weak_compact_maybe(weak_table_t *weak_table)
 {
     size_t old_size = TABLE_SIZE(weak_table);
 
+    // Don't shrink in the middle of a resize.
+    if (weak_table->old_entries) return;
+
     // Shrink if larger than 1024 buckets and at most 1/16 full.
     if (old_size >= 1024  && old_size / 16 >= weak_table->num_entries) {
         weak_resize(weak_table, old_size / 8);
@@ -286,11 +339,16 @@ static void weak_compact_maybe(weak_table_t *weak_table)
  */
 static void weak_entry_remove(weak_table_t *weak_table, weak_entry_t *entry)
 {
+    bool isOld = weak_table->old_entries  &&  
+        entry >= weak_table->old_entries  &&  
+        entry < weak_table->old_entries + OLD_TABLE_SIZE(weak_table);
+
     // remove entry
     if (entry->out_of_line()) free(entry->referrers);
     bzero(entry, sizeof(*entry));
 
-    weak_table->num_entries--;
+    if (isOld) weak_table->old_num_entries--;
+    else weak_table->num_entries--;
 
     weak_compact_maybe(weak_table);
 }
@@ -319,16 +377,35 @@ weak_entry_for_referent(weak_table_t *weak_table, objc_object *referent)
     size_t begin = hash_pointer(referent) & weak_table->mask;
     size_t index = begin;
     size_t hash_displacement = 0;
-    while (weak_table->weak_entries[index].referent != referent) {
+    while (weak_entries[index].referent != referent) {
         index = (index+1) & weak_table->mask;
-        if (index == begin) bad_weak_table(weak_table->weak_entries);
+        if (index == begin) bad_weak_table(weak_entries);
         hash_displacement++;
         if (hash_displacement > weak_table->max_hash_displacement) {
-            return nil;
+            goto old;
         }
     }
     
-    return &weak_table->weak_entries[index];
+    return &weak_entries[index];
+
+ old:
+    // Not in the new array. Check the one being migrated, if any.
+    weak_entries = weak_table->old_entries;
+    if (!weak_entries) return nil;
+
+    begin = hash_pointer(referent) & weak_table->old_mask;
+    index = begin;
+    hash_displacement = 0;
+    while (weak_entries[index].referent != referent) {
+        index = (index+1) & weak_table->old_mask;
+        if (index == begin) bad_weak_table(weak_entries);
+        hash_displacement++;
+        if (hash_displacement > weak_table->old_max_hash_displacement) {
+            return nil;
+        }
+    }
+
+    return &weak_entries[index];
 }
 
 /** 
@@ -357,6 +434,8 @@ weak_unregister_no_lock(weak_table_t *weak_table, id referent_id,
 
     if (!referent) return;
 
+    weak_migrate_some(weak_table, WEAK_MIGRATE_BATCH);
+
     if ((entry = weak_entry_for_referent(weak_table, referent))) {
         remove_referrer(entry, referrer);
         bool empty = true;
@@ -427,6 +506,7 @@ weak_register_no_lock(weak_table_t *weak_table, id referent_id,
     }
 
     // now remember it and where it is being stored
+    weak_migrate_some(weak_table, WEAK_MIGRATE_BATCH);
     weak_entry_t *entry;
     if ((entry = weak_entry_for_referent(weak_table, referent))) {
         append_referrer(entry, referrer);
@@ -457,21 +537,38 @@ weak_is_registered_no_lock(weak_table_t *weak_table, id referent_id)
  * Called by dealloc; nils out all weak pointers that point to the 
  * provided object so that they can no longer be used.
  * 
+ * At most WEAK_CLEAR_BATCH referrers are cleared per call. If more 
+ * remain, the caller may release the lock so other threads can use the 
+ * weak table, then retake it and call again with the same cursor. 
+ * Referrers are removed from the entry as they are zeroed, and the 
+ * entry itself is removed with the last batch. Until then any weak load 
+ * of the referent fails because it is deallocating, and any weak store 
+ * of it is rejected.
+ * 
  * @param weak_table 
  * @param referent The object being deallocated. 
+ * @param cursor Zero-filled before the first call.
+ * 
+ * @return true if referrers remain to be cleared.
  */
 /// 清理 weak_table_t 核心方法
-void 
-weak_clear_no_lock(weak_table_t *weak_table, id referent_id) 
+bool 
+weak_clear_no_lock(weak_table_t *weak_table, id referent_id, 
+                   weak_clear_cursor_t *cursor) 
 {
     /// 取得对象
     objc_object *referent = (objc_object *)referent_id;
+
+    weak_migrate_some(weak_table, WEAK_MIGRATE_BATCH);
+
     /// 取得weak_entries数组中的weak_entry_t  Weak指针地址的数组
     weak_entry_t *entry = weak_entry_for_referent(weak_table, referent);
     if (entry == nil) {
         /// XXX shouldn't happen, but does with mismatched CF/objc
         //printf("XXX no entry for clear deallocating %p\n", referent);
-        return;
+        // Also reached if every remaining referrer was 
+        // unregistered while the lock was dropped.
+        return false;
     }
 
     // zero out references
@@ -487,8 +584,17 @@ weak_clear_no_lock(weak_table_t *weak_table, id referent_id)
         referrers = entry->inline_referrers;
         count = WEAK_INLINE_COUNT;
     }
+
+    // Inline entries move during migration and are always cleared 
+    // in one batch. An out-of-line array changes only if something 
+    // was appended to it while the lock was dropped. Start over then.
+    size_t begin = cursor->begin;
+    if (referrers != cursor->referrers) begin = 0;
+    size_t end = (count - begin > WEAK_CLEAR_BATCH) 
+        ? begin + WEAK_CLEAR_BATCH : count;
+
     /// 遍历这个数组把其中的数据设为nil
-    for (size_t i = 0; i < count; ++i) {
+    for (size_t i = begin; i < end; ++i) {
         objc_object **referrer = referrers[i];
         if (referrer) {
             /// 清空引用计数
@@ -503,9 +609,20 @@ weak_clear_no_lock(weak_table_t *weak_table, id referent_id)
                              referrer, (void*)*referrer, (void*)referent);
                 objc_weak_error();
             }
+            // Forget the referrer now so nothing touches it after 
+            // the lock is dropped and its storage may be freed.
+            referrers[i] = nil;
+            if (entry->out_of_line()) entry->num_refs--;
         }
     }
-    /// 从 weak_entries 表里面移除对应的记录
-    weak_entry_remove(weak_table, entry);
-}
 
+    if (end == count) {
+        /// 从 weak_entries 表里面移除对应的记录
+        weak_entry_remove(weak_table, entry);
+        return false;
+    }
+
+    cursor->referrers = referrers;
+    cursor->begin = end;
+    return true;
+}
@@ -0,0 +1,136 @@
+// TEST_CFLAGS -framework Foundation
+// TEST_CONFIG MEM=mrc
+
+// Atomic property and atomic struct throughput from 1 to 64 threads,
+// with getters racing setters on the same objects. Getters must never
+// see a deallocated value or a torn struct, and after each round every 
+// stored value must be retained exactly once, by its holder. Timings 
+// are printed with VERBOSE=2; build the runtime with 
+// SUPPORT_LOCKFREE_ACCESSORS=0 to compare with the locked getters.
+
+#include "test.h"
+#import <Foundation/Foundation.h>
+#include <objc/runtime.h>
+
+#define LOOPS 20000
+#define OBJECTS 16
+
+static int Deallocs;
+@interface Deallocator : NSObject {
+  @public
+    int alive;
+}
+@end
+@implementation Deallocator
+-(id)init {
+    if ((self = [super init])) alive = 1;
+    return self;
+}
+-(void)dealloc {
+    alive = 0;
+    OSAtomicIncrement32(&Deallocs);
+    [super dealloc];
+}
+@end
+
+typedef struct {
+    long a, b, c, d, e, f;
+} Sextet;
+
+@interface Holder : NSObject
+@property(atomic, retain) id value;
+@property(atomic) Sextet sextet;
+@end
+@implementation Holder
+@synthesize value, sextet;
+-(void)dealloc {
+    [value release];
+    [super dealloc];
+}
+@end
+
+static Holder *holders[OBJECTS];
+
+enum { Get, Set, GetSet, GetStruct, GetSetStruct };
+
+static void worker(size_t t, void *arg)
+{
+    int mode = (int)(uintptr_t)arg;
+    for (size_t i = 0; i < LOOPS; i++) {
+        Holder *h = holders[i % OBJECTS];
+        // In the mixed modes every fourth thread writes.
+        bool writer = (mode == Set)  ||
+            ((mode == GetSet  ||  mode == GetSetStruct)  &&  t % 4 == 3);
+        if (mode == Get  ||  mode == Set  ||  mode == GetSet) {
+            @autoreleasepool {
+                if (writer) {
+                    Deallocator *d = [Deallocator new];
+                    h.value = d;
+                    [d release];
+                } else {
+                    Deallocator *d = h.value;
+                    testassert(d->alive);
+                }
+            }
+        } else {
+            if (writer) {
+                long n = (long)(t * LOOPS + i);
+                h.sextet = (Sextet){ n, n, n, n, n, n };
+            } else {
+                Sextet s = h.sextet;
+                testassert(s.a == s.b  &&  s.a == s.c  &&  s.a == s.d  &&
+                           s.a == s.e  &&  s.a == s.f);
+            }
+        }
+    }
+}
+
+// Getters retain and autorelease, and every pool has been popped, 
+// so only the holder's own reference remains.
+static void checkValues(void)
+{
+    Ivar ivar = class_getInstanceVariable([Holder class], "value");
+    for (size_t i = 0; i < OBJECTS; i++) {
+        Deallocator *d = object_getIvar(holders[i], ivar);
+        testassert(d->alive);
+        testassert([d retainCount] == 1);
+    }
+}
+
+static double run(int mode, size_t threads)
+{
+    double ns = testonthreads(threads, worker, (void *)(uintptr_t)mode);
+    checkValues();
+    return ns / (threads * LOOPS);
+}
+
+int main()
+{
+    for (size_t i = 0; i < OBJECTS; i++) {
+        holders[i] = [Holder new];
+        Deallocator *d = [Deallocator new];
+        holders[i].value = d;
+        [d release];
+    }
+
+    for (size_t threads = 1; threads <= TEST_MAXTHREADS; threads *= 2) {
+        double get = run(Get, threads);
+        double set = run(Set, threads);
+        double getSet = run(GetSet, threads);
+        double getStruct = run(GetStruct, threads);
+        double getSetStruct = run(GetSetStruct, threads);
+        testprintf("%2zu threads: get %6.1f ns, set %6.1f ns, "
+                   "get+set %6.1f ns, struct get %6.1f ns, "
+                   "struct get+set %6.1f ns\n",
+                   threads, get, set, getSet, getStruct, getSetStruct);
+    }
+
+    // Each holder keeps only its last value.
+    int created = Deallocs + OBJECTS;
+    for (size_t i = 0; i < OBJECTS; i++) {
+        [holders[i] release];
+    }
+    testassert(Deallocs == created);
+
+    succeed(__FILE__);
+}
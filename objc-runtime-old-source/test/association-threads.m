@@ -0,0 +1,118 @@
+// TEST_CFLAGS -framework Foundation
+// TEST_CONFIG MEM=mrc
+
+// Associated object get/set/remove throughput from 1 to 64 threads.
+// Each thread works on its own objects, so the only contention is
+// inside the runtime's association store. After each round the shared 
+// value's retain count must be exactly one per live association. 
+// Timings are printed with VERBOSE=2.
+
+#include "test.h"
+#import <Foundation/Foundation.h>
+#include <objc/runtime.h>
+
+#define LOOPS 20000
+#define OBJECTS 16
+#define KEYS 4
+
+static int Deallocs;
+@interface Deallocator : NSObject @end
+@implementation Deallocator
+-(void)dealloc {
+    OSAtomicIncrement32(&Deallocs);
+    [super dealloc];
+}
+@end
+
+static char keys[KEYS];
+static id objects[TEST_MAXTHREADS][OBJECTS];
+static id value;
+
+enum { Get, GetAtomic, Set, Remove };
+
+static void worker(size_t t, void *arg)
+{
+    int mode = (int)(uintptr_t)arg;
+    for (size_t i = 0; i < LOOPS; i++) {
+        id obj = objects[t][i % OBJECTS];
+        // keys[0] holds the atomic association set up by main().
+        void *key = &keys[1 + i % (KEYS-1)];
+        switch (mode) {
+        case Get:
+            testassert(objc_getAssociatedObject(obj, key) == value);
+            break;
+        case GetAtomic:
+            @autoreleasepool {
+                testassert(objc_getAssociatedObject(obj, &keys[0]) == value);
+            }
+            break;
+        case Set:
+            objc_setAssociatedObject(obj, key, value,
+                                     OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+            break;
+        case Remove:
+            objc_setAssociatedObject(obj, key, nil,
+                                     OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+            objc_setAssociatedObject(obj, key, value,
+                                     OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+            break;
+        }
+    }
+}
+
+static double run(int mode, size_t threads)
+{
+    double ns = testonthreads(threads, worker, (void *)(uintptr_t)mode);
+    return ns / (threads * LOOPS);
+}
+
+// main's reference, the atomic association on every object, and 
+// the other KEYS-1 associations on the objects of threads that ran Set.
+// LOOPS covers every (object, key) pair because OBJECTS and KEYS-1 
+// are coprime.
+static void checkValueRetainCount(size_t threads)
+{
+    testassert([value retainCount] == 
+               1 + TEST_MAXTHREADS * OBJECTS + threads * OBJECTS * (KEYS-1));
+}
+
+int main()
+{
+    value = [Deallocator new];
+    for (size_t t = 0; t < TEST_MAXTHREADS; t++) {
+        for (size_t i = 0; i < OBJECTS; i++) {
+            objects[t][i] = [Deallocator new];
+            // One atomic association so GetAtomic takes the retain path.
+            objc_setAssociatedObject(objects[t][i], &keys[0], value,
+                                     OBJC_ASSOCIATION_RETAIN);
+        }
+    }
+
+    checkValueRetainCount(0);
+    for (size_t threads = 1; threads <= TEST_MAXTHREADS; threads *= 2) {
+        double set = run(Set, threads);
+        checkValueRetainCount(threads);
+        double get = run(Get, threads);
+        double getAtomic = run(GetAtomic, threads);
+        checkValueRetainCount(threads);
+        double remove = run(Remove, threads);
+        checkValueRetainCount(threads);
+        testprintf("%2zu threads: set %6.1f ns, get %6.1f ns, "
+                   "atomic get %6.1f ns, remove+set %6.1f ns\n",
+                   threads, set, get, getAtomic, remove);
+    }
+
+    // Deallocating the objects releases their associations.
+    testassert(Deallocs == 0);
+    for (size_t t = 0; t < TEST_MAXTHREADS; t++) {
+        for (size_t i = 0; i < OBJECTS; i++) {
+            [objects[t][i] release];
+        }
+    }
+    testassert(Deallocs == TEST_MAXTHREADS * OBJECTS);
+    testassert([value retainCount] == 1);
+    [value release];
+    testassert(Deallocs == TEST_MAXTHREADS * OBJECTS + 1);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,81 @@
+// TEST_CONFIG MEM=mrc
+
+// Deep autorelease pool push/pop cycles. Each cycle fills many pool
+// pages and pops them all; after the first cycle every page should
+// come from the thread's free list or the shared overflow list
+// instead of malloc. A thread that exits gives its free pages to
+// the shared list. Timings are printed with VERBOSE=2. Run with
+// OBJC_POOL_PAGE_ARENAS=YES to allocate pages from arenas.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/objc-internal.h>
+#include <mach/vm_param.h>
+
+#define PAGES 16
+#define OBJECTS (PAGES * PAGE_MAX_SIZE / sizeof(id))
+#define ROUNDS 1000
+
+static void cycle(id obj)
+{
+    void *pool = objc_autoreleasePoolPush();
+    for (size_t i = 0; i < OBJECTS; i++) {
+        [[obj retain] autorelease];
+    }
+    objc_autoreleasePoolPop(pool);
+}
+
+static void thread(size_t t __unused, void *arg)
+{
+    id obj = (id)arg;
+    cycle(obj);
+
+    struct objc_autorelease_pool_statistics stats;
+    _objc_autoreleasePoolGetStatistics(&stats);
+    testassert(stats.pagesAllocated + stats.pagesRecycled >= PAGES);
+    testassert(stats.pagesInUseHiwat >= PAGES);
+}
+
+int main()
+{
+    struct objc_autorelease_pool_statistics before, after;
+    id obj = [TestRoot new];
+
+    void *outer = objc_autoreleasePoolPush();
+    cycle(obj);
+    _objc_autoreleasePoolGetStatistics(&before);
+    testassert(before.pagesInUseHiwat >= PAGES);
+    testassert(before.pagesCached > 0);
+
+    uint64_t start = mach_absolute_time();
+    for (int round = 0; round < ROUNDS; round++) {
+        cycle(obj);
+    }
+    uint64_t elapsed = mach_absolute_time() - start;
+
+    _objc_autoreleasePoolGetStatistics(&after);
+    testassert(after.pagesAllocated == before.pagesAllocated);
+    testassert(after.pagesRecycled - before.pagesRecycled
+               >= (uint64_t)ROUNDS * (PAGES - 2));
+    testassert(after.pagesInUseHiwat == before.pagesInUseHiwat);
+    testassert(after.pagesInUse <= 2);
+    testprintf("%.1f ns per push/pop cycle of %d pages, "
+               "%llu pages allocated, %llu recycled\n",
+               testnanoseconds(elapsed) / ROUNDS, PAGES,
+               (unsigned long long)after.pagesAllocated,
+               (unsigned long long)after.pagesRecycled);
+
+    objc_autoreleasePoolPop(outer);
+
+    // An exiting thread's pages go to the shared list.
+    testonthreads(1, thread, obj);
+    _objc_autoreleasePoolGetStatistics(&after);
+    testassert(after.pagesShared > 0);
+
+    testassert(TestRootAutorelease == (int)(OBJECTS * (ROUNDS + 2)));
+    testassert(TestRootDealloc == 0);
+    [obj release];
+    testassert(TestRootDealloc == 1);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,93 @@
+// TEST_CONFIG MEM=mrc
+
+// imp_implementationWithBlock() and imp_removeBlock() churn from 1 to 64
+// threads. Each thread keeps a window of live trampolines, replacing the
+// oldest one on every iteration, and checks that every trampoline still
+// calls its own block. After each round the windows of all threads must 
+// hold distinct trampolines. Timings are printed with VERBOSE=2.
+
+#include "test.h"
+#include <objc/runtime.h>
+#include <Block.h>
+
+#define LOOPS 20000
+#define WINDOW 100
+
+// Each thread's trampolines that are still live at the end of a round.
+static IMP imps[TEST_MAXTHREADS][WINDOW];
+static uintptr_t values[TEST_MAXTHREADS][WINDOW];
+
+static void worker(size_t t, void *arg __unused)
+{
+    IMP *mine = imps[t];
+    uintptr_t *myValues = values[t];
+    bzero(mine, sizeof(imps[t]));
+
+    for (uintptr_t i = 0; i < LOOPS; i++) {
+        size_t slot = i % WINDOW;
+        if (mine[slot]) {
+            uintptr_t (*fn)(id, SEL) = (uintptr_t(*)(id, SEL))mine[slot];
+            testassert(fn(nil, @selector(churn)) == myValues[slot]);
+            testassert(imp_removeBlock(mine[slot]));
+        }
+        uintptr_t value = t * LOOPS + i;
+        mine[slot] = imp_implementationWithBlock(^(id self __unused) {
+            return value;
+        });
+        myValues[slot] = value;
+        testassert(mine[slot]);
+        testassert(imp_getBlock(mine[slot]));
+    }
+}
+
+static int compareIMPs(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(const IMP *)a;
+    uintptr_t y = (uintptr_t)*(const IMP *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// No trampoline may be handed to two threads at once. 
+// Then every one still calls its own block, and is removed.
+static void checkAndRemove(size_t threads)
+{
+    size_t count = threads * WINDOW;
+    IMP *sorted = (IMP *)malloc(count * sizeof(IMP));
+    memcpy(sorted, imps, count * sizeof(IMP));
+    qsort(sorted, count, sizeof(IMP), compareIMPs);
+    for (size_t i = 1; i < count; i++) {
+        testassert(sorted[i] != sorted[i-1]);
+    }
+    free(sorted);
+
+    for (size_t t = 0; t < threads; t++) {
+        for (size_t slot = 0; slot < WINDOW; slot++) {
+            uintptr_t (*fn)(id, SEL) = (uintptr_t(*)(id, SEL))imps[t][slot];
+            testassert(fn(nil, @selector(churn)) == values[t][slot]);
+            testassert(imp_removeBlock(imps[t][slot]));
+        }
+    }
+}
+
+static double run(size_t threads)
+{
+    double ns = testonthreads(threads, worker, NULL);
+    checkAndRemove(threads);
+    return ns / (threads * LOOPS);
+}
+
+int main()
+{
+    for (size_t threads = 1; threads <= TEST_MAXTHREADS; threads *= 2) {
+        double churn = run(threads);
+        testprintf("%2zu threads: create+remove %6.1f ns\n", threads, churn);
+    }
+
+    // A trampoline that was already removed is not removed again.
+    IMP imp = imp_implementationWithBlock(^(id self __unused) { return 1; });
+    testassert(imp_removeBlock(imp));
+    testassert(!imp_getBlock(imp));
+    testassert(!imp_removeBlock(imp));
+
+    succeed(__FILE__);
+}
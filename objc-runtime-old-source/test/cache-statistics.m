@@ -0,0 +1,145 @@
+/*
+TEST_ENV OBJC_PRINT_CACHE_STATISTICS=YES
+
+TEST_RUN_OUTPUT
+OK: cache-statistics.m
+(objc\[\d+\]: CACHES: .*\n)+
+END
+*/
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/objc-internal.h>
+#include <pthread.h>
+
+// Method cache statistics for one class with many methods.
+// The SIMD and scalar cache probes must find the same buckets,
+// so this is also worth running with SUPPORT_SIMD_CACHE_FILL_PROBE=0.
+
+#define M(n) -(int)m##n { return n; }
+#define M8(n) M(n##0) M(n##1) M(n##2) M(n##3) M(n##4) M(n##5) M(n##6) M(n##7)
+#define C(n) sum += [obj m##n];
+#define C8(n) C(n##0) C(n##1) C(n##2) C(n##3) C(n##4) C(n##5) C(n##6) C(n##7)
+
+@interface CacheStats : TestRoot @end
+@implementation CacheStats
+M8(1) M8(2) M8(3) M8(4) M8(5) M8(6) M8(7) M8(8)
+@end
+
+// Each call of C8(n) adds the sum of n0..n7, which is 80n+28.
+static int callAll(CacheStats *obj)
+{
+    int sum = 0;
+    C8(1) C8(2) C8(3) C8(4) C8(5) C8(6) C8(7) C8(8)
+    return sum;
+}
+#define EXPECTED_SUM (80*36 + 28*8)
+
+// Sends messages, then sleeps without entering the runtime again.
+// The collector must see it blocked and not wait for it.
+static pthread_mutex_t sleeperLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleeperCond = PTHREAD_COND_INITIALIZER;
+static int sleeperState;
+
+static void *sleeper(void *arg)
+{
+    testassert(callAll((CacheStats *)arg) == EXPECTED_SUM);
+    pthread_mutex_lock(&sleeperLock);
+    sleeperState = 1;
+    pthread_cond_broadcast(&sleeperCond);
+    while (sleeperState == 1) pthread_cond_wait(&sleeperCond, &sleeperLock);
+    pthread_mutex_unlock(&sleeperLock);
+    testassert(callAll((CacheStats *)arg) == EXPECTED_SUM);
+    return NULL;
+}
+
+int main()
+{
+    CacheStats *obj = [CacheStats new];
+    Class cls = [CacheStats class];
+    struct objc_cache_statistics stats;
+
+    // Cold calls fill the cache. Warm calls hit it.
+    testassert(callAll(obj) == EXPECTED_SUM);
+    testassert(callAll(obj) == EXPECTED_SUM);
+
+    testassert(_class_getCacheStatistics(cls, &stats));
+    testprintf("fills %zu probes %zu expansions %zu garbage %zu "
+               "occupied %u/%u hit probes %zu\n", 
+               stats.fills, stats.fillProbes, stats.expansions, 
+               stats.garbageBytes, stats.occupied, stats.capacity, 
+               stats.hitProbes);
+    // 64 methods do not fit in the initial cache. Each expansion 
+    // discards the old contents, so some methods are filled again.
+    testassert(stats.fills >= 64);
+    testassert(stats.fillProbes >= stats.fills);
+    testassert(stats.expansions >= 4);
+    testassert(stats.garbageBytes > 0);
+    testassert(stats.occupied > 0);
+    testassert(stats.occupied <= stats.capacity * 3 / 4);
+    testassert(stats.hitProbes >= stats.occupied);
+    testassert(stats.flushes == 0);
+
+    // Everything is cached now. More calls add no fills.
+    size_t fills = stats.fills;
+    uint32_t occupied = stats.occupied;
+    testassert(callAll(obj) == EXPECTED_SUM);
+    testassert(_class_getCacheStatistics(cls, &stats));
+    testassert(stats.fills == fills);
+    testassert(stats.occupied == occupied);
+
+    // Flushing empties the cache and counts its buckets as garbage.
+    size_t garbage = stats.garbageBytes;
+    _objc_flush_caches(cls);
+    testassert(_class_getCacheStatistics(cls, &stats));
+    testassert(stats.flushes == 1);
+    testassert(stats.occupied == 0);
+    testassert(stats.garbageBytes > garbage);
+    testassert(callAll(obj) == EXPECTED_SUM);
+    testassert(_class_getCacheStatistics(cls, &stats));
+    testassert(stats.fills > fills);
+
+    // Totals cover at least this class.
+    struct objc_cache_statistics total;
+    testassert(_class_getCacheStatistics(Nil, &total));
+    testassert(total.fills >= stats.fills);
+    testassert(total.capacity >= stats.capacity);
+    testassert(total.maxRetainedGarbageBytes >= total.retainedGarbageBytes);
+
+    // Flushing every cache collects all garbage once each thread 
+    // has passed a quiescent state, including a thread that is asleep.
+    pthread_t thread;
+    pthread_create(&thread, NULL, &sleeper, obj);
+    pthread_mutex_lock(&sleeperLock);
+    while (sleeperState == 0) pthread_cond_wait(&sleeperCond, &sleeperLock);
+    pthread_mutex_unlock(&sleeperLock);
+    _objc_flush_caches(cls);
+    _objc_flush_caches(Nil);
+    testassert(_class_getCacheStatistics(Nil, &total));
+    testprintf("garbage retained %zu (max %zu) reclaimed %zu in %zu blocks "
+               "after %llu scans\n", 
+               total.retainedGarbageBytes, total.maxRetainedGarbageBytes, 
+               total.reclaimedGarbageBytes, total.reclaimedGarbageCount, 
+               (unsigned long long)total.garbageScans);
+    testassert(total.retainedGarbageBytes == 0);
+    testassert(total.reclaimedGarbageBytes >= stats.garbageBytes);
+    testassert(total.reclaimedGarbageCount > 0);
+    testassert(total.garbageScans > 0);
+    testassert(total.maxReclaimLatency <= total.reclaimLatency);
+
+    // The sleeper's next calls refill the flushed cache.
+    pthread_mutex_lock(&sleeperLock);
+    sleeperState = 2;
+    pthread_cond_broadcast(&sleeperCond);
+    pthread_mutex_unlock(&sleeperLock);
+    pthread_join(thread, NULL);
+
+    // A class that was never messaged has no statistics.
+    Class unused = objc_allocateClassPair([TestRoot class], "Unused", 0);
+    objc_registerClassPair(unused);
+    testassert(!_class_getCacheStatistics(unused, &stats));
+    testassert(stats.fills == 0);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,175 @@
+/*
+TEST_CFLAGS -Wl,-no_objc_category_merging
+TEST_ENV OBJC_DEFER_CATEGORY_METHODS=YES OBJC_PRINT_CATEGORY_STATISTICS=YES
+
+TEST_RUN_OUTPUT
+OK: category-defer.m
+objc\[\d+\]: CATEGORIES: \d+ classes methodized in .*
+(objc\[\d+\]: CATEGORIES: slowest class .*\n)?objc\[\d+\]: CATEGORIES: \d+ method lists \(\d+ bytes\) attached right away
+objc\[\d+\]: CATEGORIES: [1-9]\d* method lists \(\d+ bytes\) deferred, [1-9]\d* \(\d+ bytes\) attached later, .*
+END
+*/
+
+// Category methods set aside by OBJC_DEFER_CATEGORY_METHODS must be
+// attached, in category order, before any lookup or introspection can
+// see the class's methods: message sends to the class and subclasses,
+// class_getInstanceMethod(), class_copyMethodList(), class_addMethod(),
+// and the custom retain/release scan when the class is initialized.
+// Each of the first three is checked on a class that nothing else has 
+// touched, so it is the one that finds the categories still pending.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+
+@interface Deferred : TestRoot @end
+@implementation Deferred
+-(int)overridden { return 0; }
++(int)classOverridden { return 0; }
+@end
+
+@interface Deferred (First) @end
+@implementation Deferred (First)
+-(int)overridden { return 1; }
+-(int)added { return 1; }
++(int)classOverridden { return 1; }
+@end
+
+@interface Deferred (Second) @end
+@implementation Deferred (Second)
+-(int)overridden { return 2; }
+@end
+
+@interface DeferredSub : Deferred @end
+@implementation DeferredSub @end
+
+// Never messaged before its subclass is introspected.
+@interface DeferredIntrospected : TestRoot @end
+@implementation DeferredIntrospected
+-(int)base { return 0; }
+@end
+
+@interface DeferredIntrospected (Category) @end
+@implementation DeferredIntrospected (Category)
+-(int)categoryMethod { return 1; }
+@end
+
+// One class per first search, each overriding and adding in a category.
+@interface DeferredLookup : TestRoot @end
+@implementation DeferredLookup
+-(int)overridden { return 0; }
+@end
+
+@interface DeferredLookup (Category) @end
+@implementation DeferredLookup (Category)
+-(int)overridden { return 1; }
+-(int)added { return 1; }
+@end
+
+@interface DeferredResponds : TestRoot @end
+@implementation DeferredResponds
+-(BOOL)respondsToSelector:(SEL)sel {
+    return class_respondsToSelector(object_getClass(self), sel);
+}
+@end
+
+@interface DeferredResponds (Category) @end
+@implementation DeferredResponds (Category)
+-(int)added { return 1; }
+@end
+
+@interface DeferredSend : TestRoot @end
+@implementation DeferredSend
+-(int)overridden { return 0; }
+@end
+
+@interface DeferredSend (Category) @end
+@implementation DeferredSend (Category)
+-(int)overridden { return 1; }
+@end
+
+@interface DeferredAdded : TestRoot @end
+@implementation DeferredAdded @end
+
+@interface DeferredAdded (Category) @end
+@implementation DeferredAdded (Category)
+-(int)added { return 1; }
+@end
+
+@interface DeferredAdded (Other)
+-(int)other;
+@end
+
+// A category that overrides -retain must still turn off
+// the fast retain path when the class is initialized.
+static int CustomRetains;
+
+@interface DeferredRR : TestRoot @end
+@implementation DeferredRR @end
+
+@interface DeferredRR (Retain) @end
+@implementation DeferredRR (Retain)
+-(id)retain { CustomRetains++; return self; }
+@end
+
+static int addedImp(id self __unused, SEL _cmd __unused) { return 3; }
+
+int main()
+{
+    // class_getInstanceMethod() before any message.
+    Class cls = objc_getClass("DeferredLookup");
+    Method m = class_getInstanceMethod(cls, @selector(overridden));
+    testassert(m);
+    testassert(((int(*)(id, SEL))method_getImplementation(m))
+               (nil, @selector(overridden)) == 1);
+    testassert(class_getInstanceMethod(cls, @selector(added)));
+
+    // class_respondsToSelector() before any message, 
+    // then -respondsToSelector:.
+    cls = objc_getClass("DeferredResponds");
+    testassert(class_respondsToSelector(cls, @selector(added)));
+    DeferredResponds *responds = [cls new];
+    testassert([responds respondsToSelector:@selector(added)]);
+    testassert(![responds respondsToSelector:@selector(overridden)]);
+    [responds release];
+
+    // A message send is the first search of the instance methods.
+    DeferredSend *send = [DeferredSend new];
+    testassert([send overridden] == 1);
+    [send release];
+
+    // Subclass lookups attach the superclass's categories.
+    DeferredSub *sub = [DeferredSub new];
+    testassert([sub overridden] == 2);
+    testassert([sub added] == 1);
+    testassert([DeferredSub classOverridden] == 1);
+    [sub release];
+
+    // Introspection before any message.
+    cls = objc_getClass("DeferredIntrospected");
+    unsigned int count;
+    Method *methods = class_copyMethodList(cls, &count);
+    testassert(count == 2);
+    free(methods);
+    testassert(class_getInstanceMethod(cls, @selector(categoryMethod)));
+
+    // Added methods don't replace category methods.
+    cls = objc_getClass("DeferredAdded");
+    testassert(!class_addMethod(cls, @selector(added), 
+                                (IMP)addedImp, "i@:"));
+    testassert(class_addMethod(cls, @selector(other), 
+                               (IMP)addedImp, "i@:"));
+    DeferredAdded *obj = [cls new];
+    testassert([obj added] == 1);
+    testassert([obj other] == 3);
+    [obj release];
+
+    DeferredRR *rr = [DeferredRR new];
+    objc_retain(rr);
+    testassert(CustomRetains == 1);
+    [rr retain];
+    testassert(CustomRetains == 2);
+    [rr release];
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,124 @@
+// TEST_CONFIG MEM=mrc
+
+// Slab allocation of instances with _class_setUsesInstanceSlabs().
+// Instances must come back zeroed after their blocks are reused,
+// weak references and associated objects must still be cleaned up,
+// and instances too big for the slabs must still work. Then a churn
+// of short-lived objects from 1 to 16 threads compares the slab
+// path with calloc; every slab object must be counted by the slab 
+// statistics and no calloc object may be. Timings are printed with 
+// VERBOSE=2.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/objc-internal.h>
+
+#define MAXTHREADS 16
+#define BATCH 256
+#define LOOPS 2000
+
+@interface SlabObject : TestRoot {
+  @public
+    uintptr_t ivars[10];
+}
+@end
+@implementation SlabObject @end
+
+@interface MallocObject : TestRoot {
+  @public
+    uintptr_t ivars[10];
+}
+@end
+@implementation MallocObject @end
+
+@interface BigSlabObject : TestRoot {
+  @public
+    uintptr_t ivars[64];
+}
+@end
+@implementation BigSlabObject @end
+
+static uint64_t totalAllocations(void)
+{
+    uint64_t total = 0;
+    struct objc_instance_slab_statistics stats;
+    for (unsigned sc = 0; _objc_getInstanceSlabStatistics(sc, &stats); sc++) {
+        total += stats.allocations;
+    }
+    return total;
+}
+
+static void worker(size_t t __unused, void *arg)
+{
+    Class cls = (Class)arg;
+    id objs[BATCH];
+    for (int loop = 0; loop < LOOPS; loop++) {
+        for (int i = 0; i < BATCH; i++) objs[i] = [cls new];
+        for (int i = 0; i < BATCH; i++) [objs[i] release];
+    }
+}
+
+static double churn(Class cls, bool slab, size_t threads)
+{
+    uint64_t objects = (uint64_t)threads * LOOPS * BATCH;
+    uint64_t allocations = totalAllocations();
+    int deallocs = TestRootDealloc;
+    double ns = testonthreads(threads, worker, (void *)cls);
+    testassert(totalAllocations() - allocations == (slab ? objects : 0));
+    testassert(TestRootDealloc - deallocs == (int)objects);
+    return ns / objects;
+}
+
+int main()
+{
+    _class_setUsesInstanceSlabs([SlabObject class]);
+    _class_setUsesInstanceSlabs([BigSlabObject class]);
+
+    // Reused blocks are zeroed.
+    uint64_t before = totalAllocations();
+    for (int round = 0; round < 3; round++) {
+        SlabObject *objs[BATCH];
+        for (int i = 0; i < BATCH; i++) {
+            objs[i] = [SlabObject new];
+            for (int j = 0; j < 10; j++) {
+                testassert(objs[i]->ivars[j] == 0);
+                objs[i]->ivars[j] = ~(uintptr_t)0;
+            }
+        }
+        for (int i = 0; i < BATCH; i++) [objs[i] release];
+    }
+    testassert(totalAllocations() - before == 3 * BATCH);
+
+    // Weak references and associated objects are cleared.
+    id weak = nil;
+    SlabObject *obj = [SlabObject new];
+    objc_storeWeak(&weak, obj);
+    objc_setAssociatedObject(obj, &weak, [TestRoot new],
+                             OBJC_ASSOCIATION_ASSIGN);
+    int deallocs = TestRootDealloc;
+    [obj release];
+    testassert(TestRootDealloc == deallocs + 1);
+    testassert(objc_loadWeak(&weak) == nil);
+    objc_destroyWeak(&weak);
+
+    // Too big for the slabs: still allocated, zeroed, and freed.
+    before = totalAllocations();
+    BigSlabObject *big = [BigSlabObject new];
+    for (int j = 0; j < 64; j++) testassert(big->ivars[j] == 0);
+    [big release];
+    testassert(totalAllocations() == before);
+
+    // object_dispose() frees slab instances too.
+    obj = [SlabObject new];
+    object_dispose(obj);
+
+    for (size_t threads = 1; threads <= MAXTHREADS; threads *= 2) {
+        double slab = churn([SlabObject class], true, threads);
+        double heap = churn([MallocObject class], false, threads);
+        testprintf("%2zu threads: %6.1f ns per slab object, "
+                   "%6.1f ns per calloc object\n", threads, slab, heap);
+    }
+
+    succeed(__FILE__);
+}
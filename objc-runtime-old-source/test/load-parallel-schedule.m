@@ -0,0 +1,135 @@
+/*
+TEST_BUILD
+    $C{COMPILE} $DIR/load-parallel00.m -o load-parallel-schedule00.dylib -dynamiclib
+    $C{COMPILE} $DIR/load-parallel-schedule.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule.out -DCOUNT=10
+
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule0.dylib -dynamiclib -DN=0
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule1.dylib -dynamiclib -DN=1
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule2.dylib -dynamiclib -DN=2
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule3.dylib -dynamiclib -DN=3
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule4.dylib -dynamiclib -DN=4
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule5.dylib -dynamiclib -DN=5
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule6.dylib -dynamiclib -DN=6
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule7.dylib -dynamiclib -DN=7
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule8.dylib -dynamiclib -DN=8
+    $C{COMPILE} $DIR/load-parallel0.m -x none load-parallel-schedule00.dylib -o load-parallel-schedule9.dylib -dynamiclib -DN=9
+END
+TEST_ENV OBJC_PARALLEL_LOAD=YES
+*/
+
+// With OBJC_PARALLEL_LOAD, +load is still called superclass-first,
+// category +load still waits for its class's +load, and every +load
+// is called once. The load-parallel images of 26 root classes are
+// loaded one at a time; their times are printed with VERBOSE=2 and
+// can be compared with a run without OBJC_PARALLEL_LOAD.
+
+#include "test.h"
+#include "testroot.i"
+#include <dlfcn.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+#include <libkern/OSAtomic.h>
+
+#ifndef COUNT
+#error -DCOUNT=c missing
+#endif
+
+extern int state;
+
+static volatile int32_t Loads;
+
+#define LOADED(cls) Loaded_##cls
+#define BASE(cls, sup)                                                  \
+    static volatile int LOADED(cls);                                    \
+    @interface cls : sup @end                                           \
+    @implementation cls                                                 \
+    +(void)load {                                                       \
+        testassert(!LOADED(cls));                                       \
+        usleep(10);                                                     \
+        LOADED(cls) = 1;                                                \
+        OSAtomicIncrement32Barrier(&Loads);                             \
+    }                                                                   \
+    @end
+// cls's nearest superclass with +load is anc.
+#define SUB_OF(cls, sup, anc)                                           \
+    static volatile int LOADED(cls);                                    \
+    @interface cls : sup @end                                           \
+    @implementation cls                                                 \
+    +(void)load {                                                       \
+        OSMemoryBarrier();                                              \
+        testassert(LOADED(anc));                                        \
+        testassert(!LOADED(cls));                                       \
+        usleep(10);                                                     \
+        LOADED(cls) = 1;                                                \
+        OSAtomicIncrement32Barrier(&Loads);                             \
+    }                                                                   \
+    @end
+#define SUB(cls, sup) SUB_OF(cls, sup, sup)
+
+BASE(A, TestRoot)
+SUB(AA, A)
+SUB(AB, A)
+SUB(AAA, AA)
+SUB(AAB, AA)
+SUB(ABA, AB)
+SUB(AAAA, AAA)
+BASE(B, TestRoot)
+SUB(BA, B)
+SUB(BB, B)
+SUB(BC, B)
+SUB(BAA, BA)
+BASE(C, TestRoot)
+SUB(CA, C)
+SUB(CAA, CA)
+SUB(CAAA, CAA)
+
+// Subclass without +load between two classes with +load.
+@interface DNoLoad : A @end
+@implementation DNoLoad @end
+SUB_OF(DA, DNoLoad, A)
+
+@implementation AAAA (Category)
++(void)load {
+    OSMemoryBarrier();
+    testassert(LOADED(AAAA));
+    OSAtomicIncrement32Barrier(&Loads);
+}
+@end
+
+@implementation BC (Category)
++(void)load {
+    OSMemoryBarrier();
+    testassert(LOADED(BC));
+    OSAtomicIncrement32Barrier(&Loads);
+}
+@end
+
+int main()
+{
+    // A's +load ran before DA's, through DNoLoad.
+    testassert(LOADED(DA));
+    testassert(Loads == 19);
+
+    uint64_t total = 0;
+    for (int i = 0; i < COUNT; i++) {
+        char *buf;
+        asprintf(&buf, "load-parallel-schedule%d.dylib", i);
+        uint64_t start = mach_absolute_time();
+        void *dlh = dlopen(buf, RTLD_LAZY);
+        uint64_t end = mach_absolute_time();
+        if (!dlh) {
+            fail("dlopen failed: %s", dlerror());
+        }
+        uint64_t us = (uint64_t)testnanoseconds(end - start) / 1000;
+        testprintf("%s: %llu us\n", buf, (unsigned long long)us);
+        total += us;
+        free(buf);
+    }
+    testprintf("%d images of 26 +loads: %llu us\n",
+               COUNT, (unsigned long long)total);
+
+    testprintf("loaded %d/%d\n", state, COUNT*26);
+    testassert(state == COUNT*26);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,81 @@
+/*
+TEST_CONFIG MEM=mrc
+TEST_ENV OBJC_PROFILE_LOCKS=YES
+
+TEST_RUN_OUTPUT
+OK: lock-profile.m
+(objc\[\d+\]: LOCKS: .*\n)+END
+*/
+
+// With OBJC_PROFILE_LOCKS the runtime's mutexes and rwlocks sample their
+// wait and hold times and print a histogram for each lock at exit.
+// Threads add methods, set associated objects, retain and release,
+// and @synchronize on shared objects so that the runtime lock, the
+// striped tables, and the sync lists are all contended. Profiling must
+// not change what any of these do.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <pthread.h>
+
+#define THREADS 16
+#define LOOPS 2000
+
+@interface Profiled : TestRoot @end
+@implementation Profiled @end
+
+static id shared[4];
+static int counter;
+
+static int addedImp(id self __unused, SEL _cmd __unused) { return 1; }
+
+static void *worker(void *arg)
+{
+    size_t t = (size_t)arg;
+    Class cls = objc_getClass("Profiled");
+    char name[64];
+    for (int i = 0; i < LOOPS; i++) {
+        id obj = shared[i % 4];
+
+        if (i % 64 == 0) {
+            snprintf(name, sizeof(name), "profiled%zu_%d", t, i);
+            testassert(class_addMethod(cls, sel_registerName(name),
+                                       (IMP)addedImp, "i@:"));
+        }
+
+        objc_setAssociatedObject(obj, (void *)t, obj,
+                                 OBJC_ASSOCIATION_ASSIGN);
+        testassert(objc_getAssociatedObject(obj, (void *)t) == obj);
+
+        [obj retain];
+        @synchronized(obj) {
+            counter++;
+        }
+        [obj release];
+    }
+    return NULL;
+}
+
+int main()
+{
+    for (int i = 0; i < 4; i++) shared[i] = [Profiled new];
+
+    pthread_t th[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        pthread_create(&th[t], NULL, &worker, (void *)t);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        pthread_join(th[t], NULL);
+    }
+
+    testassert(counter == THREADS * LOOPS);
+    testassert(class_respondsToSelector(objc_getClass("Profiled"),
+                                        sel_registerName("profiled0_64")));
+
+    int deallocs = TestRootDealloc;
+    for (int i = 0; i < 4; i++) [shared[i] release];
+    testassert(TestRootDealloc == deallocs + 4);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,135 @@
+// TEST_CONFIG MEM=mrc
+
+// Cold method cache lookups from 1 to 64 threads. Each round flushes
+// the caches of a family of classes, then every thread messages every
+// selector of every class, so each thread takes cache misses into
+// lookUpImpOrForward(). Meanwhile one more thread adds methods, and
+// after each round every class must see them with no stale cache
+// entries left behind. A thread that has seen an override must never 
+// see the overridden method again. Timings are printed with VERBOSE=2. 
+// Run with OBJC_DISABLE_LOCK_FREE_LOOKUP=YES to compare with the 
+// locked search.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/message.h>
+#include <objc/objc-internal.h>
+
+#define CLASSES 64
+#define METHODS 32
+#define ROUNDS 20
+
+static uintptr_t impBase(id self __unused, SEL _cmd)
+{
+    return (uintptr_t)_cmd;
+}
+static uintptr_t impOverride(id self __unused, SEL _cmd)
+{
+    return ~(uintptr_t)_cmd;
+}
+
+typedef uintptr_t (*Send)(id, SEL);
+#define SEND(obj, sel) (((Send)objc_msgSend)(obj, sel))
+
+static Class base;
+static Class classes[CLASSES];
+static id objects[CLASSES];
+static SEL sels[METHODS];
+static bool overridden[CLASSES][METHODS];
+// Overrides each lookup thread has seen. Overrides are never removed.
+static bool seen[TEST_MAXTHREADS][CLASSES][METHODS];
+
+static size_t changes;
+
+static void lookup(size_t t)
+{
+    for (size_t i = 0; i < CLASSES; i++) {
+        // Start at different classes so threads miss at once
+        // on different classes as well as the same ones.
+        size_t c = (i + t) % CLASSES;
+        for (size_t m = 0; m < METHODS; m++) {
+            // Thread 0 may be overriding this method.
+            uintptr_t v = SEND(objects[c], sels[m]);
+            if (v == ~(uintptr_t)sels[m]) {
+                seen[t][c][m] = true;
+            } else {
+                testassert(v == (uintptr_t)sels[m]);
+                testassert(!seen[t][c][m]);
+            }
+        }
+    }
+}
+
+// Override one more method while the lookup threads run.
+static void override(void)
+{
+    size_t c = changes % CLASSES;
+    size_t m = (changes / CLASSES) % METHODS;
+    changes++;
+    if (!overridden[c][m]) {
+        testassert(class_addMethod(classes[c], sels[m],
+                                   (IMP)impOverride, "L@:"));
+        overridden[c][m] = true;
+    }
+}
+
+// Thread 0 overrides. The others look up.
+static void worker(size_t t, void *arg __unused)
+{
+    if (t == 0) override();
+    else lookup(t - 1);
+}
+
+static void check()
+{
+    for (size_t c = 0; c < CLASSES; c++) {
+        for (size_t m = 0; m < METHODS; m++) {
+            uintptr_t expected = overridden[c][m]
+                ? ~(uintptr_t)sels[m] : (uintptr_t)sels[m];
+            testassert(SEND(objects[c], sels[m]) == expected);
+        }
+    }
+}
+
+static void run(size_t threads)
+{
+    double total = 0;
+    for (size_t round = 0; round < ROUNDS; round++) {
+        _objc_flush_caches(base);
+        total += testonthreads(threads + 1, worker, NULL);
+        check();
+    }
+
+    testprintf("%2zu threads: %6.2f ms per cold round\n",
+               threads, total / 1000000.0 / ROUNDS);
+}
+
+int main()
+{
+    base = objc_allocateClassPair([TestRoot class], "LookupBase", 0);
+    for (size_t m = 0; m < METHODS; m++) {
+        char name[32];
+        snprintf(name, sizeof(name), "method%zu", m);
+        sels[m] = sel_registerName(name);
+        testassert(class_addMethod(base, sels[m], (IMP)impBase, "L@:"));
+    }
+    objc_registerClassPair(base);
+
+    for (size_t c = 0; c < CLASSES; c++) {
+        char name[32];
+        snprintf(name, sizeof(name), "LookupSub%zu", c);
+        classes[c] = objc_allocateClassPair(base, name, 0);
+        objc_registerClassPair(classes[c]);
+        objects[c] = [classes[c] new];
+    }
+
+    // Initialize every class.
+    check();
+
+    for (size_t threads = 1; threads <= TEST_MAXTHREADS; threads *= 2) {
+        run(threads);
+    }
+
+    succeed(__FILE__);
+}
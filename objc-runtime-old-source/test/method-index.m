@@ -0,0 +1,133 @@
+// TEST_CONFIG MEM=mrc
+
+// Method lookup in classes with many method lists, and in hierarchies
+// of depth 1 to 32, with the method cache flushed before each round
+// so every lookup searches the method lists. Checks that the hashed
+// method index and the remembered failed lookups see methods added
+// later. Timings are printed with VERBOSE=2. Run with
+// OBJC_DISABLE_METHOD_INDEX=YES to compare with the list search.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/objc-internal.h>
+
+#define MAXDEPTH 32
+#define METHODS 64
+#define ROUNDS 200
+
+static id impA(id self, SEL _cmd __unused) { return self; }
+static id impB(id self, SEL _cmd __unused) { return self; }
+
+static SEL sels[MAXDEPTH][METHODS];
+static SEL missing[METHODS];
+static SEL shared;
+
+static SEL makeSel(const char *prefix, int a, int b)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s%d_%d", prefix, a, b);
+    return sel_registerName(name);
+}
+
+// Each class_addMethod() call attaches a new method list,
+// like a class with one method per category.
+static Class makeHierarchy(int depth)
+{
+    Class cls = [TestRoot class];
+    for (int level = 0; level < depth; level++) {
+        char name[64];
+        snprintf(name, sizeof(name), "Depth%d_Level%d", depth, level);
+        cls = objc_allocateClassPair(cls, name, 0);
+        for (int i = 0; i < METHODS; i++) {
+            testassert(class_addMethod(cls, sels[level][i], (IMP)impA, "@@:"));
+        }
+        testassert(class_addMethod(cls, shared,
+                                   level == depth-1 ? (IMP)impB : (IMP)impA,
+                                   "@@:"));
+        objc_registerClassPair(cls);
+    }
+    return cls;
+}
+
+static void run(int depth)
+{
+    Class leaf = makeHierarchy(depth);
+    Class root = leaf;
+    for (int level = 1; level < depth; level++) {
+        root = class_getSuperclass(root);
+    }
+
+    // The leaf's own method wins over the superclasses'.
+    testassert(class_getMethodImplementation(leaf, shared)
+               == (IMP)impB);
+    if (depth > 1) {
+        testassert(class_getMethodImplementation(root, shared)
+                   == (IMP)impA);
+    }
+
+    uint64_t hitTime = 0;
+    uint64_t missTime = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        _objc_flush_caches(leaf);
+        uint64_t start = mach_absolute_time();
+        for (int i = 0; i < METHODS; i++) {
+            // Defined by the root of the hierarchy, the slowest hit.
+            testassert(class_respondsToSelector(leaf, sels[0][i]));
+        }
+        uint64_t middle = mach_absolute_time();
+        for (int i = 0; i < METHODS; i++) {
+            testassert(!class_respondsToSelector(leaf, missing[i]));
+        }
+        uint64_t end = mach_absolute_time();
+        hitTime += middle - start;
+        missTime += end - middle;
+    }
+
+    testprintf("depth %2d: %7.1f ns per hit, %7.1f ns per miss\n", depth,
+               testnanoseconds(hitTime) / (ROUNDS * METHODS),
+               testnanoseconds(missTime) / (ROUNDS * METHODS));
+
+    // A method added to the root after failed lookups is found.
+    SEL late = makeSel("late", depth, 0);
+    testassert(!class_respondsToSelector(leaf, late));
+    testassert(!class_respondsToSelector(leaf, late));
+    testassert(class_addMethod(root, late, (IMP)impA, "@@:"));
+    testassert(class_respondsToSelector(leaf, late));
+    testassert(class_getMethodImplementation(leaf, late) == (IMP)impA);
+
+    // A method added to the leaf after its index was built is found.
+    SEL later = makeSel("later", depth, 0);
+    testassert(!class_respondsToSelector(leaf, later));
+    testassert(class_addMethod(leaf, later, (IMP)impB, "@@:"));
+    testassert(class_respondsToSelector(leaf, later));
+    testassert(class_getMethodImplementation(leaf, later) == (IMP)impB);
+
+    // An existing method is not added again.
+    testassert(!class_addMethod(leaf, sels[depth-1][0], (IMP)impB, "@@:"));
+    testassert(class_getMethodImplementation(leaf, sels[depth-1][0])
+               == (IMP)impA);
+    testassert(class_replaceMethod(leaf, sels[depth-1][0], (IMP)impB, "@@:")
+               == (IMP)impA);
+    testassert(class_getMethodImplementation(leaf, sels[depth-1][0])
+               == (IMP)impB);
+}
+
+int main()
+{
+    shared = sel_registerName("shared");
+    for (int level = 0; level < MAXDEPTH; level++) {
+        for (int i = 0; i < METHODS; i++) {
+            sels[level][i] = makeSel("method", level, i);
+        }
+    }
+    for (int i = 0; i < METHODS; i++) {
+        missing[i] = makeSel("missing", 0, i);
+    }
+
+    for (int depth = 1; depth <= MAXDEPTH; depth *= 2) {
+        run(depth);
+    }
+
+    succeed(__FILE__);
+}
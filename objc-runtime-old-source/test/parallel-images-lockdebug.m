@@ -0,0 +1,70 @@
+/*
+TEST_ENV OBJC_PARALLEL_IMAGE_READING=YES
+
+TEST_BUILD
+    $C{COMPILE} $DIR/parallel-images-lockdebug0.m -o parallel-images-lockdebug0.dylib -dynamiclib -DN=0
+    $C{COMPILE} $DIR/parallel-images-lockdebug0.m -o parallel-images-lockdebug1.dylib -dynamiclib -DN=1
+    $C{COMPILE} $DIR/parallel-images-lockdebug0.m -o parallel-images-lockdebug2.dylib -dynamiclib -DN=2
+    $C{COMPILE} $DIR/parallel-images-lockdebug0.m -o parallel-images-lockdebug3.dylib -dynamiclib -DN=3
+    $C{COMPILE} $DIR/parallel-images-lockdebug0.m -o parallel-images-lockdebug4.dylib -dynamiclib -DN=4
+    $C{COMPILE} $DIR/parallel-images-lockdebug0.m -o parallel-images-lockdebug5.dylib -dynamiclib -DN=5
+    $C{COMPILE} $DIR/parallel-images-lockdebug0.m -o parallel-images-lockdebug6.dylib -dynamiclib -DN=6
+    $C{COMPILE} $DIR/parallel-images-lockdebug0.m -o parallel-images-lockdebug7.dylib -dynamiclib -DN=7
+    $C{COMPILE} $DIR/parallel-images-lockdebug0.m -x none parallel-images-lockdebug0.dylib parallel-images-lockdebug1.dylib parallel-images-lockdebug2.dylib parallel-images-lockdebug3.dylib parallel-images-lockdebug4.dylib parallel-images-lockdebug5.dylib parallel-images-lockdebug6.dylib parallel-images-lockdebug7.dylib -o parallel-images-lockdebug8.dylib -dynamiclib -DN=8
+    $C{COMPILE} $DIR/parallel-images-lockdebug.m -o parallel-images-lockdebug.out
+END
+*/
+
+// One dlopen() reads nine images at once, so their selector references 
+// are uniqued on the image workers and the calling thread together. 
+// Every thread takes selector shard locks while the workers borrow 
+// the caller's runtimeLock and selLock. Run against a libobjc built 
+// with DEBUG=1 so lockdebug checks that lock loan.
+
+#include "test.h"
+#include <objc/runtime.h>
+#include <dlfcn.h>
+#include <string.h>
+
+#define IMAGES 9
+#define SELECTORS 32
+
+typedef size_t (*selectors_fn)(SEL *sels);
+
+int main()
+{
+    void *dl = dlopen("parallel-images-lockdebug8.dylib", RTLD_LAZY);
+    testassert(dl);
+
+    SEL sels[IMAGES][SELECTORS];
+    for (int n = 0; n < IMAGES; n++) {
+        char *fnName;
+        asprintf(&fnName, "parallelSelectors%d", n);
+        selectors_fn fn = (selectors_fn)dlsym(dl, fnName);
+        testassert(fn);
+        free(fnName);
+        testassert(fn(sels[n]) == SELECTORS);
+    }
+
+    // Every image's references reach the registered selectors, 
+    // and images that share a selector share its reference.
+    for (int k = 0; k < SELECTORS/2; k++) {
+        char *name;
+        asprintf(&name, "parallelShared%d", k);
+        SEL shared = sel_registerName(name);
+        testassert(sel_isMapped(shared));
+        for (int n = 0; n < IMAGES; n++) {
+            testassert(sels[n][2*k] == shared);
+        }
+        free(name);
+
+        for (int n = 0; n < IMAGES; n++) {
+            asprintf(&name, "parallelImage%d_%d", n, k);
+            testassert(sels[n][2*k+1] == sel_registerName(name));
+            testassert(0 == strcmp(sel_getName(sels[n][2*k+1]), name));
+            free(name);
+        }
+    }
+
+    succeed(__FILE__);
+}
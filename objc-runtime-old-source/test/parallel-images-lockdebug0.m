@@ -0,0 +1,29 @@
+#ifndef N
+#error -DN=n missing
+#endif
+
+#include <objc/runtime.h>
+#include <stddef.h>
+
+// Each image references selectors that no other image has registered 
+// yet, so reading it takes the selector shard locks. The shared 
+// selectors are referenced by every image; the private ones by one.
+
+#define CAT2(a,b) a##b
+#define XCAT2(a,b) CAT2(a,b)
+#define CAT4(a,b,c,d) a##b##c##d
+#define XCAT4(a,b,c,d) CAT4(a,b,c,d)
+
+#define SHARED(k) @selector(XCAT2(parallelShared, k))
+#define PRIVATE(k) @selector(XCAT4(parallelImage, N, _, k))
+#define STORE(k) sels[i++] = SHARED(k); sels[i++] = PRIVATE(k)
+
+size_t XCAT2(parallelSelectors, N)(SEL *sels)
+{
+    size_t i = 0;
+    STORE(0);  STORE(1);  STORE(2);  STORE(3);
+    STORE(4);  STORE(5);  STORE(6);  STORE(7);
+    STORE(8);  STORE(9);  STORE(10); STORE(11);
+    STORE(12); STORE(13); STORE(14); STORE(15);
+    return i;
+}
@@ -0,0 +1,59 @@
+/*
+TEST_ENV OBJC_PARALLEL_IMAGE_READING=YES OBJC_PRINT_IMAGE_TIMES=YES
+
+TEST_RUN_OUTPUT
+(objc\[\d+\]: .*IMAGE TIMES: .*\n)*OK: parallel-images.m
+END
+*/
+
+// Images read with OBJC_PARALLEL_IMAGE_READING must end up with
+// the same selector, class, and protocol references as images read
+// on one thread. Timings of each phase are printed, with the number
+// of worker threads when there is more than one CPU.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <dlfcn.h>
+
+@protocol ParallelProto
+-(int)parallelMethod;
+@end
+
+@interface ParallelClass : TestRoot <ParallelProto> @end
+@implementation ParallelClass
+-(int)parallelMethod { return 42; }
+@end
+
+@interface ParallelSubclass : ParallelClass @end
+@implementation ParallelSubclass
+-(int)parallelMethod { return [super parallelMethod] + 1; }
+@end
+
+int main()
+{
+    // Selector references are uniqued with registered names.
+    testassert(@selector(parallelMethod) ==
+               sel_registerName("parallelMethod"));
+    testassert(@selector(alloc) == sel_registerName("alloc"));
+
+    // Class and super references reach the registered classes.
+    testassert([ParallelClass class] == objc_getClass("ParallelClass"));
+    ParallelSubclass *obj = [ParallelSubclass new];
+    testassert([obj parallelMethod] == 43);
+    [obj release];
+
+    // Protocol references reach the registered protocol.
+    testassert(@protocol(ParallelProto) == objc_getProtocol("ParallelProto"));
+    testassert(class_conformsToProtocol([ParallelClass class],
+                                        @protocol(ParallelProto)));
+
+    // Images loaded later are read the same way.
+    void *dl = dlopen("/System/Library/Frameworks/Foundation.framework/"
+                      "Foundation", RTLD_LAZY);
+    testassert(dl);
+    testassert(objc_getClass("NSObject"));
+    testassert(sel_registerName("parallelMethod") == @selector(parallelMethod));
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,126 @@
+/*
+TEST_BUILD
+    $C{COMPILE} $DIR/preopt-sidecar.m -Wl,-no_fixup_chains -o preopt-sidecar.out
+    $C{COMPILE} $DIR/preopt-sidecar0.m -Wl,-no_fixup_chains -o preopt-sidecar0.dylib -dynamiclib -DN=0
+    $C{COMPILE} $DIR/preopt-sidecar0.m -Wl,-no_fixup_chains -o preopt-sidecar1.dylib -dynamiclib -DN=1
+    $C{CXX} -std=c++11 $DIR/../objcopt.cpp -o objcopt
+    ./objcopt -arch $C{ARCH} -o preopt-sidecar.objcopt preopt-sidecar.out preopt-sidecar0.dylib
+END
+TEST_ENV OBJC_PREOPT_SIDECAR=preopt-sidecar.objcopt
+*/
+
+// Selectors and classes of the test executable are found through the
+// sidecar that objcopt wrote for it. They must behave exactly as if
+// they had been registered the ordinary way.
+//
+// preopt-sidecar0.dylib and preopt-sidecar1.dylib are copies of 260
+// classes; only the first is in the sidecar. Their dlopen times, which
+// are mostly map_images, are printed with VERBOSE=2.
+
+#include "test.h"
+#include "testroot.i"
+#include <string.h>
+#include <dlfcn.h>
+#include <mach/mach_time.h>
+#include <objc/runtime.h>
+#include <objc/objc-internal.h>
+
+@interface SidecarSuper : TestRoot @end
+@implementation SidecarSuper
+-(int)sidecarMethod { return 1; }
+@end
+
+@interface SidecarSub : SidecarSuper @end
+@implementation SidecarSub
+-(int)sidecarMethod { return 2; }
+-(int)sidecarSubMethod:(int)x { return x; }
+@end
+
+static uint64_t timedOpen(const char *name)
+{
+    uint64_t start = mach_absolute_time();
+    void *dlh = dlopen(name, RTLD_LAZY);
+    uint64_t end = mach_absolute_time();
+    if (!dlh) {
+        fail("dlopen failed: %s", dlerror());
+    }
+    return (uint64_t)testnanoseconds(end - start) / 1000;
+}
+
+int main()
+{
+#if !__OBJC2__  ||  !__LP64__
+    struct objc_preopt_sidecar_statistics stats;
+    testassert(!_objc_getPreoptSidecarStatistics(&stats));
+#else
+    struct objc_preopt_sidecar_statistics stats;
+    testassert(_objc_getPreoptSidecarStatistics(&stats));
+    testprintf("images %u/%u selectors %u classes %u\n",
+               stats.loadedImages, stats.images,
+               stats.selectors, stats.classes);
+    testassert(stats.images == 2);
+    testassert(stats.loadedImages == 1);
+    testassert(stats.selectors > 0);
+    testassert(stats.classes >= 3);
+#endif
+
+    // Selectors in the sidecar are unique and keep their names.
+    SEL sel = sel_registerName("sidecarMethod");
+    testassert(sel == @selector(sidecarMethod));
+    testassert(0 == strcmp(sel_getName(sel), "sidecarMethod"));
+    testassert(sel_registerName("sidecarSubMethod:") ==
+               @selector(sidecarSubMethod:));
+    testassert(sel_getUid("sidecarMethod") == sel);
+
+    // Selectors that are not in the sidecar are registered as usual.
+    char name[] = "sidecarMissingMethod";
+    SEL missing = sel_registerName(name);
+    testassert(missing != sel);
+    name[0] = 'X';
+    testassert(0 == strcmp(sel_getName(missing), "sidecarMissingMethod"));
+    testassert(sel_registerName("sidecarMissingMethod") == missing);
+
+    // Classes in the sidecar are found by name and work.
+    testassert(objc_getClass("SidecarSuper") == [SidecarSuper class]);
+    testassert(objc_getClass("SidecarSub") == [SidecarSub class]);
+    testassert(objc_lookUpClass("SidecarMissing") == nil);
+    testassert(class_getSuperclass([SidecarSub class]) ==
+               [SidecarSuper class]);
+    testassert([[SidecarSub new] sidecarMethod] == 2);
+    testassert([[SidecarSub new] sidecarSubMethod:3] == 3);
+
+    // Their names are taken.
+    testassert(objc_allocateClassPair([TestRoot class], "SidecarSub", 0) == nil);
+    Class dynamic = objc_allocateClassPair([SidecarSuper class],
+                                           "SidecarDynamic", 0);
+    testassert(dynamic);
+    objc_registerClassPair(dynamic);
+    testassert(objc_getClass("SidecarDynamic") == dynamic);
+
+    // Every class is listed once.
+    unsigned int count;
+    Class *classes = objc_copyClassList(&count);
+    unsigned int seen = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (classes[i] == [SidecarSub class]) seen++;
+    }
+    free(classes);
+    testassert(seen == 1);
+
+    // An image in the sidecar and one that is not.
+    uint64_t without = timedOpen("preopt-sidecar1.dylib");
+    uint64_t with = timedOpen("preopt-sidecar0.dylib");
+    testprintf("260 classes: %llu us with sidecar, %llu us without\n",
+               (unsigned long long)with, (unsigned long long)without);
+#if __OBJC2__  &&  __LP64__
+    testassert(_objc_getPreoptSidecarStatistics(&stats));
+    testassert(stats.loadedImages == 2);
+#endif
+    testassert(objc_getClass("S_z9_0"));
+    testassert(objc_getClass("S_z9_1"));
+    testassert(objc_getClass("S_z9_0") != objc_getClass("S_z9_1"));
+    testassert(sel_registerName("sidecar_a0_0") !=
+               sel_registerName("sidecar_a0_1"));
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,49 @@
+#ifndef N
+#error -DN=n missing
+#endif
+
+#import <objc/objc-api.h>
+
+// 260 root classes of two methods each, for timing map_images of an
+// image with and without the preoptimization sidecar.
+
+#define CLASS0(c,d,n)                                                   \
+    OBJC_ROOT_CLASS                                                     \
+    @interface S_##c##d##_##n @end                                      \
+    @implementation S_##c##d##_##n                                      \
+    -(int)sidecar_##c##d##_##n { return 0; }                            \
+    +(int)sidecar_##c##d##_##n##_class { return 0; }                    \
+    @end
+
+#define CLASS(c,d,n) CLASS0(c,d,n)
+
+#define CLASSES(c)                                                      \
+    CLASS(c,0,N) CLASS(c,1,N) CLASS(c,2,N) CLASS(c,3,N) CLASS(c,4,N)    \
+    CLASS(c,5,N) CLASS(c,6,N) CLASS(c,7,N) CLASS(c,8,N) CLASS(c,9,N)
+
+CLASSES(a)
+CLASSES(b)
+CLASSES(c)
+CLASSES(d)
+CLASSES(e)
+CLASSES(f)
+CLASSES(g)
+CLASSES(h)
+CLASSES(i)
+CLASSES(j)
+CLASSES(k)
+CLASSES(l)
+CLASSES(m)
+CLASSES(n)
+CLASSES(o)
+CLASSES(p)
+CLASSES(q)
+CLASSES(r)
+CLASSES(s)
+CLASSES(t)
+CLASSES(u)
+CLASSES(v)
+CLASSES(w)
+CLASSES(x)
+CLASSES(y)
+CLASSES(z)
@@ -0,0 +1,120 @@
+// TEST_CFLAGS -framework Foundation
+// TEST_CONFIG MEM=mrc ARCH=x86_64
+// TEST_ENV OBJC_PIN_OVERFLOWED_RETAIN_COUNTS=YES
+
+// Pinned retain counts for nonpointer isa. The first overflow of the
+// inline retain count pins the object, and from then on its retains
+// and releases use the pinned count instead of borrowing from the
+// side table. Threads retain and release a shared object as in
+// rr-sidetable.m so its count keeps crossing the inline limit, then
+// bigrc.m's retain-a-lot pattern checks -retainCount, weak references,
+// and deallocation of a pinned object.
+//
+// x86_64 only, for the same reason as rr-sidetable.m.
+//
+// Run with and without OBJC_PIN_OVERFLOWED_RETAIN_COUNTS=YES to compare
+// with the side table. Timings and the overflow and borrow counts are
+// printed with VERBOSE=2.
+
+#include "test.h"
+#import <Foundation/Foundation.h>
+#include <objc/objc-internal.h>
+
+#define LOOPS 256
+#define THREADS 16
+#define LOTS 0x100000
+#if __x86_64__
+#   define RC_HALF  (1ULL<<7)
+#else
+#   error sorry
+#endif
+#define RC_DELTA RC_HALF
+
+static int Deallocs;
+@interface Deallocator : NSObject @end
+@implementation Deallocator
+-(void)dealloc {
+    Deallocs++;
+    [super dealloc];
+}
+@end
+
+static Deallocator *obj;
+
+static void churn(size_t t __unused, void *arg __unused)
+{
+    for (size_t a = 0; a < LOOPS; a++) {
+        for (size_t b = 0; b < RC_DELTA; b++) {
+            [obj retain];
+        }
+        for (size_t b = 0; b < RC_DELTA; b++) {
+            [obj release];
+        }
+    }
+}
+
+int main()
+{
+    const char *env = getenv("OBJC_PIN_OVERFLOWED_RETAIN_COUNTS");
+    bool pinning = env  &&  0 == strcmp(env, "YES");
+
+    struct objc_retain_count_statistics before, after;
+    testassert(_objc_getRetainCountStatistics(&before));
+
+    obj = [Deallocator new];
+
+    // Below the inline limit nothing overflows.
+    for (size_t b = 0; b < RC_HALF; b++) [obj retain];
+    for (size_t b = 0; b < RC_HALF; b++) [obj release];
+    _objc_getRetainCountStatistics(&after);
+    testassert(after.overflows == before.overflows);
+    testassert(after.pins == before.pins);
+
+    // Overflow once, then churn across the inline limit.
+    for (size_t b = 0; b < 2*RC_HALF; b++) [obj retain];
+    testassert([obj retainCount] == 1 + 2*RC_HALF);
+
+    double elapsed = testonthreads(THREADS, churn, NULL);
+    testassert([obj retainCount] == 1 + 2*RC_HALF);
+
+    for (size_t b = 0; b < 2*RC_HALF; b++) [obj release];
+    testassert(Deallocs == 0);
+    testassert([obj retainCount] == 1);
+
+    _objc_getRetainCountStatistics(&after);
+    testprintf("%.1f ns per retain/release, %llu overflows, "
+               "%llu borrows, %llu pins\n",
+               elapsed / (THREADS * LOOPS * RC_DELTA * 2),
+               after.overflows - before.overflows,
+               after.borrows - before.borrows,
+               after.pins - before.pins);
+    if (pinning) {
+        testassert(after.overflows == before.overflows + 1);
+        testassert(after.pins == before.pins + 1);
+        testassert(after.borrows == before.borrows);
+    } else {
+        testassert(after.overflows > before.overflows);
+        testassert(after.pins == before.pins);
+    }
+
+    // Retain a lot, including through a weak reference.
+    id w;
+    objc_storeWeak(&w, obj);
+    size_t rc = 1;
+    do {
+        if (rc % 2) [obj retain];
+        else testassert(objc_loadWeakRetained(&w) == obj);
+    } while (++rc < LOTS);
+    testassert([obj retainCount] == rc);
+    do {
+        [obj release];
+    } while (--rc > 1);
+    testassert([obj retainCount] == 1);
+    testassert(Deallocs == 0);
+
+    [obj release];
+    testassert(Deallocs == 1);
+    testassert(w == nil);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,137 @@
+// TEST_CFLAGS -framework Foundation
+// TEST_CONFIG MEM=mrc
+// TEST_ENV OBJC_DISABLE_NONPOINTER_ISA=YES
+
+// Side table retain/release under contention, and its throughput 
+// from 1 to 64 threads. Raw isa objects keep their entire retain 
+// count in the side table, so every -retain and -release here goes 
+// through sidetable_retain() and sidetable_release().
+//
+// Build libobjc with SUPPORT_CONCURRENT_REFCOUNT=1 and run with 
+// OBJC_DEFER_SIDETABLE_RELEASE=YES to compare the refcount engines. 
+// Timings are printed with VERBOSE=2.
+
+#include "test.h"
+#import <Foundation/Foundation.h>
+
+#define LOOPS 100000
+#define PRIVATE_OBJECTS 64
+#define HELD 1000
+
+static int Deallocs;
+@interface Deallocator : NSObject @end
+@implementation Deallocator
+-(void)dealloc {
+    OSAtomicIncrement32(&Deallocs);
+    [super dealloc];
+}
+@end
+
+static Deallocator *shared;
+static Deallocator *privates[TEST_MAXTHREADS][PRIVATE_OBJECTS];
+
+static void sharedLoop(size_t t __unused, void *arg __unused)
+{
+    for (size_t i = 0; i < LOOPS; i++) {
+        [shared retain];
+        [shared retain];
+        [shared release];
+        [shared release];
+    }
+}
+
+static void privateLoop(size_t t, void *arg __unused)
+{
+    for (size_t i = 0; i < LOOPS; i++) {
+        id obj = privates[t][i % PRIVATE_OBJECTS];
+        [obj retain];
+        [obj retain];
+        [obj release];
+        [obj release];
+    }
+}
+
+static void retainHeld(size_t t __unused, void *arg)
+{
+    for (size_t i = 0; i < HELD; i++) [(id)arg retain];
+}
+
+static void releaseHeld(size_t t __unused, void *arg)
+{
+    for (size_t i = 0; i < HELD; i++) [(id)arg release];
+}
+
+static void releaseOnce(size_t t __unused, void *arg)
+{
+    [(id)arg release];
+}
+
+// Flushes this thread's deferred releases, if any.
+static void flush(void)
+{
+    objc_autoreleasePoolPop(objc_autoreleasePoolPush());
+}
+
+int main()
+{
+    shared = [Deallocator new];
+    for (size_t t = 0; t < TEST_MAXTHREADS; t++) {
+        for (size_t i = 0; i < PRIVATE_OBJECTS; i++) {
+            privates[t][i] = [Deallocator new];
+        }
+    }
+
+    testassert([shared retainCount] == 1);
+
+    // Counts are exact once the threads are done. Threads that 
+    // defer releases flush them when they exit.
+    for (size_t threads = 1; threads <= TEST_MAXTHREADS; threads *= 2) {
+        testonthreads(threads, retainHeld, shared);
+        testassert([shared retainCount] == 1 + threads * HELD);
+        testonthreads(threads, releaseHeld, shared);
+        testassert([shared retainCount] == 1);
+        testassert(Deallocs == 0);
+    }
+
+    // Racing last releases deallocate exactly once, and only after 
+    // the last one.
+    for (size_t threads = 1; threads <= TEST_MAXTHREADS; threads *= 2) {
+        Deallocator *obj = [Deallocator new];
+        for (size_t i = 1; i < threads; i++) [obj retain];
+        testassert([obj retainCount] == threads);
+        int before = Deallocs;
+        testonthreads(threads, releaseOnce, obj);
+        testassert(Deallocs == before + 1);
+    }
+    int raced = Deallocs;
+
+    for (size_t threads = 1; threads <= TEST_MAXTHREADS; threads *= 2) {
+        double sharedTime = testonthreads(threads, sharedLoop, NULL);
+        double privateTime = testonthreads(threads, privateLoop, NULL);
+
+        double ops = (double)threads * LOOPS * 4;
+        testprintf("%2zu threads: shared %6.1f ns/op, private %6.1f ns/op\n",
+                   threads, sharedTime / ops, privateTime / ops);
+    }
+
+    // Every retain was balanced. Nothing deallocated early.
+    flush();
+    testassert(Deallocs == raced);
+    testassert([shared retainCount] == 1);
+    for (size_t t = 0; t < TEST_MAXTHREADS; t++) {
+        for (size_t i = 0; i < PRIVATE_OBJECTS; i++) {
+            testassert([privates[t][i] retainCount] == 1);
+        }
+    }
+
+    [shared release];
+    for (size_t t = 0; t < TEST_MAXTHREADS; t++) {
+        for (size_t i = 0; i < PRIVATE_OBJECTS; i++) {
+            [privates[t][i] release];
+        }
+    }
+    flush();
+    testassert(Deallocs == raced + 1 + TEST_MAXTHREADS*PRIVATE_OBJECTS);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,68 @@
+// TEST_CONFIG MEM=mrc
+
+// Concurrent selector registration from 1 to 64 threads. Each round
+// every thread registers the same set of new names in a different
+// order, then looks them all up again with sel_getUid(). Every thread
+// must get the same SEL for each name, sel_isMapped() must accept it as 
+// soon as it is returned, and the SELs must stay valid after the name 
+// buffers are reused. Timings are printed with VERBOSE=2.
+
+#include "test.h"
+#include <objc/runtime.h>
+
+#define NAMES 4096
+
+static size_t generation;
+static SEL sels[TEST_MAXTHREADS][NAMES];
+
+static void makeName(char *buf, size_t len, size_t r, size_t i)
+{
+    snprintf(buf, len, "gen%zu:selector%zu:with:", r, i);
+}
+
+static void worker(size_t t, void *arg __unused)
+{
+    char name[64];
+    for (size_t n = 0; n < NAMES; n++) {
+        // Start at different names so threads insert into
+        // different shards as well as the same ones.
+        size_t i = (n + t * 97) % NAMES;
+        makeName(name, sizeof(name), generation, i);
+        sels[t][i] = sel_registerName(name);
+        testassert(sel_isMapped(sels[t][i]));
+    }
+    for (size_t i = 0; i < NAMES; i++) {
+        makeName(name, sizeof(name), generation, i);
+        testassert(sel_getUid(name) == sels[t][i]);
+    }
+}
+
+int main()
+{
+    // Builtin and previously registered selectors.
+    testassert(sel_registerName("alloc") == @selector(alloc));
+    testassert(sel_getUid("dealloc") == @selector(dealloc));
+    testassert(sel_isMapped(@selector(alloc)));
+
+    char name[64];
+    for (size_t threads = 1; threads <= TEST_MAXTHREADS; threads *= 2) {
+        double elapsed = testonthreads(threads, worker, NULL);
+
+        for (size_t i = 0; i < NAMES; i++) {
+            makeName(name, sizeof(name), generation, i);
+            testassert(0 == strcmp(sel_getName(sels[0][i]), name));
+            testassert(sel_isMapped(sels[0][i]));
+            for (size_t t = 1; t < threads; t++) {
+                testassert(sels[t][i] == sels[0][i]);
+            }
+        }
+        testprintf("%2zu threads: %6.1f ns per registration\n",
+                   threads, elapsed / (threads * NAMES * 2));
+        generation++;
+    }
+
+    // Names are copied: the registered strings are not the buffer.
+    testassert(sel_getName(sel_registerName(name)) != name);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,162 @@
+// TEST_CONFIG
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <mach/mach_time.h>
+#include <objc/runtime.h>
+#include <objc/objc-sync.h>
+#include <Foundation/NSObject.h>
+
+// @synchronized thin lock stress test.
+// Many objects, so several share each thin lock word. Each thread
+// locks one object recursively and sometimes a second object inside
+// it, taken in address order so the test itself cannot deadlock.
+// Run with OBJC_DISABLE_THIN_SYNC_LOCKS=YES to compare against the
+// SyncData-only path, and OBJC_PRINT_SYNC_STATISTICS=YES to see
+// how often the thin path was used.
+
+#define THREADS 16
+#define OBJECTS 512
+#define COUNT 1024*32
+
+static id objects[OBJECTS];
+static int counts[OBJECTS];
+
+static void *threadfn(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+
+    for (int n = 0; n < COUNT; n++) {
+        int ia = rand_r(&seed) % OBJECTS;
+        int ib = rand_r(&seed) % OBJECTS;
+        if (objects[ib] < objects[ia]) { int tmp = ia; ia = ib; ib = tmp; }
+        id a = objects[ia];
+        id b = objects[ib];
+
+        testassert(objc_sync_enter(a) == OBJC_SYNC_SUCCESS);
+        testassert(objc_sync_enter(a) == OBJC_SYNC_SUCCESS);
+        counts[ia]++;
+        if (n % 4 == 0  &&  a != b) {
+            testassert(objc_sync_enter(b) == OBJC_SYNC_SUCCESS);
+            counts[ib]++;
+            testassert(objc_sync_exit(b) == OBJC_SYNC_SUCCESS);
+        }
+        testassert(objc_sync_exit(a) == OBJC_SYNC_SUCCESS);
+        testassert(objc_sync_exit(a) == OBJC_SYNC_SUCCESS);
+    }
+
+    return NULL;
+}
+
+// All threads on two objects, so most acquires find the thin word
+// taken and inflate while the owner and later arrivals keep trying
+// the thin path on the same stripe. Every exit must succeed, or a
+// SyncData mutex is left locked and the checks below deadlock.
+#define HOT_COUNT 1024*16
+static int hotCounts[2];
+
+static void *hotfn(void *arg)
+{
+    for (int n = 0; n < HOT_COUNT; n++) {
+        int i = (n + (int)(uintptr_t)arg) % 2;
+        testassert(objc_sync_enter(objects[i]) == OBJC_SYNC_SUCCESS);
+        hotCounts[i]++;
+        if (n % 8 == 0) {
+            testassert(objc_sync_enter(objects[i]) == OBJC_SYNC_SUCCESS);
+            testassert(objc_sync_exit(objects[i]) == OBJC_SYNC_SUCCESS);
+        }
+        testassert(objc_sync_exit(objects[i]) == OBJC_SYNC_SUCCESS);
+    }
+
+    return NULL;
+}
+
+static void *lockedfn(void *arg)
+{
+    // Exiting a lock held by another thread fails.
+    testassert(objc_sync_exit((id)arg) == OBJC_SYNC_NOT_OWNING_THREAD_ERROR);
+    return NULL;
+}
+
+static void *unlockedfn(void *arg)
+{
+    testassert(objc_sync_enter((id)arg) == OBJC_SYNC_SUCCESS);
+    testassert(objc_sync_exit((id)arg) == OBJC_SYNC_SUCCESS);
+    return NULL;
+}
+
+int main()
+{
+    pthread_t threads[THREADS];
+
+    for (int i = 0; i < OBJECTS; i++) {
+        objects[i] = [NSObject new];
+    }
+
+    // Uncontended and recursive locking on one thread.
+    id obj = objects[0];
+    testassert(objc_sync_exit(obj) == OBJC_SYNC_NOT_OWNING_THREAD_ERROR);
+    testassert(objc_sync_enter(obj) == OBJC_SYNC_SUCCESS);
+    testassert(objc_sync_enter(obj) == OBJC_SYNC_SUCCESS);
+    pthread_create(&threads[0], NULL, &lockedfn, obj);
+    pthread_join(threads[0], NULL);
+    testassert(objc_sync_exit(obj) == OBJC_SYNC_SUCCESS);
+    testassert(objc_sync_exit(obj) == OBJC_SYNC_SUCCESS);
+    testassert(objc_sync_exit(obj) == OBJC_SYNC_NOT_OWNING_THREAD_ERROR);
+
+    // Every object locked at once from one thread.
+    // Most of them share a thin lock word with another.
+    for (int i = 0; i < OBJECTS; i++) {
+        testassert(objc_sync_enter(objects[i]) == OBJC_SYNC_SUCCESS);
+    }
+    for (int i = OBJECTS-1; i >= 0; i--) {
+        testassert(objc_sync_exit(objects[i]) == OBJC_SYNC_SUCCESS);
+    }
+
+    uint64_t start = mach_absolute_time();
+    for (int t = 0; t < THREADS; t++) {
+        pthread_create(&threads[t], NULL, &threadfn, (void *)(uintptr_t)(t+1));
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    uint64_t end = mach_absolute_time();
+
+    // Compare against a single-threaded replay of the same sequence.
+    int expected[OBJECTS] = {0};
+    for (int t = 0; t < THREADS; t++) {
+        unsigned int seed = t+1;
+        for (int n = 0; n < COUNT; n++) {
+            int ia = rand_r(&seed) % OBJECTS;
+            int ib = rand_r(&seed) % OBJECTS;
+            if (objects[ib] < objects[ia]) { int tmp = ia; ia = ib; ib = tmp; }
+            expected[ia]++;
+            if (n % 4 == 0  &&  ia != ib) expected[ib]++;
+        }
+    }
+    for (int i = 0; i < OBJECTS; i++) {
+        testassert(counts[i] == expected[i]);
+    }
+
+    for (int t = 0; t < THREADS; t++) {
+        pthread_create(&threads[t], NULL, &hotfn, (void *)(uintptr_t)t);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    testassert(hotCounts[0] + hotCounts[1] == THREADS * HOT_COUNT);
+
+    // Nothing was left locked: another thread can take every object.
+    for (int i = 0; i < OBJECTS; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, &unlockedfn, objects[i]);
+        pthread_join(thread, NULL);
+    }
+
+    testprintf("%d threads: %.1f ms\n", THREADS,
+               testnanoseconds(end - start) / 1000000.0);
+
+    succeed(__FILE__);
+}
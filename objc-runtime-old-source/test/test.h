@@ -207,6 +207,71 @@ static inline void testonthread(__unsafe_unretained testblock_t code)
     pthread_join(th, NULL);
 }
 
+
+/* Multithreaded timing. 
+   testonthreads(n, fn, arg) calls fn(i, arg) on n new threads at once, 
+   for i in 0..n-1, and returns the nanoseconds from their start until 
+   the last one returned. Run it for n = 1, 2, 4, ... TEST_MAXTHREADS 
+   and print the results with testprintf().
+*/
+#define TEST_MAXTHREADS 64
+
+static inline double testnanoseconds(uint64_t machTime)
+{
+    static mach_timebase_info_data_t tb;
+    if (tb.denom == 0) mach_timebase_info(&tb);
+    return (double)machTime * tb.numer / tb.denom;
+}
+
+typedef void (*testthreadfn_t)(size_t thread, void *arg);
+
+static pthread_mutex_t _testthreads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _testthreads_cond = PTHREAD_COND_INITIALIZER;
+static testthreadfn_t _testthreads_fn;
+static void *_testthreads_arg;
+static int _testthreads_go;
+static size_t _testthreads_running;
+static uint64_t _testthreads_end;
+
+static inline void *_testthreadsthread(void *arg)
+{
+    pthread_mutex_lock(&_testthreads_lock);
+    while (!_testthreads_go) {
+        pthread_cond_wait(&_testthreads_cond, &_testthreads_lock);
+    }
+    pthread_mutex_unlock(&_testthreads_lock);
+
+    _testthreads_fn((size_t)arg, _testthreads_arg);
+
+    pthread_mutex_lock(&_testthreads_lock);
+    if (--_testthreads_running == 0) _testthreads_end = mach_absolute_time();
+    pthread_mutex_unlock(&_testthreads_lock);
+    return NULL;
+}
+
+static inline double testonthreads(size_t count, testthreadfn_t fn, void *arg)
+{
+    pthread_t *th = (pthread_t *)malloc(count * sizeof(pthread_t));
+    _testthreads_fn = fn;
+    _testthreads_arg = arg;
+    _testthreads_go = 0;
+    _testthreads_running = count;
+    for (size_t i = 0; i < count; i++) {
+        pthread_create(&th[i], NULL, _testthreadsthread, (void *)i);
+    }
+
+    pthread_mutex_lock(&_testthreads_lock);
+    uint64_t start = mach_absolute_time();
+    _testthreads_go = 1;
+    pthread_cond_broadcast(&_testthreads_cond);
+    pthread_mutex_unlock(&_testthreads_lock);
+
+    for (size_t i = 0; i < count; i++) pthread_join(th[i], NULL);
+    free(th);
+    return testnanoseconds(_testthreads_end - start);
+}
+
+
 /* Make sure libobjc does not call global operator new. 
    Any test that DOES need to call global operator new must 
    `#define TEST_CALLS_OPERATOR_NEW` before including test.h.
@@ -0,0 +1,134 @@
+// TEST_CFLAGS -framework Foundation
+// TEST_CONFIG MEM=mrc
+
+// Weak reference churn from 1 to 64 threads: objc_storeWeak(),
+// objc_loadWeakRetained(), and deallocation of weakly referenced
+// objects. While the churn runs, one more thread repeatedly
+// deallocates an object with many weak referrers; the slowest
+// single objc_storeWeak() seen by the churn threads is reported.
+// Every weak variable must read nil once its object is deallocated, 
+// and every object must be deallocated exactly once.
+// Timings are printed with VERBOSE=2.
+
+#include "test.h"
+#import <Foundation/Foundation.h>
+#include <objc/runtime.h>
+
+#define LOOPS 20000
+#define SLOTS 64
+#define BIGREFS 100000
+
+static int Deallocs;
+@interface Deallocator : NSObject @end
+@implementation Deallocator
+-(void)dealloc {
+    OSAtomicIncrement32(&Deallocs);
+    [super dealloc];
+}
+@end
+
+static id slots[TEST_MAXTHREADS][SLOTS];
+static id bigSlots[BIGREFS];
+static uint64_t worst[TEST_MAXTHREADS];
+
+// Churn threads in this round, and how many have finished.
+static int32_t Workers;
+static int32_t Finished;
+
+static size_t bigClears;
+static uint64_t bigClearTime;
+
+static void churn(size_t t)
+{
+    id *mine = slots[t];
+    uint64_t slowest = 0;
+
+    for (size_t i = 0; i < LOOPS; i++) {
+        size_t s = i % SLOTS;
+        id obj = [Deallocator new];
+
+        uint64_t start = mach_absolute_time();
+        objc_storeWeak(&mine[s], obj);
+        uint64_t elapsed = mach_absolute_time() - start;
+        if (elapsed > slowest) slowest = elapsed;
+
+        id loaded = objc_loadWeakRetained(&mine[s]);
+        testassert(loaded == obj);
+        [loaded release];
+
+        // Deallocate the object while it is still weakly referenced,
+        // so its slot is cleared by dealloc.
+        [obj release];
+        testassert(mine[s] == nil);
+        testassert(objc_loadWeakRetained(&mine[s]) == nil);
+    }
+    for (size_t s = 0; s < SLOTS; s++) {
+        objc_destroyWeak(&mine[s]);
+        mine[s] = nil;
+    }
+    worst[t] = slowest;
+    OSAtomicIncrement32Barrier(&Finished);
+}
+
+// Clear objects with many weak referrers until every churn thread 
+// has finished.
+static void clearBig(void)
+{
+    do {
+        id big = [Deallocator new];
+        for (size_t i = 0; i < BIGREFS; i++) {
+            objc_storeWeak(&bigSlots[i], big);
+        }
+        uint64_t clearStart = mach_absolute_time();
+        [big release];
+        bigClearTime += mach_absolute_time() - clearStart;
+        bigClears++;
+        for (size_t i = 0; i < BIGREFS; i++) {
+            testassert(bigSlots[i] == nil);
+        }
+    } while (OSAtomicAdd32Barrier(0, &Finished) < Workers);
+}
+
+// Thread 0 clears big objects. The others churn.
+static void worker(size_t t, void *arg __unused)
+{
+    if (t == 0) clearBig();
+    else churn(t - 1);
+}
+
+static double ms(uint64_t t)
+{
+    return testnanoseconds(t) / 1000000.0;
+}
+
+static void run(size_t threads)
+{
+    Workers = (int32_t)threads;
+    Finished = 0;
+    bigClears = 0;
+    bigClearTime = 0;
+
+    int deallocsBefore = Deallocs;
+    double total = testonthreads(threads + 1, worker, NULL);
+
+    uint64_t slowest = 0;
+    for (size_t t = 0; t < threads; t++) {
+        if (worst[t] > slowest) slowest = worst[t];
+    }
+
+    testassert(Deallocs - deallocsBefore == (int)(threads * LOOPS + bigClears));
+    testprintf("%2zu threads: %7.1f ms total, %zu clears of %d referrers "
+               "(%.2f ms each), slowest store %.3f ms\n",
+               threads, total / 1000000.0, bigClears, BIGREFS,
+               ms(bigClearTime) / bigClears, ms(slowest));
+}
+
+int main()
+{
+    for (size_t threads = 1; threads <= TEST_MAXTHREADS; threads *= 2) {
+        bzero(worst, sizeof(worst));
+        run(threads);
+    }
+
+    succeed(__FILE__);
+}